@@ -13,9 +13,7 @@ TEMPLATE = app
 
 CONFIG += c++11 O3
 
-QMAKE_CFLAGS_WARN_ON = -Wno-sign-compare
-
-LIBS += -L/lib -lparted
+include(rufusl.pri)
 
 SOURCES += main.cpp\
         ui/rufuswindow.cpp \
@@ -23,13 +21,7 @@ SOURCES += main.cpp\
     ui/about.cpp \
     ui/devicecombobox.cpp \
     rufusworker.cpp \
-    linux/user.c \
-    ui/errordialog.cpp \
-    linux/devices.c \
-    linux/mounting.c \
-    linux/partition.c \
-    linux/fat32.c \
-    iso.c
+    ui/errordialog.cpp
 
 
 HEADERS  += ui/rufuswindow.h \
@@ -37,15 +29,7 @@ HEADERS  += ui/rufuswindow.h \
     ui/about.h \
     ui/devicecombobox.h \
     rufusworker.h \
-    linux/user.h \
-    ui/errordialog.h \
-    linux/devices.h \
-    linux/mounting.h \
-    linux/partition.h \
-    linux/fat32.h \
-    definitions.h \
-    iso.h \
-    rufusl.h
+    ui/errordialog.h
 
 FORMS    += ui/rufuswindow.ui \
     ui/log.ui \
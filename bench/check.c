@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+
+#include <ftw.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "check.h"
+
+#define EXFAT_FILE 0x85
+#define EXFAT_STREAM 0xC0
+#define EXFAT_NO_FAT_CHAIN 0x02
+
+#define ATTR_VOLUME_ID 0x08
+#define ATTR_DIRECTORY 0x10
+#define ATTR_LFN 0x0F
+
+/* Either kind of volume, as far as walking its directories goes */
+
+typedef struct volume {
+    int fd;
+    uint64_t heap;          /* Byte offset of cluster 2 */
+    uint32_t cluster;       /* Bytes per cluster */
+    unsigned char *fat;
+    uint32_t entries;
+    uint32_t mask;          /* FAT32 entries only have 28 bits */
+} volume_t;
+
+static check_t *walking;
+
+static uint16_t le16(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t le32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t le64(const unsigned char *p) {
+    return le32(p) | ((uint64_t) le32(p + 4) << 32);
+}
+
+static int tree_walk(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    (void) fpath;
+    (void) ftwbuf;
+
+    if (typeflag == FTW_F && S_ISREG(sb->st_mode)) {
+        walking->files++;
+        walking->bytes += sb->st_size;
+    }
+
+    return 0;
+}
+
+int check_tree(const char *dir, check_t *found) {
+    memset(found, 0, sizeof(check_t));
+    walking = found;
+
+    return nftw(dir, tree_walk, 16, FTW_PHYS);
+}
+
+static int read_fat(volume_t *v, uint64_t offset, uint64_t bytes) {
+    if ((v->fat = malloc(bytes)) == NULL) return -1;
+
+    if (pread(v->fd, v->fat, bytes, offset) != (ssize_t) bytes) {
+        free(v->fat);
+        v->fat = NULL;
+        return -1;
+    }
+
+    v->entries = bytes / 4;
+
+    return 0;
+}
+
+/* A directory's clusters, one run of length bytes when contiguous,
+   otherwise a chain that ends on anything that isn't a cluster. Every
+   cluster is followed once at most, a loop can't go on for ever. */
+
+static unsigned char *read_dir(const volume_t *v, uint32_t first, uint64_t length, int contiguous,
+                               uint64_t *got) {
+    unsigned char *data;
+
+    if (contiguous) {
+        if (first < 2 || (data = malloc(length)) == NULL) return NULL;
+
+        if (pread(v->fd, data, length, v->heap + (uint64_t) (first - 2) * v->cluster) != (ssize_t) length) {
+            free(data);
+            return NULL;
+        }
+
+        *got = length;
+
+        return data;
+    }
+
+    uint32_t c = first;
+
+    data = NULL;
+    *got = 0;
+
+    for (uint32_t n = 0; c >= 2 && c < v->entries && n < v->entries; n++) {
+        unsigned char *more = realloc(data, *got + v->cluster);
+
+        if (more == NULL) {
+            free(data);
+            return NULL;
+        }
+
+        data = more;
+
+        if (pread(v->fd, data + *got, v->cluster, v->heap + (uint64_t) (c - 2) * v->cluster) != (ssize_t) v->cluster) {
+            free(data);
+            return NULL;
+        }
+
+        *got += v->cluster;
+        c = le32(v->fat + 4 * (uint64_t) c) & v->mask;
+    }
+
+    return data;
+}
+
+static int fat32_dir(const volume_t *v, uint32_t first, check_t *found) {
+    uint64_t len;
+    unsigned char *d = read_dir(v, first, 0, 0, &len);
+    int ret = 0;
+
+    if (d == NULL) return -1;
+
+    for (uint64_t i = 0; i + 32 <= len && ret == 0; i += 32) {
+        const unsigned char *e = d + i;
+
+        if (e[0] == 0x00) break;
+
+        if (e[0] == 0xE5 || e[0] == '.' || (e[11] & 0x3F) == ATTR_LFN || (e[11] & ATTR_VOLUME_ID)) continue;
+
+        if (e[11] & ATTR_DIRECTORY) {
+            ret = fat32_dir(v, ((uint32_t) le16(e + 20) << 16) | le16(e + 26), found);
+            continue;
+        }
+
+        found->files++;
+        found->bytes += le32(e + 28);
+    }
+
+    free(d);
+
+    return ret;
+}
+
+int check_fat32(int fd, check_t *found) {
+    unsigned char bpb[512];
+    volume_t v;
+
+    memset(found, 0, sizeof(check_t));
+    memset(&v, 0, sizeof(v));
+
+    if (pread(fd, bpb, sizeof(bpb), 0) != sizeof(bpb) || bpb[510] != 0x55 || bpb[511] != 0xAA) {
+        r_printf("No FAT32 boot sector\n");
+        return -1;
+    }
+
+    uint32_t bps = le16(bpb + 11);
+    uint32_t reserved = le16(bpb + 14);
+    uint64_t fat_bytes = (uint64_t) le32(bpb + 36) * bps;
+
+    if (bps < 512 || bpb[13] == 0 || bpb[16] == 0 || fat_bytes == 0) {
+        r_printf("Invalid FAT32 boot sector\n");
+        return -1;
+    }
+
+    v.fd = fd;
+    v.cluster = bpb[13] * bps;
+    v.heap = (uint64_t) reserved * bps + bpb[16] * fat_bytes;
+    v.mask = 0x0FFFFFFF;
+
+    if (read_fat(&v, (uint64_t) reserved * bps, fat_bytes) < 0) return -1;
+
+    int ret = fat32_dir(&v, le32(bpb + 44), found);
+
+    free(v.fat);
+
+    return ret;
+}
+
+/* A file is a file entry, a stream extension with where its data is
+   and how long it is, then its names */
+
+static int exfat_dir(const volume_t *v, uint32_t first, uint64_t length, int contiguous, check_t *found) {
+    uint64_t len;
+    unsigned char *d = read_dir(v, first, length, contiguous, &len);
+    int ret = 0;
+
+    if (d == NULL) return -1;
+
+    for (uint64_t i = 0; i + 32 <= len && ret == 0; i += 32) {
+        const unsigned char *e = d + i;
+
+        if (e[0] == 0x00) break;
+
+        if (e[0] != EXFAT_FILE) continue;
+
+        const unsigned char *s = e + 32;
+
+        if (i + 64 > len || s[0] != EXFAT_STREAM) {
+            ret = -1;
+            break;
+        }
+
+        uint64_t size = le64(s + 24);
+
+        if (le16(e + 4) & ATTR_DIRECTORY) {
+            if (size > 0) ret = exfat_dir(v, le32(s + 20), size, s[1] & EXFAT_NO_FAT_CHAIN, found);
+        } else {
+            found->files++;
+            found->bytes += size;
+        }
+
+        i += 32 * e[1];
+    }
+
+    free(d);
+
+    return ret;
+}
+
+int check_exfat(int fd, check_t *found) {
+    unsigned char boot[512];
+    volume_t v;
+
+    memset(found, 0, sizeof(check_t));
+    memset(&v, 0, sizeof(v));
+
+    if (pread(fd, boot, sizeof(boot), 0) != sizeof(boot) || memcmp(boot + 3, "EXFAT   ", 8) != 0) {
+        r_printf("No exFAT boot sector\n");
+        return -1;
+    }
+
+    if (boot[108] < 9 || boot[108] > 12 || boot[109] > 25 - boot[108]) {
+        r_printf("Invalid exFAT boot sector\n");
+        return -1;
+    }
+
+    uint32_t sector = 1u << boot[108];
+
+    v.fd = fd;
+    v.cluster = sector << boot[109];
+    v.heap = (uint64_t) le32(boot + 88) * sector;
+    v.mask = 0xFFFFFFFF;
+
+    if (read_fat(&v, (uint64_t) le32(boot + 80) * sector, (uint64_t) le32(boot + 84) * sector) < 0) return -1;
+
+    int ret = exfat_dir(&v, le32(boot + 96), 0, 0, found);
+
+    free(v.fat);
+
+    return ret;
+}
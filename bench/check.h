@@ -0,0 +1,20 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdint.h>
+
+/* What a stage left behind, read back: the regular files in a
+   directory tree, on a FAT32 or on an exFAT volume, and their bytes,
+   to be held against the corpus that went in. Only the directories
+   are read, none of the file data. */
+
+typedef struct check {
+    uint64_t files;
+    uint64_t bytes;
+} check_t;
+
+int check_tree(const char *dir, check_t *found);
+int check_fat32(int fd, check_t *found);
+int check_exfat(int fd, check_t *found);
+
+#endif // CHECK_H
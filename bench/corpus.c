@@ -0,0 +1,749 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "corpus.h"
+
+#define SECTOR 2048
+#define MAX_EXTENT 0xFFFFF800u  /* Largest ISO9660 extent, whole sectors */
+#define WRITE_BUF (1024 * 1024) /* A multiple of CORPUS_BLOCK */
+
+#define KIB 1024ull
+#define MIB (1024 * KIB)
+#define GIB (1024 * MIB)
+
+static const char *names[CORPUS_PROFILES] = { "tiny", "huge", "deep", "windows", "linux" };
+
+static uint64_t splitmix(uint64_t *x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ull);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+
+    return z ^ (z >> 31);
+}
+
+static uint64_t between(uint64_t *st, uint64_t lo, uint64_t hi) {
+    return lo + splitmix(st) % (hi - lo + 1);
+}
+
+static uint64_t scaled(uint64_t size, double scale) {
+    uint64_t s = size * scale;
+
+    return s < CORPUS_BLOCK ? CORPUS_BLOCK : s;
+}
+
+static int count(int n, double scale) {
+    int s = n * scale;
+
+    return s < 1 ? 1 : s;
+}
+
+static int add(corpus_t *c, uint64_t size, const char *format, ...) {
+    if (c->count == c->cap) {
+        size_t cap = c->cap ? c->cap * 2 : 256;
+        corpus_file_t *files = realloc(c->files, cap * sizeof(corpus_file_t));
+
+        if (files == NULL) return -1;
+
+        c->files = files;
+        c->cap = cap;
+    }
+
+    va_list ap;
+    char *path;
+
+    va_start(ap, format);
+    int n = vasprintf(&path, format, ap);
+    va_end(ap);
+
+    if (n < 0) return -1;
+
+    c->files[c->count].path = path;
+    c->files[c->count].size = size;
+    c->files[c->count].sparse = 0;
+    c->count++;
+    c->bytes += size;
+
+    if (size > c->largest) c->largest = size;
+
+    return 0;
+}
+
+/* The bytes of file n from off on, off has to be a multiple of
+   CORPUS_BLOCK. Every block is seeded on its own, so any block can be
+   produced without the ones before it. The data does not compress and
+   has no zero runs, like the archives that make up most of an ISO. */
+
+static void fill(const corpus_t *c, size_t n, uint64_t off, unsigned char *buf, size_t len) {
+    size_t done = 0;
+
+    while (done < len) {
+        uint64_t st = c->seed ^ ((uint64_t) n << 40) ^ ((off + done) / CORPUS_BLOCK);
+        uint64_t x = splitmix(&st) | 1;
+        size_t end = len - done < CORPUS_BLOCK ? len : done + CORPUS_BLOCK;
+
+        while (done < end) {
+            x ^= x >> 12;
+            x ^= x << 25;
+            x ^= x >> 27;
+
+            uint64_t v = x * 0x2545F4914F6CDD1Dull;
+            size_t k = end - done < 8 ? end - done : 8;
+
+            memcpy(buf + done, &v, k);
+            done += k;
+        }
+    }
+}
+
+static int plan_tiny(corpus_t *c, double scale, uint64_t *st) {
+    int files = count(20000, scale);
+    int dirs = files / 100 + 1;
+
+    for (int i = 0; i < files; i++) {
+        if (add(c, between(st, 100, 16 * KIB), "d%03d/f%05d.txt", i % dirs, i) < 0) return -1;
+    }
+
+    return 0;
+}
+
+static int plan_huge(corpus_t *c, double scale, uint64_t *st) {
+    for (int i = 0; i < 4; i++) {
+        if (add(c, scaled(512 * MIB, scale) + between(st, 0, MIB), "huge%d.bin", i) < 0) return -1;
+    }
+
+    /* At full size past what FAT32 can hold and what one ISO9660
+       extent can, mostly a hole so that it costs next to nothing */
+
+    if (add(c, scaled(4 * GIB + 512 * MIB, scale) + between(st, 0, MIB), "disk.img") < 0) return -1;
+
+    c->files[c->count - 1].sparse = 1;
+
+    return 0;
+}
+
+static int plan_deep(corpus_t *c, double scale, uint64_t *st) {
+    int branches = count(8, scale);
+
+    for (int b = 0; b < branches; b++) {
+        char dir[64 * 8 + 16];
+        int len = snprintf(dir, sizeof(dir), "b%d", b);
+
+        for (int level = 0; level < 64; level++) {
+            len += snprintf(dir + len, sizeof(dir) - len, "/l%02d", level);
+
+            for (int i = 0; i < 4; i++) {
+                if (add(c, between(st, KIB, 64 * KIB), "%s/f%d.cfg", dir, i) < 0) return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int plan_windows(corpus_t *c, double scale, uint64_t *st) {
+    int ret = 0;
+
+    ret |= add(c, 400 * KIB, "bootmgr");
+    ret |= add(c, 1400 * KIB, "bootmgr.efi");
+    ret |= add(c, 100 * KIB, "setup.exe");
+    ret |= add(c, 128, "autorun.inf");
+    ret |= add(c, 16 * KIB, "boot/bcd");
+    ret |= add(c, 3 * MIB, "boot/boot.sdi");
+    ret |= add(c, 4 * KIB, "boot/etfsboot.com");
+    ret |= add(c, 1500 * KIB, "efi/boot/bootx64.efi");
+    ret |= add(c, scaled(500 * MIB, scale), "sources/boot.wim");
+    ret |= add(c, scaled(3584 * MIB, scale), "sources/install.wim");
+
+    for (int i = 0; i < 20 && ret == 0; i++) {
+        ret |= add(c, between(st, 50 * KIB, 3 * MIB), "boot/fonts/font%02d.ttf", i);
+    }
+
+    for (int i = 0; i < 40 && ret == 0; i++) {
+        ret |= add(c, between(st, KIB, 200 * KIB), "efi/microsoft/boot/res%02d.mui", i);
+    }
+
+    for (int i = 0; i < count(1000, scale) && ret == 0; i++) {
+        ret |= add(c, between(st, 10 * KIB, 2 * MIB), "sources/lib%04d.dll", i);
+    }
+
+    for (int i = 0; i < count(200, scale) && ret == 0; i++) {
+        ret |= add(c, between(st, 5 * KIB, 100 * KIB), "sources/en-us/msg%03d.mui", i);
+    }
+
+    for (int i = 0; i < 50 && ret == 0; i++) {
+        ret |= add(c, between(st, KIB, 64 * KIB), "support/logging/log%02d.dll", i);
+    }
+
+    return ret;
+}
+
+static int plan_linux(corpus_t *c, double scale, uint64_t *st) {
+    int ret = 0;
+
+    ret |= add(c, scaled(2560 * MIB, scale), "casper/filesystem.squashfs");
+    ret |= add(c, 12 * MIB, "casper/vmlinuz");
+    ret |= add(c, 60 * MIB, "casper/initrd");
+    ret |= add(c, 60 * KIB, "casper/filesystem.manifest");
+    ret |= add(c, 11, "casper/filesystem.size");
+    ret |= add(c, 2 * KIB, "boot/grub/grub.cfg");
+    ret |= add(c, 2300 * KIB, "boot/grub/font.pf2");
+    ret |= add(c, 950 * KIB, "efi/boot/bootx64.efi");
+    ret |= add(c, 2300 * KIB, "efi/boot/grubx64.efi");
+    ret |= add(c, 40 * KIB, "isolinux/isolinux.bin");
+    ret |= add(c, 40 * KIB, "md5sum.txt");
+
+    for (int i = 0; i < 280 && ret == 0; i++) {
+        ret |= add(c, between(st, 2 * KIB, 60 * KIB), "boot/grub/x86_64-efi/mod%03d.mod", i);
+    }
+
+    for (int i = 0; i < count(150, scale) && ret == 0; i++) {
+        ret |= add(c, between(st, 20 * KIB, 5 * MIB), "pool/main/p%02d/pkg%03d.deb", i % 26, i);
+    }
+
+    for (int i = 0; i < 20 && ret == 0; i++) {
+        ret |= add(c, between(st, 200, 40 * KIB), "dists/stable/main/list%02d", i);
+    }
+
+    return ret;
+}
+
+int corpus_plan(corpus_t *c, int profile, double scale, uint64_t seed) {
+    uint64_t st = seed;
+    int ret = -1;
+
+    memset(c, 0, sizeof(corpus_t));
+    c->seed = seed;
+
+    switch (profile) {
+    case CORPUS_TINY:
+        ret = plan_tiny(c, scale, &st);
+        break;
+    case CORPUS_HUGE:
+        ret = plan_huge(c, scale, &st);
+        break;
+    case CORPUS_DEEP:
+        ret = plan_deep(c, scale, &st);
+        break;
+    case CORPUS_WINDOWS:
+        ret = plan_windows(c, scale, &st);
+        break;
+    case CORPUS_LINUX:
+        ret = plan_linux(c, scale, &st);
+        break;
+    }
+
+    if (ret < 0) corpus_free(c);
+
+    return ret;
+}
+
+void corpus_free(corpus_t *c) {
+    for (size_t i = 0; i < c->count; i++) free(c->files[i].path);
+
+    free(c->files);
+    memset(c, 0, sizeof(corpus_t));
+}
+
+const char *corpus_name(int profile) {
+    return profile >= 0 && profile < CORPUS_PROFILES ? names[profile] : "unknown";
+}
+
+int corpus_profile(const char *name) {
+    for (int i = 0; i < CORPUS_PROFILES; i++) {
+        if (strcmp(names[i], name) == 0) return i;
+    }
+
+    return -1;
+}
+
+/* Writes size bytes of file n at off in fd. Of a sparse file only the
+   first and the last block are written, fd has to read as zeros in
+   between already. */
+
+static int write_file(const corpus_t *c, size_t n, int fd, uint64_t off, unsigned char *buf) {
+    uint64_t size = c->files[n].size;
+
+    if (c->files[n].sparse && size > 2 * CORPUS_BLOCK) {
+        uint64_t tail = (size - 1) / CORPUS_BLOCK * CORPUS_BLOCK;
+
+        fill(c, n, 0, buf, CORPUS_BLOCK);
+        fill(c, n, tail, buf + CORPUS_BLOCK, size - tail);
+
+        if (pwrite(fd, buf, CORPUS_BLOCK, off) != CORPUS_BLOCK ||
+            pwrite(fd, buf + CORPUS_BLOCK, size - tail, off + tail) != (ssize_t) (size - tail)) {
+            return -1;
+        }
+
+        return 0;
+    }
+
+    for (uint64_t done = 0; done < size; ) {
+        size_t len = size - done < WRITE_BUF ? size - done : WRITE_BUF;
+
+        fill(c, n, done, buf, len);
+
+        if (pwrite(fd, buf, len, off + done) != (ssize_t) len) return -1;
+
+        done += len;
+    }
+
+    return 0;
+}
+
+int corpus_tree(const corpus_t *c, const char *dir) {
+    unsigned char *buf = malloc(WRITE_BUF);
+    char path[4096];
+    int ret = 0;
+
+    if (buf == NULL) return -1;
+
+    for (size_t i = 0; i < c->count && ret == 0; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, c->files[i].path);
+
+        /* Every parent directory, existing ones are fine */
+
+        for (char *p = path + strlen(dir) + 1; (p = strchr(p, '/')) != NULL; p++) {
+            *p = 0;
+
+            if (mkdir(path, 0755) < 0 && errno != EEXIST) ret = -1;
+
+            *p = '/';
+        }
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        if (fd >= 0 && c->files[i].sparse && ftruncate(fd, c->files[i].size) < 0) ret = -1;
+
+        if (ret < 0 || fd < 0 || write_file(c, i, fd, 0, buf) < 0) {
+            r_printf("Error writing %s: %s\n", path, strerror(errno));
+            ret = -1;
+        }
+
+        if (fd >= 0) close(fd);
+    }
+
+    free(buf);
+
+    return ret;
+}
+
+/* ISO9660 with Rock Ridge names. The ISO9660 names are just numbers,
+   the real ones are in an NM entry of every record. The little and the
+   big endian path table come first after the volume descriptors, then
+   the directories, then the file data, each file contiguous. isofs
+   never reads the path tables, other readers do. */
+
+typedef struct node {
+    const char *name;
+    int name_len;
+    int file;               /* Index in the corpus, -1 for directories */
+    int parent;
+    int first;              /* First child */
+    int last;
+    int next;               /* Next sibling */
+    int children;
+    int index;              /* Among the parent's children, the ISO9660 name */
+    int number;             /* Directories, in the path table */
+    uint32_t lba;
+    uint32_t size;          /* Directory bytes, whole sectors */
+} node_t;
+
+static void put733(unsigned char *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = v >> (8 * i);
+        p[7 - i] = v >> (8 * i);
+    }
+}
+
+static void put723(unsigned char *p, uint16_t v) {
+    p[0] = p[3] = v & 0xFF;
+    p[1] = p[2] = v >> 8;
+}
+
+static void put32(unsigned char *p, uint32_t v, int big) {
+    for (int i = 0; i < 4; i++) p[big ? 3 - i : i] = v >> (8 * i);
+}
+
+static void put16(unsigned char *p, uint16_t v, int big) {
+    p[big ? 1 : 0] = v & 0xFF;
+    p[big ? 0 : 1] = v >> 8;
+}
+
+static int add_node(node_t **nodes, int *n, int *cap, const char *name, int len, int parent, int file) {
+    if (*n == *cap) {
+        int grown = *cap ? *cap * 2 : 1024;
+        node_t *more = realloc(*nodes, grown * sizeof(node_t));
+
+        if (more == NULL) return -1;
+
+        *nodes = more;
+        *cap = grown;
+    }
+
+    node_t *d = &(*nodes)[*n];
+
+    memset(d, 0, sizeof(node_t));
+    d->name = name;
+    d->name_len = len;
+    d->file = file;
+    d->parent = parent;
+    d->first = d->last = d->next = -1;
+
+    if (parent >= 0) {
+        node_t *p = &(*nodes)[parent];
+
+        d->index = p->children;
+
+        if (p->last >= 0) {
+            (*nodes)[p->last].next = *n;
+        } else {
+            p->first = *n;
+        }
+
+        p->last = *n;
+        p->children++;
+    }
+
+    return (*n)++;
+}
+
+/* Length of a record, its ISO9660 name is the child's number in hex.
+   Every record in a directory has a PX entry, readers take one without
+   any Rock Ridge entry for a broken one. The root record in the volume
+   descriptor has a fixed size and none. */
+
+#define SU_SP 1
+#define SU_PX 2
+
+#define PX_LEN 36
+
+static int record_len(int iso_len, int nm_len, int su) {
+    int len = 33 + iso_len + (iso_len % 2 == 0) + (nm_len ? 5 + nm_len : 0) +
+              (su & SU_SP ? 7 : 0) + (su & SU_PX ? PX_LEN : 0);
+
+    return len + (len % 2);
+}
+
+static int record(unsigned char *r, uint32_t lba, uint32_t size, uint8_t flags,
+                  const char *iso, int iso_len, const char *nm, int nm_len, int entries) {
+    int len = record_len(iso_len, nm_len, entries);
+    unsigned char *su = r + 33 + iso_len + (iso_len % 2 == 0);
+
+    memset(r, 0, len);
+    r[0] = len;
+    put733(r + 2, lba);
+    put733(r + 10, size);
+    r[18] = 116;            /* 2016-01-01 */
+    r[19] = 1;
+    r[20] = 1;
+    r[25] = flags;
+    put723(r + 28, 1);
+    r[32] = iso_len;
+    memcpy(r + 33, iso, iso_len);
+
+    if (entries & SU_SP) {
+        memcpy(su, "SP\x07\x01\xBE\xEF\x00", 7);
+        su += 7;
+    }
+
+    if (entries & SU_PX) {
+        su[0] = 'P';
+        su[1] = 'X';
+        su[2] = PX_LEN;
+        su[3] = 1;
+        put733(su + 4, (flags & 2) ? 040755 : 0100644);
+        put733(su + 12, (flags & 2) ? 2 : 1);
+        su += PX_LEN;
+    }
+
+    if (nm_len) {
+        su[0] = 'N';
+        su[1] = 'M';
+        su[2] = 5 + nm_len;
+        su[3] = 1;
+        su[4] = 0;
+        memcpy(su + 5, nm, nm_len);
+    }
+
+    return len;
+}
+
+static int extents(uint64_t size) {
+    return size <= MAX_EXTENT ? 1 : (size + MAX_EXTENT - 1) / MAX_EXTENT;
+}
+
+/* Lays out or, with buf, writes the records of directory d. Returns
+   the size in bytes, records never cross a sector. */
+
+static uint32_t directory(const corpus_t *c, const node_t *nodes, int d, unsigned char *buf) {
+    const node_t *dir = &nodes[d];
+    const node_t *up = &nodes[dir->parent >= 0 ? dir->parent : d];
+    unsigned char r[256];
+    uint32_t pos = 0;
+    int len;
+
+#define PLACE(len) \
+    do { \
+        if (pos % SECTOR + (len) > SECTOR) pos = (pos / SECTOR + 1) * SECTOR; \
+        if (buf) memcpy(buf + pos, r, (len)); \
+        pos += (len); \
+    } while (0)
+
+    len = record(r, dir->lba, dir->size, 2, "\0", 1, NULL, 0, dir->parent < 0 ? SU_SP | SU_PX : SU_PX);
+    PLACE(len);
+    len = record(r, up->lba, up->size, 2, "\1", 1, NULL, 0, SU_PX);
+    PLACE(len);
+
+    for (int i = dir->first; i >= 0; i = nodes[i].next) {
+        const node_t *e = &nodes[i];
+        char iso[16];
+        int iso_len = snprintf(iso, sizeof(iso), e->file < 0 ? "%X" : "%X.;1", e->index);
+
+        if (e->file < 0) {
+            len = record(r, e->lba, e->size, 2, iso, iso_len, e->name, e->name_len, SU_PX);
+            PLACE(len);
+            continue;
+        }
+
+        uint64_t size = c->files[e->file].size;
+        uint32_t lba = e->lba;
+        int n = extents(size);
+
+        for (int x = 0; x < n; x++) {
+            uint32_t part = size > MAX_EXTENT ? MAX_EXTENT : size;
+
+            len = record(r, lba, part, x < n - 1 ? 0x80 : 0, iso, iso_len, e->name, e->name_len, SU_PX);
+            PLACE(len);
+
+            lba += part / SECTOR;
+            size -= part;
+        }
+    }
+
+#undef PLACE
+
+    return (pos + SECTOR - 1) / SECTOR * SECTOR;
+}
+
+/* Lays out or, with buf, writes a path table: every directory parents
+   first, in the order of their numbers, which this breadth first
+   numbering keeps sorted by parent. Returns its size in bytes. */
+
+static uint32_t path_table(const node_t *nodes, const int *order, int dirs, unsigned char *buf, int big) {
+    uint32_t pos = 0;
+
+    for (int i = 0; i < dirs; i++) {
+        const node_t *d = &nodes[order[i]];
+        char iso[16];
+        int len = d->parent < 0 ? 1 : snprintf(iso, sizeof(iso), "%X", d->index);
+
+        if (buf) {
+            unsigned char *r = buf + pos;
+
+            r[0] = len;
+            r[1] = 0;
+            put32(r + 2, d->lba, big);
+            put16(r + 6, d->parent < 0 ? 1 : nodes[d->parent].number, big);
+
+            if (d->parent < 0) {
+                r[8] = 0;
+            } else {
+                memcpy(r + 8, iso, len);
+            }
+        }
+
+        pos += 8 + len + (len % 2);
+    }
+
+    return pos;
+}
+
+static void volume_descriptor(unsigned char *pvd, uint32_t sectors, const node_t *root,
+                              uint32_t table_size, uint32_t l_table, uint32_t m_table) {
+    memset(pvd, 0, SECTOR);
+    pvd[0] = 1;
+    memcpy(pvd + 1, "CD001", 5);
+    pvd[6] = 1;
+    memset(pvd + 8, ' ', 32);
+    memset(pvd + 40, ' ', 32);
+    memcpy(pvd + 40, "RUFUSL_BENCH", 12);
+    put733(pvd + 80, sectors);
+    put723(pvd + 120, 1);
+    put723(pvd + 124, 1);
+    put723(pvd + 128, SECTOR);
+    put733(pvd + 132, table_size);
+    put32(pvd + 140, l_table, 0);
+    put32(pvd + 148, m_table, 1);
+    record(pvd + 156, root->lba, root->size, 2, "\0", 1, NULL, 0, 0);
+    memset(pvd + 190, ' ', 623);
+
+    for (int i = 0; i < 4; i++) {
+        memset(pvd + 813 + 17 * i, '0', 16);
+    }
+
+    pvd[881] = 1;
+}
+
+int corpus_iso(const corpus_t *c, const char *path, uint64_t *size) {
+    node_t *nodes = NULL;
+    int n = 0;
+    int cap = 0;
+    int ret = -1;
+    int fd = -1;
+    int dirs = 0;
+    int *order = NULL;
+    unsigned char *buf = NULL;
+    unsigned char *table = NULL;
+
+    if (add_node(&nodes, &n, &cap, "", 0, -1, -1) < 0) goto out;
+
+    /* The tree, directories are found by name among the children */
+
+    for (size_t i = 0; i < c->count; i++) {
+        const char *p = c->files[i].path;
+        int parent = 0;
+        const char *slash;
+
+        while ((slash = strchr(p, '/')) != NULL) {
+            int len = slash - p;
+            int found = -1;
+
+            for (int k = nodes[parent].first; k >= 0; k = nodes[k].next) {
+                if (nodes[k].file < 0 && nodes[k].name_len == len && memcmp(nodes[k].name, p, len) == 0) {
+                    found = k;
+                    break;
+                }
+            }
+
+            if (found < 0 && (found = add_node(&nodes, &n, &cap, p, len, parent, -1)) < 0) goto out;
+
+            parent = found;
+            p = slash + 1;
+        }
+
+        if (add_node(&nodes, &n, &cap, p, strlen(p), parent, i) < 0) goto out;
+    }
+
+    /* Path table numbers go breadth first, the root is 1 */
+
+    if ((order = malloc(n * sizeof(int))) == NULL) goto out;
+
+    order[dirs++] = 0;
+    nodes[0].number = 1;
+
+    for (int q = 0; q < dirs; q++) {
+        for (int k = nodes[order[q]].first; k >= 0; k = nodes[k].next) {
+            if (nodes[k].file >= 0) continue;
+
+            order[dirs++] = k;
+            nodes[k].number = dirs;
+        }
+    }
+
+    if (dirs > 0xFFFF) {
+        errno = EOVERFLOW;
+        goto out;
+    }
+
+    uint32_t table_size = path_table(nodes, order, dirs, NULL, 0);
+    uint32_t table_sectors = (table_size + SECTOR - 1) / SECTOR;
+
+    /* Directories get their sectors after the path tables, in the
+       order they were found, which puts every parent before its
+       children */
+
+    uint32_t lba = 18 + 2 * table_sectors;
+
+    for (int i = 0; i < n; i++) {
+        if (nodes[i].file >= 0) continue;
+
+        nodes[i].size = directory(c, nodes, i, NULL);
+        nodes[i].lba = lba;
+        lba += nodes[i].size / SECTOR;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (nodes[i].file < 0) continue;
+
+        uint64_t bytes = c->files[nodes[i].file].size;
+
+        nodes[i].lba = bytes ? lba : 0;
+        lba += (bytes + SECTOR - 1) / SECTOR;
+    }
+
+    if ((buf = malloc(WRITE_BUF > 64 * SECTOR ? WRITE_BUF : 64 * SECTOR)) == NULL) goto out;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) goto out;
+
+    if (ftruncate(fd, (uint64_t) lba * SECTOR) < 0) goto out;
+
+    volume_descriptor(buf, lba, &nodes[0], table_size, 18, 18 + table_sectors);
+
+    if (pwrite(fd, buf, SECTOR, 16 * SECTOR) != SECTOR) goto out;
+
+    if ((table = calloc(table_sectors, SECTOR)) == NULL) goto out;
+
+    for (int big = 0; big < 2; big++) {
+        path_table(nodes, order, dirs, table, big);
+
+        if (pwrite(fd, table, table_size, (uint64_t) (18 + big * table_sectors) * SECTOR) != (ssize_t) table_size) {
+            goto out;
+        }
+    }
+
+    memset(buf, 0, SECTOR);
+    buf[0] = 0xFF;
+    memcpy(buf + 1, "CD001", 5);
+    buf[6] = 1;
+
+    if (pwrite(fd, buf, SECTOR, 17 * SECTOR) != SECTOR) goto out;
+
+    for (int i = 0; i < n; i++) {
+        if (nodes[i].file >= 0) continue;
+
+        unsigned char *dir = calloc(1, nodes[i].size);
+
+        if (dir == NULL) goto out;
+
+        directory(c, nodes, i, dir);
+
+        ssize_t w = pwrite(fd, dir, nodes[i].size, (uint64_t) nodes[i].lba * SECTOR);
+
+        free(dir);
+
+        if (w != (ssize_t) nodes[i].size) goto out;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (nodes[i].file < 0) continue;
+
+        if (write_file(c, nodes[i].file, fd, (uint64_t) nodes[i].lba * SECTOR, buf) < 0) goto out;
+    }
+
+    if (size) *size = (uint64_t) lba * SECTOR;
+
+    ret = 0;
+
+out:
+    if (ret < 0) r_printf("Error writing %s: %s\n", path, strerror(errno));
+
+    if (fd >= 0 && close(fd) < 0) ret = -1;
+
+    free(table);
+    free(buf);
+    free(order);
+    free(nodes);
+
+    return ret;
+}
@@ -0,0 +1,43 @@
+#ifndef CORPUS_H
+#define CORPUS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Synthetic sources for the benchmarks. A profile plans a list of
+   files, the same seed always gives the same names, sizes and bytes,
+   and the plan can then be written out as a directory tree, as an
+   ISO9660 image with Rock Ridge names, or both. */
+
+#define CORPUS_TINY 0           /* Tens of thousands of small files */
+#define CORPUS_HUGE 1           /* A few files of hundreds of MiB, a sparse one past 4 GiB */
+#define CORPUS_DEEP 2           /* Directories nested 65 levels deep */
+#define CORPUS_WINDOWS 3        /* Windows installer, a big install.wim */
+#define CORPUS_LINUX 4          /* Live Linux, a big squashfs */
+#define CORPUS_PROFILES 5
+
+#define CORPUS_BLOCK 65536      /* Content is generated per block */
+
+typedef struct corpus_file {
+    char *path;
+    uint64_t size;
+    int sparse;             /* Only the first and the last block hold data */
+} corpus_file_t;
+
+typedef struct corpus {
+    corpus_file_t *files;
+    size_t count;
+    size_t cap;
+    uint64_t bytes;
+    uint64_t largest;
+    uint64_t seed;
+} corpus_t;
+
+int corpus_plan(corpus_t *c, int profile, double scale, uint64_t seed);
+void corpus_free(corpus_t *c);
+int corpus_tree(const corpus_t *c, const char *dir);
+int corpus_iso(const corpus_t *c, const char *path, uint64_t *size);
+const char *corpus_name(int profile);
+int corpus_profile(const char *name);
+
+#endif // CORPUS_H
@@ -0,0 +1,725 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "logring.h"
+#include "progress.h"
+#include "definitions.h"
+#include "isofs.h"
+#include "check.h"
+#include "corpus.h"
+#include "linux/blockio.h"
+#include "linux/copy.h"
+#include "linux/exfat.h"
+#include "linux/devprobe.h"
+#include "linux/fat32.h"
+#include "linux/fatbuild.h"
+#include "linux/partition.h"
+#include "linux/rawwrite.h"
+#include "linux/wipe.h"
+
+/* Runs the stages of a job one by one against a synthetic corpus and
+   a file or loop device standing in for the stick, and reports for
+   each how fast it went and what it cost. Nothing here needs root
+   unless the target is a real block device. */
+
+#define BENCH_DEFAULT_DIR "/var/tmp/rufusl-bench"
+#define BENCH_DEFAULT_SCALE 0.1
+#define BENCH_DRAIN_INTERVAL 50 /* ms between batches of log messages */
+#define BENCH_MIN_TARGET (512ull * 1024 * 1024)
+#define BENCH_FAT32_MAX_FILE 0xFFFFFFFFull
+
+typedef struct bench {
+    corpus_t corpus;
+    int profile;
+    char iso[4096];
+    char tree[4096];
+    char out[4096];
+    const char *target;
+    uint32_t fd;
+    int threads;
+    int depth;
+    int chunk;
+} bench_t;
+
+typedef struct stage {
+    const char *name;
+    int (*run)(bench_t *b);
+    int needs;              /* NEED_ flags */
+    int (*count)(bench_t *b, check_t *found);   /* What it wrote, if files */
+} stage_t;
+
+#define NEED_ISO 1
+#define NEED_TREE 2
+#define NEED_FILES 4        /* Counts the corpus files as its work */
+#define NEED_FAT32 8        /* Puts them on FAT32, no file may reach 4 GiB */
+
+typedef struct usage {
+    double wall;
+    uint64_t syscalls;
+    long switches;
+    long peak_kib;
+} usage_t;
+
+static const char *usage_text =
+    "Usage: rufusl-bench [options]\n"
+    "\n"
+    "  -p, --profile NAME      tiny, huge, deep, windows, linux or all, default all\n"
+    "  -s, --scale X           Size of the corpus, 1 is a full size ISO, default 0.1\n"
+    "      --seed N            Seed of the corpus, default 1\n"
+    "  -d, --dir PATH          Work directory, default " BENCH_DEFAULT_DIR "\n"
+    "  -T, --target PATH       File or loop device to write, default a sparse file in the work directory\n"
+    "      --size MIB          Size of the target file, default large enough for the corpus\n"
+    "  -S, --stages LIST       Stages to run, default probe,wipe,format,build,exfat,extract,truncate,copy,raw\n"
+    "  -t, --threads N         Copy threads\n"
+    "      --chunk MIB         DD chunk size\n"
+    "      --depth N           I/O queue depth\n"
+    "  -k, --keep              Keep the corpus and the target afterwards\n"
+    "  -v, --verbose           Log to stderr as well as to bench.log\n";
+
+enum { OPT_SEED = 256, OPT_SIZE, OPT_CHUNK, OPT_DEPTH };
+
+static const struct option options[] = {
+    { "profile", required_argument, NULL, 'p' },
+    { "scale", required_argument, NULL, 's' },
+    { "seed", required_argument, NULL, OPT_SEED },
+    { "dir", required_argument, NULL, 'd' },
+    { "target", required_argument, NULL, 'T' },
+    { "size", required_argument, NULL, OPT_SIZE },
+    { "stages", required_argument, NULL, 'S' },
+    { "threads", required_argument, NULL, 't' },
+    { "chunk", required_argument, NULL, OPT_CHUNK },
+    { "depth", required_argument, NULL, OPT_DEPTH },
+    { "keep", no_argument, NULL, 'k' },
+    { "verbose", no_argument, NULL, 'v' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+static FILE *log_file;
+static int verbose;
+static pthread_t drainer;
+static volatile int draining;
+
+/* job.c is linked in through rufusl.pri, nothing shows its ticker */
+
+void set_ticker(const char *text) {
+    (void) text;
+}
+
+static void sink(void *arg, int subsys, int level, const char *text, size_t len) {
+    (void) arg;
+    (void) subsys;
+    (void) level;
+
+    if (log_file) fwrite(text, 1, len, log_file);
+    if (verbose) fwrite(text, 1, len, stderr);
+}
+
+static void drain(void) {
+    while (log_drain(sink, NULL, 256) > 0) ;
+}
+
+static void *drain_loop(void *arg) {
+    (void) arg;
+
+    struct timespec ts = { 0, BENCH_DRAIN_INTERVAL * 1000000L };
+
+    while (__atomic_load_n(&draining, __ATOMIC_ACQUIRE)) {
+        drain();
+        nanosleep(&ts, NULL);
+    }
+
+    drain();
+
+    return NULL;
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Read and write calls made so far. Requests that go through io_uring
+   are not system calls of their own and don't show up here. */
+
+static uint64_t syscalls(void) {
+    FILE *f = fopen("/proc/self/io", "r");
+    char line[128];
+    uint64_t total = 0;
+    unsigned long long v;
+
+    if (f == NULL) return 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "syscr: %llu", &v) == 1 || sscanf(line, "syscw: %llu", &v) == 1) total += v;
+    }
+
+    fclose(f);
+
+    return total;
+}
+
+/* VmHWM is reset to the current RSS by writing 5 to clear_refs, so
+   every stage gets its own peak */
+
+static long peak_kib(int reset) {
+    if (reset) {
+        int fd = open("/proc/self/clear_refs", O_WRONLY);
+
+        if (fd >= 0) {
+            if (write(fd, "5", 1) < 0) { }
+            close(fd);
+        }
+
+        return 0;
+    }
+
+    FILE *f = fopen("/proc/self/status", "r");
+    char line[128];
+    long kib = 0;
+
+    if (f == NULL) return 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmHWM: %ld", &kib) == 1) break;
+    }
+
+    fclose(f);
+
+    return kib;
+}
+
+static long switches(void) {
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+
+    return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+/* Sources are read from the disk rather than from the page cache the
+   corpus was just written through */
+
+static void uncache(const char *path) {
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) return;
+
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static int uncache_walk(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    (void) sb;
+    (void) ftwbuf;
+
+    if (typeflag == FTW_F) uncache(fpath);
+
+    return 0;
+}
+
+static int remove_walk(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    (void) sb;
+    (void) ftwbuf;
+
+    return typeflag == FTW_DP ? rmdir(fpath) : unlink(fpath);
+}
+
+static int remove_tree(const char *path) {
+    if (access(path, F_OK) < 0) return 0;
+
+    return nftw(path, remove_walk, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/* copy.c puts the relative path right after dest, so it ends in a / */
+
+static int fresh_out(bench_t *b) {
+    char dir[4096];
+
+    snprintf(dir, sizeof(dir), "%.*s", (int) strlen(b->out) - 1, b->out);
+
+    if (remove_tree(dir) < 0 || mkdir(dir, 0755) < 0) {
+        r_printf("Error creating %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int stage_probe(bench_t *b) {
+    devprobe_t p;
+
+    return devprobe_run(b->fd, &p);
+}
+
+static int stage_wipe(bench_t *b) {
+    return full_wipe(&b->fd, WIPE_ZERO, (size_t) b->chunk * 1024 * 1024, b->depth);
+}
+
+static int stage_format(bench_t *b) {
+    return format_fat32(&b->fd, BS_4096B, PART_ALIGN_DEFAULT, "BENCH",
+                        (size_t) b->chunk * 1024 * 1024, b->depth);
+}
+
+static int stage_build(bench_t *b) {
+    isofs_t *fs;
+
+    if (isofs_open(b->iso, &fs) < 0) return -1;
+
+    int ret = build_fat32(&b->fd, fs, BS_4096B, "BENCH", PART_ALIGN_DEFAULT,
+                          (size_t) b->chunk * 1024 * 1024, NULL);
+
+    isofs_close(fs);
+
+    return ret;
+}
+
+static int stage_exfat(bench_t *b) {
+    isofs_t *fs;
+
+    if (isofs_open(b->iso, &fs) < 0) return -1;
+
+    int ret = build_exfat(&b->fd, fs, BS_AUTO, "BENCH", PART_ALIGN_DEFAULT,
+                          (size_t) b->chunk * 1024 * 1024, NULL);
+
+    isofs_close(fs);
+
+    return ret;
+}
+
+static int stage_extract(bench_t *b) {
+    isofs_t *fs;
+
+    if (fresh_out(b) < 0 || isofs_open(b->iso, &fs) < 0) return -1;
+
+    int ret = image_copy(fs, b->out, b->threads);
+
+    isofs_close(fs);
+
+    return ret;
+}
+
+/* The ISO cut off one byte into the first file that has data, with
+   every directory still whole. Extracting it has to fail, copying
+   what is there and padding the rest with zeros is not a success. */
+
+static int stage_truncate(bench_t *b) {
+    char cut[4096 + 8];
+    isofs_t *fs;
+    uint64_t end = UINT64_MAX;
+
+    if (isofs_open(b->iso, &fs) < 0) return -1;
+
+    for (size_t i = 0; i < fs->count; i++) {
+        const isofs_entry_t *e = &fs->entries[i];
+
+        for (uint32_t x = 0; x < e->nextents; x++) {
+            if (e->extents[x].offset != ISOFS_ZERO && e->extents[x].length > 0 && e->extents[x].offset < end) {
+                end = e->extents[x].offset + 1;
+            }
+        }
+    }
+
+    isofs_close(fs);
+
+    if (end == UINT64_MAX) {
+        r_printf("ERROR: no file with data to cut into\n");
+        return -1;
+    }
+
+    snprintf(cut, sizeof(cut), "%s.cut", b->iso);
+
+    int in = open(b->iso, O_RDONLY);
+    int out = open(cut, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ret = in < 0 || out < 0 ? -1 : 0;
+
+    for (uint64_t off = 0; ret == 0 && off < end;) {
+        ssize_t n = copy_file_range(in, NULL, out, NULL, end - off, 0);
+
+        if (n <= 0) {
+            r_printf("Error cutting %s: %s\n", b->iso, n < 0 ? strerror(errno) : "short image");
+            ret = -1;
+        }
+
+        off += n > 0 ? n : 0;
+    }
+
+    if (in >= 0) close(in);
+    if (out >= 0) close(out);
+
+    if (ret == 0 && (fresh_out(b) < 0 || isofs_open(cut, &fs) < 0)) ret = -1;
+
+    if (ret == 0) {
+        if (image_copy(fs, b->out, b->threads) == 0) {
+            r_printf("ERROR: %s cut at %llu bytes extracted without an error\n", b->iso,
+                     (unsigned long long) end);
+            ret = -1;
+        }
+
+        isofs_close(fs);
+    }
+
+    unlink(cut);
+
+    return ret;
+}
+
+static int stage_copy(bench_t *b) {
+    if (fresh_out(b) < 0) return -1;
+
+    return recursive_copy(b->tree, b->out, b->threads);
+}
+
+static int stage_raw(bench_t *b) {
+    return raw_write(b->iso, &b->fd, (size_t) b->chunk * 1024 * 1024, b->depth, 0, NULL, b->threads);
+}
+
+static int count_fat32(bench_t *b, check_t *found) {
+    return check_fat32(b->fd, found);
+}
+
+static int count_exfat(bench_t *b, check_t *found) {
+    return check_exfat(b->fd, found);
+}
+
+static int count_out(bench_t *b, check_t *found) {
+    return check_tree(b->out, found);
+}
+
+static const stage_t stages[] = {
+    { "probe", stage_probe, 0, NULL },
+    { "wipe", stage_wipe, 0, NULL },
+    { "format", stage_format, 0, NULL },
+    { "build", stage_build, NEED_ISO | NEED_FILES | NEED_FAT32, count_fat32 },
+    { "exfat", stage_exfat, NEED_ISO | NEED_FILES, count_exfat },
+    { "extract", stage_extract, NEED_ISO | NEED_FILES, count_out },
+    { "truncate", stage_truncate, NEED_ISO, NULL },
+    { "copy", stage_copy, NEED_TREE | NEED_FILES, count_out },
+    { "raw", stage_raw, NEED_ISO, NULL },
+};
+
+#define STAGES (int) (sizeof(stages) / sizeof(stages[0]))
+
+/* A stage that says it went fine but left files out fails all the same */
+
+static int compare(bench_t *b, const stage_t *s) {
+    check_t found;
+
+    if (s->count(b, &found) < 0) {
+        r_printf("ERROR: %s %s: can't read back what was written\n", corpus_name(b->profile), s->name);
+        return -1;
+    }
+
+    if (found.files != b->corpus.count || found.bytes != b->corpus.bytes) {
+        r_printf("ERROR: %s %s: %llu files, %llu bytes written, the corpus has %zu files, %llu bytes\n",
+                 corpus_name(b->profile), s->name, (unsigned long long) found.files,
+                 (unsigned long long) found.bytes, b->corpus.count, (unsigned long long) b->corpus.bytes);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int run_stage(bench_t *b, const stage_t *s) {
+    progress_t p;
+    usage_t u;
+
+    if ((s->needs & NEED_FAT32) && b->corpus.largest > BENCH_FAT32_MAX_FILE) {
+        r_printf("=== %s %s skipped, a file is 4 GiB or more\n", corpus_name(b->profile), s->name);
+        printf("%-8s %-8s %6s\n", corpus_name(b->profile), s->name, "skip");
+        fflush(stdout);
+        return 0;
+    }
+
+    if (s->needs & NEED_ISO) uncache(b->iso);
+    if (s->needs & NEED_TREE) nftw(b->tree, uncache_walk, 16, FTW_PHYS);
+
+    r_printf("=== %s %s\n", corpus_name(b->profile), s->name);
+
+    peak_kib(1);
+
+    double start = now();
+    uint64_t calls = syscalls();
+    long sw = switches();
+
+    int ret = s->run(b);
+
+    u.wall = now() - start;
+    u.syscalls = syscalls() - calls;
+    u.switches = switches() - sw;
+    u.peak_kib = peak_kib(0);
+
+    progress_finish();
+    progress_sample(&p);
+
+    if (ret == 0 && s->count != NULL) ret = compare(b, s);
+
+    double files = s->needs & NEED_FILES ? b->corpus.count : 0;
+
+    printf("%-8s %-8s %6s %9.2f %9.1f %9.0f %10llu %8ld %8.1f\n",
+           corpus_name(b->profile), s->name, ret < 0 ? "FAILED" : "ok", u.wall,
+           u.wall > 0 ? p.done / 1e6 / u.wall : 0.0, u.wall > 0 ? files / u.wall : 0.0,
+           (unsigned long long) u.syscalls, u.switches, u.peak_kib / 1024.0);
+    fflush(stdout);
+
+    return ret;
+}
+
+static int open_target(bench_t *b, const char *dir, uint64_t iso_size, uint64_t size, char *own) {
+    struct stat st;
+
+    if (b->target == NULL) {
+        snprintf(own, 4096, "%s/target.img", dir);
+        b->target = own;
+    }
+
+    if (stat(b->target, &st) == 0 && S_ISBLK(st.st_mode)) {
+        b->fd = open(b->target, O_RDWR);
+    } else {
+        if (size == 0) {
+            size = iso_size + iso_size / 4 + 64 * 1024 * 1024;
+            if (size < BENCH_MIN_TARGET) size = BENCH_MIN_TARGET;
+        }
+
+        b->fd = open(b->target, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+        if ((int) b->fd >= 0 && ftruncate(b->fd, size) < 0) {
+            close(b->fd);
+            b->fd = -1;
+        }
+    }
+
+    if ((int) b->fd < 0) {
+        fprintf(stderr, "Can't open %s: %s\n", b->target, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int run_profile(bench_t *b, const char *dir, double scale, uint64_t seed,
+                       const int *chosen, uint64_t size, int keep) {
+    int need = 0;
+    int failed = 0;
+    uint64_t iso_size = 0;
+    char own[4096];
+
+    for (int i = 0; i < STAGES; i++) {
+        if (chosen[i]) need |= stages[i].needs;
+    }
+
+    if (corpus_plan(&b->corpus, b->profile, scale, seed) < 0) {
+        fprintf(stderr, "Out of memory planning the corpus\n");
+        return -1;
+    }
+
+    snprintf(b->iso, sizeof(b->iso), "%s/%s/image.iso", dir, corpus_name(b->profile));
+    snprintf(b->tree, sizeof(b->tree), "%s/%s/tree", dir, corpus_name(b->profile));
+    snprintf(b->out, sizeof(b->out), "%s/%s/out/", dir, corpus_name(b->profile));
+
+    fprintf(stderr, "%s: %zu files, %.1f MiB\n", corpus_name(b->profile), b->corpus.count,
+            b->corpus.bytes / 1048576.0);
+
+    char sub[4096];
+
+    snprintf(sub, sizeof(sub), "%s/%s", dir, corpus_name(b->profile));
+    mkdir(sub, 0755);
+
+    /* The raw stage writes the ISO too, so its size sizes the target */
+
+    if (corpus_iso(&b->corpus, b->iso, &iso_size) < 0) failed = 1;
+
+    if (!failed && (need & NEED_TREE)) {
+        remove_tree(b->tree);
+        mkdir(b->tree, 0755);
+
+        if (corpus_tree(&b->corpus, b->tree) < 0) failed = 1;
+    }
+
+    drain();
+
+    if (!failed && open_target(b, dir, iso_size, size, own) < 0) failed = 1;
+
+    for (int i = 0; i < STAGES && !failed; i++) {
+        if (chosen[i] && run_stage(b, &stages[i]) < 0) failed = 1;
+    }
+
+    if ((int) b->fd >= 0) close(b->fd);
+
+    if (!keep) {
+        remove_tree(sub);
+        if (b->target == own) unlink(own);
+    }
+
+    if (b->target == own) b->target = NULL;
+
+    corpus_free(&b->corpus);
+
+    return failed ? -1 : 0;
+}
+
+static int number(const char *arg, const char *name, int min, int max) {
+    char *end;
+    long v = strtol(arg, &end, 10);
+
+    if (*arg == 0 || *end != 0 || v < min || v > max) {
+        fprintf(stderr, "Invalid %s '%s', expected %d to %d\n", name, arg, min, max);
+        exit(2);
+    }
+
+    return (int) v;
+}
+
+int main(int argc, char *argv[]) {
+    bench_t b;
+    const char *dir = BENCH_DEFAULT_DIR;
+    const char *profile = "all";
+    double scale = BENCH_DEFAULT_SCALE;
+    uint64_t seed = 1;
+    uint64_t size = 0;
+    int chosen[STAGES];
+    int keep = 0;
+    int opt;
+
+    memset(&b, 0, sizeof(b));
+    b.threads = COPY_DEFAULT_THREADS;
+    b.depth = BLOCKIO_DEFAULT_DEPTH;
+    b.chunk = RAW_DEFAULT_CHUNK_MB;
+    b.fd = -1;
+
+    for (int i = 0; i < STAGES; i++) chosen[i] = 1;
+
+    while ((opt = getopt_long(argc, argv, "p:s:d:T:S:t:kvh", options, NULL)) != -1) {
+        switch (opt) {
+        case 'p':
+            profile = optarg;
+            if (strcmp(profile, "all") != 0 && corpus_profile(profile) < 0) {
+                fprintf(stderr, "Unknown profile '%s'\n", profile);
+                return 2;
+            }
+            break;
+        case 's':
+            scale = atof(optarg);
+            if (scale <= 0 || scale > 4) {
+                fprintf(stderr, "Invalid scale '%s', expected more than 0, up to 4\n", optarg);
+                return 2;
+            }
+            break;
+        case OPT_SEED:
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        case 'T':
+            b.target = optarg;
+            break;
+        case OPT_SIZE:
+            size = (uint64_t) number(optarg, "target size", 64, 1 << 24) * 1024 * 1024;
+            break;
+        case 'S': {
+            char *list = strdup(optarg);
+
+            for (int i = 0; i < STAGES; i++) chosen[i] = 0;
+
+            for (char *name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+                int found = 0;
+
+                for (int i = 0; i < STAGES; i++) {
+                    if (strcmp(stages[i].name, name) == 0) chosen[i] = found = 1;
+                }
+
+                if (!found) {
+                    fprintf(stderr, "Unknown stage '%s'\n", name);
+                    return 2;
+                }
+            }
+
+            free(list);
+            break;
+        }
+        case 't':
+            b.threads = number(optarg, "thread count", 1, COPY_MAX_THREADS);
+            break;
+        case OPT_CHUNK:
+            b.chunk = number(optarg, "chunk size", RAW_MIN_CHUNK_MB, RAW_MAX_CHUNK_MB);
+            break;
+        case OPT_DEPTH:
+            b.depth = number(optarg, "queue depth", 1, BLOCKIO_MAX_DEPTH);
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'h':
+            fputs(usage_text, stdout);
+            return 0;
+        default:
+            fputs(usage_text, stderr);
+            return 2;
+        }
+    }
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Can't create %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s/bench.log", dir);
+    log_file = fopen(path, "w");
+
+    for (int i = 0; i < LOG_SUBSYSTEMS; i++) log_set_level(i, verbose ? LOG_DEBUG : LOG_INFO);
+
+    draining = 1;
+
+    int err = pthread_create(&drainer, NULL, drain_loop, NULL);
+
+    if (err != 0) {
+        fprintf(stderr, "Can't start the log thread: %s\n", strerror(err));
+        return 1;
+    }
+
+    printf("%-8s %-8s %6s %9s %9s %9s %10s %8s %8s\n", "profile", "stage", "status",
+           "seconds", "MB/s", "files/s", "syscalls", "ctxsw", "RSS MiB");
+
+    int failed = 0;
+
+    for (int p = 0; p < CORPUS_PROFILES; p++) {
+        if (strcmp(profile, "all") != 0 && corpus_profile(profile) != p) continue;
+
+        b.profile = p;
+
+        if (run_profile(&b, dir, scale, seed, chosen, size, keep) < 0) failed = 1;
+    }
+
+    __atomic_store_n(&draining, 0, __ATOMIC_RELEASE);
+    pthread_join(drainer, NULL);
+
+    if (failed) fprintf(stderr, "Some stages failed, see %s\n", path);
+
+    if (log_file) fclose(log_file);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,11 @@
+# Benchmarks of the job stages against a synthetic corpus, no Qt either
+TARGET = rufusl-bench
+TEMPLATE = app
+CONFIG += console O3
+CONFIG -= qt app_bundle
+include(../rufusl.pri)
+SOURCES += main.c \
+    corpus.c \
+    check.c
+HEADERS += corpus.h \
+    check.h
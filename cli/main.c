@@ -0,0 +1,354 @@
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "logring.h"
+#include "definitions.h"
+#include "job.h"
+#include "ndjson.h"
+#include "linux/blockio.h"
+#include "linux/copy.h"
+#include "linux/devices.h"
+#include "linux/fanout.h"
+#include "linux/rawwrite.h"
+#include "linux/user.h"
+
+/* Headless front end: the same job as the window, driven by options,
+   with NDJSON progress on stdout. No Qt is linked in at all. */
+
+#define MAX_DEVICES 32
+
+static const char *usage =
+    "Usage: rufusl-cli --image PATH (--device NAME ... | --all-devices) [options]\n"
+    "       rufusl-cli --list\n"
+    "       rufusl-cli --scan --image PATH\n"
+    "\n"
+    "  -i, --image PATH        ISO or raw image to write\n"
+    "  -d, --device NAME       Target device, like sdb, may be repeated for DD images\n"
+    "  -a, --all-devices       Write a DD image to every removable device\n"
+    "      --dd                Write the image as is instead of building a volume\n"
+    "  -p, --partition mbr|gpt Partition table, default mbr\n"
+    "  -F, --fs fat32|exfat    File system, default fat32, exfat for files of 4 GB or more\n"
+    "  -c, --cluster BYTES     Cluster size, 512 to 32768 or auto, the default, to fit the image\n"
+    "  -l, --label LABEL       Volume label, default GALA\n"
+    "  -f, --full-format MODE  Wipe the device first, zero or trim\n"
+    "  -t, --threads N         Copy, decode and verify threads\n"
+    "      --chunk MIB         Write size, measured per device by default\n"
+    "      --depth N           I/O queue depth, measured per device by default\n"
+    "      --probe             Measure the device again even if it was before\n"
+    "      --align KIB         Partition and cluster alignment, default the erase block or 4096\n"
+    "  -V, --verify            Read back and check what was written\n"
+    "      --interval MS       Time between progress lines, default 250\n"
+    "      --trace FILE        Write a Chrome trace of the run, for ui.perfetto.dev\n"
+    "  -q, --quiet             No log messages on stderr\n"
+    "  -v, --verbose           Also log every file and verified region\n"
+    "      --list              List removable devices and exit\n"
+    "      --scan              Analyze the image and exit\n";
+
+static const char *cluster_labels[] = {
+    BS_512B_LABEL, BS_1024B_LABEL, BS_2048B_LABEL, BS_4096B_LABEL,
+    BS_8192B_LABEL, BS_16384B_LABEL, BS_32768B_LABEL
+};
+
+enum { OPT_DD = 256, OPT_CHUNK, OPT_DEPTH, OPT_PROBE, OPT_ALIGN, OPT_INTERVAL, OPT_TRACE, OPT_LIST, OPT_SCAN };
+
+static const struct option options[] = {
+    { "image", required_argument, NULL, 'i' },
+    { "device", required_argument, NULL, 'd' },
+    { "all-devices", no_argument, NULL, 'a' },
+    { "dd", no_argument, NULL, OPT_DD },
+    { "partition", required_argument, NULL, 'p' },
+    { "fs", required_argument, NULL, 'F' },
+    { "cluster", required_argument, NULL, 'c' },
+    { "label", required_argument, NULL, 'l' },
+    { "full-format", required_argument, NULL, 'f' },
+    { "threads", required_argument, NULL, 't' },
+    { "chunk", required_argument, NULL, OPT_CHUNK },
+    { "depth", required_argument, NULL, OPT_DEPTH },
+    { "probe", no_argument, NULL, OPT_PROBE },
+    { "align", required_argument, NULL, OPT_ALIGN },
+    { "verify", no_argument, NULL, 'V' },
+    { "interval", required_argument, NULL, OPT_INTERVAL },
+    { "trace", required_argument, NULL, OPT_TRACE },
+    { "quiet", no_argument, NULL, 'q' },
+    { "verbose", no_argument, NULL, 'v' },
+    { "list", no_argument, NULL, OPT_LIST },
+    { "scan", no_argument, NULL, OPT_SCAN },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+static int number(const char *arg, const char *name, int min, int max) {
+    char *end;
+    long v = strtol(arg, &end, 10);
+
+    if (*arg == 0 || *end != 0 || v < min || v > max) {
+        fprintf(stderr, "Invalid %s '%s', expected %d to %d\n", name, arg, min, max);
+        exit(2);
+    }
+
+    return (int) v;
+}
+
+static void list_devices(const Device *devices, int count) {
+    for (int i = 0; i < count; i++) {
+        printf("{\"event\":\"device\",\"name\":");
+        ndjson_string(stdout, devices[i].device);
+        printf(",\"vendor\":");
+        ndjson_string(stdout, devices[i].vendor);
+        printf(",\"model\":");
+        ndjson_string(stdout, devices[i].model);
+        printf(",\"serial\":");
+        ndjson_string(stdout, devices[i].serial);
+        printf(",\"bytes\":%llu,\"major\":%d,\"minor\":%d}\n",
+               (unsigned long long) devices[i].capacity * 512, devices[i].major, devices[i].minor);
+    }
+
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+
+    static Device devices[MAX_DEVICES];
+    static Device chosen[MAX_DEVICES];
+    const char *names[MAX_DEVICES];
+    int nnames = 0;
+    int all = 0;
+    int list = 0;
+    int scan = 0;
+    int level = LOG_INFO;
+    int interval = NDJSON_DEFAULT_INTERVAL;
+    uint8_t discovered = 0;
+    job_t job;
+
+    memset(&job, 0, sizeof(job));
+
+    job.partition_scheme = TB_MBR;
+    job.file_system = FS_FAT32;
+    job.cluster_size = BS_AUTO;
+    job.quick_format = 1;
+    job.wipe_mode = WIPE_ZERO;
+    job.threads = COPY_DEFAULT_THREADS;
+    job.source = SRC_ISO;
+    job.label = "GALA";
+
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "i:d:ap:F:c:l:f:t:Vqvh", options, NULL)) != -1) {
+        switch (opt) {
+        case 'i':
+            job.image_path = optarg;
+            break;
+        case 'd':
+            if (nnames == MAX_DEVICES) {
+                fprintf(stderr, "At most %d devices\n", MAX_DEVICES);
+                return 2;
+            }
+            names[nnames++] = strncmp(optarg, "/dev/", 5) == 0 ? optarg + 5 : optarg;
+            break;
+        case 'a':
+            all = 1;
+            break;
+        case OPT_DD:
+            job.source = SRC_DD;
+            break;
+        case 'p':
+            if (strcmp(optarg, "mbr") == 0) {
+                job.partition_scheme = TB_MBR;
+            } else if (strcmp(optarg, "gpt") == 0) {
+                job.partition_scheme = TB_GPT;
+            } else {
+                fprintf(stderr, "Invalid partition table '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case 'F':
+            if (strcmp(optarg, "fat32") == 0) {
+                job.file_system = FS_FAT32;
+            } else if (strcmp(optarg, "exfat") == 0) {
+                job.file_system = FS_EXFAT;
+            } else {
+                fprintf(stderr, "Invalid file system '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case 'c': {
+            if (strcmp(optarg, "auto") == 0) {
+                job.cluster_size = BS_AUTO;
+                break;
+            }
+
+            int bytes = number(optarg, "cluster size", 512, 32768);
+
+            job.cluster_size = -1;
+
+            for (int i = 0; i <= BS_32768B; i++) {
+                if (atoi(cluster_labels[i]) == bytes) job.cluster_size = i;
+            }
+
+            if (job.cluster_size < 0) {
+                fprintf(stderr, "Invalid cluster size %d\n", bytes);
+                return 2;
+            }
+            break;
+        }
+        case 'l':
+            if (strlen(optarg) > 11) {
+                fprintf(stderr, "Volume labels are at most 11 characters\n");
+                return 2;
+            }
+            job.label = optarg;
+            break;
+        case 'f':
+            job.quick_format = 0;
+
+            if (strcmp(optarg, "zero") == 0) {
+                job.wipe_mode = WIPE_ZERO;
+            } else if (strcmp(optarg, "trim") == 0) {
+                job.wipe_mode = WIPE_TRIM;
+            } else {
+                fprintf(stderr, "Invalid wipe mode '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case 't':
+            job.threads = number(optarg, "thread count", 1, COPY_MAX_THREADS);
+            break;
+        case OPT_CHUNK:
+            job.chunk_size = number(optarg, "chunk size", RAW_MIN_CHUNK_MB, RAW_MAX_CHUNK_MB);
+            break;
+        case OPT_DEPTH:
+            job.queue_depth = number(optarg, "queue depth", 1, BLOCKIO_MAX_DEPTH);
+            break;
+        case OPT_PROBE:
+            job.probe = 1;
+            break;
+        case OPT_ALIGN:
+            job.alignment = number(optarg, "alignment", 4, 64 * 1024);
+
+            if (job.alignment % 4 != 0) {
+                fprintf(stderr, "Alignment must be a multiple of 4 KiB\n");
+                return 2;
+            }
+            break;
+        case 'V':
+            job.verify = 1;
+            break;
+        case OPT_INTERVAL:
+            interval = number(optarg, "interval", 10, 60000);
+            break;
+        case OPT_TRACE:
+            job.trace_path = optarg;
+            break;
+        case 'q':
+            level = LOG_NONE;
+            break;
+        case 'v':
+            level = LOG_DEBUG;
+            break;
+        case OPT_LIST:
+            list = 1;
+            break;
+        case OPT_SCAN:
+            scan = 1;
+            break;
+        case 'h':
+            fputs(usage, stdout);
+            return 0;
+        default:
+            fputs(usage, stderr);
+            return 2;
+        }
+    }
+
+    ndjson_init(level, interval);
+
+    if (list || nnames > 0 || all) {
+        scan_devices(devices, MAX_DEVICES, &discovered);
+    }
+
+    if (list) {
+        list_devices(devices, discovered);
+        return 0;
+    }
+
+    if (job.image_path == NULL) {
+        fputs(usage, stderr);
+        return 2;
+    }
+
+    /* Scanning only reads the image file */
+
+    if (scan) {
+        int ret = job_scan(job.image_path);
+
+        ndjson_done(ret);
+
+        return ret < 0 ? 1 : 0;
+    }
+
+    if (!check_root()) {
+        fprintf(stderr, "rufusl-cli has to be run as root\n");
+        return 1;
+    }
+
+    /* Only removable devices found by the scan can be written, a typo
+       must not hit a system disk */
+
+    if (all) {
+        memcpy(chosen, devices, sizeof(Device) * discovered);
+        job.ndevices = discovered;
+    } else {
+        for (int i = 0; i < nnames; i++) {
+            int found = 0;
+
+            for (int j = 0; j < discovered; j++) {
+                if (strcmp(devices[j].device, names[i]) == 0) {
+                    chosen[job.ndevices++] = devices[j];
+                    found = 1;
+                    break;
+                }
+            }
+
+            if (!found) {
+                fprintf(stderr, "%s is not a removable device\n", names[i]);
+                return 2;
+            }
+
+            /* Two writers on one device would corrupt each other */
+
+            for (int k = 0; k < job.ndevices - 1; k++) {
+                if (strcmp(chosen[k].device, chosen[job.ndevices - 1].device) == 0) {
+                    fprintf(stderr, "%s is given more than once\n", names[i]);
+                    return 2;
+                }
+            }
+        }
+    }
+
+    if (job.ndevices == 0) {
+        fprintf(stderr, "No target device\n");
+        return 2;
+    }
+
+    if (job.ndevices > 1 && job.source != SRC_DD) {
+        fprintf(stderr, "Several devices at once only work with --dd\n");
+        return 2;
+    }
+
+    if (job.ndevices > FANOUT_MAX_TARGETS) {
+        fprintf(stderr, "At most %d devices can be written at once\n", FANOUT_MAX_TARGETS);
+        return 2;
+    }
+
+    job.devices = chosen;
+
+    int ret = job_copy(&job);
+
+    ndjson_done(ret);
+
+    return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,225 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "logring.h"
+#include "progress.h"
+#include "ndjson.h"
+
+/* log.h for the command line: progress goes to stdout as one JSON
+   object per line, messages to stderr as plain text. A thread of our
+   own wakes up every NDJSON_DRAIN_INTERVAL, writes out the messages
+   piled up on the log ring and samples progress.c, which the workers
+   count into as fast as they like. A progress line goes out once per
+   interval while something is being counted, plus one when a stage
+   gets to its end. */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t drainer;
+static int draining;
+static uint64_t dropped;
+
+static double interval = NDJSON_DEFAULT_INTERVAL / 1000.0;
+static double started;
+
+static char phase[128] = "Starting";
+static double phase_start;
+static double last_emit = -1;
+static uint32_t ended = (uint32_t) -1;  /* Stage whose end was reported */
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void ndjson_string(FILE *f, const char *s) {
+    fputc('"', f);
+
+    for (; *s; s++) {
+        unsigned char c = *s;
+
+        if (c == '"' || c == '\\') {
+            fprintf(f, "\\%c", c);
+        } else if (c == '\n') {
+            fputs("\\n", f);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+
+    fputc('"', f);
+}
+
+static void to_stderr(void *arg, int subsys, int level, const char *text, size_t len) {
+    fwrite(text, 1, len, stderr);
+}
+
+/* Called with the lock held */
+
+static void emit_progress(double t, const progress_t *p) {
+    printf("{\"event\":\"progress\",\"time\":%.3f,\"phase\":", t - started);
+    ndjson_string(stdout, phase);
+    printf(",\"bytes_done\":%llu", (unsigned long long)p->done);
+
+    if (p->total > 0) {
+        printf(",\"bytes_total\":%llu", (unsigned long long)p->total);
+    } else {
+        printf(",\"bytes_total\":null");
+    }
+
+    printf(",\"percent\":%d,\"mb_per_s\":%.2f", p->percent, p->rate / 1e6);
+
+    if (p->eta >= 0) {
+        printf(",\"eta_s\":%.1f}\n", p->eta);
+    } else {
+        printf(",\"eta_s\":null}\n");
+    }
+
+    fflush(stdout);
+
+    last_emit = t;
+}
+
+/* log_drain and progress_sample want a single consumer, the thread and
+   the final drain take turns */
+
+static void drain(void) {
+    pthread_mutex_lock(&drain_lock);
+
+    while (log_drain(to_stderr, NULL, LOG_RING_SIZE) > 0);
+
+    uint64_t lost = log_dropped();
+
+    if (lost != dropped) {
+        fprintf(stderr, "[%llu messages dropped]\n", (unsigned long long)(lost - dropped));
+        dropped = lost;
+    }
+
+    fflush(stderr);
+
+    progress_t p;
+    double t = now();
+
+    progress_sample(&p);
+
+    int end = p.percent == 100 && ended != p.phase;
+
+    int moving = (p.total > 0 || p.done > 0) && p.percent < 100;
+
+    if (end || (moving && t - last_emit >= interval)) {
+        pthread_mutex_lock(&lock);
+        emit_progress(t, &p);
+        pthread_mutex_unlock(&lock);
+
+        if (end) ended = p.phase;
+    }
+
+    pthread_mutex_unlock(&drain_lock);
+}
+
+static void *drain_thread(void *arg) {
+    long ms = interval * 1000 < NDJSON_DRAIN_INTERVAL ? interval * 1000 : NDJSON_DRAIN_INTERVAL;
+    struct timespec ts = { 0, ms * 1000000L };
+
+    while (__atomic_load_n(&draining, __ATOMIC_RELAXED)) {
+        drain();
+        nanosleep(&ts, NULL);
+    }
+
+    return NULL;
+}
+
+static void stop_draining(void) {
+    if (__atomic_exchange_n(&draining, 0, __ATOMIC_RELAXED)) pthread_join(drainer, NULL);
+
+    drain();
+}
+
+/* level is the verbosity for every subsystem, LOG_NONE for no
+   messages at all */
+
+void ndjson_init(int level, int interval_ms) {
+    interval = interval_ms / 1000.0;
+    started = now();
+    phase_start = started;
+
+    for (int i = 0; i < LOG_SUBSYSTEMS; i++) log_set_level(i, level);
+
+    draining = 1;
+
+    if (pthread_create(&drainer, NULL, drain_thread, NULL) == 0) {
+        atexit(stop_draining);
+    } else {
+        draining = 0;
+    }
+}
+
+void ndjson_event(const char *event, const char *key, const char *value) {
+    pthread_mutex_lock(&lock);
+
+    printf("{\"event\":\"%s\",\"time\":%.3f", event, now() - started);
+
+    if (key != NULL) {
+        printf(",\"%s\":", key);
+        ndjson_string(stdout, value);
+    }
+
+    printf("}\n");
+    fflush(stdout);
+
+    pthread_mutex_unlock(&lock);
+}
+
+void ndjson_done(int status) {
+    stop_draining();
+
+    pthread_mutex_lock(&lock);
+
+    printf("{\"event\":\"done\",\"time\":%.3f,\"status\":\"%s\",\"phase\":",
+           now() - started, status == 0 ? "ok" : "failed");
+    ndjson_string(stdout, phase);
+    printf("}\n");
+    fflush(stdout);
+
+    pthread_mutex_unlock(&lock);
+}
+
+void set_ticker(const char *text) {
+
+    /* Whatever the last stage counted is reported under its own name */
+
+    drain();
+
+    pthread_mutex_lock(&lock);
+
+    /* "Writing image to USB..." reads better without the dots */
+
+    size_t len = strlen(text);
+
+    while (len > 0 && text[len - 1] == '.') len--;
+
+    if (len >= sizeof(phase)) len = sizeof(phase) - 1;
+
+    memcpy(phase, text, len);
+    phase[len] = 0;
+
+    phase_start = now();
+
+    printf("{\"event\":\"phase\",\"time\":%.3f,\"phase\":", phase_start - started);
+    ndjson_string(stdout, phase);
+    printf("}\n");
+    fflush(stdout);
+
+    pthread_mutex_unlock(&lock);
+}
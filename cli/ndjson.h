@@ -0,0 +1,14 @@
+#ifndef NDJSON_H
+#define NDJSON_H
+
+#include <stdio.h>
+
+#define NDJSON_DEFAULT_INTERVAL 250 /* ms between progress lines */
+#define NDJSON_DRAIN_INTERVAL 50    /* ms between batches of log messages */
+
+void ndjson_init(int level, int interval_ms);
+void ndjson_event(const char *event, const char *key, const char *value);
+void ndjson_done(int status);
+void ndjson_string(FILE *f, const char *s);
+
+#endif // NDJSON_H
@@ -0,0 +1,14 @@
+# Command line tool, same job as the window without any Qt at run time
+
+TARGET = rufusl-cli
+TEMPLATE = app
+
+CONFIG += console O3
+CONFIG -= qt app_bundle
+
+include(../rufusl.pri)
+
+SOURCES += main.c \
+    ndjson.c
+
+HEADERS += ndjson.h
@@ -3,9 +3,11 @@
 
 #define FS_FAT32 0
 #define FS_NTFS 1
+#define FS_EXFAT 2
 
 #define FS_FAT32_LABEL "FAT32"
 #define FS_NTFS_LABEL "NTFS"
+#define FS_EXFAT_LABEL "exFAT"
 
 #define BS_512B 0
 #define BS_1024B 1
@@ -14,6 +16,7 @@
 #define BS_8192B 4
 #define BS_16384B 5
 #define BS_32768B 6
+#define BS_AUTO 7              /* From the image's files, see fat32_pick_cluster() */
 
 #define BS_512B_LABEL "512 bytes"
 #define BS_1024B_LABEL "1024 bytes"
@@ -22,6 +25,7 @@
 #define BS_8192B_LABEL "8192 bytes"
 #define BS_16384B_LABEL "16384 bytes"
 #define BS_32768B_LABEL "32768 bytes"
+#define BS_AUTO_LABEL "Auto"
 
 #define TB_MBR 0
 #define TB_GPT 1
@@ -35,8 +39,15 @@
 #define SRC_ISO_LABEL "ISO Image"
 #define SRC_DD_LABEL "DD Image"
 
+#define WIPE_ZERO 0
+#define WIPE_TRIM 1
+
+#define WIPE_ZERO_LABEL "Zero fill"
+#define WIPE_TRIM_LABEL "TRIM only"
+
 #define MOUNT_FAT32 "vfat"
 #define MOUNT_NTFS "ntfs"
+#define MOUNT_EXFAT "exfat"
 #define MOUNT_ISO9660 "iso9660"
 #define MOUNT_UDF "udf"
 
@@ -1,10 +1,11 @@
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 700
 
-#include <errno.h>
-#include <ftw.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -13,132 +14,530 @@
 #include "definitions.h"
 #include "rufusl.h"
 
-static char* dest = "/mnt/temp";
-static iso_info_t info;
+RUFUS_IMG_REPORT img_report;
+iso_manifest_t img_manifest;
+
+static iso_scan_t scan;
+
+/* Every boot marker is a basename, with the directory it has to be in
+   when that matters. They all go into one hash table keyed by the case
+   folded basename, built the first time it is needed, so a path costs
+   one hash of its last component and a probe or two no matter how many
+   markers there are. Names that appear more than once, like the WinPE
+   files in /i386 and /minint, simply take one slot each. */
+
+enum {
+    M_EFI,              /* arg: bit in has_efi */
+    M_EFI_SYSLINUX,
+    M_WIM,
+    M_GRUB2,
+    M_GRUB_MOD,
+    M_GRUB4DOS,
+    M_SYSLINUX_CFG,
+    M_SYSLINUX_BIN,
+    M_LDLINUX,
+    M_OLD_C32,          /* arg: index in has_old_c32 */
+    M_WINPE,            /* arg: bit in winpe */
+    M_REACTOS,
+    M_KOLIBRI,
+    M_AUTORUN,
+    M_BOOTMGR
+};
+
+typedef struct marker {
+    const char *name;
+    const char *dir;    /* Without slashes, "" for the root, NULL for anywhere */
+    int kind;
+    int arg;
+    int is_dir;
+} marker_t;
+
+static const marker_t markers[] = {
+    { "bootia32.efi", "efi/boot", M_EFI, 0, 0 },
+    { "bootia64.efi", "efi/boot", M_EFI, 1, 0 },
+    { "bootx64.efi", "efi/boot", M_EFI, 2, 0 },
+    { "bootarm.efi", "efi/boot", M_EFI, 3, 0 },
+    { "bootaa64.efi", "efi/boot", M_EFI, 4, 0 },
+    { "bootebc.efi", "efi/boot", M_EFI, 5, 0 },
+    { "syslinux.cfg", "efi/boot", M_EFI_SYSLINUX, 0, 0 },
+    { "install.wim", "sources", M_WIM, 0, 0 },
+    { "install.swm", "sources", M_WIM, 0, 0 },
+    { "i386-pc", "boot/grub", M_GRUB2, 0, 1 },
+    { "normal.mod", "boot/grub/i386-pc", M_GRUB_MOD, 0, 0 },
+    { "grldr", "", M_GRUB4DOS, 0, 0 },
+    { "isolinux.cfg", NULL, M_SYSLINUX_CFG, 0, 0 },
+    { "syslinux.cfg", NULL, M_SYSLINUX_CFG, 0, 0 },
+    { "extlinux.conf", NULL, M_SYSLINUX_CFG, 0, 0 },
+    { "archiso_sys32.cfg", NULL, M_SYSLINUX_CFG, 0, 0 },
+    { "archiso_sys64.cfg", NULL, M_SYSLINUX_CFG, 0, 0 },
+    { "isolinux.bin", NULL, M_SYSLINUX_BIN, 0, 0 },
+    { "boot.bin", NULL, M_SYSLINUX_BIN, 0, 0 },
+    { "ldlinux.sys", NULL, M_LDLINUX, 0, 0 },
+    { "ldlinux.c32", NULL, M_LDLINUX, 0, 0 },
+    { "menu.c32", NULL, M_OLD_C32, 0, 0 },
+    { "vesamenu.c32", NULL, M_OLD_C32, 1, 0 },
+    { "ntdetect.com", "i386", M_WINPE, 0, 0 },
+    { "setupldr.bin", "i386", M_WINPE, 1, 0 },
+    { "txtsetup.sif", "i386", M_WINPE, 2, 0 },
+    { "ntdetect.com", "minint", M_WINPE, 3, 0 },
+    { "setupldr.bin", "minint", M_WINPE, 4, 0 },
+    { "txtsetup.sif", "minint", M_WINPE, 5, 0 },
+    { "setupldr.sys", NULL, M_REACTOS, 0, 0 },
+    { "freeldr.sys", NULL, M_REACTOS, 0, 0 },
+    { "kolibri.img", "", M_KOLIBRI, 0, 0 },
+    { "autorun.inf", "", M_AUTORUN, 0, 0 },
+    { "bootmgr", "", M_BOOTMGR, 0, 0 },
+    { "bootmgr.efi", "", M_BOOTMGR, 0, 0 },
+};
+
+#define NB_MARKERS (int) (sizeof(markers) / sizeof(markers[0]))
+#define TABLE_SIZE 128      /* A power of two, at least twice NB_MARKERS */
+
+static const int64_t old_c32_threshold[NB_OLD_C32] = OLD_C32_THRESHOLD;
+
+static int table[TABLE_SIZE];
+static uint32_t hashes[NB_MARKERS];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static uint32_t fold_hash(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) tolower((unsigned char) s[i])) * 16777619u;
+    }
 
-static const char* bootmgr_efi_name = "bootmgr.efi";
-static const char* grldr_name = "grldr";
-static const char* ldlinux_name = "ldlinux.sys";
-static const char* ldlinux_c32 = "ldlinux.c32";
+    return h;
+}
 
-static const char* efi[] = { "efi/boot/bootia32.efi",
-                             "efi/boot/bootia64.efi",
-                             "efi/boot/bootx64.efi",
-                             "efi/boot/bootarm.efi",
-                             "efi/boot/bootaa64.efi",
-                             "efi/boot/bootebc.efi" };
+static int same_folded(const char *a, const char *b, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (tolower((unsigned char) a[i]) != tolower((unsigned char) b[i])) return 0;
+    }
 
-static const char* windows_wim[] = { "/sources/install.wim",
-                                     "/sources/install.swm" };
+    return 1;
+}
 
-static const char* grub_dirname = "/boot/grub/i386-pc";
-static const char* grub_cfg = "grub.cfg";
-static const char* syslinux_cfg[] = { "isolinux.cfg", "syslinux.cfg", "extlinux.conf" };
-static const char* arch_cfg[] = { "archiso_sys32.cfg", "archiso_sys64.cfg" };
-static const char* isolinux_tmp = ".\\isolinux.tmp";
-static const char* isolinux_bin[] = { "isolinux.bin", "boot.bin" };
-static const char* pe_dirname[] = { "/i386", "/minint" };
-static const char* pe_file[] = { "ntdetect.com", "setupldr.bin", "txtsetup.sif" };
-static const char* reactos_name = "setupldr.sys";
-static const char* kolibri_name = "kolibri.img";
-static const char* autorun_name = "autorun.inf";
+static void build_table(void) {
+    for (int i = 0; i < TABLE_SIZE; i++) table[i] = -1;
 
-int compare_string(const char *a, const char *b) {
+    for (int i = 0; i < NB_MARKERS; i++) {
+        uint32_t slot;
 
-    uint32_t len = strlen(a);
+        hashes[i] = fold_hash(markers[i].name, strlen(markers[i].name));
 
-    if (len != strlen(b)) return -1;
+        for (slot = hashes[i] & (TABLE_SIZE - 1); table[slot] >= 0; slot = (slot + 1) & (TABLE_SIZE - 1)) ;
 
-    for (int i = 0; i < len; i++) {
-        if (*(a+i) != *(b+i)) return -1;
+        table[slot] = i;
     }
+}
+
+static void keep_path(char *dst, size_t size, const char *path) {
+    if (dst[0] == 0) snprintf(dst, size, "%s", path);
+}
+
+static void mark(iso_scan_t *s, const marker_t *m, const char *path, uint64_t size) {
+    RUFUS_IMG_REPORT *r = s->report;
+
+    switch (m->kind) {
+    case M_EFI:
+        r->has_efi |= 1 << m->arg;
+        break;
+    case M_EFI_SYSLINUX:
+        r->has_efi_syslinux = TRUE;
+        break;
+    case M_WIM:
+        keep_path(r->install_wim_path, sizeof(r->install_wim_path), path);
+        break;
+    case M_GRUB2:
+        r->has_grub2 = TRUE;
+        break;
+    case M_GRUB_MOD:
+        r->has_grub2 = TRUE;
+        keep_path(s->grub_mod_path, sizeof(s->grub_mod_path), path);
+        break;
+    case M_GRUB4DOS:
+        r->has_grub4dos = TRUE;
+        break;
+    case M_SYSLINUX_CFG:
+        /* The one closest to the root is the one the loader reads */
+        if (r->cfg_path[0] == 0 || strlen(path) < strlen(r->cfg_path)) {
+            snprintf(r->cfg_path, sizeof(r->cfg_path), "%s", path);
+        }
+        break;
+    case M_SYSLINUX_BIN:
+        keep_path(s->syslinux_path, sizeof(s->syslinux_path), path);
+        break;
+    case M_LDLINUX:
+        r->needs_syslinux_overwrite = TRUE;
+        keep_path(s->syslinux_path, sizeof(s->syslinux_path), path);
+        break;
+    case M_OLD_C32:
+        if ((int64_t) size <= old_c32_threshold[m->arg]) {
+            r->has_old_c32[m->arg] = TRUE;
+            if (m->arg == 1) r->has_old_vesamenu = TRUE;
+        }
+        break;
+    case M_WINPE:
+        r->winpe |= 1 << m->arg;
+        break;
+    case M_REACTOS:
+        keep_path(r->reactos_path, sizeof(r->reactos_path), path);
+        break;
+    case M_KOLIBRI:
+        r->has_kolibrios = TRUE;
+        break;
+    case M_AUTORUN:
+        r->has_autorun = TRUE;
+        break;
+    case M_BOOTMGR:
+        r->has_bootmgr = TRUE;
+        break;
+    }
+}
+
+void iso_manifest_free(iso_manifest_t *m) {
+    if (m->pool == NULL) {
+        for (size_t i = 0; i < m->count; i++) free(m->files[i].path);
+    }
+
+    free(m->files);
+    free(m->pool);
+    memset(m, 0, sizeof(iso_manifest_t));
+}
+
+/* Directory sizes come from their entries: one per child plus one long
+   name entry per 13 characters, "." and ".." in every directory. The
+   entries are gathered per parent by sorting on a hash of its path. */
+
+typedef struct dir_slots {
+    uint64_t parent;
+    uint32_t slots;
+} dir_slots_t;
+
+static uint64_t path_hash(const char *path, size_t len) {
+    uint64_t h = 14695981039346656037ull;
+
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char) path[i]) * 1099511628211ull;
+
+    return h;
+}
+
+static int by_parent(const void *a, const void *b) {
+    uint64_t x = ((const dir_slots_t *) a)->parent;
+    uint64_t y = ((const dir_slots_t *) b)->parent;
+
+    return x < y ? -1 : x > y;
+}
+
+int iso_fat32_usage(const iso_manifest_t *m, fat32_usage_t *u) {
+    dir_slots_t *d = malloc((2 * m->count + 1) * sizeof(dir_slots_t));
+    size_t n = 0;
+
+    if (d == NULL) return -1;
+
+    memset(u, 0, sizeof(fat32_usage_t));
+
+    d[n++] = (dir_slots_t) { path_hash("", 0), 2 };
+    u->dirs = 1;
+
+    for (size_t i = 0; i < m->count; i++) {
+        const iso_file_t *f = &m->files[i];
+        const char *slash = strrchr(f->path, '/');
+        size_t parent = slash ? (size_t) (slash - f->path) : 0;
+        size_t name = strlen(f->path) - (slash ? parent + 1 : 0);
+
+        d[n++] = (dir_slots_t) { path_hash(f->path, parent), 1 + (name + 12) / 13 };
+
+        if (S_ISDIR(f->mode)) {
+            d[n++] = (dir_slots_t) { path_hash(f->path, strlen(f->path)), 2 };
+            u->dirs++;
+            continue;
+        }
+
+        u->files++;
+        u->bytes += f->size;
+
+        for (int c = 0; c < FAT32_CLUSTER_SIZES; c++) {
+            uint64_t bytes = 512ull << c;
+            uint64_t clusters = (f->size + bytes - 1) / bytes;
+
+            u->clusters[c] += clusters;
+            u->slack[c] += clusters * bytes - f->size;
+        }
+    }
+
+    qsort(d, n, sizeof(dir_slots_t), by_parent);
+
+    for (size_t i = 0; i < n;) {
+        uint64_t bytes = 0;
+        size_t j = i;
+
+        for (; j < n && d[j].parent == d[i].parent; j++) bytes += d[j].slots * 32;
+
+        for (int c = 0; c < FAT32_CLUSTER_SIZES; c++) {
+            uint64_t clusters = (bytes + (512ull << c) - 1) / (512ull << c);
+
+            u->clusters[c] += clusters;
+        }
+
+        i = j;
+    }
+
+    free(d);
 
     return 0;
+}
 
+static void manifest_add(iso_manifest_t *m, const char *path, uint64_t size, mode_t mode) {
+    if (m->count == m->cap) {
+        size_t cap = m->cap ? m->cap * 2 : 1024;
+        iso_file_t *files = realloc(m->files, cap * sizeof(iso_file_t));
+
+        if (files == NULL) return;
+
+        m->files = files;
+        m->cap = cap;
+    }
+
+    if ((m->files[m->count].path = strdup(path)) == NULL) return;
+
+    m->files[m->count].size = S_ISREG(mode) ? size : 0;
+    m->files[m->count].mode = mode;
+    m->count++;
+
+    if (S_ISREG(mode)) m->bytes += size;
+}
+
+void iso_scan_begin(iso_scan_t *s, RUFUS_IMG_REPORT *report, iso_manifest_t *manifest) {
+    memset(s, 0, sizeof(iso_scan_t));
+    memset(report, 0, sizeof(RUFUS_IMG_REPORT));
+
+    if (manifest) iso_manifest_free(manifest);
+
+    s->report = report;
+    s->manifest = manifest;
+    report->is_iso = TRUE;
+
+    pthread_once(&table_once, build_table);
 }
 
-int iso_scan(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+void iso_classify(iso_scan_t *s, const char *path, uint64_t size, mode_t mode) {
+    RUFUS_IMG_REPORT *r = s->report;
+    const char *base = strrchr(path, '/');
+    const char *dir = path;
 
-  /* Allocate new array and copy fpath into it because
-     nftw() has an assertion if fpath has been changed. */
+    base = base ? base + 1 : path;
 
-  char buf[strlen(fpath) + 1];
-  memcpy(buf, fpath, strlen(fpath) + 1);
+    while (*dir == '/') dir++;
 
-  /* Get length of path where the loop device is mounted */
+    size_t base_len = strlen(base);
+    size_t dir_len = base > dir ? base - dir - 1 : 0;
 
-  uint32_t a_len = strlen(TEMP_DIR_ISO);
+    if (base_len == 0) return;
 
-  /* Trim soure path. Write each char from (buf + a_len + 1) to buf. */
+    if (s->manifest) manifest_add(s->manifest, path, size, mode);
 
-  uint32_t i = a_len + 1;
-  uint32_t j = 0;
+    if (base_len > 64) r->has_long_filename = TRUE;
 
-  for (; j < sizeof(buf) - a_len; i++) {
-    buf[j] = *(buf + i);
-    j++;
-  }
+    if (S_ISLNK(mode)) {
+        r->has_symlinks = TRUE;
+        return;
+    }
 
-  buf[j] = 0x00; /* Null-terminate the string. Now we have a relative path */
+    if (S_ISREG(mode)) {
+        r->projected_size += size;
+        if (size >= FAT32_MAX) r->has_4GB_file = TRUE;
+    }
 
+    uint32_t h = fold_hash(base, base_len);
 
-  if (buf == NULL || strlen(buf) <= 0) return 0;
+    for (uint32_t slot = h & (TABLE_SIZE - 1); table[slot] >= 0; slot = (slot + 1) & (TABLE_SIZE - 1)) {
+        const marker_t *m = &markers[table[slot]];
 
-  if (sb->st_size > FAT32_MAX) {
-      info.has_4gb = 1;
-  }
+        if (hashes[table[slot]] != h || strlen(m->name) != base_len ||
+            !same_folded(m->name, base, base_len)) continue;
 
-  for(int i = 0; i < strlen(buf); i++){
-    *(buf + i) = tolower(*(buf + i));
-  }
+        if (m->is_dir != !!S_ISDIR(mode)) continue;
 
-  for (int i = 0; i < 5; i++) {
-      if (compare_string(buf, efi[i]) == 0) {
-          info.has_uefi = 1;
-      }
-  }
+        if (m->dir != NULL && (strlen(m->dir) != dir_len || !same_folded(m->dir, dir, dir_len))) continue;
 
-  return 0;
+        mark(s, m, path, size);
+    }
 }
 
-int recursive_iso_scan(uint32_t *loop_fd) {
+/* "ISOLINUX 6.04-pre1 ..." and the like, right in the loader */
 
-    info.has_syslinux = 0;
-    info.has_grub = 0;
-    info.has_windows = 0;
-    info.has_arch = 0;
-    info.has_uefi = 0;
-    info.has_autorun = 0;
-    info.has_4gb = 0;
+static void syslinux_version(RUFUS_IMG_REPORT *r, const char *buf, size_t len) {
+    for (size_t i = 0; i + 9 < len; i++) {
+        int major, minor, n = 0;
 
-    if (lseek(*loop_fd, (off_t) LABEL_OFFSET, SEEK_SET) < 0) {
-        r_printf("Falied to seek file: %s\n", strerror(errno));
-        return -1;
+        if (memcmp(buf + i + 3, "LINUX ", 6) != 0) continue;
+
+        if (sscanf(buf + i + 9, "%d.%d%n", &major, &minor, &n) != 2 ||
+            major < 0 || major > 255 || minor < 0 || minor > 99) continue;
+
+        r->sl_version = (major << 8) | minor;
+        snprintf(r->sl_version_str, sizeof(r->sl_version_str), "%d.%02d", major, minor);
+
+        const char *ext = buf + i + 9 + n;
+        size_t ext_len = 0;
+
+        while (i + 9 + n + ext_len < len && isgraph((unsigned char) ext[ext_len]) &&
+               ext_len < sizeof(r->sl_version_ext) - 1) ext_len++;
+
+        memcpy(r->sl_version_ext, ext, ext_len);
+        r->sl_version_ext[ext_len] = 0;
+
+        return;
+    }
+}
+
+/* The version comes right after the format string that prints it */
+
+static void grub2_version(RUFUS_IMG_REPORT *r, const char *buf, size_t len) {
+    static const char key[] = "GRUB  version %s";
+
+    for (size_t i = 0; i + sizeof(key) < len; i++) {
+        if (memcmp(buf + i, key, sizeof(key)) != 0) continue;
+
+        const char *v = buf + i + sizeof(key);
+
+        snprintf(r->grub2_version, sizeof(r->grub2_version), "%.*s",
+                 (int) strnlen(v, len - i - sizeof(key)), v);
+
+        return;
+    }
+}
+
+void iso_scan_end(iso_scan_t *s, iso_reader_t read, void *arg) {
+    RUFUS_IMG_REPORT *r = s->report;
+    char *buf = malloc(ISO_PROBE_SIZE + 1);
+    ssize_t n;
+
+    r->uses_minint = (r->winpe & WINPE_MININT) == WINPE_MININT;
+
+    if (buf == NULL) return;
+
+    /* Terminated, so sscanf() can't run off the end */
+
+    if (s->syslinux_path[0] && (n = read(arg, s->syslinux_path, buf, ISO_PROBE_SIZE)) > 0) {
+        buf[n] = 0;
+        syslinux_version(r, buf, n);
+    }
+
+    if (s->grub_mod_path[0] && (n = read(arg, s->grub_mod_path, buf, ISO_PROBE_SIZE)) > 0) {
+        grub2_version(r, buf, n);
+    }
+
+    /* "MSWIM\0\0\0", header size, then the version */
+
+    if (r->install_wim_path[0] && (n = read(arg, r->install_wim_path, buf, 16)) == 16 &&
+        memcmp(buf, "MSWIM\0\0\0", 8) == 0) {
+        r->install_wim_version = (uint8_t) buf[12] | (uint8_t) buf[13] << 8 |
+                                 (uint8_t) buf[14] << 16 | (uint32_t) (uint8_t) buf[15] << 24;
+    }
+
+    free(buf);
+}
+
+/* The volume identifier as it is, and as a FAT label, which is upper
+   case, at most 11 characters and can't have some of the punctuation */
+
+void iso_set_label(RUFUS_IMG_REPORT *r, const char *volume_id, size_t len) {
+    while (len > 0 && (volume_id[len - 1] == ' ' || volume_id[len - 1] == 0)) len--;
+
+    if (len >= sizeof(r->label)) len = sizeof(r->label) - 1;
+
+    memcpy(r->label, volume_id, len);
+    r->label[len] = 0;
+
+    size_t i;
+
+    for (i = 0; i < len && i < 11; i++) {
+        char c = toupper((unsigned char) volume_id[i]);
+
+        r->usb_label[i] = (c < 0x20 || strchr("*?.,;:/\\|+=<>[]\"", c)) ? '_' : c;
+    }
+
+    r->usb_label[i] = 0;
+}
+
+void iso_print_report(const RUFUS_IMG_REPORT *r) {
+    r_printf(" * Label: %s\n", r->label);
+    r_printf(" * Size of the files: %llu bytes\n", (unsigned long long) r->projected_size);
+
+    if (r->has_efi) r_printf(" * Uses EFI\n");
+    if (r->has_efi_syslinux) r_printf(" * Uses EFI Syslinux\n");
+
+    if (r->sl_version) {
+        r_printf(" * Uses Syslinux/Isolinux v%s%s\n", r->sl_version_str, r->sl_version_ext);
+    } else if (r->cfg_path[0]) {
+        r_printf(" * Uses Syslinux/Isolinux\n");
     }
 
-    memset(info.label, 0, 11);
+    if (r->cfg_path[0]) r_printf(" * Syslinux configuration: %s\n", r->cfg_path);
+    if (r->has_old_c32[0] || r->has_old_c32[1]) r_printf(" * Has an old menu.c32 or vesamenu.c32\n");
 
-    if (read(*loop_fd, info.label, (size_t) 11) < 0) {
-        r_printf("Error reading label from ISO: %s\n", strerror(errno));
+    if (r->has_grub2) {
+        r_printf(" * Uses GRUB2%s%s\n", r->grub2_version[0] ? " " : "", r->grub2_version);
     }
 
-    for(int i = 0; i < 11; i++){
-      info.label[i] = toupper(info.label[i]);
+    if (r->has_grub4dos) r_printf(" * Uses Grub4DOS\n");
+    if (r->has_bootmgr) r_printf(" * Uses Bootmgr\n");
+
+    if (r->install_wim_version) {
+        r_printf(" * Has a Windows image: %s (version %u)\n", r->install_wim_path, r->install_wim_version);
+    } else if (r->install_wim_path[0]) {
+        r_printf(" * Has a Windows image: %s\n", r->install_wim_path);
+    }
+
+    if (r->winpe) r_printf(" * Uses WinPE%s\n", r->uses_minint ? " (with /minint)" : "");
+    if (r->reactos_path[0]) r_printf(" * Uses ReactOS: %s\n", r->reactos_path);
+    if (r->has_kolibrios) r_printf(" * Uses KolibriOS\n");
+    if (r->has_autorun) r_printf(" * Has an autorun.inf\n");
+    if (r->has_4GB_file) r_printf(" * Has a file of 4 GB or more, too large for FAT32\n");
+    if (r->has_long_filename) r_printf(" * Has names longer than 64 characters\n");
+    if (r->has_symlinks) r_printf(" * Has symbolic links\n");
+    if (r->is_bootable_img) r_printf(" * Is a hybrid image, bootable as it is\n");
+}
+
+/* isofs paths have no leading slash, the report's do */
+
+static ssize_t read_image(void *arg, const char *path, void *buf, size_t len) {
+    isofs_t *fs = arg;
+
+    for (size_t i = 0; i < fs->count; i++) {
+        const isofs_entry_t *e = &fs->entries[i];
+
+        if (strcmp(e->path, path + 1) == 0) return isofs_pread(fs, e, buf, len < e->size ? len : e->size, 0);
     }
 
-    r_printf(" * Label: %s\n", info.label);
+    return -1;
+}
+
+int iso_scan_image(isofs_t *fs) {
+
+    unsigned char mbr[512];
 
-    nftw(TEMP_DIR_ISO, iso_scan, 4, 0);
+    iso_scan_begin(&scan, &img_report, &img_manifest);
+    iso_set_label(&img_report, fs->label, strlen(fs->label));
 
-    if (info.has_uefi) {
-        r_printf(" * Uses EFI\n");
+    /* Hybrid images carry an MBR and boot when written as they are */
+
+    if (pread(fs->fd, mbr, sizeof(mbr), 0) == sizeof(mbr) && mbr[510] == 0x55 && mbr[511] == 0xAA) {
+        img_report.is_bootable_img = TRUE;
     }
 
-    if (lseek(*loop_fd, (off_t) 0, SEEK_SET) < 0) {
-        r_printf("Falied to seek file: %s\n", strerror(errno));
-        return -1;
+    for (size_t i = 0; i < fs->count; i++) {
+        const isofs_entry_t *e = &fs->entries[i];
+        char path[strlen(e->path) + 2];
+
+        snprintf(path, sizeof(path), "/%s", e->path);
+        iso_classify(&scan, path, e->size, e->mode);
     }
 
-    set_ticker("READY");
+    iso_scan_end(&scan, read_image, fs);
+    iso_print_report(&img_report);
 
+    return 0;
 }
@@ -2,25 +2,17 @@
 #define ISO_H
 
 #include <stdint.h>
+#include <sys/types.h>
+
+#include "isofs.h"
+#include "linux/fat32.h"
 #include "rufusl.h"
 
-#define LABEL_OFFSET 0x8028
 #define FAT32_MAX 4294967296LL
-#define TEMP_DIR_ISO "/mnt/rufus_isofs"
-
-typedef struct iso_info {
-
-    uint8_t has_syslinux;
-    uint8_t has_grub;
-    uint8_t has_windows;
-    uint8_t has_arch;
-    uint8_t has_uefi;
-    uint8_t has_autorun;
-    uint8_t has_4gb;
+#define ISO_PROBE_SIZE (512 * 1024) /* Most read from a file to find a version */
 
-    char label[11];
-
-} iso_info_t;
+#define WINPE_I386 0x07     /* ntdetect.com, setupldr.bin and txtsetup.sif in /i386 */
+#define WINPE_MININT 0x38   /* The same three in /minint */
 
 typedef struct {
     char label[192];			/* 3*64 to account for UTF-8 */
@@ -55,7 +47,46 @@ typedef struct {
     char grub2_version[32];
 } RUFUS_IMG_REPORT;
 
+/* A scan hands every path of the image, relative to its root and with
+   a leading slash, to iso_classify() once. The few files whose content
+   matters are remembered and read at the end through the reader. */
+
+typedef struct iso_file {
+    char *path;
+    uint64_t size;
+    uint32_t mode;
+} iso_file_t;
+
+/* Every file and directory of the image with its size. Paths are
+   strdup()ed while scanning, or point into pool when loaded whole. */
+
+typedef struct iso_manifest {
+    iso_file_t *files;
+    size_t count;
+    size_t cap;
+    uint64_t bytes;
+    char *pool;
+} iso_manifest_t;
+
+typedef ssize_t (*iso_reader_t)(void *arg, const char *path, void *buf, size_t len);
+
+typedef struct iso_scan {
+    RUFUS_IMG_REPORT *report;
+    iso_manifest_t *manifest;   /* NULL when no list is wanted */
+    char syslinux_path[128];    /* isolinux.bin or ldlinux.sys, for sl_version */
+    char grub_mod_path[128];    /* normal.mod, for grub2_version */
+} iso_scan_t;
+
+extern RUFUS_IMG_REPORT img_report;
+extern iso_manifest_t img_manifest;
 
-int recursive_iso_scan(uint32_t *loop_fds);
+void iso_scan_begin(iso_scan_t *s, RUFUS_IMG_REPORT *report, iso_manifest_t *manifest);
+void iso_classify(iso_scan_t *s, const char *path, uint64_t size, mode_t mode);
+void iso_scan_end(iso_scan_t *s, iso_reader_t read, void *arg);
+void iso_set_label(RUFUS_IMG_REPORT *report, const char *volume_id, size_t len);
+void iso_print_report(const RUFUS_IMG_REPORT *report);
+void iso_manifest_free(iso_manifest_t *m);
+int iso_scan_image(isofs_t *fs);
+int iso_fat32_usage(const iso_manifest_t *m, fat32_usage_t *u);
 
 #endif // ISO_H
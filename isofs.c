@@ -0,0 +1,1119 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "isofs.h"
+#include "log.h"
+
+/* Nothing deeper could be created under a Linux mount point anyway,
+   it is only there so that a directory pointing back at one of its
+   parents fails instead of recursing for ever */
+
+#define MAX_DEPTH (PATH_MAX / 2)
+#define MAX_NAME 1024
+#define MAX_LINK 4096
+
+#define UDF_TAG_AVDP 2
+#define UDF_TAG_PD 5
+#define UDF_TAG_LVD 6
+#define UDF_TAG_TD 8
+#define UDF_TAG_FSD 256
+#define UDF_TAG_FID 257
+#define UDF_TAG_AED 258
+#define UDF_TAG_FE 261
+#define UDF_TAG_EFE 266
+
+#define UDF_FT_DIR 4
+#define UDF_FT_SYMLINK 12
+
+static uint16_t le16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t le64(const uint8_t *p) {
+    return le32(p) | ((uint64_t) le32(p + 4) << 32);
+}
+
+static int read_at(isofs_t *fs, void *buf, size_t len, uint64_t off) {
+
+    uint8_t *p = buf;
+
+    while (len > 0) {
+        ssize_t n = pread(fs->fd, p, len, (off_t) off);
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            r_printf("Error reading image: %s\n", strerror(errno));
+            return -1;
+        }
+
+        if (n == 0) {
+            r_printf("Error reading image: unexpected end of file\n");
+            return -1;
+        }
+
+        p += n;
+        len -= n;
+        off += n;
+    }
+
+    return 0;
+}
+
+/* Append one UTF-16 code unit sequence to a UTF-8 string */
+
+static size_t put_utf8(char *out, size_t pos, size_t max, uint32_t c) {
+
+    if (c < 0x80) {
+        if (pos + 1 >= max) return pos;
+        out[pos++] = c;
+    } else if (c < 0x800) {
+        if (pos + 2 >= max) return pos;
+        out[pos++] = 0xC0 | (c >> 6);
+        out[pos++] = 0x80 | (c & 0x3F);
+    } else if (c < 0x10000) {
+        if (pos + 3 >= max) return pos;
+        out[pos++] = 0xE0 | (c >> 12);
+        out[pos++] = 0x80 | ((c >> 6) & 0x3F);
+        out[pos++] = 0x80 | (c & 0x3F);
+    } else {
+        if (pos + 4 >= max) return pos;
+        out[pos++] = 0xF0 | (c >> 18);
+        out[pos++] = 0x80 | ((c >> 12) & 0x3F);
+        out[pos++] = 0x80 | ((c >> 6) & 0x3F);
+        out[pos++] = 0x80 | (c & 0x3F);
+    }
+
+    return pos;
+}
+
+static void utf16be_to_utf8(const uint8_t *in, size_t len, char *out, size_t max) {
+
+    size_t pos = 0;
+
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        uint32_t c = (in[i] << 8) | in[i + 1];
+
+        if (c >= 0xD800 && c < 0xDC00 && i + 3 < len) {
+            uint32_t lo = (in[i + 2] << 8) | in[i + 3];
+            if (lo >= 0xDC00 && lo < 0xE000) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (lo - 0xDC00);
+                i += 2;
+            }
+        }
+
+        pos = put_utf8(out, pos, max, c);
+    }
+
+    out[pos] = 0x00;
+}
+
+/* UDF dstrings/d-characters start with a compression ID:
+   8 means one byte per character, 16 means UTF-16BE */
+
+static void udf_to_utf8(const uint8_t *in, size_t len, char *out, size_t max) {
+
+    out[0] = 0x00;
+
+    if (len < 1) return;
+
+    if (in[0] == 16) {
+        utf16be_to_utf8(in + 1, len - 1, out, max);
+        return;
+    }
+
+    size_t pos = 0;
+
+    for (size_t i = 1; i < len; i++) {
+        pos = put_utf8(out, pos, max, in[i]);
+    }
+
+    out[pos] = 0x00;
+}
+
+static void strip_version(char *name) {
+
+    char *semi = strrchr(name, ';');
+
+    if (semi != NULL) *semi = 0x00;
+
+    size_t len = strlen(name);
+
+    if (len > 1 && name[len - 1] == '.') name[len - 1] = 0x00;
+}
+
+static void trim_label(char *label) {
+
+    size_t len = strlen(label);
+
+    while (len > 0 && label[len - 1] == ' ') label[--len] = 0x00;
+}
+
+static int add_entry(isofs_t *fs, const char *parent, const char *name,
+                     uint32_t mode, uint64_t size) {
+
+    if (fs->count == fs->cap) {
+        size_t cap = fs->cap ? fs->cap * 2 : 1024;
+        isofs_entry_t *tmp = realloc(fs->entries, cap * sizeof(isofs_entry_t));
+
+        if (tmp == NULL) return -1;
+
+        fs->entries = tmp;
+        fs->cap = cap;
+    }
+
+    isofs_entry_t *e = &fs->entries[fs->count];
+    size_t len = strlen(parent) + strlen(name) + 2;
+
+    memset(e, 0, sizeof(isofs_entry_t));
+
+    if ((e->path = malloc(len)) == NULL) return -1;
+
+    if (*parent) {
+        snprintf(e->path, len, "%s/%s", parent, name);
+    } else {
+        snprintf(e->path, len, "%s", name);
+    }
+
+    e->mode = mode;
+    e->size = size;
+
+    if (S_ISREG(mode)) fs->total_bytes += size;
+
+    return (int) fs->count++;
+}
+
+static int add_extent(isofs_entry_t *e, uint64_t offset, uint64_t length) {
+
+    /* Merge with the previous extent when they touch */
+
+    if (e->nextents > 0) {
+        isofs_extent_t *last = &e->extents[e->nextents - 1];
+
+        if (offset != ISOFS_ZERO && last->offset != ISOFS_ZERO &&
+            last->offset + last->length == offset) {
+            last->length += length;
+            return 0;
+        }
+    }
+
+    isofs_extent_t *tmp = realloc(e->extents, (e->nextents + 1) * sizeof(isofs_extent_t));
+
+    if (tmp == NULL) return -1;
+
+    e->extents = tmp;
+    e->extents[e->nextents].offset = offset;
+    e->extents[e->nextents].length = length;
+    e->nextents++;
+
+    return 0;
+}
+
+/* Reads a whole directory (or any entry) into a freshly allocated buffer */
+
+static uint8_t *read_entry(isofs_t *fs, const isofs_entry_t *e) {
+
+    uint8_t *data = malloc(e->size + 1);
+
+    if (data == NULL) return NULL;
+
+    if (isofs_pread(fs, e, data, e->size, 0) != (ssize_t) e->size) {
+        free(data);
+        return NULL;
+    }
+
+    return data;
+}
+
+/*
+ * ISO9660, Joliet and Rock Ridge
+ */
+
+typedef struct rr_info {
+    char name[MAX_NAME];
+    char link[MAX_LINK];
+    uint32_t mode;
+    uint32_t child;
+    int has_name;
+    int has_mode;
+    int has_link;
+    int has_child;
+    int relocated;
+    int link_continues;
+} rr_info_t;
+
+static void rr_append(char *dst, size_t max, const uint8_t *src, size_t len) {
+
+    size_t pos = strlen(dst);
+
+    if (pos + len >= max) len = max - pos - 1;
+
+    memcpy(dst + pos, src, len);
+    dst[pos + len] = 0x00;
+}
+
+static void rr_symlink(rr_info_t *ri, const uint8_t *p, size_t len) {
+
+    size_t pos = 0;
+
+    while (pos + 2 <= len) {
+        uint8_t flags = p[pos];
+        uint8_t clen = p[pos + 1];
+        const uint8_t *comp = p + pos + 2;
+
+        if (pos + 2 + clen > len) break;
+
+        /* Separate from the previous component unless it continues */
+
+        size_t cur = strlen(ri->link);
+
+        if (ri->has_link && !ri->link_continues &&
+            !(cur == 1 && ri->link[0] == '/')) {
+            rr_append(ri->link, MAX_LINK, (const uint8_t *) "/", 1);
+        }
+
+        if (flags & 0x02) {
+            rr_append(ri->link, MAX_LINK, (const uint8_t *) ".", 1);
+        } else if (flags & 0x04) {
+            rr_append(ri->link, MAX_LINK, (const uint8_t *) "..", 2);
+        } else if (flags & 0x08) {
+            ri->link[0] = '/';
+            ri->link[1] = 0x00;
+        } else {
+            rr_append(ri->link, MAX_LINK, comp, clen);
+        }
+
+        ri->has_link = 1;
+        ri->link_continues = flags & 0x01;
+        pos += 2 + clen;
+    }
+}
+
+static void rr_parse(isofs_t *fs, const uint8_t *p, size_t len, rr_info_t *ri, int depth) {
+
+    uint64_t ce_off = 0;
+    uint32_t ce_len = 0;
+
+    while (len >= 4) {
+        uint8_t l = p[2];
+
+        if (l < 4 || l > len) break;
+
+        if (p[0] == 'N' && p[1] == 'M' && l >= 5) {
+            if (!(p[4] & 0x06)) {
+                rr_append(ri->name, MAX_NAME, p + 5, l - 5);
+                ri->has_name = 1;
+            }
+        } else if (p[0] == 'P' && p[1] == 'X' && l >= 12) {
+            ri->mode = le32(p + 4);
+            ri->has_mode = 1;
+        } else if (p[0] == 'S' && p[1] == 'L' && l >= 5) {
+            rr_symlink(ri, p + 5, l - 5);
+        } else if (p[0] == 'C' && p[1] == 'L' && l >= 12) {
+            ri->child = le32(p + 4);
+            ri->has_child = 1;
+        } else if (p[0] == 'R' && p[1] == 'E') {
+            ri->relocated = 1;
+        } else if (p[0] == 'C' && p[1] == 'E' && l >= 28) {
+            ce_off = (uint64_t) le32(p + 4) * ISOFS_SECTOR + le32(p + 12);
+            ce_len = le32(p + 20);
+        } else if (p[0] == 'S' && p[1] == 'T') {
+            break;
+        }
+
+        p += l;
+        len -= l;
+    }
+
+    /* Continuation area, with a sanity limit on the length and on
+       how many times we follow them */
+
+    if (ce_len > 0 && ce_len <= ISOFS_SECTOR && depth < 8 &&
+        ce_off + ce_len <= fs->image_size) {
+        uint8_t buf[ISOFS_SECTOR];
+
+        if (read_at(fs, buf, ce_len, ce_off) == 0) {
+            rr_parse(fs, buf, ce_len, ri, depth + 1);
+        }
+    }
+}
+
+/* A directory iso_record() found, walked by iso_walk() once the
+   record's own buffers are off the stack */
+
+typedef struct iso_dir {
+    int idx;
+    uint32_t lba;
+    uint32_t size;
+} iso_dir_t;
+
+static __attribute__((noinline)) int iso_record(isofs_t *fs, const uint8_t *r, uint8_t len,
+                                                const char *parent, int joliet, int rr,
+                                                int *pending, iso_dir_t *dir) {
+
+    uint8_t name_len = r[32];
+    uint32_t lba = le32(r + 2);
+    uint32_t size = le32(r + 10);
+    uint8_t flags = r[25];
+    char name[MAX_NAME];
+    rr_info_t ri;
+
+    if (33 + name_len > len) return 0;
+
+    /* Skip the "." and ".." records */
+
+    if (name_len == 1 && (r[33] == 0x00 || r[33] == 0x01)) return 0;
+
+    memset(&ri, 0, sizeof(ri));
+
+    if (rr) {
+        size_t su = 33 + name_len + (name_len % 2 == 0 ? 1 : 0) + fs->rr_skip;
+
+        if (su < len) rr_parse(fs, r + su, len - su, &ri, 0);
+
+        if (ri.relocated) return 0;
+    }
+
+    if (ri.has_name) {
+        snprintf(name, sizeof(name), "%s", ri.name);
+    } else if (joliet) {
+        utf16be_to_utf8(r + 33, name_len, name, sizeof(name));
+        strip_version(name);
+    } else {
+        memcpy(name, r + 33, name_len);
+        name[name_len] = 0x00;
+        strip_version(name);
+        for (char *c = name; *c; c++) *c = tolower(*c);
+    }
+
+    if (name[0] == 0x00) return 0;
+
+    /* The directory that deep trees got relocated into is
+       not part of the image contents */
+
+    if (rr && *parent == 0x00 && (strcmp(name, "rr_moved") == 0 || strcmp(name, ".rr_moved") == 0)) return 0;
+
+    /* Multi-extent files are split into several records with the same
+       name, all but the last one flagged with 0x80 */
+
+    if (*pending >= 0 && strcmp(fs->entries[*pending].path + strlen(parent) + (*parent ? 1 : 0), name) == 0) {
+        isofs_entry_t *e = &fs->entries[*pending];
+
+        if (add_extent(e, (uint64_t) lba * ISOFS_SECTOR, size) < 0) return -1;
+
+        e->size += size;
+        fs->total_bytes += size;
+        *pending = (flags & 0x80) ? *pending : -1;
+
+        return 0;
+    }
+
+    *pending = -1;
+
+    int is_dir = (flags & 0x02) || ri.has_child;
+    uint32_t mode;
+
+    if (ri.has_link) {
+        mode = S_IFLNK | 0777;
+    } else if (is_dir) {
+        mode = S_IFDIR | (ri.has_mode ? (ri.mode & 07777) : 0755);
+    } else {
+        mode = S_IFREG | (ri.has_mode ? (ri.mode & 07777) : 0644);
+    }
+
+    /* A relocated directory: the real one lives where CL points to,
+       and its own "." record tells us how big it is */
+
+    if (ri.has_child) {
+        uint8_t sec[ISOFS_SECTOR];
+
+        lba = ri.child;
+
+        if (read_at(fs, sec, ISOFS_SECTOR, (uint64_t) lba * ISOFS_SECTOR) < 0) return -1;
+
+        size = le32(sec + 10);
+    }
+
+    int idx = add_entry(fs, parent, name, mode, S_ISREG(mode) ? size : 0);
+
+    if (idx < 0) return -1;
+
+    isofs_entry_t *e = &fs->entries[idx];
+
+    if (S_ISLNK(mode)) {
+        if ((e->link = strdup(ri.link)) == NULL) return -1;
+        return 0;
+    }
+
+    if (S_ISREG(mode)) {
+        if (size > 0 && add_extent(e, (uint64_t) lba * ISOFS_SECTOR, size) < 0) return -1;
+        if (flags & 0x80) *pending = idx;
+        return 0;
+    }
+
+    dir->idx = idx;
+    dir->lba = lba;
+    dir->size = size;
+
+    return 1;
+}
+
+static int iso_walk(isofs_t *fs, uint32_t lba, uint32_t size, const char *parent,
+                    int joliet, int rr, int depth) {
+
+    uint64_t off = (uint64_t) lba * ISOFS_SECTOR;
+
+    if (depth > MAX_DEPTH) {
+        r_printf("Directory tree is more than %d levels deep or loops\n", MAX_DEPTH);
+        return -1;
+    }
+
+    if (size == 0) return 0;
+
+    if (off + size > fs->image_size) {
+        r_printf("Directory %s points outside of the image\n", *parent ? parent : "/");
+        return -1;
+    }
+
+    uint8_t *data = malloc(size);
+
+    if (data == NULL) return -1;
+
+    if (read_at(fs, data, size, off) < 0) {
+        free(data);
+        return -1;
+    }
+
+    int pending = -1;
+    uint32_t pos = 0;
+    int ret = 0;
+
+    while (pos < size) {
+        uint8_t len = data[pos];
+
+        /* Records never cross a sector boundary, a zero length means
+           the rest of the sector is padding */
+
+        if (len == 0) {
+            pos = (pos / ISOFS_SECTOR + 1) * ISOFS_SECTOR;
+            continue;
+        }
+
+        if (len < 34 || pos + len > size) break;
+
+        iso_dir_t dir;
+
+        if ((ret = iso_record(fs, data + pos, len, parent, joliet, rr, &pending, &dir)) < 0) break;
+
+        pos += len;
+
+        if (ret == 0) continue;
+
+        /* The entries array may move while walking, take a private copy
+           of the path first */
+
+        char *path = strdup(fs->entries[dir.idx].path);
+
+        if (path == NULL) {
+            ret = -1;
+            break;
+        }
+
+        ret = iso_walk(fs, dir.lba, dir.size, path, joliet, rr, depth + 1);
+
+        free(path);
+
+        if (ret < 0) break;
+    }
+
+    free(data);
+
+    return ret;
+}
+
+static int iso_open(isofs_t *fs, const uint8_t *vds, uint32_t sectors) {
+
+    const uint8_t *pvd = NULL;
+    const uint8_t *svd = NULL;
+    uint8_t sec[ISOFS_SECTOR];
+
+    for (uint32_t i = 0; i < sectors; i++) {
+        const uint8_t *d = vds + i * ISOFS_SECTOR;
+
+        if (memcmp(d + 1, "CD001", 5) != 0) break;
+
+        if (d[0] == 0xFF) break;
+
+        if (d[0] == 1 && pvd == NULL) pvd = d;
+
+        /* A supplementary descriptor with one of the UCS-2 escape
+           sequences %/@, %/C or %/E is Joliet */
+
+        if (d[0] == 2 && svd == NULL && d[88] == 0x25 && d[89] == 0x2F &&
+            (d[90] == 0x40 || d[90] == 0x43 || d[90] == 0x45)) {
+            svd = d;
+        }
+    }
+
+    if (pvd == NULL) return -1;
+
+    if (le16(pvd + 128) != ISOFS_SECTOR) {
+        r_printf("Unsupported ISO9660 block size %d\n", le16(pvd + 128));
+        return -1;
+    }
+
+    /* Rock Ridge is announced by an SP entry in the system use
+       area of the root directory's "." record */
+
+    const uint8_t *root = pvd + 156;
+    uint32_t root_lba = le32(root + 2);
+    uint32_t root_size = le32(root + 10);
+    int rr = 0;
+
+    if (read_at(fs, sec, ISOFS_SECTOR, (uint64_t) root_lba * ISOFS_SECTOR) == 0) {
+        uint8_t len = sec[0];
+
+        if (len >= 34 + 7 && sec[32] == 1) {
+            const uint8_t *su = sec + 34;
+            if (su[0] == 'S' && su[1] == 'P' && su[4] == 0xBE && su[5] == 0xEF) {
+                rr = 1;
+                fs->rr_skip = su[6];
+            }
+        }
+    }
+
+    memcpy(fs->label, pvd + 40, 32);
+    fs->label[32] = 0x00;
+    trim_label(fs->label);
+
+    if (rr) {
+        fs->type = ISOFS_ROCKRIDGE;
+        return iso_walk(fs, root_lba, root_size, "", 0, 1, 0);
+    }
+
+    if (svd != NULL) {
+        fs->type = ISOFS_JOLIET;
+        utf16be_to_utf8(svd + 40, 32, fs->label, sizeof(fs->label));
+        trim_label(fs->label);
+        root = svd + 156;
+        return iso_walk(fs, le32(root + 2), le32(root + 10), "", 1, 0, 0);
+    }
+
+    fs->type = ISOFS_ISO9660;
+
+    return iso_walk(fs, root_lba, root_size, "", 0, 0, 0);
+}
+
+/*
+ * UDF
+ */
+
+static int udf_tag(const uint8_t *b) {
+    return le16(b);
+}
+
+static int udf_read_ads(isofs_t *fs, isofs_entry_t *e, const uint8_t *ads, uint32_t l_ad,
+                        int long_ad, int depth) {
+
+    uint32_t step = long_ad ? 16 : 8;
+
+    for (uint32_t pos = 0; pos + step <= l_ad; pos += step) {
+        uint32_t len = le32(ads + pos) & 0x3FFFFFFF;
+        uint32_t type = le32(ads + pos) >> 30;
+        uint32_t lbn = le32(ads + pos + 4);
+
+        if (len == 0) break;
+
+        if (type == 3) {
+
+            /* The rest of the descriptors continue in another block */
+
+            uint8_t aed[ISOFS_SECTOR];
+
+            if (depth >= 16) return -1;
+
+            if (read_at(fs, aed, ISOFS_SECTOR, fs->udf_start + (uint64_t) lbn * ISOFS_SECTOR) < 0) return -1;
+
+            if (udf_tag(aed) != UDF_TAG_AED) return -1;
+
+            uint32_t next = le32(aed + 20);
+
+            if (next > ISOFS_SECTOR - 24) return -1;
+
+            return udf_read_ads(fs, e, aed + 24, next, long_ad, depth + 1);
+        }
+
+        if (type == 0) {
+            if (add_extent(e, fs->udf_start + (uint64_t) lbn * ISOFS_SECTOR, len) < 0) return -1;
+        } else {
+            if (add_extent(e, ISOFS_ZERO, len) < 0) return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Clamp the extent list to the information length */
+
+static void udf_clamp(isofs_entry_t *e, uint64_t size) {
+
+    uint64_t total = 0;
+
+    for (uint32_t i = 0; i < e->nextents; i++) {
+        if (total + e->extents[i].length > size) {
+            e->extents[i].length = size - total;
+            e->nextents = i + 1;
+            break;
+        }
+        total += e->extents[i].length;
+    }
+}
+
+static void udf_symlink(const uint8_t *p, size_t len, char *out, size_t max) {
+
+    size_t pos = 0;
+
+    out[0] = 0x00;
+
+    while (pos + 4 <= len) {
+        uint8_t type = p[pos];
+        uint8_t clen = p[pos + 1];
+        char comp[MAX_NAME];
+
+        if (pos + 4 + clen > len) break;
+
+        if (out[0] != 0x00 && strcmp(out, "/") != 0) strncat(out, "/", max - strlen(out) - 1);
+
+        switch (type) {
+        case 1:
+        case 2:
+            snprintf(out, max, "/");
+            break;
+        case 3:
+            strncat(out, "..", max - strlen(out) - 1);
+            break;
+        case 4:
+            strncat(out, ".", max - strlen(out) - 1);
+            break;
+        case 5:
+            udf_to_utf8(p + pos + 4, clen, comp, sizeof(comp));
+            strncat(out, comp, max - strlen(out) - 1);
+            break;
+        }
+
+        pos += 4 + clen;
+    }
+}
+
+/* Adds the file entry at lbn and returns its index, directories are
+   left to udf_walk() so that this frame is not part of the recursion */
+
+static int udf_file(isofs_t *fs, uint32_t lbn, const char *parent, const char *name) {
+
+    uint8_t b[ISOFS_SECTOR];
+    uint64_t fe_off = fs->udf_start + (uint64_t) lbn * ISOFS_SECTOR;
+    uint32_t base, l_ea, l_ad;
+
+    if (read_at(fs, b, ISOFS_SECTOR, fe_off) < 0) return -1;
+
+    if (udf_tag(b) == UDF_TAG_FE) {
+        l_ea = le32(b + 168);
+        l_ad = le32(b + 172);
+        base = 176;
+    } else if (udf_tag(b) == UDF_TAG_EFE) {
+        l_ea = le32(b + 208);
+        l_ad = le32(b + 212);
+        base = 216;
+    } else {
+        r_printf("Invalid UDF file entry for %s\n", name);
+        return -1;
+    }
+
+    if (base + l_ea + l_ad > ISOFS_SECTOR) return -1;
+
+    uint8_t file_type = b[16 + 11];
+    int ad_type = le16(b + 16 + 18) & 0x07;
+    uint64_t size = le64(b + 56);
+    const uint8_t *ads = b + base + l_ea;
+    uint32_t mode;
+
+    if (file_type == UDF_FT_DIR) {
+        mode = S_IFDIR | 0755;
+    } else if (file_type == UDF_FT_SYMLINK) {
+        mode = S_IFLNK | 0777;
+    } else {
+        mode = S_IFREG | 0644;
+    }
+
+    int idx = add_entry(fs, parent, name, mode, S_ISREG(mode) ? size : 0);
+
+    if (idx < 0) return -1;
+
+    isofs_entry_t *e = &fs->entries[idx];
+    int ret = 0;
+
+    switch (ad_type) {
+    case 0:
+    case 1:
+        ret = udf_read_ads(fs, e, ads, l_ad, ad_type == 1, 0);
+        break;
+    case 3:
+
+        /* Small files and directories live inside the file entry */
+
+        if (l_ad > 0) ret = add_extent(e, fe_off + base + l_ea, l_ad);
+        break;
+    default:
+        r_printf("Unsupported UDF allocation descriptors in %s\n", e->path);
+        return -1;
+    }
+
+    if (ret < 0) return -1;
+
+    udf_clamp(e, size);
+
+    if (S_ISLNK(mode)) {
+        uint8_t *data;
+
+        e->size = size;
+        data = read_entry(fs, e);
+        e->size = 0;
+
+        if (data == NULL || (e->link = malloc(MAX_LINK)) == NULL) {
+            free(data);
+            return -1;
+        }
+
+        udf_symlink(data, size, e->link, MAX_LINK);
+        free(data);
+
+        return idx;
+    }
+
+    /* Directories carry their data size as well, keep it
+       around only for as long as we need to read them */
+
+    if (S_ISDIR(mode)) e->size = size;
+
+    return idx;
+}
+
+/* The name is decoded in a frame of its own, which is gone again by
+   the time udf_walk() recurses */
+
+static __attribute__((noinline)) int udf_child(isofs_t *fs, uint32_t icb, const char *parent,
+                                               const uint8_t *id, uint8_t l_fi) {
+
+    char name[MAX_NAME];
+
+    udf_to_utf8(id, l_fi, name, sizeof(name));
+
+    return udf_file(fs, icb, parent, name);
+}
+
+static int udf_walk(isofs_t *fs, int dir, int depth) {
+
+    isofs_entry_t *e = &fs->entries[dir];
+
+    if (depth > MAX_DEPTH) {
+        r_printf("Directory tree is more than %d levels deep or loops\n", MAX_DEPTH);
+        return -1;
+    }
+
+    uint64_t size = e->size;
+    uint8_t *data = read_entry(fs, e);
+
+    e->size = 0;
+
+    if (data == NULL) return -1;
+
+    char *path = strdup(e->path);
+
+    if (path == NULL) {
+        free(data);
+        return -1;
+    }
+
+    int ret = 0;
+    uint64_t pos = 0;
+
+    while (pos + 38 <= size) {
+        const uint8_t *fid = data + pos;
+
+        if (udf_tag(fid) != UDF_TAG_FID) break;
+
+        uint8_t chars = fid[18];
+        uint8_t l_fi = fid[19];
+        uint32_t icb = le32(fid + 24);
+        uint16_t l_iu = le16(fid + 36);
+        uint64_t total = (38 + l_iu + l_fi + 3) & ~3;
+
+        if (pos + 38 + l_iu + l_fi > size) break;
+
+        /* Skip deleted entries and the parent directory */
+
+        if (!(chars & 0x04) && !(chars & 0x08) && l_fi > 0) {
+            if ((ret = udf_child(fs, icb, path, fid + 38 + l_iu, l_fi)) < 0) break;
+
+            if (S_ISDIR(fs->entries[ret].mode) && (ret = udf_walk(fs, ret, depth + 1)) < 0) break;
+
+            ret = 0;
+        }
+
+        pos += total;
+    }
+
+    free(path);
+    free(data);
+
+    return ret;
+}
+
+static int udf_open(isofs_t *fs) {
+
+    uint8_t b[ISOFS_SECTOR];
+    uint32_t part_start = 0;
+    uint32_t fsd_lbn = 0;
+    int has_pd = 0;
+    int has_lvd = 0;
+
+    if (fs->image_size < 257 * ISOFS_SECTOR) return -1;
+
+    /* The anchor volume descriptor pointer is always at sector 256 */
+
+    if (read_at(fs, b, ISOFS_SECTOR, 256 * ISOFS_SECTOR) < 0) return -1;
+
+    if (udf_tag(b) != UDF_TAG_AVDP) return -1;
+
+    uint32_t vds_len = le32(b + 16) / ISOFS_SECTOR;
+    uint32_t vds_loc = le32(b + 20);
+
+    for (uint32_t i = 0; i < vds_len && i < 64; i++) {
+        if (read_at(fs, b, ISOFS_SECTOR, (uint64_t) (vds_loc + i) * ISOFS_SECTOR) < 0) return -1;
+
+        int tag = udf_tag(b);
+
+        if (tag == UDF_TAG_TD) break;
+
+        if (tag == UDF_TAG_PD && !has_pd) {
+            part_start = le32(b + 188);
+            has_pd = 1;
+        }
+
+        if (tag == UDF_TAG_LVD && !has_lvd) {
+            if (le32(b + 212) != ISOFS_SECTOR) {
+                r_printf("Unsupported UDF block size %d\n", le32(b + 212));
+                return -1;
+            }
+
+            /* Only plain type 1 partition maps, metadata partitions
+               (UDF 2.50+) are left to the ISO9660 side */
+
+            if (le32(b + 268) < 1 || b[440] != 1) {
+                r_printf("Unsupported UDF partition map\n");
+                return -1;
+            }
+
+            fsd_lbn = le32(b + 248 + 4);
+            udf_to_utf8(b + 84, b[84 + 127] < 127 ? b[84 + 127] : 127, fs->label, sizeof(fs->label));
+            has_lvd = 1;
+        }
+    }
+
+    if (!has_pd || !has_lvd) return -1;
+
+    fs->udf_start = (uint64_t) part_start * ISOFS_SECTOR;
+
+    if (read_at(fs, b, ISOFS_SECTOR, fs->udf_start + (uint64_t) fsd_lbn * ISOFS_SECTOR) < 0) return -1;
+
+    if (udf_tag(b) != UDF_TAG_FSD) return -1;
+
+    fs->type = ISOFS_UDF;
+
+    /* The root directory goes in as a nameless first entry, then
+       gets dropped once its contents are known */
+
+    if (udf_file(fs, le32(b + 400 + 4), "", "") < 0) return -1;
+
+    if (!S_ISDIR(fs->entries[0].mode) || udf_walk(fs, 0, 0) < 0) return -1;
+
+    isofs_entry_t *root = &fs->entries[0];
+
+    free(root->path);
+    free(root->extents);
+    memmove(fs->entries, fs->entries + 1, (fs->count - 1) * sizeof(isofs_entry_t));
+    fs->count--;
+
+    return 0;
+}
+
+/* The volume recognition sequence of UDF sits among the ISO9660
+   descriptors, BEA01, NSR02 or NSR03, then TEA01. Without any
+   descriptor at all only the anchor at sector 256 can tell. */
+
+static int has_nsr(const uint8_t *vds, uint32_t sectors) {
+
+    for (uint32_t i = 0; i < sectors; i++) {
+        const uint8_t *id = vds + i * ISOFS_SECTOR + 1;
+
+        if (memcmp(id, "NSR02", 5) == 0 || memcmp(id, "NSR03", 5) == 0) return 1;
+
+        if (memcmp(id, "CD001", 5) != 0 && memcmp(id, "BEA01", 5) != 0 &&
+            memcmp(id, "BOOT2", 5) != 0 && memcmp(id, "CDW02", 5) != 0) return i == 0;
+    }
+
+    return 0;
+}
+
+static void reset(isofs_t *fs) {
+
+    for (size_t i = 0; i < fs->count; i++) {
+        free(fs->entries[i].path);
+        free(fs->entries[i].link);
+        free(fs->entries[i].extents);
+    }
+
+    free(fs->entries);
+
+    fs->entries = NULL;
+    fs->count = 0;
+    fs->cap = 0;
+    fs->total_bytes = 0;
+    fs->rr_skip = 0;
+    fs->udf_start = 0;
+    fs->label[0] = 0x00;
+}
+
+int isofs_open(const char *path, isofs_t **out) {
+
+    struct stat st;
+    isofs_t *fs = calloc(1, sizeof(isofs_t));
+
+    if (fs == NULL) return -1;
+
+    if ((fs->fd = open(path, O_RDONLY)) < 0) {
+        r_printf("Opening %s failed: %s\n", path, strerror(errno));
+        free(fs);
+        return -1;
+    }
+
+    if (fstat(fs->fd, &st) < 0) {
+        r_printf("Stat %s failed: %s\n", path, strerror(errno));
+        isofs_close(fs);
+        return -1;
+    }
+
+    fs->image_size = st.st_size;
+
+    /* The whole volume descriptor set comes in with one read. UDF is
+       only tried when it announces an NSR descriptor, then, like the
+       kernel mount this replaces, it is preferred with ISO9660 as the
+       fall back when its tree is not usable. */
+
+    uint8_t *vds = malloc(ISOFS_VDS_SECTORS * ISOFS_SECTOR);
+    uint32_t sectors = 0;
+    int ret = -1;
+
+    if (fs->image_size > 16 * ISOFS_SECTOR) {
+        sectors = (fs->image_size - 16 * ISOFS_SECTOR) / ISOFS_SECTOR;
+        if (sectors > ISOFS_VDS_SECTORS) sectors = ISOFS_VDS_SECTORS;
+    }
+
+    if (vds != NULL && read_at(fs, vds, (size_t) sectors * ISOFS_SECTOR, 16 * ISOFS_SECTOR) == 0) {
+        if (has_nsr(vds, sectors) && udf_open(fs) == 0) {
+            ret = 0;
+        } else {
+            reset(fs);
+            ret = iso_open(fs, vds, sectors);
+        }
+    }
+
+    free(vds);
+
+    if (ret < 0) {
+        r_printf("%s is not a valid ISO9660 or UDF image\n", path);
+        isofs_close(fs);
+        return -1;
+    }
+
+    posix_fadvise(fs->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    r_printf(" * Image format is %s, %zu entries, %.1f MiB of files\n",
+             isofs_type_name(fs->type), fs->count, fs->total_bytes / 1048576.0);
+
+    *out = fs;
+
+    return 0;
+}
+
+ssize_t isofs_pread(isofs_t *fs, const isofs_entry_t *e, void *buf, size_t len, uint64_t off) {
+
+    uint8_t *p = buf;
+    uint64_t start = 0;
+    size_t done = 0;
+
+    for (uint32_t i = 0; i < e->nextents && done < len; i++) {
+        const isofs_extent_t *x = &e->extents[i];
+
+        if (off >= start + x->length) {
+            start += x->length;
+            continue;
+        }
+
+        uint64_t in = off - start;
+        size_t chunk = x->length - in;
+
+        if (chunk > len - done) chunk = len - done;
+
+        if (x->offset == ISOFS_ZERO) {
+            memset(p + done, 0, chunk);
+        } else if (read_at(fs, p + done, chunk, x->offset + in) < 0) {
+            return -1;
+        }
+
+        done += chunk;
+        off += chunk;
+        start += x->length;
+    }
+
+    return done;
+}
+
+void isofs_close(isofs_t *fs) {
+
+    if (fs == NULL) return;
+
+    reset(fs);
+
+    if (fs->fd >= 0) close(fs->fd);
+
+    free(fs);
+}
+
+const char *isofs_type_name(int type) {
+
+    switch (type) {
+    case ISOFS_JOLIET:
+        return "ISO9660/Joliet";
+    case ISOFS_ROCKRIDGE:
+        return "ISO9660/Rock Ridge";
+    case ISOFS_UDF:
+        return "UDF";
+    default:
+        return "ISO9660";
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef ISOFS_H
+#define ISOFS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Userspace reader for ISO9660 (with Joliet and Rock Ridge) and UDF
+   images. isofs_open() parses the volume descriptors and every
+   directory of the image up front, so that the whole tree is available
+   as a flat list of entries, parents always before their children.
+   File data is then read straight from the image with pread(), no
+   loop device or mount needed. */
+
+#define ISOFS_SECTOR 2048
+#define ISOFS_ZERO UINT64_MAX /* Extent that reads back as zeros */
+#define ISOFS_VDS_SECTORS 48  /* Volume descriptors read from sector 16 on */
+
+#define ISOFS_ISO9660 0
+#define ISOFS_JOLIET 1
+#define ISOFS_ROCKRIDGE 2
+#define ISOFS_UDF 3
+
+typedef struct isofs_extent {
+    uint64_t offset; /* Byte offset in the image, or ISOFS_ZERO */
+    uint64_t length;
+} isofs_extent_t;
+
+typedef struct isofs_entry {
+    char *path;      /* Relative to the image root, UTF-8 */
+    char *link;      /* Symlink target, NULL if not a symlink */
+    uint64_t size;
+    uint32_t mode;   /* S_IFDIR, S_IFREG or S_IFLNK with permissions */
+    uint32_t nextents;
+    isofs_extent_t *extents;
+} isofs_entry_t;
+
+typedef struct isofs {
+    int fd;
+    int type;
+    uint64_t image_size;
+    char label[128];
+    isofs_entry_t *entries;
+    size_t count;
+    size_t cap;
+    uint64_t total_bytes;
+
+    /* Parsing state */
+    int rr_skip;
+    uint64_t udf_start;
+} isofs_t;
+
+int isofs_open(const char *path, isofs_t **fs);
+ssize_t isofs_pread(isofs_t *fs, const isofs_entry_t *e, void *buf, size_t len, uint64_t off);
+void isofs_close(isofs_t *fs);
+const char *isofs_type_name(int type);
+
+#endif // ISOFS_H
@@ -0,0 +1,499 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "job.h"
+#include "log.h"
+#include "progress.h"
+#include "trace.h"
+#include "definitions.h"
+#include "linux/devprobe.h"
+#include "linux/mounting.h"
+#include "linux/partition.h"
+#include "linux/wipe.h"
+#include "linux/fat32.h"
+#include "linux/copy.h"
+#include "linux/fatbuild.h"
+#include "linux/exfat.h"
+#include "linux/rawwrite.h"
+#include "linux/verify.h"
+#include "linux/fanout.h"
+#include "linux/blockio.h"
+#include "iso.h"
+#include "isofs.h"
+#include "scancache.h"
+
+/* The stages of a job, shared by the window's worker thread and the
+   command line tool. Progress and messages only go through log.h, so
+   whoever links this in decides where they end up. */
+
+#define ASSERT(x)\
+    if (x < 0) { \
+        set_ticker("FAILED"); \
+        progress_begin(0); \
+        isofs_close(image); \
+        if (verifier != NULL) verify_finish(verifier); \
+        clean_up(&device_fd, &part_fd, &loop_fd, &iso_fd); \
+        return -1; \
+    }
+
+/* A stage of the job, timed as a span of its own */
+
+#define STAGE(name, x) { \
+        TRACE_SPAN(name); \
+        ASSERT(x); \
+    }
+
+/* The request size and queue depth for one device: what the job asks
+   for, otherwise the device's profile, measured first if it has none.
+   A device that can't be measured gets the defaults. */
+
+static void io_sizes(const job_t *job, const Device *dev, int fd, devprobe_t *io) {
+
+    memset(io, 0, sizeof(devprobe_t));
+
+    if ((job->chunk_size == 0 || job->queue_depth == 0) &&
+        (job->probe || devprobe_load(dev, io) < 0)) {
+        TRACE_SPAN_ARG("probe", dev->device);
+
+        set_ticker("Measuring device...");
+
+        if (devprobe_run(fd, io) == 0) {
+            devprobe_save(dev, io);
+        } else {
+            memset(io, 0, sizeof(devprobe_t));
+        }
+    }
+
+    if (job->chunk_size != 0) io->chunk = (size_t) job->chunk_size * 1024 * 1024;
+    if (job->queue_depth != 0) io->depth = job->queue_depth;
+
+    if (io->chunk == 0) io->chunk = (size_t) RAW_DEFAULT_CHUNK_MB * 1024 * 1024;
+    if (io->depth == 0) io->depth = BLOCKIO_DEFAULT_DEPTH;
+}
+
+/* The boundary the partition and the FAT data region start on. The
+   default is a multiple of every power of two erase block up to it,
+   an erase block that isn't one of those is used as it is. Only sysfs
+   is asked, nothing is written to find out. */
+
+static uint32_t alignment(const job_t *job, const Device *dev) {
+
+    if (job->alignment != 0) return (uint32_t) job->alignment * 1024;
+
+    uint32_t erase = devprobe_erase_size(dev);
+
+    if (erase != 0 && PART_ALIGN_DEFAULT % erase != 0) return erase;
+
+    return PART_ALIGN_DEFAULT;
+}
+
+/* The cluster size for the files in the image, or a check that the one
+   asked for leaves room for them. The list comes from the scan, made
+   again if it isn't saved. exFAT only needs the layout to fit the
+   partition. Nothing has been written to the device yet when this
+   fails. */
+
+static int plan_clusters(const job_t *job, isofs_t *image, uint32_t device_fd, uint32_t align,
+                         int *cluster_size) {
+
+    scancache_key_t key;
+    fat32_usage_t usage;
+    exfat_layout_t layout;
+    uint64_t sectors;
+    int64_t start, end;
+
+    *cluster_size = job->cluster_size;
+
+    if (job->file_system == FS_EXFAT) {
+        if (fat32_sectors(device_fd, &sectors) < 0 || partition_bounds(sectors, 512, align, &start, &end) < 0) {
+            return -1;
+        }
+
+        if (exfat_layout(end - start + 1, job->cluster_size, align, &layout) < 0) return -1;
+
+        if (image != NULL && image->total_bytes > ((uint64_t) layout.clusters << layout.clus_shift) * 512) {
+            r_printf("ERROR: The image does not fit on the device\n");
+            return -1;
+        }
+
+        return 0;
+    }
+
+    if (scancache_key(job->image_path, &key) < 0 || scancache_load(&key, &img_report, &img_manifest) < 0) {
+        if (image == NULL) {
+            r_printf("No list of files, the cluster size is left to the formatter\n");
+            return 0;
+        }
+
+        iso_scan_image(image);
+    }
+
+    if (img_report.has_4GB_file) {
+        r_printf("ERROR: The image has a file of 4 GB or more, use exFAT instead of FAT32\n");
+        return -1;
+    }
+
+    if (iso_fat32_usage(&img_manifest, &usage) < 0) return -1;
+
+    /* In 512 byte sectors, a 4K device ends up a few sectors off */
+
+    if (fat32_sectors(device_fd, &sectors) < 0 || partition_bounds(sectors, 512, align, &start, &end) < 0) {
+        return -1;
+    }
+
+    r_printf("%u files and %u directories, %.1f MiB\n", usage.files, usage.dirs, usage.bytes / 1048576.0);
+
+    if ((*cluster_size = fat32_pick_cluster(end - start + 1, align, &usage, job->cluster_size)) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* An empty volume for the mount and copy paths */
+
+static int format(const job_t *job, const uint32_t *part_fd, int cluster_size, uint32_t align,
+                  const devprobe_t *io) {
+
+    if (job->file_system == FS_EXFAT) {
+        TRACE_SPAN("format_exfat");
+        return format_exfat(part_fd, cluster_size, align, (char*) job->label);
+    }
+
+    TRACE_SPAN("format_fat32");
+    return format_fat32(part_fd, cluster_size, align, (char*) job->label, io->chunk, io->depth);
+}
+
+/* Many sticks at once: the image is read once and shared by a writer
+   per device, a device that fails is simply left out */
+
+static int fan_out(const job_t *job) {
+
+    fanout_target_t fan[FANOUT_MAX_TARGETS];
+    verify_t checks[FANOUT_MAX_TARGETS];
+    devprobe_t io;
+    devprobe_t slowest;
+    char paths[FANOUT_MAX_TARGETS][32];
+    char status[64];
+    int count = 0;
+    int ok = -1;
+
+    memset(fan, 0, sizeof(fan));
+    memset(&slowest, 0, sizeof(slowest));
+
+    for (int i = 0; i < job->ndevices && count < FANOUT_MAX_TARGETS; i++) {
+        Device *dev = &job->devices[i];
+        fanout_target_t *t = &fan[count];
+
+        snprintf(paths[count], sizeof(paths[count]), TEMP_DEVICE_N, count);
+        t->name = dev->device;
+
+        if (make_temp_node(paths[count], dev->major, dev->minor, &t->fd) < 0) {
+            r_printf("%s: FAILED, device left out\n", dev->device);
+            continue;
+        }
+
+        if (raw_check(job->image_path, &t->fd) < 0) {
+            r_printf("%s: FAILED, device left out\n", dev->device);
+            close(t->fd);
+            remove(paths[count]);
+            continue;
+        }
+
+        /* All of them are fed at the pace of the slowest one */
+
+        io_sizes(job, dev, t->fd, &io);
+
+        if (slowest.depth == 0 || io.write_mbps < slowest.write_mbps) slowest = io;
+
+        if (!job->quick_format) {
+            TRACE_SPAN_ARG("full_wipe", dev->device);
+
+            set_ticker("Running full format...");
+
+            if (full_wipe(&t->fd, job->wipe_mode, io.chunk, io.depth) < 0) {
+                r_printf("%s: FAILED to wipe, device left out\n", dev->device);
+                close(t->fd);
+                remove(paths[count]);
+                continue;
+            }
+        }
+
+        if (job->verify && verify_start(&checks[count], paths[count], job->threads) == 0) {
+            t->verify = &checks[count];
+        }
+
+        count++;
+    }
+
+    if (count > 0) {
+        TRACE_SPAN("fanout_write");
+
+        set_ticker("Writing image to USB...");
+        ok = fanout_write(job->image_path, fan, count, slowest.chunk, slowest.depth, job->threads);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (fan[i].verify != NULL) {
+            TRACE_SPAN_ARG("verify_finish", fan[i].name);
+
+            set_ticker("Verifying...");
+
+            if (verify_finish(fan[i].verify) < 0 && ok > 0 && fan[i].error == 0) {
+                r_printf("%s: verification FAILED\n", fan[i].name);
+                ok--;
+            }
+        }
+
+        close(fan[i].fd);
+        remove(paths[i]);
+    }
+
+    if (ok == job->ndevices) {
+        snprintf(status, sizeof(status), "DONE");
+    } else if (ok > 0) {
+        snprintf(status, sizeof(status), "DONE on %d of %d devices", ok, job->ndevices);
+    } else {
+        snprintf(status, sizeof(status), "FAILED");
+    }
+
+    if (ok > 0) {
+        progress_finish();
+    } else {
+        progress_begin(0);
+    }
+
+    set_ticker(status);
+
+    return ok == job->ndevices ? 0 : -1;
+}
+
+static int run(const job_t *job) {
+
+    uint32_t device_fd = -1;
+    uint32_t part_fd = -1;
+    uint32_t loop_fd = -1;
+    uint32_t iso_fd = -1;
+    int32_t file_system = job->file_system;
+    isofs_t *image = NULL;
+    verify_t verification;
+    verify_t *verifier = NULL;
+    devprobe_t io;
+    uint32_t align;
+    int cluster_size = job->cluster_size;
+    Device *theOne = &job->devices[0];
+
+    r_printf("Using %s\n major: %d\n minor: %d\n", theOne->device, theOne->major, theOne->minor);
+
+    set_ticker("Warming up...");
+    progress_begin(0);
+
+    if (job->source == SRC_DD && job->ndevices > 1) return fan_out(job);
+
+    if (job->source == SRC_DD) {
+
+        /* Raw images go to the whole device as they are */
+
+        STAGE("make_temp_device", make_temp_device(theOne->major, theOne->minor, &device_fd));
+        STAGE("raw_check", raw_check(job->image_path, &device_fd));
+
+        io_sizes(job, theOne, device_fd, &io);
+
+        /* After a zero fill the zero parts of the image need not be
+           written, discarded blocks are not guaranteed to read as zeros */
+
+        if (!job->quick_format) {
+           set_ticker("Running full format...");
+           STAGE("full_wipe", full_wipe(&device_fd, job->wipe_mode, io.chunk, io.depth));
+        }
+
+        if (job->verify) {
+           STAGE("verify_start", verify_start(&verification, TEMP_DEVICE, job->threads));
+           verifier = &verification;
+        }
+
+        set_ticker("Writing image to USB...");
+
+        STAGE("raw_write", raw_write(job->image_path, &device_fd, io.chunk, io.depth,
+                         !job->quick_format && job->wipe_mode == WIPE_ZERO, verifier, job->threads));
+
+        if (verifier != NULL) {
+           set_ticker("Verifying...");
+           verifier = NULL;
+           STAGE("verify_finish", verify_finish(&verification));
+        }
+
+        set_ticker("Cleaning up...");
+        {
+            TRACE_SPAN("clean_up");
+            clean_up(&device_fd, &part_fd, &loop_fd, &iso_fd);
+        }
+
+        progress_finish();
+        set_ticker("DONE");
+
+        return 0;
+    }
+
+    /* Read the image directly when we can, the loop mount is
+       only needed for images isofs does not understand */
+
+    {
+        TRACE_SPAN("isofs_open");
+
+        if (isofs_open(job->image_path, &image) < 0) {
+            r_printf("Falling back to mounting the image\n");
+            image = NULL;
+        }
+    }
+
+    STAGE("make_temp_dir", make_temp_dir(TEMP_DIR));
+    STAGE("make_temp_device", make_temp_device(theOne->major, theOne->minor, &device_fd));
+
+    align = alignment(job, theOne);
+
+    if (job->file_system == FS_FAT32 || job->file_system == FS_EXFAT) {
+        set_ticker("Planning the volume...");
+        STAGE("plan_clusters", plan_clusters(job, image, device_fd, align, &cluster_size));
+    }
+
+    /* Measuring writes over the start of the device, so it only comes
+       once the volume is known to fit, and not at all when nothing
+       below uses the sizes: a quick format to exFAT that has to mount
+       and copy the image */
+
+    memset(&io, 0, sizeof(io));
+
+    if (!job->quick_format || job->file_system != FS_EXFAT || image != NULL) {
+        io_sizes(job, theOne, device_fd, &io);
+    }
+
+    if (!job->quick_format) {
+       set_ticker("Running full format...");
+       STAGE("full_wipe", full_wipe(&device_fd, job->wipe_mode, io.chunk, io.depth));
+    }
+
+    set_ticker("Partitioning drive...");
+
+    STAGE("nuke_and_partition", nuke_and_partition(TEMP_DEVICE, job->partition_scheme, job->file_system, align));
+    STAGE("make_temp_partition", make_temp_partition(theOne->major, theOne->minor, &part_fd));
+
+    if (image != NULL && (job->file_system == FS_FAT32 || job->file_system == FS_EXFAT)) {
+
+        /* Lay out the whole volume from the image and write it in one
+           sequential pass, no mkfs and no mount needed */
+
+        if (job->verify) {
+           STAGE("verify_start", verify_start(&verification, TEMP_PART, job->threads));
+           verifier = &verification;
+        }
+
+        set_ticker("Writing data to USB...");
+
+        if (job->file_system == FS_EXFAT) {
+            STAGE("build_exfat", build_exfat(&part_fd, image, cluster_size, (char*) job->label, align,
+                                             io.chunk, verifier));
+        } else {
+            STAGE("build_fat32", build_fat32(&part_fd, image, cluster_size, (char*) job->label, align,
+                                             io.chunk, verifier));
+        }
+
+        if (verifier != NULL) {
+           set_ticker("Verifying...");
+           verifier = NULL;
+           STAGE("verify_finish", verify_finish(&verification));
+        }
+
+    } else if (image != NULL) {
+        if (job->verify) r_printf("Verification is only done when the volume is built directly\n");
+
+        ASSERT(format(job, &part_fd, cluster_size, align, &io));
+        STAGE("mount_device_to_temp", mount_device_to_temp(&file_system));
+
+        set_ticker("Copying data to USB...");
+        STAGE("image_copy", image_copy(image, (char*) TEMP_DIR, job->threads));
+    } else {
+        if (job->verify) r_printf("Verification is only done when the volume is built directly\n");
+
+        ASSERT(format(job, &part_fd, cluster_size, align, &io));
+        STAGE("mount_device_to_temp", mount_device_to_temp(&file_system));
+
+        STAGE("make_temp_dir", make_temp_dir(TEMP_DIR_ISO));
+        STAGE("make_loop_device", make_loop_device(&loop_fd));
+        STAGE("mount_iso_to_loop", mount_iso_to_loop(job->image_path, strlen(job->image_path), &loop_fd, &iso_fd));
+
+        set_ticker("Copying data to USB...");
+
+        STAGE("recursive_copy", recursive_copy( (char*) TEMP_DIR_ISO, (char*) TEMP_DIR, job->threads));
+    }
+
+    set_ticker("Cleaning up...");
+
+    {
+        TRACE_SPAN("clean_up");
+        isofs_close(image);
+        clean_up(&device_fd, &part_fd, &loop_fd, &iso_fd);
+    }
+
+    progress_finish();
+
+    set_ticker("DONE");
+
+    return 0;
+}
+
+/* The whole job under one span, with a trace written when asked for */
+
+int job_copy(const job_t *job) {
+    int ret;
+
+    trace_start(job->trace_path);
+    trace_thread("job");
+
+    {
+        TRACE_SPAN("job_copy");
+        ret = run(job);
+    }
+
+    trace_stop();
+
+    return ret;
+}
+
+int job_scan(const char *image_path) {
+
+    isofs_t *image = NULL;
+    scancache_key_t key;
+    int cached = scancache_key(image_path, &key) == 0;
+
+    set_ticker("Analyzing ISO Image...");
+    r_printf("Analyzing ISO Image\n");
+
+    /* The same image picked again is answered from the cache */
+
+    if (cached && scancache_load(&key, &img_report, &img_manifest) == 0) {
+        r_printf("Using the saved analysis of %s\n", key.path);
+        iso_print_report(&img_report);
+        set_ticker("READY");
+        return 0;
+    }
+
+    /* Only the volume descriptors and the directories are read from
+       the image file, no loop device, no mount and no root needed */
+
+    if (isofs_open(image_path, &image) < 0) {
+        set_ticker("FAILED");
+        return -1;
+    }
+
+    iso_scan_image(image);
+    isofs_close(image);
+
+    if (cached) scancache_store(&key, &img_report, &img_manifest);
+
+    set_ticker("READY");
+
+    return 0;
+}
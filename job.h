@@ -0,0 +1,34 @@
+#ifndef JOB_H
+#define JOB_H
+
+#include <stdint.h>
+
+#include "linux/devices.h"
+
+/* One run of the tool, filled in by the window or the command line.
+   All sizes and modes use the indices from definitions.h. */
+
+typedef struct job {
+    Device *devices;        /* Several only for DD fan-out */
+    int ndevices;
+    int partition_scheme;
+    int file_system;
+    int cluster_size;
+    int quick_format;
+    int wipe_mode;
+    int threads;
+    int source;
+    int chunk_size;         /* MiB, 0 for the device's profile */
+    int queue_depth;        /* 0 for the device's profile */
+    int probe;              /* Measure the device even if it has a profile */
+    int alignment;          /* KiB, 0 for the erase block or PART_ALIGN_DEFAULT */
+    int verify;
+    const char *image_path;
+    const char *label;
+    const char *trace_path; /* Chrome trace of the run, NULL for none */
+} job_t;
+
+int job_copy(const job_t *job);
+int job_scan(const char *image_path);
+
+#endif // JOB_H
@@ -0,0 +1,398 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "../log.h"
+#include "../trace.h"
+#include "blockio.h"
+
+/* io_uring is used through the raw system calls, the few ring
+   operations needed here don't justify another library dependency.
+   Requests are submitted one by one as soon as they are queued, so the
+   submission ring never holds more than depth entries. */
+
+#ifdef __NR_io_uring_setup
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned op, void *arg, unsigned nr) {
+  return syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+static void uring_unmap(blockio_t *b) {
+  if (b->sqes != NULL) munmap(b->sqes, b->sqes_len);
+  if (b->cq_ring != NULL && b->cq_ring != b->sq_ring)
+    munmap(b->cq_ring, b->cq_ring_len);
+  if (b->sq_ring != NULL) munmap(b->sq_ring, b->sq_ring_len);
+
+  b->sqes = NULL;
+  b->sq_ring = b->cq_ring = NULL;
+}
+
+static int uring_init(blockio_t *b, size_t buf_size) {
+  struct io_uring_params p;
+
+  memset(&p, 0, sizeof(p));
+
+  if ((b->ring_fd = uring_setup(b->depth, &p)) < 0) return -1;
+
+  b->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  b->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (b->cq_ring_len > b->sq_ring_len) b->sq_ring_len = b->cq_ring_len;
+    b->cq_ring_len = b->sq_ring_len;
+  }
+
+  b->sq_ring = mmap(NULL, b->sq_ring_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, b->ring_fd, IORING_OFF_SQ_RING);
+
+  if (b->sq_ring == MAP_FAILED) {
+    b->sq_ring = NULL;
+    goto fail;
+  }
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    b->cq_ring = b->sq_ring;
+  } else {
+    b->cq_ring = mmap(NULL, b->cq_ring_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, b->ring_fd, IORING_OFF_CQ_RING);
+
+    if (b->cq_ring == MAP_FAILED) {
+      b->cq_ring = NULL;
+      goto fail;
+    }
+  }
+
+  b->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  b->sqes = mmap(NULL, b->sqes_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, b->ring_fd, IORING_OFF_SQES);
+
+  if (b->sqes == MAP_FAILED) {
+    b->sqes = NULL;
+    goto fail;
+  }
+
+  unsigned char *sq = b->sq_ring;
+  unsigned char *cq = b->cq_ring;
+
+  b->sq_head = (unsigned *)(sq + p.sq_off.head);
+  b->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  b->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  b->sq_array = (unsigned *)(sq + p.sq_off.array);
+  b->cq_head = (unsigned *)(cq + p.cq_off.head);
+  b->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  b->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  b->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  /* Registering is an optimization only, both can fail on old kernels
+     or with a low memlock limit and the ring still works without */
+
+  b->fixed_file = uring_register(b->ring_fd, IORING_REGISTER_FILES, &b->fd, 1) == 0;
+
+  struct iovec *iov = calloc(b->nbufs, sizeof(struct iovec));
+
+  if (iov != NULL) {
+    for (int i = 0; i < b->nbufs; i++) {
+      iov[i].iov_base = b->bufs[i];
+      iov[i].iov_len = buf_size;
+    }
+
+    b->fixed_bufs = uring_register(b->ring_fd, IORING_REGISTER_BUFFERS, iov, b->nbufs) == 0;
+
+    free(iov);
+  }
+
+  return 0;
+
+fail:
+  uring_unmap(b);
+  close(b->ring_fd);
+  b->ring_fd = -1;
+
+  return -1;
+}
+
+static int uring_push(blockio_t *b, int buf) {
+  blockio_op_t *op = &b->ops[buf];
+  unsigned tail = *b->sq_tail;
+  unsigned idx = tail & *b->sq_mask;
+  struct io_uring_sqe *sqe = &b->sqes[idx];
+
+  memset(sqe, 0, sizeof(*sqe));
+
+  if (b->fixed_bufs) {
+    sqe->opcode = op->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe->buf_index = buf;
+  } else {
+    sqe->opcode = op->write ? IORING_OP_WRITE : IORING_OP_READ;
+  }
+
+  if (b->fixed_file) {
+    sqe->fd = 0;
+    sqe->flags = IOSQE_FIXED_FILE;
+  } else {
+    sqe->fd = b->fd;
+  }
+
+  sqe->addr = (uintptr_t)(b->bufs[buf] + op->done);
+  sqe->len = op->len - op->done;
+  sqe->off = op->off + op->done;
+  sqe->user_data = buf;
+
+  b->sq_array[idx] = idx;
+
+  __atomic_store_n(b->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  while (uring_enter(b->ring_fd, 1, 0, 0) < 0) {
+    if (errno == EINTR || errno == EAGAIN) continue;
+    return -1;
+  }
+
+  return 0;
+}
+
+#else
+
+static int uring_init(blockio_t *b, size_t buf_size) {
+  errno = ENOSYS;
+  return -1;
+}
+
+#endif
+
+static void finish(blockio_t *b, int buf, int error) {
+  blockio_op_t *op = &b->ops[buf];
+
+  b->inflight--;
+
+  if (error && !b->error) {
+    b->error = error;
+    r_printf("Error %s at offset %llu: %s\n", op->write ? "writing" : "reading",
+             (unsigned long long)(op->off + op->done), strerror(error));
+  }
+
+  if (op->cb) op->cb(op->arg, buf, op->done, error);
+}
+
+/* Synchronous fallback, the request is done before submit returns */
+
+static void sync_io(blockio_t *b, int buf) {
+  blockio_op_t *op = &b->ops[buf];
+  int error = 0;
+  TRACE_SPAN(op->write ? "pwrite" : "pread");
+
+  while (op->done < op->len) {
+    unsigned char *p = b->bufs[buf] + op->done;
+    size_t len = op->len - op->done;
+    uint64_t off = op->off + op->done;
+    ssize_t n = op->write ? pwrite(b->fd, p, len, off) : pread(b->fd, p, len, off);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      error = errno;
+      break;
+    }
+
+    if (n == 0) break;
+
+    op->done += n;
+  }
+
+  finish(b, buf, error);
+}
+
+static int submit(blockio_t *b, int write, int buf, size_t len, uint64_t off,
+                  blockio_done_t cb, void *arg) {
+  while (b->inflight >= b->depth) {
+    if (blockio_reap(b, 1) < 0) return -1;
+  }
+
+  if (b->error) return -1;
+
+  blockio_op_t *op = &b->ops[buf];
+
+  op->write = write;
+  op->off = off;
+  op->len = len;
+  op->done = 0;
+  op->cb = cb;
+  op->arg = arg;
+
+  b->inflight++;
+
+#ifdef __NR_io_uring_setup
+  if (b->backend == BLOCKIO_URING) {
+    if (uring_push(b, buf) < 0) {
+      finish(b, buf, errno);
+      return -1;
+    }
+    return 0;
+  }
+#endif
+
+  sync_io(b, buf);
+
+  return b->error ? -1 : 0;
+}
+
+int blockio_open(blockio_t *b, int fd, int depth, unsigned char **bufs,
+                 int nbufs, size_t buf_size) {
+  memset(b, 0, sizeof(blockio_t));
+
+  if (depth < 1) depth = 1;
+  if (depth > BLOCKIO_MAX_DEPTH) depth = BLOCKIO_MAX_DEPTH;
+  if (depth > nbufs) depth = nbufs;
+
+  b->fd = fd;
+  b->depth = depth;
+  b->bufs = bufs;
+  b->nbufs = nbufs;
+  b->ring_fd = -1;
+  b->backend = BLOCKIO_PWRITE;
+
+  if ((b->ops = calloc(nbufs, sizeof(blockio_op_t))) == NULL) {
+    r_printf("Error: out of memory for I/O requests\n");
+    return -1;
+  }
+
+  if (depth > 1) {
+    if (uring_init(b, buf_size) == 0) {
+      b->backend = BLOCKIO_URING;
+    } else {
+      r_printf("io_uring not available (%s), using pwrite\n", strerror(errno));
+      b->depth = 1;
+    }
+  }
+
+  r_printf("Block I/O: %s, queue depth %d%s%s\n", blockio_name(b), b->depth,
+           b->fixed_bufs ? ", registered buffers" : "",
+           b->fixed_file ? ", fixed file" : "");
+
+  return 0;
+}
+
+int blockio_write(blockio_t *b, int buf, size_t len, uint64_t off,
+                  blockio_done_t cb, void *arg) {
+  return submit(b, 1, buf, len, off, cb, arg);
+}
+
+int blockio_read(blockio_t *b, int buf, size_t len, uint64_t off,
+                 blockio_done_t cb, void *arg) {
+  return submit(b, 0, buf, len, off, cb, arg);
+}
+
+/* Handles finished requests, with wait set it blocks until at least
+   one request finished if any are in flight */
+
+int blockio_reap(blockio_t *b, int wait) {
+#ifdef __NR_io_uring_setup
+  if (b->backend != BLOCKIO_URING) return b->error ? -1 : 0;
+
+  int reaped = 0;
+
+  for (;;) {
+    unsigned head = *b->cq_head;
+    unsigned tail = __atomic_load_n(b->cq_tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail) {
+      if (!wait || reaped || b->inflight == 0) break;
+
+      TRACE_SPAN("io_wait");
+
+      if (uring_enter(b->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+          errno != EINTR) {
+        r_printf("io_uring wait failed: %s\n", strerror(errno));
+        if (!b->error) b->error = errno;
+
+        /* Nothing can be reaped anymore, closing the ring cancels
+           whatever is still in flight */
+
+        b->inflight = 0;
+        return -1;
+      }
+
+      continue;
+    }
+
+    struct io_uring_cqe *cqe = &b->cqes[head & *b->cq_mask];
+    int buf = (int)cqe->user_data;
+    int res = cqe->res;
+
+    __atomic_store_n(b->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    reaped++;
+
+    blockio_op_t *op = &b->ops[buf];
+
+    if (res == -EINTR || res == -EAGAIN) {
+      if (uring_push(b, buf) < 0) finish(b, buf, errno);
+    } else if (res < 0) {
+      finish(b, buf, -res);
+    } else {
+      op->done += res;
+
+      /* Short transfers are resubmitted for the rest, a read that
+         hits the end of the device simply finishes short */
+
+      if (res > 0 && op->done < op->len) {
+        if (uring_push(b, buf) < 0) finish(b, buf, errno);
+      } else {
+        finish(b, buf, 0);
+      }
+    }
+  }
+#endif
+
+  return b->error ? -1 : 0;
+}
+
+int blockio_drain(blockio_t *b) {
+  while (b->inflight > 0) blockio_reap(b, 1);
+
+  return b->error ? -1 : 0;
+}
+
+void blockio_close(blockio_t *b) {
+  blockio_drain(b);
+
+#ifdef __NR_io_uring_setup
+  if (b->ring_fd >= 0) {
+    uring_unmap(b);
+    close(b->ring_fd);
+  }
+#endif
+
+  free(b->ops);
+  b->ops = NULL;
+  b->ring_fd = -1;
+}
+
+int blockio_direct(int fd, int on) {
+  int flags = fcntl(fd, F_GETFL);
+
+  if (flags < 0) return -1;
+
+  flags = on ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+
+  return fcntl(fd, F_SETFL, flags);
+}
+
+const char *blockio_name(const blockio_t *b) {
+  return b->backend == BLOCKIO_URING ? "io_uring" : "pwrite";
+}
@@ -0,0 +1,78 @@
+#ifndef BLOCKIO_H
+#define BLOCKIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLOCKIO_PWRITE 0
+#define BLOCKIO_URING 1
+
+#define BLOCKIO_ALIGN 4096
+#define BLOCKIO_MAX_DEPTH 64
+#define BLOCKIO_DEFAULT_DEPTH 8
+
+/* Called when a request finished: len is what was transferred and
+   error an errno value, 0 on success. The buffer is free again. */
+
+typedef void (*blockio_done_t)(void *arg, int buf, size_t len, int error);
+
+typedef struct blockio_op {
+  int write;
+  uint64_t off;
+  size_t len;
+  size_t done;
+  blockio_done_t cb;
+  void *arg;
+} blockio_op_t;
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/* Block I/O on one device with up to depth requests in flight. The
+   caller owns the buffers, every request names one of them by index,
+   and with io_uring they are registered with the kernel along with
+   the file so the per-request setup is skipped. Without io_uring the
+   requests are plain pread/pwrite done on the spot. */
+
+typedef struct blockio {
+  int fd;
+  int backend;
+  int depth;
+  int inflight;
+  int error;
+  int nbufs;
+  unsigned char **bufs;
+  blockio_op_t *ops;
+
+  int ring_fd;
+  int fixed_file;
+  int fixed_bufs;
+  void *sq_ring;
+  size_t sq_ring_len;
+  void *cq_ring;
+  size_t cq_ring_len;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+} blockio_t;
+
+int blockio_open(blockio_t *b, int fd, int depth, unsigned char **bufs,
+                 int nbufs, size_t buf_size);
+int blockio_write(blockio_t *b, int buf, size_t len, uint64_t off,
+                  blockio_done_t cb, void *arg);
+int blockio_read(blockio_t *b, int buf, size_t len, uint64_t off,
+                 blockio_done_t cb, void *arg);
+int blockio_reap(blockio_t *b, int wait);
+int blockio_drain(blockio_t *b);
+void blockio_close(blockio_t *b);
+int blockio_direct(int fd, int on);
+const char *blockio_name(const blockio_t *b);
+
+#endif // BLOCKIO_H
@@ -0,0 +1,399 @@
+#define _XOPEN_SOURCE 500
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../log.h"
+#include "../logring.h"
+#include "../progress.h"
+#include "../trace.h"
+#include "copy.h"
+#include "transfer.h"
+
+/* The copy is done in two passes. The first pass walks the source
+   tree, creates every directory on the destination right away and
+   collects the regular files into a list. The list is sorted by size,
+   largest first, and the second pass hands it to a pool of workers.
+   Even workers take files from the large end, odd workers from the
+   small end, so that the stick is kept busy streaming big files while
+   the per-file open/close latency of the small ones overlaps with it. */
+
+static char *source;
+static char *dest;
+static isofs_t *image;
+
+static copy_file_t *files;
+static size_t files_len;
+static size_t files_cap;
+static int walk_failed;
+
+typedef struct copy_queue {
+  pthread_mutex_t lock;
+  size_t head; /* Next large file */
+  size_t tail; /* One past the next small file */
+  size_t done;
+  uint64_t bytes;
+  uint64_t total;
+  int failed;
+} copy_queue_t;
+
+typedef struct copy_worker {
+  pthread_t thread;
+  int id;
+  copy_queue_t *queue;
+} copy_worker_t;
+
+static int add_file(const char *fpath, const char *dest_path, off_t size,
+                    const isofs_entry_t *entry) {
+  if (files_len == files_cap) {
+    size_t cap = files_cap ? files_cap * 2 : 1024;
+    copy_file_t *tmp = realloc(files, cap * sizeof(copy_file_t));
+
+    if (tmp == NULL) return -1;
+
+    files = tmp;
+    files_cap = cap;
+  }
+
+  files[files_len].src = fpath ? strdup(fpath) : NULL;
+  files[files_len].dest = strdup(dest_path);
+  files[files_len].size = size;
+  files[files_len].entry = entry;
+
+  if ((fpath && files[files_len].src == NULL) || files[files_len].dest == NULL) {
+    free(files[files_len].src);
+    free(files[files_len].dest);
+    return -1;
+  }
+
+  files_len++;
+
+  return 0;
+}
+
+static void free_files(void) {
+  for (size_t i = 0; i < files_len; i++) {
+    free(files[i].src);
+    free(files[i].dest);
+  }
+
+  free(files);
+  files = NULL;
+  files_len = 0;
+  files_cap = 0;
+}
+
+static int walk(const char *fpath, const struct stat *sb, int typeflag,
+                struct FTW *ftwbuf) {
+  /* Trim the source prefix to get a path relative to the mount point */
+
+  const char *rel = fpath + strlen(source);
+
+  while (*rel == '/') rel++;
+
+  char dest_path[strlen(dest) + strlen(rel) + 1];
+
+  snprintf(dest_path, sizeof(dest_path), "%s%s", dest, rel);
+
+  if (typeflag == FTW_D) {
+    if (mkdir(dest_path, 0700) < 0 && errno != EEXIST) {
+      r_printf("Error creating %s: %s\n", dest_path, strerror(errno));
+      walk_failed = 1;
+      return -1;
+    }
+    return 0;
+  }
+
+  if (typeflag != FTW_F) return 0;
+
+  if (add_file(fpath, dest_path, sb->st_size, NULL) < 0) {
+    r_printf("Error: out of memory while listing files\n");
+    walk_failed = 1;
+    return -1;
+  }
+
+  return 0;
+}
+
+static int by_size_desc(const void *a, const void *b) {
+  const copy_file_t *x = a;
+  const copy_file_t *y = b;
+
+  if (x->size == y->size) return 0;
+  return x->size < y->size ? 1 : -1;
+}
+
+/* Files from an image are a list of extents in the image file. The
+   holes that UDF allows are skipped over and filled in by the final
+   ftruncate(). */
+
+static int copy_extents(const copy_file_t *file, transfer_t *t, int outputFd,
+                        int *method) {
+  const isofs_entry_t *e = file->entry;
+
+  for (uint32_t i = 0; i < e->nextents; i++) {
+    const isofs_extent_t *x = &e->extents[i];
+
+    if (x->offset == ISOFS_ZERO) {
+      if (lseek(outputFd, x->length, SEEK_CUR) < 0) return -1;
+      continue;
+    }
+
+    if (transfer_range(t, image->fd, x->offset, outputFd, x->length, method) < 0) {
+      return -1;
+    }
+  }
+
+  return ftruncate(outputFd, e->size);
+}
+
+static int copy_one(const copy_file_t *file, transfer_t *t) {
+  int inputFd, outputFd, openFlags, method;
+  mode_t filePerms;
+  int ret;
+
+  if (file->entry != NULL) {
+    openFlags = O_CREAT | O_WRONLY | O_TRUNC;
+    filePerms = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+
+    if ((outputFd = open(file->dest, openFlags, filePerms)) == -1) {
+      r_printf("Error: %s: %s\n", file->dest, strerror(errno));
+      return -1;
+    }
+
+    method = TRANSFER_READ_WRITE;
+
+    if ((ret = copy_extents(file, t, outputFd, &method)) < 0) {
+      r_printf("Error: %s: %s\n", file->dest, strerror(errno));
+    } else {
+      r_debug(LOG_COPY, "Extracting: %s (%s)\n", file->dest, transfer_name(method));
+    }
+
+    if (close(outputFd) == -1) {
+      r_printf("Error: %s: %s\n", file->dest, strerror(errno));
+      ret = -1;
+    }
+
+    return ret;
+  }
+
+  inputFd = open(file->src, O_RDONLY);
+
+  if (inputFd == -1) {
+    r_printf("Error: %s: %s\n", file->src, strerror(errno));
+    return -1;
+  }
+
+  openFlags = O_CREAT | O_WRONLY;
+  filePerms = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+
+  outputFd = open(file->dest, openFlags, filePerms);
+
+  if (outputFd == -1) {
+    r_printf("Error: %s: %s\n", file->dest, strerror(errno));
+    close(inputFd);
+    return -1;
+  }
+
+  if ((ret = transfer_file(t, inputFd, outputFd, file->size, &method)) < 0) {
+    r_printf("Error: %s: %s\n", file->dest, strerror(errno));
+  } else {
+    r_debug(LOG_COPY, "Extracting: %s (%s)\n", file->dest, transfer_name(method));
+  }
+
+  if (close(outputFd) == -1) {
+    r_printf("Error: %s: %s\n", file->dest, strerror(errno));
+    ret = -1;
+  }
+
+  close(inputFd);
+
+  return ret;
+}
+
+static void *copy_worker(void *arg) {
+  copy_worker_t *self = arg;
+  copy_queue_t *q = self->queue;
+  transfer_t t;
+
+  transfer_init(&t);
+  trace_thread("copy %d", self->id);
+
+  for (;;) {
+    const copy_file_t *file;
+    int ret;
+
+    pthread_mutex_lock(&q->lock);
+
+    if (q->failed || q->head >= q->tail) {
+      pthread_mutex_unlock(&q->lock);
+      break;
+    }
+
+    if (self->id % 2 == 0) {
+      file = &files[q->head++];
+    } else {
+      file = &files[--q->tail];
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    {
+      TRACE_SPAN_ARG("copy", file->dest);
+      ret = copy_one(file, &t);
+    }
+
+    pthread_mutex_lock(&q->lock);
+
+    if (ret < 0) {
+      q->failed = 1;
+    } else {
+      q->done++;
+      q->bytes += file->size;
+    }
+
+    pthread_mutex_unlock(&q->lock);
+  }
+
+  transfer_free(&t);
+
+  return NULL;
+}
+
+static double elapsed(const struct timespec *start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - start->tv_sec) +
+         (now.tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+static int run_workers(int threads, const struct timespec *start) {
+  if (threads < 1) threads = 1;
+  if (threads > COPY_MAX_THREADS) threads = COPY_MAX_THREADS;
+
+  transfer_reset();
+
+  qsort(files, files_len, sizeof(copy_file_t), by_size_desc);
+
+  if ((size_t)threads > files_len) threads = files_len ? files_len : 1;
+
+  r_printf("Copying %zu files using %d threads\n", files_len, threads);
+
+  copy_queue_t queue;
+  copy_worker_t workers[COPY_MAX_THREADS];
+  int started = 0;
+
+  memset(&queue, 0, sizeof(queue));
+  pthread_mutex_init(&queue.lock, NULL);
+  queue.tail = files_len;
+
+  for (size_t i = 0; i < files_len; i++) queue.total += files[i].size;
+
+  /* The transfers count every chunk as it goes, a big file moves the
+     bar as much as its size says rather than one step at the end */
+
+  progress_begin(queue.total);
+
+  for (int i = 0; i < threads; i++) {
+    workers[i].id = i;
+    workers[i].queue = &queue;
+
+    int err = pthread_create(&workers[i].thread, NULL, copy_worker, &workers[i]);
+
+    if (err != 0) {
+      r_printf("Failed to start copy thread %d: %s\n", i, strerror(err));
+      break;
+    }
+
+    started++;
+  }
+
+  /* With no thread running at all, do the work on this one */
+
+  if (started == 0) {
+    workers[0].id = 0;
+    workers[0].queue = &queue;
+    copy_worker(&workers[0]);
+  }
+
+  for (int i = 0; i < started; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+
+  pthread_mutex_destroy(&queue.lock);
+
+  double secs = elapsed(start);
+
+  r_printf("Copied %zu of %zu files, %.1f MiB in %.1f s (%.1f MiB/s)\n",
+           queue.done, files_len, queue.bytes / 1048576.0, secs,
+           secs > 0 ? queue.bytes / 1048576.0 / secs : 0.0);
+
+  free_files();
+
+  return queue.failed ? -1 : 0;
+}
+
+int recursive_copy(char *src, char *dest_, int threads) {
+  source = src;
+  dest = dest_;
+  image = NULL;
+  walk_failed = 0;
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  r_printf("Creating directory tree and listing files...\n");
+
+  if (nftw(source, walk, 16, FTW_PHYS) != 0 || walk_failed) {
+    if (!walk_failed) r_printf("Error walking %s: %s\n", source, strerror(errno));
+    free_files();
+    return -1;
+  }
+
+  return run_workers(threads, &start);
+}
+
+int image_copy(isofs_t *fs, char *dest_, int threads) {
+  image = fs;
+  dest = dest_;
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  r_printf("Creating directory tree and listing files...\n");
+
+  for (size_t i = 0; i < fs->count; i++) {
+    const isofs_entry_t *e = &fs->entries[i];
+    char dest_path[strlen(dest) + strlen(e->path) + 1];
+
+    snprintf(dest_path, sizeof(dest_path), "%s%s", dest, e->path);
+
+    if (S_ISDIR(e->mode)) {
+      if (mkdir(dest_path, 0700) < 0 && errno != EEXIST) {
+        r_printf("Error creating %s: %s\n", dest_path, strerror(errno));
+        free_files();
+        return -1;
+      }
+    } else if (S_ISLNK(e->mode)) {
+      log_write(LOG_COPY, LOG_INFO, "Skipping symlink: %s -> %s\n", e->path, e->link);
+    } else if (add_file(NULL, dest_path, e->size, e) < 0) {
+      r_printf("Error: out of memory while listing files\n");
+      free_files();
+      return -1;
+    }
+  }
+
+  return run_workers(threads, &start);
+}
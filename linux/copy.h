@@ -0,0 +1,22 @@
+#ifndef COPY_H
+#define COPY_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "../isofs.h"
+
+#define COPY_MAX_THREADS 32
+#define COPY_DEFAULT_THREADS 4
+
+typedef struct copy_file {
+  char *src;
+  char *dest;
+  off_t size;
+  const isofs_entry_t *entry; /* Set when copying out of an image */
+} copy_file_t;
+
+int recursive_copy(char *src, char *dest, int threads);
+int image_copy(isofs_t *fs, char *dest, int threads);
+
+#endif // COPY_H
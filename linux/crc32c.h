@@ -0,0 +1,10 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+const char *crc32c_name(void);
+
+#endif // CRC32C_H
@@ -0,0 +1,646 @@
+#define _GNU_SOURCE
+
+#include <bzlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <lzma.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "../log.h"
+#include "../trace.h"
+#include "decomp.h"
+
+/* gzip and bzip2 are decoded in order on the caller's thread, liblzma
+   splits xz blocks across its own threads. zstd frames are independent,
+   so a file with several of them (pzstd, zstd --split) has each frame
+   decoded by a worker into its own buffer and handed out in order. A
+   frame whose size is unknown or too large to buffer is streamed by
+   the caller instead. */
+
+#define ZSTD_MAX_FRAME (64 * 1024 * 1024)
+#define ZSTD_MAX_JOBS 16
+
+static int fill_input(decomp_t *d) {
+  for (;;) {
+    ssize_t n = read(d->fd, d->in, DECOMP_IN_SIZE);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      r_printf("Error reading compressed image: %s\n", strerror(errno));
+      return -1;
+    }
+
+    d->in_len = n;
+    d->in_pos += n;
+    if (n == 0) d->in_eof = 1;
+
+    return 0;
+  }
+}
+
+/* Once a member ended cleanly anything that doesn't start a new one,
+   like the zero padding some tools leave, is ignored */
+
+static int trailing_garbage(decomp_t *d) {
+  if (!d->member_end) return 0;
+
+  r_printf("Ignoring trailing data after the last compressed stream\n");
+  d->done = 1;
+
+  return 1;
+}
+
+static ssize_t gzip_read(decomp_t *d, unsigned char *buf, size_t len) {
+  z_stream *z = d->state;
+
+  z->next_out = buf;
+  z->avail_out = len;
+
+  while (z->avail_out > 0 && !d->done) {
+    if (z->avail_in == 0) {
+      if (d->in_eof || fill_input(d) < 0) {
+        if (d->in_eof && d->member_end) {
+          d->done = 1;
+          break;
+        }
+        if (d->in_eof) r_printf("Error: gzip stream is truncated\n");
+        return -1;
+      }
+      z->next_in = d->in;
+      z->avail_in = d->in_len;
+      continue;
+    }
+
+    int ret = inflate(z, Z_NO_FLUSH);
+
+    if (ret == Z_STREAM_END) {
+      d->member_end = 1;
+      inflateReset(z);
+    } else if (ret == Z_OK) {
+      d->member_end = 0;
+    } else if (ret != Z_BUF_ERROR) {
+      if (trailing_garbage(d)) break;
+      r_printf("Error: gzip stream is corrupt (%s)\n", z->msg ? z->msg : "unknown");
+      return -1;
+    }
+  }
+
+  return len - z->avail_out;
+}
+
+static ssize_t bzip2_read(decomp_t *d, unsigned char *buf, size_t len) {
+  bz_stream *bz = d->state;
+
+  bz->next_out = (char *)buf;
+  bz->avail_out = len;
+
+  while (bz->avail_out > 0 && !d->done) {
+    if (bz->avail_in == 0) {
+      if (d->in_eof || fill_input(d) < 0) {
+        if (d->in_eof && d->member_end) {
+          d->done = 1;
+          break;
+        }
+        if (d->in_eof) r_printf("Error: bzip2 stream is truncated\n");
+        return -1;
+      }
+      bz->next_in = (char *)d->in;
+      bz->avail_in = d->in_len;
+      continue;
+    }
+
+    int ret = BZ2_bzDecompress(bz);
+
+    if (ret == BZ_STREAM_END) {
+
+      /* Streams are concatenated by pbzip2 and friends, the decoder
+         has to be started afresh for each one */
+
+      char *next_in = bz->next_in;
+      unsigned avail_in = bz->avail_in;
+      char *next_out = bz->next_out;
+      unsigned avail_out = bz->avail_out;
+
+      BZ2_bzDecompressEnd(bz);
+      memset(bz, 0, sizeof(*bz));
+
+      if (BZ2_bzDecompressInit(bz, 0, 0) != BZ_OK) {
+        r_printf("Error: cannot restart the bzip2 decoder\n");
+        return -1;
+      }
+
+      bz->next_in = next_in;
+      bz->avail_in = avail_in;
+      bz->next_out = next_out;
+      bz->avail_out = avail_out;
+      d->member_end = 1;
+    } else if (ret == BZ_OK) {
+      d->member_end = 0;
+    } else {
+      if (trailing_garbage(d)) break;
+      r_printf("Error: bzip2 stream is corrupt (%d)\n", ret);
+      return -1;
+    }
+  }
+
+  return len - bz->avail_out;
+}
+
+static ssize_t xz_read(decomp_t *d, unsigned char *buf, size_t len) {
+  lzma_stream *x = d->state;
+
+  x->next_out = buf;
+  x->avail_out = len;
+
+  while (x->avail_out > 0 && !d->done) {
+    if (x->avail_in == 0 && !d->in_eof) {
+      if (fill_input(d) < 0) return -1;
+      x->next_in = d->in;
+      x->avail_in = d->in_len;
+    }
+
+    lzma_ret ret = lzma_code(x, d->in_eof ? LZMA_FINISH : LZMA_RUN);
+
+    if (ret == LZMA_STREAM_END) {
+      d->done = 1;
+    } else if (ret != LZMA_OK) {
+      r_printf("Error: xz stream is %s (%d)\n",
+               ret == LZMA_BUF_ERROR ? "truncated" : "corrupt", ret);
+      return -1;
+    }
+  }
+
+  return len - x->avail_out;
+}
+
+#ifdef HAVE_ZSTD
+
+#define JOB_QUEUED 0
+#define JOB_RUNNING 1
+#define JOB_DONE 2
+#define JOB_STREAM 3
+#define JOB_ERROR 4
+
+typedef struct zstd_job {
+  const unsigned char *src;
+  size_t src_len;
+  size_t src_pos;   /* Only used for streamed frames */
+  unsigned char *out;
+  size_t out_len;
+  size_t out_pos;
+  int state;
+} zstd_job_t;
+
+typedef struct zstd_state {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  const unsigned char *map;
+  size_t map_len;
+  size_t scan;        /* Start of the next frame not yet queued */
+
+  zstd_job_t jobs[ZSTD_MAX_JOBS];
+  int njobs;
+  uint64_t head;      /* Next job handed out */
+  uint64_t next;      /* Next job to be picked by a worker */
+  uint64_t tail;      /* Next free job */
+  int stop;
+
+  pthread_t *workers;
+  int nworkers;
+  ZSTD_DCtx *dctx;    /* Streams oversized frames on the caller's thread */
+} zstd_state_t;
+
+static void *zstd_worker(void *arg) {
+  zstd_state_t *z = arg;
+  ZSTD_DCtx *dctx = ZSTD_createDCtx();
+
+  trace_thread("zstd");
+  pthread_mutex_lock(&z->lock);
+
+  for (;;) {
+    while (z->next == z->tail && !z->stop) pthread_cond_wait(&z->cond, &z->lock);
+
+    if (z->stop) break;
+
+    zstd_job_t *job = &z->jobs[z->next % z->njobs];
+
+    z->next++;
+    job->state = JOB_RUNNING;
+
+    pthread_mutex_unlock(&z->lock);
+
+    unsigned long long size = ZSTD_getFrameContentSize(job->src, job->src_len);
+    int state = JOB_STREAM;
+
+    if (dctx != NULL && size != ZSTD_CONTENTSIZE_UNKNOWN &&
+        size != ZSTD_CONTENTSIZE_ERROR && size <= ZSTD_MAX_FRAME) {
+      job->out = malloc(size > 0 ? size : 1);
+
+      if (job->out != NULL) {
+        TRACE_SPAN("zstd_frame");
+        size_t n = ZSTD_decompressDCtx(dctx, job->out, size, job->src, job->src_len);
+
+        if (ZSTD_isError(n)) {
+          r_printf("Error: zstd frame is corrupt (%s)\n", ZSTD_getErrorName(n));
+          state = JOB_ERROR;
+        } else {
+          job->out_len = n;
+          state = JOB_DONE;
+        }
+      }
+    }
+
+    pthread_mutex_lock(&z->lock);
+    job->state = state;
+    pthread_cond_broadcast(&z->cond);
+  }
+
+  pthread_mutex_unlock(&z->lock);
+
+  ZSTD_freeDCtx(dctx);
+
+  return NULL;
+}
+
+/* Called with the lock held, queues frames until the job ring is full */
+
+static int zstd_queue(decomp_t *d, zstd_state_t *z) {
+  while (z->tail - z->head < (uint64_t)z->njobs && z->scan < z->map_len) {
+    size_t n = ZSTD_findFrameCompressedSize(z->map + z->scan, z->map_len - z->scan);
+
+    if (ZSTD_isError(n)) {
+
+      /* A bad frame ends the queue, the error only counts once
+         everything before it was handed out */
+
+      if (z->tail != z->head) break;
+
+      if (trailing_garbage(d)) return 0;
+
+      r_printf("Error: zstd stream is corrupt (%s)\n", ZSTD_getErrorName(n));
+      return -1;
+    }
+
+    zstd_job_t *job = &z->jobs[z->tail % z->njobs];
+
+    memset(job, 0, sizeof(*job));
+    job->src = z->map + z->scan;
+    job->src_len = n;
+    job->state = JOB_QUEUED;
+
+    z->scan += n;
+    z->tail++;
+    d->member_end = 0;
+  }
+
+  pthread_cond_broadcast(&z->cond);
+
+  return 0;
+}
+
+static ssize_t zstd_read(decomp_t *d, unsigned char *buf, size_t len) {
+  zstd_state_t *z = d->state;
+  size_t done = 0;
+
+  pthread_mutex_lock(&z->lock);
+
+  while (done < len && !d->done) {
+    if (zstd_queue(d, z) < 0) goto fail;
+
+    if (z->head == z->tail) {
+      d->done = 1;
+      break;
+    }
+
+    zstd_job_t *job = &z->jobs[z->head % z->njobs];
+
+    while (job->state == JOB_QUEUED || job->state == JOB_RUNNING)
+      pthread_cond_wait(&z->cond, &z->lock);
+
+    if (job->state == JOB_ERROR) goto fail;
+
+    if (job->state == JOB_DONE) {
+      size_t n = job->out_len - job->out_pos;
+
+      if (n > len - done) n = len - done;
+
+      memcpy(buf + done, job->out + job->out_pos, n);
+      job->out_pos += n;
+      done += n;
+
+      if (job->out_pos < job->out_len) continue;
+
+      free(job->out);
+      job->out = NULL;
+    } else {
+      pthread_mutex_unlock(&z->lock);
+
+      ZSTD_inBuffer in = { job->src, job->src_len, job->src_pos };
+      ZSTD_outBuffer out = { buf + done, len - done, 0 };
+      size_t ret = ZSTD_decompressStream(z->dctx, &out, &in);
+
+      pthread_mutex_lock(&z->lock);
+
+      if (ZSTD_isError(ret)) {
+        r_printf("Error: zstd frame is corrupt (%s)\n", ZSTD_getErrorName(ret));
+        goto fail;
+      }
+
+      job->src_pos = in.pos;
+      done += out.pos;
+
+      if (ret != 0) {
+        if (in.pos == in.size && out.pos < out.size) {
+          r_printf("Error: zstd frame is truncated\n");
+          goto fail;
+        }
+        continue;
+      }
+
+      ZSTD_DCtx_reset(z->dctx, ZSTD_reset_session_only);
+    }
+
+    d->in_pos = job->src + job->src_len - z->map;
+    d->member_end = 1;
+    z->head++;
+  }
+
+  pthread_mutex_unlock(&z->lock);
+
+  return done;
+
+fail:
+  pthread_mutex_unlock(&z->lock);
+
+  return -1;
+}
+
+static int zstd_open(decomp_t *d) {
+  zstd_state_t *z = calloc(1, sizeof(zstd_state_t));
+
+  if (z == NULL) return -1;
+
+  d->state = z;
+
+  pthread_mutex_init(&z->lock, NULL);
+  pthread_cond_init(&z->cond, NULL);
+
+  z->map = mmap(NULL, d->in_size, PROT_READ, MAP_PRIVATE, d->fd, 0);
+
+  if (z->map == MAP_FAILED) {
+    r_printf("Error mapping compressed image: %s\n", strerror(errno));
+    z->map = NULL;
+    return -1;
+  }
+
+  madvise((void *)z->map, d->in_size, MADV_SEQUENTIAL);
+
+  z->map_len = d->in_size;
+  z->njobs = d->threads * 2 > ZSTD_MAX_JOBS ? ZSTD_MAX_JOBS : d->threads * 2;
+  z->dctx = ZSTD_createDCtx();
+  z->workers = calloc(d->threads, sizeof(pthread_t));
+
+  if (z->dctx == NULL || z->workers == NULL) return -1;
+
+  for (int i = 0; i < d->threads; i++) {
+    if (pthread_create(&z->workers[i], NULL, zstd_worker, z) != 0) break;
+    z->nworkers++;
+  }
+
+  if (z->nworkers == 0) {
+    r_printf("Error starting zstd threads\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+static void zstd_close(decomp_t *d) {
+  zstd_state_t *z = d->state;
+
+  if (z->nworkers > 0) {
+    pthread_mutex_lock(&z->lock);
+    z->stop = 1;
+    pthread_cond_broadcast(&z->cond);
+    pthread_mutex_unlock(&z->lock);
+
+    for (int i = 0; i < z->nworkers; i++) pthread_join(z->workers[i], NULL);
+  }
+
+  pthread_mutex_destroy(&z->lock);
+  pthread_cond_destroy(&z->cond);
+
+  for (int i = 0; i < ZSTD_MAX_JOBS; i++) free(z->jobs[i].out);
+
+  if (z->map != NULL) munmap((void *)z->map, z->map_len);
+
+  ZSTD_freeDCtx(z->dctx);
+  free(z->workers);
+}
+
+#endif
+
+int decomp_detect(const char *path) {
+  unsigned char m[6] = { 0 };
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0) return DECOMP_NONE;
+
+  ssize_t n = pread(fd, m, sizeof(m), 0);
+
+  close(fd);
+
+  if (n >= 2 && m[0] == 0x1f && m[1] == 0x8b) return DECOMP_GZIP;
+  if (n >= 6 && memcmp(m, "\xfd" "7zXZ\0", 6) == 0) return DECOMP_XZ;
+  if (n >= 4 && memcmp(m, "\x28\xb5\x2f\xfd", 4) == 0) return DECOMP_ZSTD;
+  if (n >= 3 && memcmp(m, "BZh", 3) == 0) return DECOMP_BZIP2;
+
+  return DECOMP_NONE;
+}
+
+int decomp_open(decomp_t *d, const char *path, int threads) {
+  struct stat st;
+
+  memset(d, 0, sizeof(*d));
+
+  d->type = decomp_detect(path);
+
+  if (threads < 1) threads = 1;
+  if (threads > DECOMP_MAX_THREADS) threads = DECOMP_MAX_THREADS;
+
+  d->threads = threads;
+
+  if ((d->fd = open(path, O_RDONLY)) < 0) {
+    r_printf("Error opening %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  if (fstat(d->fd, &st) < 0) {
+    r_printf("Error: %s: %s\n", path, strerror(errno));
+    close(d->fd);
+    return -1;
+  }
+
+  d->in_size = st.st_size;
+
+  posix_fadvise(d->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  if (d->type != DECOMP_ZSTD && (d->in = malloc(DECOMP_IN_SIZE)) == NULL) {
+    r_printf("Error: out of memory for the decompressor\n");
+    close(d->fd);
+    return -1;
+  }
+
+  int ok = 0;
+
+  switch (d->type) {
+  case DECOMP_GZIP: {
+    z_stream *z = calloc(1, sizeof(z_stream));
+
+    d->state = z;
+
+    /* 15 + 32 picks up the gzip header by itself */
+
+    ok = z != NULL && inflateInit2(z, 15 + 32) == Z_OK;
+    d->threads = 1;
+    break;
+  }
+  case DECOMP_BZIP2: {
+    bz_stream *bz = calloc(1, sizeof(bz_stream));
+
+    d->state = bz;
+    ok = bz != NULL && BZ2_bzDecompressInit(bz, 0, 0) == BZ_OK;
+    d->threads = 1;
+    break;
+  }
+  case DECOMP_XZ: {
+    lzma_stream *x = calloc(1, sizeof(lzma_stream));
+
+    d->state = x;
+
+    if (x == NULL) break;
+
+    *x = (lzma_stream)LZMA_STREAM_INIT;
+
+    /* Files written without -T have one block and decode on a single
+       thread whatever is asked for */
+
+    lzma_mt mt;
+
+    memset(&mt, 0, sizeof(mt));
+    mt.threads = threads;
+    mt.flags = LZMA_CONCATENATED;
+    mt.memlimit_threading = lzma_physmem() / 4;
+    mt.memlimit_stop = UINT64_MAX;
+
+    if (threads > 1 && lzma_stream_decoder_mt(x, &mt) == LZMA_OK) {
+      ok = 1;
+    } else {
+      d->threads = 1;
+      ok = lzma_stream_decoder(x, UINT64_MAX, LZMA_CONCATENATED) == LZMA_OK;
+    }
+    break;
+  }
+  case DECOMP_ZSTD:
+#ifdef HAVE_ZSTD
+    ok = zstd_open(d) == 0;
+#else
+    r_printf("Error: this build has no zstd support\n");
+#endif
+    break;
+  default:
+    r_printf("Error: %s is not a compressed image\n", path);
+    break;
+  }
+
+  if (!ok) {
+    r_printf("Error setting up the %s decoder\n", decomp_name(d->type));
+    decomp_close(d);
+    return -1;
+  }
+
+  r_printf("Decompressing %s image on %d thread%s\n", decomp_name(d->type),
+           d->threads, d->threads > 1 ? "s" : "");
+
+  return 0;
+}
+
+/* Fills buf completely unless the end of the data is reached */
+
+ssize_t decomp_read(decomp_t *d, unsigned char *buf, size_t len) {
+  if (d->done) return 0;
+
+  switch (d->type) {
+  case DECOMP_GZIP:
+    return gzip_read(d, buf, len);
+  case DECOMP_BZIP2:
+    return bzip2_read(d, buf, len);
+  case DECOMP_XZ:
+    return xz_read(d, buf, len);
+#ifdef HAVE_ZSTD
+  case DECOMP_ZSTD:
+    return zstd_read(d, buf, len);
+#endif
+  }
+
+  return -1;
+}
+
+void decomp_close(decomp_t *d) {
+  if (d->state != NULL) {
+    switch (d->type) {
+    case DECOMP_GZIP:
+      inflateEnd(d->state);
+      break;
+    case DECOMP_BZIP2:
+      BZ2_bzDecompressEnd(d->state);
+      break;
+    case DECOMP_XZ:
+      lzma_end(d->state);
+      break;
+#ifdef HAVE_ZSTD
+    case DECOMP_ZSTD:
+      zstd_close(d);
+      break;
+#endif
+    }
+  }
+
+  free(d->state);
+  free(d->in);
+
+  if (d->fd >= 0) close(d->fd);
+
+  d->state = NULL;
+  d->in = NULL;
+  d->fd = -1;
+}
+
+const char *decomp_name(int type) {
+  switch (type) {
+  case DECOMP_GZIP:
+    return "gzip";
+  case DECOMP_XZ:
+    return "xz";
+  case DECOMP_ZSTD:
+    return "zstd";
+  case DECOMP_BZIP2:
+    return "bzip2";
+  }
+
+  return "raw";
+}
@@ -0,0 +1,42 @@
+#ifndef DECOMP_H
+#define DECOMP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define DECOMP_NONE 0
+#define DECOMP_GZIP 1
+#define DECOMP_XZ 2
+#define DECOMP_ZSTD 3
+#define DECOMP_BZIP2 4
+
+#define DECOMP_IN_SIZE (1024 * 1024)
+#define DECOMP_MAX_THREADS 32
+
+/* Decompressing reader for raw images, picked by the magic bytes.
+   xz and multi-frame zstd files are decoded on several threads, gzip
+   and bzip2 streams can only be decoded in order. Concatenated
+   streams are read through to the end. */
+
+typedef struct decomp {
+  int type;
+  int fd;
+  int threads;
+  uint64_t in_size;
+  uint64_t in_pos;   /* Compressed bytes consumed, for progress */
+  unsigned char *in;
+  size_t in_len;
+  int in_eof;
+  int member_end;    /* The last gzip/bzip2 member finished cleanly */
+  int done;
+  void *state;
+} decomp_t;
+
+int decomp_detect(const char *path);
+int decomp_open(decomp_t *d, const char *path, int threads);
+ssize_t decomp_read(decomp_t *d, unsigned char *buf, size_t len);
+void decomp_close(decomp_t *d);
+const char *decomp_name(int type);
+
+#endif // DECOMP_H
@@ -8,6 +8,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <limits.h>
 
 #include "devices.h"
 
@@ -16,156 +17,197 @@
 #define SYSFS_BLOCK_MODEL "/sys/block/%s/device/model"
 #define SYSFS_BLOCK_VENDOR "/sys/block/%s/device/vendor"
 #define SYSFS_BLOCK_SIZE "/sys/block/%s/size"
+#define SYSFS_BLOCK_DEVICE "/sys/block/%s/device"
 
 #define REMOVABLE '1'
 #define SCSI_DEVICE '8'
 #define MAX_DEVICES 32
+#define SERIAL_DEPTH 6
 
-int scan_devices(Device *dev, int array_size, uint8_t *discovered) {
+/* The serial number belongs to the USB device a few levels above the
+   SCSI disk, the first parent with an idVendor is that device */
+
+static void read_serial(const char *name, Device *dev) {
+
+    char path[PATH_MAX];
+    char file[PATH_MAX + 16];
+
+    snprintf(file, sizeof(file), SYSFS_BLOCK_DEVICE, name);
+    if (realpath(file, path) == NULL) return;
+
+    for (int i = 0; i < SERIAL_DEPTH; i++) {
+        char *slash = strrchr(path, '/');
+
+        snprintf(file, sizeof(file), "%s/idVendor", path);
+
+        if (access(file, R_OK) == 0) {
+            snprintf(file, sizeof(file), "%s/serial", path);
+
+            if (access(file, R_OK) == 0 && buffread(dev->serial, sizeof(dev->serial) - 1, file) == 0) {
+                trimwhitespace(dev->serial);
+            }
+
+            return;
+        }
+
+        if (slash == NULL || slash == path) return;
+        *slash = 0;
+    }
+}
+
+/* Fills in dev for /sys/block/name. Returns 1 for a removable SCSI
+   (USB) disk, 0 for anything else and -1 when sysfs can't be read. */
+
+int probe_device(const char *name, Device *dev) {
 
-    DIR *dp;
-    struct dirent *ep;
     char major[10];
     char minor[10];
     int i, j, len;
     char devfile[150];
-    int index = 0;
 
-    dp = opendir("/sys/block/");
+    /* Wipe the buffer, construct the path to SYSFS_BLOCK_DEVFILE
+       and read the SYSFS_BLOCK_DEVFILE into the buffer */
 
-  if (dp != NULL) {
+    memset(devfile, 0, sizeof(devfile));
+    if ((snprintf(devfile, sizeof(devfile), SYSFS_BLOCK_DEVFILE, name)) < 0) return -1;
+    if (buffread(devfile, sizeof(devfile), devfile) < 0) return -1;
 
-    while ((ep = readdir(dp))) {
+    /* Check if the SYSFS_BLOCK_DEVFILE's
+       major in the buffer indicates that it is
+       an SCSI (USB) device */
 
-        if (ep->d_name[0] == '.') continue;
+    if (*devfile != SCSI_DEVICE) return 0;
 
-        /* Wipe the buffer becuase of the loop,
-           construct the path to SYSFS_BLOCK_DEVFILE
-           and read the SYSFS_BLOCK_DEVFILE
-           into the buffer */
+    /* Wipe the buffer clean, format the
+       path to SYSFS_BLOCK_REMOVABLE and
+       read SYSFS_BLOCK_REMOVABLE into the
+       buffer */
 
-        memset(devfile, 0, sizeof(devfile));
-        if ((snprintf(devfile, sizeof(devfile), SYSFS_BLOCK_DEVFILE, ep->d_name)) < 0) return -1;
-        if (buffread(devfile, sizeof(devfile), devfile) < 0) return -1;
+    memset(devfile, 0, sizeof(devfile));
+    if ((snprintf(devfile, sizeof(devfile), SYSFS_BLOCK_REMOVABLE , name)) < 0) return -1;
+    if (buffread(devfile, sizeof(devfile), devfile) < 0) return -1;
 
-        /* Check if the SYSFS_BLOCK_DEVFILE's
-           major in the buffer indicates that it is
-           an SCSI (USB) device */
+    /* Check if SYSFS_BLOCK_REMOVABLE in
+       the buffer indidcates that the SCSI
+       device is removable */
 
-        if (*devfile == SCSI_DEVICE) {
+    if (*devfile != REMOVABLE) return 0;
 
-            /* Wipe the buffer clean, format the
-               path to SYSFS_BLOCK_REMOVABLE and
-               read SYSFS_BLOCK_REMOVABLE into the
-               buffer */
+    if (strlen(name) >= sizeof(dev->device)) return 0;
 
-            memset(devfile, 0, sizeof(devfile));
-            if ((snprintf(devfile, sizeof(devfile), SYSFS_BLOCK_REMOVABLE , ep->d_name)) < 0) return -1;
-            if (buffread(devfile, sizeof(devfile), devfile) < 0) return -1;
+    memset(dev, 0, sizeof(Device));
+    strcpy(dev->device, name);
 
-            /* Check if SYSFS_BLOCK_REMOVABLE in
-               the buffer indidcates that the SCSI
-               device is removable */
+    /* Wipe the buffer clean, and format
+       the path to SYSFS_BLOCK_VENDOR, then
+       read from SYSFS_BLOCK_VENDOR and write
+       into the Device struct vendor name, then
+       trim all trailing and leading whitespaces
+       including the newline character */
 
-            if (*devfile == REMOVABLE) {
+    memset(devfile, 0, sizeof(devfile));
+    if ((snprintf(devfile, sizeof(devfile), SYSFS_BLOCK_VENDOR , name)) < 0) return -1;
+    if (buffread(dev->vendor, sizeof(dev->vendor), devfile) < 0) return -1;
+    trimwhitespace(dev->vendor);
 
-                /* Copy the current device sysfs
-                   name into the indexth
-                   Device struct */
+    /* Same for SYSFS_BLOCK_MODEL into the model name */
 
-                if (strcpy((*(dev + index)).device, ep->d_name) == NULL) continue;
+    memset(devfile, 0, sizeof(devfile));
+    if ((snprintf(devfile, sizeof(devfile), SYSFS_BLOCK_MODEL , name)) < 0) return -1;
+    if (buffread(dev->model, sizeof(dev->model), devfile) < 0) return -1;
+    trimwhitespace(dev->model);
 
-                /* Wipe the buffer clean, and format
-                   the path to SYSFS_BLOCK_VENDOR, then
-                   read from SYSFS_BLOCK_VENDOR and write
-                   into indexth Device struct vendor name, then
-                   trim all trailing and leading whitespaces
-                   including the newline character */
+    read_serial(name, dev);
 
-                memset(devfile, 0, sizeof(devfile));
-                if ((snprintf(devfile, sizeof(devfile), SYSFS_BLOCK_VENDOR , ep->d_name)) < 0) return -1;
-                if (buffread((*(dev + index)).vendor, sizeof((*(dev + index)).vendor), devfile) < 0) return -1;
-                trimwhitespace((*(dev + index)).vendor);
+    /* Wipe the buffer clean, and format
+       the path to SYSFS_BLOCK_SIZE, then
+       read from SYSFS_BLOCK_SIZE and write into
+       the buffer, then convert the buffer string
+       it to an unsigned 64-bit integer ignoring
+       all garbage that strtol may produce, and
+       assign it to the Device struct capacity
+       property */
 
-                /* Wipe the buffer clean, and format
-                   the path to SYSFS_BLOCK_MODEL, then
-                   read from SYSFS_BLOCK_MODEL and write
-                   into indexth Device struct model name, then
-                   trim all trailing and leading whitespaces
-                   including the newline character */
+    memset(devfile, 0, sizeof(devfile));
+    if ((snprintf(devfile, sizeof(devfile), SYSFS_BLOCK_SIZE , name)) < 0) return -1;
+    if (buffread(devfile, sizeof(devfile), devfile) < 0) return -1;
+    dev->capacity = strtol(devfile, NULL, 10);
 
-                memset(devfile, 0, sizeof(devfile));
-                if ((snprintf(devfile, sizeof(devfile), SYSFS_BLOCK_MODEL , ep->d_name)) < 0) return -1;
-                if (buffread((*(dev + index)).model, sizeof((*(dev + index)).model), devfile) < 0) return -1;
-                trimwhitespace((*(dev + index)).model);
+    /* Read devfile again to populate struct */
 
-                /* Wipe the buffer clean, and format
-                   the path to SYSFS_BLOCK_SIZE, then
-                   read from SYSFS_BLOCK_SIZE and write into
-                   the buffer, then convert the buffer string
-                   it to an unsigned 64-bit integer ignoring
-                   all garbage that strtol may produce, and
-                   assign it to the Device struct capacity
-                   property */
+    memset(devfile, 0, sizeof(devfile));
+    if ((snprintf(devfile, sizeof(devfile), SYSFS_BLOCK_DEVFILE , name)) < 0) return -1;
+    if (buffread(devfile, sizeof(devfile), devfile) < 0) return -1;
 
-                memset(devfile, 0, sizeof(devfile));
-                if ((snprintf(devfile, sizeof(devfile), SYSFS_BLOCK_SIZE , ep->d_name)) < 0) return -1;
-                if (buffread(devfile, sizeof(devfile), devfile) < 0) return -1;
-                (*(dev + index)).capacity = strtol(devfile, NULL, 10);
+    /* Wipe buffer */
 
+    memset(minor, 0, sizeof(minor));
+    memset(major, 0, sizeof(major));
 
-                /* Read devfile again to populate struct */
+    len = strlen(devfile);
 
-                memset(devfile, 0, sizeof(devfile));
-                if ((snprintf(devfile, sizeof(devfile), SYSFS_BLOCK_DEVFILE , ep->d_name)) < 0) return -1;
-                if (buffread(devfile, sizeof(devfile), devfile) < 0) return -1;
+    /* Write digits up to ":" to buffer */
 
-                /* Wipe buffer */
+    for (i = 0; i < len && i < (int) sizeof(major) - 1; i++) {
+        if (devfile[i] == ':') break;
+        major[i] = devfile[i];
+    }
 
-                memset(minor, 0, sizeof(minor));
-                memset(major, 0, sizeof(major));
+    /* Skip ":" char */
 
-                len = strlen(devfile);
+    i++;
 
-                /* Write digits up to ":" to buffer */
+    /* Read after ":" into buffer */
 
-                for (i = 0; i < len; i++) {
-                    if (devfile[i] == ':') break;
-                    major[i] = devfile[i];
-                }
+    for (j = 0; i < len && j < (int) sizeof(minor) - 1; i++) {
+        if (devfile[i] == '\n') break;
+        minor[j] = devfile[i];
+        j++;
+    }
 
-                /* Skip ":" char */
+    /* Cover buffer to long and cast long to short */
 
-                i++;
+    dev->minor = (uint8_t) strtol(minor, NULL, 10);
+    dev->major = (uint8_t) strtol(major, NULL, 10);
 
-                /* Read after ":" into buffer */
+    return 1;
+}
 
-                for (j = 0;i < len; i++) {
-                    if (devfile[i] == '\n') break;
-                    minor[j] = devfile[i];
-                    j++;
-                }
+int scan_devices(Device *dev, int array_size, uint8_t *discovered) {
 
-                /* Cover buffer to long and cast long to short */
+    DIR *dp;
+    struct dirent *ep;
+    int index = 0;
 
-                (*(dev + index)).minor = (uint8_t) strtol(minor, NULL, 10);
-                (*(dev + index)).major = (uint8_t) strtol(major, NULL, 10);
+    dp = opendir("/sys/block/");
 
-                /* Increment number of discovered
-                   devices and the index of the current
-                   Device struct in the array */
+  if (dp != NULL) {
 
-                (*discovered)++;
-                index++;
+    while ((ep = readdir(dp))) {
 
-                /* If there is more device in /sys/block than
-                   there is Device struct members, break the loop
-                   ignoring the other members */
+        if (ep->d_name[0] == '.') continue;
 
-                if (index >= array_size) break;
+        int ret = probe_device(ep->d_name, dev + index);
 
+        if (ret < 0) {
+            closedir(dp);
+            return -1;
         }
-      }
+
+        if (ret == 0) continue;
+
+        /* Increment number of discovered
+           devices and the index of the current
+           Device struct in the array */
+
+        (*discovered)++;
+        index++;
+
+        /* If there is more device in /sys/block than
+           there is Device struct members, break the loop
+           ignoring the other members */
+
+        if (index >= array_size) break;
     }
 
     closedir(dp);
@@ -201,6 +243,7 @@ int buffread(char *buf, int sizeofbuf, char *path) {
 
     if (read(file_fd, buf, sizeofbuf) < 0) {
         perror("buffread");
+        close(file_fd);
         return -1;
     }
 
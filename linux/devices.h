@@ -7,11 +7,13 @@ typedef struct DEVICE {
   char device[4];
   char model[255];
   char vendor[255];
+  char serial[64];      /* Of the USB device, empty when it has none */
   uint64_t capacity;
   uint8_t minor;
   uint8_t major;
 } Device;
 
+int probe_device(const char *name, struct DEVICE *dev);
 int scan_devices(struct DEVICE *dev, int array_size, uint8_t *discovered);
 void trimwhitespace(char *str);
 int buffread(char *buf, int sizeofbuf, char *path);
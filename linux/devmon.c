@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../log.h"
+#include "devmon.h"
+
+#define UEVENT_BUFFER 8192
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static Device table[DEVMON_MAX_DEVICES];
+static int count;
+
+static pthread_t thread;
+static int running;
+static int wake_fd = -1;
+static int sock = -1;
+static devmon_callback_t callback;
+static void *callback_arg;
+
+static int find(const char *name) {
+  for (int i = 0; i < count; i++) {
+    if (strcmp(table[i].device, name) == 0) return i;
+  }
+
+  return -1;
+}
+
+static int same(const Device *a, const Device *b) {
+  return a->capacity == b->capacity && a->major == b->major && a->minor == b->minor &&
+         strcmp(a->vendor, b->vendor) == 0 && strcmp(a->model, b->model) == 0 &&
+         strcmp(a->serial, b->serial) == 0;
+}
+
+/* Brings one entry in line with what sysfs says about it now */
+
+static void update(const char *name) {
+  Device dev;
+  int event = -1;
+  int ret = probe_device(name, &dev);
+
+  pthread_mutex_lock(&lock);
+
+  int i = find(name);
+
+  if (ret <= 0 && i >= 0) {
+    dev = table[i];
+    table[i] = table[--count];
+    event = DEVMON_REMOVE;
+  } else if (ret > 0 && i < 0 && count < DEVMON_MAX_DEVICES) {
+    table[count++] = dev;
+    event = DEVMON_ADD;
+  } else if (ret > 0 && i >= 0 && !same(&table[i], &dev)) {
+    table[i] = dev;
+    event = DEVMON_CHANGE;
+  }
+
+  pthread_mutex_unlock(&lock);
+
+  if (event >= 0 && callback) callback(callback_arg, event, &dev);
+}
+
+/* The full walk, for the start and for anything uevents didn't tell */
+
+static void rescan(void) {
+  char seen[DEVMON_MAX_DEVICES][sizeof(table[0].device)];
+  int nseen = 0;
+  DIR *dp = opendir("/sys/block/");
+  struct dirent *ep;
+
+  if (dp == NULL) return;
+
+  while ((ep = readdir(dp))) {
+    if (ep->d_name[0] == '.') continue;
+
+    update(ep->d_name);
+
+    pthread_mutex_lock(&lock);
+
+    if (find(ep->d_name) >= 0 && nseen < DEVMON_MAX_DEVICES) {
+      strcpy(seen[nseen++], ep->d_name);
+    }
+
+    pthread_mutex_unlock(&lock);
+  }
+
+  closedir(dp);
+
+  /* Whatever is in the table and no longer in sysfs has gone */
+
+  for (;;) {
+    char gone[sizeof(table[0].device)] = "";
+
+    pthread_mutex_lock(&lock);
+
+    for (int i = 0; i < count && gone[0] == 0; i++) {
+      int found = 0;
+
+      for (int j = 0; j < nseen && !found; j++) found = strcmp(seen[j], table[i].device) == 0;
+
+      if (!found) strcpy(gone, table[i].device);
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    if (gone[0] == 0) break;
+
+    update(gone);
+  }
+}
+
+/* A kernel uevent is "action@devpath" followed by KEY=value strings,
+   only whole disks matter here, partitions come and go with them */
+
+static void uevent(const char *buf, size_t len) {
+  const char *action = NULL;
+  const char *subsystem = NULL;
+  const char *devtype = NULL;
+  const char *devname = NULL;
+
+  for (size_t pos = strlen(buf) + 1; pos < len; pos += strlen(buf + pos) + 1) {
+    const char *kv = buf + pos;
+
+    if (strncmp(kv, "ACTION=", 7) == 0) action = kv + 7;
+    else if (strncmp(kv, "SUBSYSTEM=", 10) == 0) subsystem = kv + 10;
+    else if (strncmp(kv, "DEVTYPE=", 8) == 0) devtype = kv + 8;
+    else if (strncmp(kv, "DEVNAME=", 8) == 0) devname = kv + 8;
+  }
+
+  if (action == NULL || devname == NULL || subsystem == NULL || devtype == NULL) return;
+
+  if (strcmp(subsystem, "block") != 0 || strcmp(devtype, "disk") != 0) return;
+
+  if (strncmp(devname, "/dev/", 5) == 0) devname += 5;
+
+  r_printf("Device %s: %s\n", devname, action);
+
+  update(devname);
+}
+
+static int open_netlink(void) {
+  struct sockaddr_nl addr;
+  int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+
+  if (fd < 0) return -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = 1; /* Kernel events, not the ones udev passes on */
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static void *monitor(void *arg) {
+  char buf[UEVENT_BUFFER + 1];
+
+  rescan();
+
+  while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+    struct pollfd fds[2] = { { wake_fd, POLLIN, 0 }, { sock, POLLIN, 0 } };
+    int n = poll(fds, sock >= 0 ? 2 : 1, DEVMON_RESCAN_INTERVAL);
+
+    if (n < 0 && errno != EINTR) break;
+
+    if (n == 0) {
+      rescan();
+      continue;
+    }
+
+    if (fds[0].revents) break;
+
+    if (sock >= 0 && (fds[1].revents & POLLIN)) {
+      ssize_t len;
+
+      while ((len = recv(sock, buf, UEVENT_BUFFER, 0)) > 0) {
+        buf[len] = 0;
+        uevent(buf, len);
+      }
+
+      /* The socket buffer overflowed, events were lost */
+
+      if (len < 0 && errno == ENOBUFS) rescan();
+    }
+  }
+
+  return NULL;
+}
+
+int devmon_start(devmon_callback_t cb, void *arg) {
+  if (running) return 0;
+
+  callback = cb;
+  callback_arg = arg;
+
+  if ((wake_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+    r_printf("Device monitor: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if ((sock = open_netlink()) < 0) {
+    r_printf("No device events (%s), checking every %d s instead\n", strerror(errno),
+             DEVMON_RESCAN_INTERVAL / 1000);
+  }
+
+  running = 1;
+
+  int err = pthread_create(&thread, NULL, monitor, NULL);
+
+  if (err != 0) {
+    r_printf("Device monitor: %s\n", strerror(err));
+    running = 0;
+    close(wake_fd);
+    if (sock >= 0) close(sock);
+    wake_fd = sock = -1;
+    return -1;
+  }
+
+  return 0;
+}
+
+void devmon_stop(void) {
+  uint64_t one = 1;
+
+  if (!running) return;
+
+  __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+
+  if (write(wake_fd, &one, sizeof(one)) < 0) r_printf("Device monitor: %s\n", strerror(errno));
+
+  pthread_join(thread, NULL);
+
+  close(wake_fd);
+  if (sock >= 0) close(sock);
+  wake_fd = sock = -1;
+}
+
+int devmon_devices(Device *out, int max) {
+  pthread_mutex_lock(&lock);
+
+  int n = count < max ? count : max;
+
+  memcpy(out, table, n * sizeof(Device));
+
+  pthread_mutex_unlock(&lock);
+
+  return n;
+}
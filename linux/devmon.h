@@ -0,0 +1,34 @@
+#ifndef DEVMON_H
+#define DEVMON_H
+
+#include "devices.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DEVMON_MAX_DEVICES 32
+#define DEVMON_RESCAN_INTERVAL 5000 /* ms, sysfs is walked when no uevent came */
+
+#define DEVMON_ADD 0
+#define DEVMON_REMOVE 1
+#define DEVMON_CHANGE 2
+
+/* Keeps the table of removable devices up to date from a thread of its
+   own. Kernel uevents for block disks update the one device they are
+   about, and sysfs is walked in full now and then in case one was
+   missed or netlink can't be used. The callback runs on the monitor
+   thread for every difference, devmon_devices() copies the table as it
+   is without touching sysfs. */
+
+typedef void (*devmon_callback_t)(void *arg, int event, const Device *dev);
+
+int devmon_start(devmon_callback_t callback, void *arg);
+void devmon_stop(void);
+int devmon_devices(Device *out, int max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DEVMON_H
@@ -0,0 +1,287 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../log.h"
+#include "../logring.h"
+#include "../scancache.h"
+#include "blockio.h"
+#include "devprobe.h"
+
+static const size_t sizes[] = {
+  128 * 1024, 512 * 1024, 1024 * 1024, 2 * 1024 * 1024, 4 * 1024 * 1024, 8 * 1024 * 1024
+};
+
+static const int depths[] = { 1, 2, 4, 8, 16, 32 };
+
+#define FIRST_DEPTH 4 /* Used while the sizes are compared */
+
+typedef struct probe_state {
+  int free[BLOCKIO_MAX_DEPTH];
+  int nfree;
+  uint64_t bytes;
+} probe_state_t;
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void probe_done(void *arg, int buf, size_t len, int error) {
+  probe_state_t *s = arg;
+
+  s->free[s->nfree++] = buf;
+  s->bytes += len;
+}
+
+/* MB/s for one request size and depth, the requests go round the
+   scratch region until it was covered once or the time is up. The
+   buffers are slices of the region buffer. */
+
+static double measure(int fd, unsigned char *region, size_t chunk, int depth, int write,
+                      int direct) {
+  unsigned char *bufs[BLOCKIO_MAX_DEPTH];
+  int nbufs = depth;
+  probe_state_t s;
+  blockio_t b;
+
+  if ((size_t)nbufs * chunk > DEVPROBE_SPAN) nbufs = DEVPROBE_SPAN / chunk;
+
+  memset(&s, 0, sizeof(s));
+
+  for (int i = 0; i < nbufs; i++) {
+    bufs[i] = region + i * chunk;
+    s.free[s.nfree++] = i;
+  }
+
+  if (blockio_open(&b, fd, nbufs, bufs, nbufs, chunk) < 0) return -1;
+
+  double start = now();
+  double end = start + DEVPROBE_RUN_MS / 1000.0;
+  int ret = 0;
+
+  for (uint64_t off = 0; ret == 0 && off < DEVPROBE_SPAN && now() < end; off += chunk) {
+    while (s.nfree == 0 && ret == 0) ret = blockio_reap(&b, 1);
+
+    if (ret < 0) break;
+
+    if (write) {
+      ret = blockio_write(&b, s.free[--s.nfree], chunk, off, probe_done, &s);
+    } else {
+      ret = blockio_read(&b, s.free[--s.nfree], chunk, off, probe_done, &s);
+    }
+  }
+
+  if (blockio_drain(&b) < 0) ret = -1;
+
+  blockio_close(&b);
+
+  /* Without O_DIRECT the writes are only done once they are synced */
+
+  if (ret == 0 && write && !direct && fdatasync(fd) < 0) ret = -1;
+
+  double secs = now() - start;
+
+  if (ret < 0 || s.bytes == 0 || secs <= 0) return -1;
+
+  return s.bytes / secs / 1e6;
+}
+
+int devprobe_run(int fd, devprobe_t *p) {
+  uint64_t size;
+  struct stat st;
+  unsigned char *region;
+  double best = 0;
+
+  if (ioctl(fd, BLKGETSIZE64, &size) < 0) {
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) return -1;
+
+    size = st.st_size;
+  }
+
+  if (size < DEVPROBE_SPAN) return -1;
+
+  if (posix_memalign((void **)&region, BLOCKIO_ALIGN, DEVPROBE_SPAN) != 0) {
+    r_printf("Error: out of memory for the device probe\n");
+    return -1;
+  }
+
+  /* Not zeros, some controllers treat those specially */
+
+  uint64_t x = 0x9E3779B97F4A7C15ull;
+
+  for (size_t i = 0; i < DEVPROBE_SPAN; i += sizeof(x)) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    memcpy(region + i, &x, sizeof(x));
+  }
+
+  int direct = blockio_direct(fd, 1) == 0;
+
+  memset(p, 0, sizeof(devprobe_t));
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    double mbps = measure(fd, region, sizes[i], FIRST_DEPTH, 1, direct);
+
+    r_debug(LOG_MAIN, "Probe: %zu KiB x %d: %.1f MB/s\n", sizes[i] / 1024, FIRST_DEPTH, mbps);
+
+    if (mbps > best * DEVPROBE_BETTER) {
+      best = mbps;
+      p->chunk = sizes[i];
+      p->depth = FIRST_DEPTH;
+    }
+  }
+
+  for (size_t i = 0; best > 0 && i < sizeof(depths) / sizeof(depths[0]); i++) {
+    if (depths[i] == FIRST_DEPTH || (size_t)depths[i] * p->chunk > DEVPROBE_SPAN) continue;
+
+    double mbps = measure(fd, region, p->chunk, depths[i], 1, direct);
+
+    r_debug(LOG_MAIN, "Probe: %zu KiB x %d: %.1f MB/s\n", p->chunk / 1024, depths[i], mbps);
+
+    /* A lower depth wins unless the higher one was really faster */
+
+    if (depths[i] < p->depth ? mbps * DEVPROBE_BETTER >= best : mbps > best * DEVPROBE_BETTER) {
+      best = mbps;
+      p->depth = depths[i];
+    }
+  }
+
+  if (best > 0) p->read_mbps = measure(fd, region, p->chunk, p->depth, 0, direct);
+
+  if (direct) blockio_direct(fd, 0);
+
+  free(region);
+
+  if (best <= 0) {
+    r_printf("Device probe failed\n");
+    return -1;
+  }
+
+  p->write_mbps = best;
+
+  r_printf("Device writes %.1f MB/s with %zu KiB requests %d deep, reads %.1f MB/s\n",
+           p->write_mbps, p->chunk / 1024, p->depth, p->read_mbps);
+
+  return 0;
+}
+
+/* SD cards say what their erase block is, some USB bridges pass on an
+   optimal I/O size, most sticks say nothing useful at all */
+
+uint32_t devprobe_erase_size(const Device *dev) {
+  static const char *files[] = { "device/preferred_erase_size", "queue/optimal_io_size" };
+  char path[PATH_MAX];
+  char buf[32];
+
+  for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+    snprintf(path, sizeof(path), "/sys/block/%s/%s", dev->device, files[i]);
+
+    if (access(path, R_OK) < 0 || buffread(buf, sizeof(buf) - 1, path) < 0) continue;
+
+    unsigned long size = strtoul(buf, NULL, 10);
+
+    if (size >= DEVPROBE_MIN_ERASE && size <= DEVPROBE_MAX_ERASE && size % BLOCKIO_ALIGN == 0) {
+      return size;
+    }
+  }
+
+  return 0;
+}
+
+/* Profiles are lines of vendor, model, serial, request size, depth and
+   the two rates, separated by tabs, which sysfs strings don't have */
+
+static int profile_path(char *out, size_t len, int create) {
+  char dir[PATH_MAX];
+
+  if (scancache_dir(dir, sizeof(dir), create) < 0) return -1;
+
+  return snprintf(out, len, "%s/" DEVPROBE_FILE, dir) < (int)len ? 0 : -1;
+}
+
+static int matches(const char *line, const Device *dev) {
+  char key[sizeof(dev->vendor) + sizeof(dev->model) + sizeof(dev->serial) + 3];
+  int n = snprintf(key, sizeof(key), "%s\t%s\t%s\t", dev->vendor, dev->model, dev->serial);
+
+  return strncmp(line, key, n) == 0;
+}
+
+int devprobe_load(const Device *dev, devprobe_t *p) {
+  char path[PATH_MAX];
+  char line[1024];
+  int ret = -1;
+
+  if (profile_path(path, sizeof(path), 0) < 0) return -1;
+
+  FILE *f = fopen(path, "r");
+
+  if (f == NULL) return -1;
+
+  while (ret < 0 && fgets(line, sizeof(line), f)) {
+    if (!matches(line, dev)) continue;
+
+    char *fields = line;
+
+    for (int tabs = 0; tabs < 3; tabs++) fields = strchr(fields, '\t') + 1;
+
+    if (sscanf(fields, "%zu\t%d\t%lf\t%lf", &p->chunk, &p->depth, &p->write_mbps,
+               &p->read_mbps) == 4 &&
+        p->chunk >= BLOCKIO_ALIGN && p->chunk % BLOCKIO_ALIGN == 0 &&
+        p->chunk <= DEVPROBE_SPAN && p->depth >= 1 && p->depth <= BLOCKIO_MAX_DEPTH) {
+      ret = 0;
+    }
+  }
+
+  fclose(f);
+
+  return ret;
+}
+
+/* The other devices' lines are kept, the file is replaced in one go */
+
+int devprobe_save(const Device *dev, const devprobe_t *p) {
+  char path[PATH_MAX];
+  char tmp[PATH_MAX + 32];
+  char line[1024];
+
+  if (profile_path(path, sizeof(path), 1) < 0) return -1;
+
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+
+  FILE *out = fopen(tmp, "w");
+
+  if (out == NULL) return -1;
+
+  FILE *in = fopen(path, "r");
+
+  while (in != NULL && fgets(line, sizeof(line), in)) {
+    if (!matches(line, dev)) fputs(line, out);
+  }
+
+  if (in != NULL) fclose(in);
+
+  fprintf(out, "%s\t%s\t%s\t%zu\t%d\t%.1f\t%.1f\n", dev->vendor, dev->model, dev->serial,
+          p->chunk, p->depth, p->write_mbps, p->read_mbps);
+
+  if (ferror(out) | fclose(out) || rename(tmp, path) < 0) {
+    r_printf("Could not save the device profile: %s\n", strerror(errno));
+    unlink(tmp);
+    return -1;
+  }
+
+  return 0;
+}
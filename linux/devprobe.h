@@ -0,0 +1,44 @@
+#ifndef DEVPROBE_H
+#define DEVPROBE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "devices.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DEVPROBE_SPAN (32 * 1024 * 1024)   /* Scratch region at the start of the device */
+#define DEVPROBE_RUN_MS 300                /* Longest a single measurement may take */
+#define DEVPROBE_BETTER 1.05               /* Gain needed to pick larger sizes or depths */
+#define DEVPROBE_FILE "devices"            /* In the scan cache directory */
+#define DEVPROBE_MIN_ERASE (64 * 1024)
+#define DEVPROBE_MAX_ERASE (64 * 1024 * 1024)
+
+/* The request size and queue depth a device writes fastest with. They
+   are found by timing short runs of writes over the scratch region,
+   first with every request size at a moderate depth and then with
+   every depth at the best size, and a read of the region at the
+   chosen settings. What the region held is lost, so this only runs on
+   a device that is about to be overwritten. Profiles are kept per
+   vendor, model and serial number, the same stick is measured once. */
+
+typedef struct devprobe {
+  size_t chunk;      /* Bytes per request */
+  int depth;
+  double write_mbps;
+  double read_mbps;
+} devprobe_t;
+
+int devprobe_run(int fd, devprobe_t *p);
+uint32_t devprobe_erase_size(const Device *dev);
+int devprobe_load(const Device *dev, devprobe_t *p);
+int devprobe_save(const Device *dev, const devprobe_t *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DEVPROBE_H
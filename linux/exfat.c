@@ -0,0 +1,803 @@
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../definitions.h"
+#include "../log.h"
+#include "../logring.h"
+#include "../progress.h"
+#include "../trace.h"
+#include "crc32c.h"
+#include "exfat.h"
+#include "fat32.h"
+#include "fatbuild.h"
+#include "stream.h"
+
+/* The volume is written front to back in one pass:
+ *
+ *   boot region | backup boot region | FAT | bitmap | up-case table | directories | file data
+ *
+ * The allocation bitmap, the up-case table and the root directory are
+ * the only cluster chains in the FAT. Everything else is a single run
+ * of clusters marked NoFatChain in its stream extension entry, so the
+ * FAT is written once with a handful of entries and is never touched
+ * again, and the bitmap is all ones up to the last used cluster.
+ */
+
+#define ENTRY_SIZE 32
+#define NAME_UNITS 15       /* UTF-16 units in one file name entry */
+#define LABEL_UNITS 11
+
+#define ENTRY_BITMAP 0x81
+#define ENTRY_UPCASE 0x82
+#define ENTRY_LABEL 0x83
+#define ENTRY_FILE 0x85
+#define ENTRY_STREAM 0xC0
+#define ENTRY_NAME 0xC1
+
+#define ATTR_DIRECTORY 0x10
+#define ATTR_ARCHIVE 0x20
+
+#define ALLOCATION_POSSIBLE 0x01
+#define NO_FAT_CHAIN 0x02
+
+#define FAT_MEDIA 0xFFFFFFF8
+#define FAT_EOC 0xFFFFFFFF
+
+#define BS_VOLUME_FLAGS_OFFSET 106
+#define BS_PERCENT_IN_USE_OFFSET 112
+
+typedef struct ex_node {
+    uint32_t first;     /* First cluster, 0 for empty files */
+    uint32_t clusters;
+    int32_t dir;        /* Index in dirs for directories, -1 otherwise */
+    uint8_t units;      /* Length of the name */
+} ex_node_t;
+
+typedef struct ex_dir {
+    int32_t entry;      /* Image entry, -1 for the root */
+    uint32_t first;
+    uint32_t clusters;
+    uint32_t entries;   /* Directory entries in use */
+    uint32_t *children;
+    uint32_t nchildren;
+    uint32_t cap;
+} ex_dir_t;
+
+typedef struct ex {
+    isofs_t *image;     /* NULL for an empty volume */
+    exfat_layout_t l;
+    uint32_t cluster_bytes;
+    ex_node_t *nodes;
+    ex_dir_t *dirs;
+    uint32_t ndirs;
+    uint32_t cap;
+    uint16_t *upcase;   /* Every character, for the name hashes */
+    uint16_t *table;    /* The same compressed, as it is on the volume */
+    uint32_t table_units;
+    uint32_t table_sum;
+    uint32_t bitmap_first;
+    uint32_t bitmap_clusters;
+    uint32_t table_first;
+    uint32_t table_clusters;
+    uint32_t next;      /* First cluster not allocated yet */
+    uint32_t stamp;
+    uint32_t serial;
+    uint16_t label[LABEL_UNITS];
+    int label_len;
+} ex_t;
+
+int exfat_layout(uint64_t sectors, uint8_t cluster_size, uint32_t align, exfat_layout_t *l) {
+
+    uint32_t align_sec = align / 512;
+    uint8_t shift;
+
+    if (sectors < EXFAT_MIN_SECTORS) {
+        r_printf("ERROR: Volume is too small for exFAT!\n");
+        return -1;
+    }
+
+    /* What Windows picks by default, up to 256 MiB, up to 32 GiB, above */
+
+    if (cluster_size <= BS_32768B) {
+        shift = cluster_size;
+    } else if (sectors <= 524288) {
+        shift = 3;
+    } else if (sectors <= 67108864) {
+        shift = 6;
+    } else {
+        shift = 8;
+    }
+
+    /* The FAT is sized for the clusters there would be without it, a
+       few sectors more than needed */
+
+    uint64_t most = (sectors - EXFAT_FAT_OFFSET) >> shift;
+
+    if (most > EXFAT_MAX_CLUSTERS) {
+        r_printf("ERROR: Volume is too large for %u byte clusters!\n", 512u << shift);
+        return -1;
+    }
+
+    uint64_t fat_len = ((most + 2) * 4 + 511) / 512;
+    uint64_t heap = EXFAT_FAT_OFFSET + fat_len;
+
+    if (align_sec > 1) heap = (heap + align_sec - 1) / align_sec * align_sec;
+
+    if (heap >= sectors || ((sectors - heap) >> shift) == 0) {
+        r_printf("ERROR: Volume is too small for exFAT!\n");
+        return -1;
+    }
+
+    l->vol_len = sectors;
+    l->fat_offset = EXFAT_FAT_OFFSET;
+    l->fat_len = fat_len;
+    l->heap_offset = heap;
+    l->clusters = (sectors - heap) >> shift;
+    l->clus_shift = shift;
+
+    return 0;
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    put16(p, v & 0xFFFF);
+    put16(p + 2, v >> 16);
+}
+
+static void put64(uint8_t *p, uint64_t v) {
+    put32(p, v & 0xFFFFFFFF);
+    put32(p + 4, v >> 32);
+}
+
+/* Runs of characters that map to themselves become 0xFFFF and the
+   length of the run. The last run reaches the end of the table, so
+   the table covers every character. */
+
+static uint32_t upcase_compress(const uint16_t *up, uint16_t *out) {
+
+    uint32_t n = 0;
+
+    for (uint32_t c = 0; c < UPCASE_CHARS; ) {
+        uint32_t run = 0;
+
+        while (c + run < UPCASE_CHARS && run < 0xFFFF && up[c + run] == c + run) run++;
+
+        if (run > 2 || (run > 0 && c + run == UPCASE_CHARS)) {
+            out[n++] = htole16(0xFFFF);
+            out[n++] = htole16(run);
+            c += run;
+        } else {
+            out[n++] = htole16(up[c]);
+            c++;
+        }
+    }
+
+    return n;
+}
+
+/* The checksum of the boot region and of the up-case table, the boot
+   sector's flags and use count are left out of the former */
+
+static uint32_t checksum32(uint32_t sum, const uint8_t *p, size_t len, int boot) {
+
+    for (size_t i = 0; i < len; i++) {
+        if (boot && (i == BS_VOLUME_FLAGS_OFFSET || i == BS_VOLUME_FLAGS_OFFSET + 1 ||
+                     i == BS_PERCENT_IN_USE_OFFSET)) {
+            continue;
+        }
+
+        sum = ((sum & 1) ? 0x80000000 : 0) + (sum >> 1) + p[i];
+    }
+
+    return sum;
+}
+
+static uint16_t set_checksum(const uint8_t *set, uint32_t count) {
+
+    uint16_t sum = 0;
+
+    for (size_t i = 0; i < (size_t) count * ENTRY_SIZE; i++) {
+        if (i == 2 || i == 3) continue;
+
+        sum = ((sum & 1) ? 0x8000 : 0) + (sum >> 1) + set[i];
+    }
+
+    return sum;
+}
+
+static uint16_t name_hash(const ex_t *b, const uint16_t *units, int len) {
+
+    uint16_t hash = 0;
+
+    for (int i = 0; i < len; i++) {
+        uint16_t c = b->upcase[units[i]];
+
+        hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c & 0xFF);
+        hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c >> 8);
+    }
+
+    return hash;
+}
+
+static int add_dir(ex_t *b, int32_t entry) {
+
+    if (b->ndirs == b->cap) {
+        uint32_t cap = b->cap ? b->cap * 2 : 256;
+        ex_dir_t *tmp = realloc(b->dirs, cap * sizeof(ex_dir_t));
+
+        if (tmp == NULL) return -1;
+
+        b->dirs = tmp;
+        b->cap = cap;
+    }
+
+    memset(&b->dirs[b->ndirs], 0, sizeof(ex_dir_t));
+    b->dirs[b->ndirs].entry = entry;
+
+    return b->ndirs++;
+}
+
+static int add_child(ex_dir_t *d, uint32_t entry) {
+
+    if (d->nchildren == d->cap) {
+        uint32_t cap = d->cap ? d->cap * 2 : 16;
+        uint32_t *tmp = realloc(d->children, cap * sizeof(uint32_t));
+
+        if (tmp == NULL) return -1;
+
+        d->children = tmp;
+        d->cap = cap;
+    }
+
+    d->children[d->nchildren++] = entry;
+
+    return 0;
+}
+
+static size_t dir_path_len(ex_t *b, uint32_t d) {
+    return b->dirs[d].entry < 0 ? 0 : strlen(b->image->entries[b->dirs[d].entry].path);
+}
+
+static uint32_t name_entries(int units) {
+    return (units + NAME_UNITS - 1) / NAME_UNITS;
+}
+
+/* The same walk as the FAT32 builder's, image entries come parents
+   first. A file, its stream extension and its names are one set of
+   entries in its directory. */
+
+static int plan_tree(ex_t *b) {
+
+    isofs_t *image = b->image;
+    uint32_t stack[256];
+    uint16_t units[MAX_LFN];
+    int depth = 0;
+
+    if (add_dir(b, -1) < 0) return -1;
+
+    /* The root holds the label, the bitmap and the up-case table */
+
+    b->dirs[0].entries = 2 + (b->label_len > 0);
+    stack[0] = 0;
+
+    for (size_t i = 0; image != NULL && i < image->count; i++) {
+        const isofs_entry_t *e = &image->entries[i];
+        const char *slash = strrchr(e->path, '/');
+        size_t parent_len = slash ? (size_t) (slash - e->path) : 0;
+        int len;
+
+        b->nodes[i].dir = -1;
+
+        while (depth > 0 && (dir_path_len(b, stack[depth]) != parent_len ||
+                             strncmp(image->entries[b->dirs[stack[depth]].entry].path, e->path, parent_len) != 0)) {
+            depth--;
+        }
+
+        if (S_ISLNK(e->mode)) {
+            log_write(LOG_COPY, LOG_INFO, "Skipping symlink: %s -> %s\n", e->path, e->link);
+            continue;
+        }
+
+        if ((len = lfn_units(slash ? slash + 1 : e->path, units)) <= 0) {
+            r_printf("ERROR: File name too long for exFAT: %s\n", e->path);
+            return -1;
+        }
+
+        b->nodes[i].units = len;
+
+        if (add_child(&b->dirs[stack[depth]], i) < 0) return -1;
+
+        b->dirs[stack[depth]].entries += 2 + name_entries(len);
+
+        if (S_ISDIR(e->mode)) {
+            int d = add_dir(b, i);
+
+            if (d < 0) return -1;
+
+            if (depth + 1 >= (int) (sizeof(stack) / sizeof(stack[0]))) {
+                r_printf("ERROR: Directories are nested more than %d levels deep, too deep for exFAT\n",
+                         (int) (sizeof(stack) / sizeof(stack[0])) - 1);
+                return -1;
+            }
+
+            b->nodes[i].dir = d;
+            stack[++depth] = d;
+        }
+    }
+
+    /* Names are compared through the up-case table, README and readme
+       in one directory would be two entries no lookup tells apart */
+
+    for (uint32_t d = 0; image != NULL && d < b->ndirs; d++) {
+        uint32_t first, second;
+        int ret = lfn_clash(image, b->dirs[d].children, b->dirs[d].nchildren, b->upcase, &first, &second);
+
+        if (ret < 0) return -1;
+
+        if (ret > 0) {
+            r_printf("ERROR: %s and %s have the same name on exFAT\n", image->entries[first].path,
+                     image->entries[second].path);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static uint32_t clusters_of(ex_t *b, uint64_t bytes) {
+    return (bytes + b->cluster_bytes - 1) / b->cluster_bytes;
+}
+
+static int plan_clusters(ex_t *b) {
+
+    b->next = 2;
+
+    b->bitmap_first = b->next;
+    b->bitmap_clusters = clusters_of(b, (b->l.clusters + 7) / 8);
+    b->next += b->bitmap_clusters;
+
+    b->table_first = b->next;
+    b->table_clusters = clusters_of(b, (uint64_t) b->table_units * 2);
+    b->next += b->table_clusters;
+
+    /* Every directory gets a cluster even when empty, the root first */
+
+    for (uint32_t d = 0; d < b->ndirs; d++) {
+        uint64_t bytes = (uint64_t) b->dirs[d].entries * ENTRY_SIZE;
+
+        if (bytes > EXFAT_MAX_DIR) {
+            r_printf("ERROR: Too many entries in one directory for exFAT\n");
+            return -1;
+        }
+
+        b->dirs[d].first = b->next;
+        b->dirs[d].clusters = bytes ? clusters_of(b, bytes) : 1;
+        b->next += b->dirs[d].clusters;
+
+        if (b->dirs[d].entry >= 0) {
+            b->nodes[b->dirs[d].entry].first = b->dirs[d].first;
+            b->nodes[b->dirs[d].entry].clusters = b->dirs[d].clusters;
+        }
+
+        if ((uint64_t) b->next - 2 > b->l.clusters) {
+            r_printf("ERROR: Image does not fit on the device.\n");
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; b->image != NULL && i < b->image->count; i++) {
+        const isofs_entry_t *e = &b->image->entries[i];
+        ex_node_t *n = &b->nodes[i];
+        uint64_t clusters = (e->size + b->cluster_bytes - 1) / b->cluster_bytes;
+
+        if (!S_ISREG(e->mode)) continue;
+
+        if ((uint64_t) b->next + clusters - 2 > b->l.clusters) {
+            r_printf("ERROR: Image does not fit on the device (%.1f MiB needed).\n",
+                     b->image->total_bytes / 1048576.0);
+            return -1;
+        }
+
+        n->clusters = clusters;
+        n->first = clusters ? b->next : 0;
+        b->next += clusters;
+    }
+
+    return 0;
+}
+
+static int write_boot(ex_t *b, stream_t *s) {
+
+    size_t size = (size_t) b->l.fat_offset * 512;
+    uint8_t *buf = calloc(1, size);
+    uint8_t *bs = buf;
+
+    if (buf == NULL) return -1;
+
+    memcpy(bs, "\xEB\x76\x90" "EXFAT   ", 11);
+
+    put64(bs + 72, b->l.vol_len);
+    put32(bs + 80, b->l.fat_offset);
+    put32(bs + 84, b->l.fat_len);
+    put32(bs + 88, b->l.heap_offset);
+    put32(bs + 92, b->l.clusters);
+    put32(bs + 96, b->dirs[0].first);
+    put32(bs + 100, b->serial);
+    put16(bs + 104, 0x0100);        /* Revision 1.00 */
+    bs[108] = 9;                    /* 512 byte sectors */
+    bs[109] = b->l.clus_shift;
+    bs[110] = 1;                    /* One FAT */
+    bs[111] = 0x80;
+    bs[BS_PERCENT_IN_USE_OFFSET] = (uint64_t) (b->next - 2) * 100 / b->l.clusters;
+
+    /* The jump lands on a halt if the stick is booted by accident */
+
+    memset(bs + 120, 0xF4, 390);
+    bs[510] = 0x55;
+    bs[511] = 0xAA;
+
+    /* Eight extended boot sectors, the OEM parameters and a reserved
+       sector, all empty, then the checksum of the eleven before it */
+
+    for (int i = 1; i <= 8; i++) {
+        buf[i * 512 + 510] = 0x55;
+        buf[i * 512 + 511] = 0xAA;
+    }
+
+    uint32_t sum = checksum32(0, buf, 512, 1);
+
+    sum = checksum32(sum, buf + 512, 10 * 512, 0);
+
+    for (int i = 0; i < 512; i += 4) put32(buf + 11 * 512 + i, sum);
+
+    memcpy(buf + EXFAT_BOOT_REGION * 512, buf, EXFAT_BOOT_REGION * 512);
+
+    int ret = stream_write(s, buf, size);
+
+    free(buf);
+
+    return ret;
+}
+
+static void chain(uint32_t *fat, uint32_t first, uint32_t clusters) {
+
+    for (uint32_t c = first; c + 1 < first + clusters; c++) fat[c] = htole32(c + 1);
+
+    if (clusters) fat[first + clusters - 1] = htole32(FAT_EOC);
+}
+
+static int write_fat(ex_t *b, stream_t *s) {
+
+    uint32_t used = b->dirs[0].first + b->dirs[0].clusters;
+    uint32_t *fat = calloc(used, sizeof(uint32_t));
+
+    if (fat == NULL) return -1;
+
+    fat[0] = htole32(FAT_MEDIA);
+    fat[1] = htole32(FAT_EOC);
+
+    chain(fat, b->bitmap_first, b->bitmap_clusters);
+    chain(fat, b->table_first, b->table_clusters);
+    chain(fat, b->dirs[0].first, b->dirs[0].clusters);
+
+    uint64_t fat_bytes = (uint64_t) b->l.fat_len * 512;
+    uint64_t gap = (uint64_t) (b->l.heap_offset - b->l.fat_offset - b->l.fat_len) * 512;
+    int ret = 0;
+
+    if (stream_write(s, fat, (size_t) used * sizeof(uint32_t)) < 0 ||
+        stream_zero(s, fat_bytes - (uint64_t) used * sizeof(uint32_t) + gap) < 0) {
+        ret = -1;
+    }
+
+    free(fat);
+
+    return ret;
+}
+
+/* Everything allocated is one run from cluster 2 on */
+
+static int write_bitmap(ex_t *b, stream_t *s) {
+
+    size_t size = (size_t) b->bitmap_clusters * b->cluster_bytes;
+    uint8_t *buf = calloc(1, size);
+    uint32_t used = b->next - 2;
+
+    if (buf == NULL) return -1;
+
+    memset(buf, 0xFF, used / 8);
+
+    if (used % 8) buf[used / 8] = (1 << (used % 8)) - 1;
+
+    int ret = stream_write(s, buf, size);
+
+    free(buf);
+
+    return ret;
+}
+
+static int write_table(ex_t *b, stream_t *s) {
+
+    size_t size = (size_t) b->table_clusters * b->cluster_bytes;
+    uint8_t *buf = calloc(1, size);
+
+    if (buf == NULL) return -1;
+
+    memcpy(buf, b->table, (size_t) b->table_units * 2);
+
+    int ret = stream_write(s, buf, size);
+
+    free(buf);
+
+    return ret;
+}
+
+static uint8_t *put_set(ex_t *b, uint8_t *slot, const isofs_entry_t *e, const ex_node_t *n) {
+
+    uint16_t units[MAX_LFN];
+    const char *slash = strrchr(e->path, '/');
+    int len = lfn_units(slash ? slash + 1 : e->path, units);
+    uint32_t names = name_entries(len);
+    uint64_t size = S_ISDIR(e->mode) ? (uint64_t) n->clusters * b->cluster_bytes : e->size;
+    uint8_t *set = slot;
+
+    slot[0] = ENTRY_FILE;
+    slot[1] = 1 + names;
+    put16(slot + 4, S_ISDIR(e->mode) ? ATTR_DIRECTORY : ATTR_ARCHIVE);
+    put32(slot + 8, b->stamp);
+    put32(slot + 12, b->stamp);
+    put32(slot + 16, b->stamp);
+    slot += ENTRY_SIZE;
+
+    slot[0] = ENTRY_STREAM;
+    slot[1] = ALLOCATION_POSSIBLE | (n->first ? NO_FAT_CHAIN : 0);
+    slot[3] = len;
+    put16(slot + 4, name_hash(b, units, len));
+    put64(slot + 8, size);
+    put32(slot + 20, n->first);
+    put64(slot + 24, size);
+    slot += ENTRY_SIZE;
+
+    for (uint32_t i = 0; i < names; i++) {
+        slot[0] = ENTRY_NAME;
+
+        for (int j = 0; j < NAME_UNITS && i * NAME_UNITS + j < (uint32_t) len; j++) {
+            put16(slot + 2 + 2 * j, units[i * NAME_UNITS + j]);
+        }
+
+        slot += ENTRY_SIZE;
+    }
+
+    put16(set + 2, set_checksum(set, 2 + names));
+
+    return slot;
+}
+
+static int write_dir(ex_t *b, stream_t *s, uint32_t d) {
+
+    ex_dir_t *dir = &b->dirs[d];
+    size_t size = (size_t) dir->clusters * b->cluster_bytes;
+    uint8_t *buf = calloc(1, size);
+    uint8_t *slot = buf;
+
+    if (buf == NULL) return -1;
+
+    if (dir->entry < 0) {
+        if (b->label_len > 0) {
+            slot[0] = ENTRY_LABEL;
+            slot[1] = b->label_len;
+
+            for (int i = 0; i < b->label_len; i++) put16(slot + 2 + 2 * i, b->label[i]);
+
+            slot += ENTRY_SIZE;
+        }
+
+        slot[0] = ENTRY_BITMAP;
+        put32(slot + 20, b->bitmap_first);
+        put64(slot + 24, (b->l.clusters + 7) / 8);
+        slot += ENTRY_SIZE;
+
+        slot[0] = ENTRY_UPCASE;
+        put32(slot + 4, b->table_sum);
+        put32(slot + 20, b->table_first);
+        put64(slot + 24, (uint64_t) b->table_units * 2);
+        slot += ENTRY_SIZE;
+    }
+
+    for (uint32_t i = 0; i < dir->nchildren; i++) {
+        slot = put_set(b, slot, &b->image->entries[dir->children[i]], &b->nodes[dir->children[i]]);
+    }
+
+    int ret = stream_write(s, buf, size);
+
+    free(buf);
+
+    return ret;
+}
+
+static int write_files(ex_t *b, stream_t *s, verify_t *verify) {
+
+    progress_begin(b->image->total_bytes);
+
+    for (size_t i = 0; i < b->image->count; i++) {
+        const isofs_entry_t *e = &b->image->entries[i];
+        uint64_t off = 0;
+        uint32_t crc = 0;
+
+        if (!S_ISREG(e->mode) || e->size == 0) continue;
+
+        TRACE_SPAN_ARG("file", e->path);
+
+        r_debug(LOG_COPY, "Extracting: %s\n", e->path);
+
+        while (off < e->size) {
+            size_t room;
+            unsigned char *dst = stream_reserve(s, &room);
+
+            if (dst == NULL) return -1;
+
+            if (room > e->size - off) room = e->size - off;
+
+            if (isofs_pread(b->image, e, dst, room, off) != (ssize_t) room) {
+                r_printf("Error reading %s from the image\n", e->path);
+                return -1;
+            }
+
+            if (verify != NULL) crc = crc32c(crc, dst, room);
+
+            if (stream_commit(s, room) < 0) return -1;
+
+            off += room;
+
+            progress_add(room);
+        }
+
+        if (verify != NULL) {
+            uint64_t at = (uint64_t) b->l.heap_offset * 512 + (uint64_t) (b->nodes[i].first - 2) * b->cluster_bytes;
+
+            if (verify_add(verify, at, e->size, crc, 0, e->path) < 0) return -1;
+        }
+
+        if (stream_zero(s, (uint64_t) b->nodes[i].clusters * b->cluster_bytes - e->size) < 0) return -1;
+    }
+
+    return 0;
+}
+
+/* Case is kept, exFAT labels are UTF-16 like the names */
+
+static void set_label(ex_t *b, const char *label) {
+
+    uint16_t units[MAX_LFN];
+    int len = lfn_units(label, units);
+
+    if (len > LABEL_UNITS) {
+        r_printf("WARNING: Label is larger than allowed 11 chars. Will truncate.\n");
+        len = LABEL_UNITS;
+    }
+
+    b->label_len = len < 0 ? 0 : len;
+    memcpy(b->label, units, b->label_len * sizeof(uint16_t));
+}
+
+static void set_time(ex_t *b) {
+
+    time_t now = time(NULL);
+    struct tm tm;
+
+    localtime_r(&now, &tm);
+
+    b->stamp = ((uint32_t) (tm.tm_year - 80) << 25) | ((tm.tm_mon + 1) << 21) | (tm.tm_mday << 16) |
+               (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+    b->serial = (uint32_t) now ^ ((uint32_t) getpid() << 16);
+}
+
+static void free_builder(ex_t *b) {
+
+    for (uint32_t d = 0; d < b->ndirs; d++) free(b->dirs[d].children);
+
+    free(b->dirs);
+    free(b->nodes);
+    free(b->upcase);
+    free(b->table);
+}
+
+static void stream_written(void *arg, uint64_t end) {
+    verify_written(arg, end);
+}
+
+int build_exfat(const uint32_t *part_fd, isofs_t *image, uint8_t cluster_size, char *label,
+                uint32_t align, size_t buf_size, verify_t *verify) {
+
+    ex_t b;
+    uint64_t sectors;
+    stream_t s;
+
+    memset(&b, 0, sizeof(b));
+    b.image = image;
+
+    if (fat32_sectors(*part_fd, &sectors) < 0) return -1;
+
+    if (exfat_layout(sectors, cluster_size, align, &b.l) < 0) return -1;
+
+    b.cluster_bytes = 512u << b.l.clus_shift;
+
+    set_label(&b, label);
+    set_time(&b);
+
+    b.nodes = calloc((image ? image->count : 0) + 1, sizeof(ex_node_t));
+    b.upcase = malloc(UPCASE_CHARS * sizeof(uint16_t));
+    b.table = malloc(UPCASE_CHARS * sizeof(uint16_t));
+
+    if (b.nodes == NULL || b.upcase == NULL || b.table == NULL) {
+        free_builder(&b);
+        return -1;
+    }
+
+    lfn_upcase(b.upcase);
+    b.table_units = upcase_compress(b.upcase, b.table);
+    b.table_sum = checksum32(0, (const uint8_t *) b.table, (size_t) b.table_units * 2, 0);
+
+    int ret = plan_tree(&b);
+
+    if (ret == 0) ret = plan_clusters(&b);
+
+    if (ret < 0) {
+        free_builder(&b);
+        return -1;
+    }
+
+    r_printf("exFAT layout: %u directories, %u of %u clusters of %u bytes used\n",
+             b.ndirs, b.next - 2, b.l.clusters, b.cluster_bytes);
+
+    if (buf_size == 0) buf_size = STREAM_BUF_SIZE;
+
+    if (stream_open(&s, *part_fd, 0, buf_size) < 0) {
+        free_builder(&b);
+        return -1;
+    }
+
+    /* Each file is checked as soon as the device has all of it */
+
+    if (verify != NULL) {
+        s.written = stream_written;
+        s.written_arg = verify;
+    }
+
+    ret = write_boot(&b, &s);
+
+    if (ret == 0) ret = write_fat(&b, &s);
+
+    if (ret == 0) ret = write_bitmap(&b, &s);
+
+    if (ret == 0) ret = write_table(&b, &s);
+
+    for (uint32_t d = 0; d < b.ndirs && ret == 0; d++) ret = write_dir(&b, &s, d);
+
+    if (ret == 0 && image != NULL) ret = write_files(&b, &s, verify);
+
+    if (stream_close(&s) < 0) ret = -1;
+
+    free_builder(&b);
+
+    return ret;
+}
+
+/* Only the metadata is written, the rest of the heap is free in the
+   bitmap whatever it holds */
+
+int format_exfat(const uint32_t *part_fd, uint8_t cluster_size, uint32_t align, char *label) {
+    return build_exfat(part_fd, NULL, cluster_size, label, align, 0, NULL);
+}
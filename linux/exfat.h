@@ -0,0 +1,42 @@
+#ifndef EXFAT_H
+#define EXFAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../isofs.h"
+#include "verify.h"
+
+#define EXFAT_BOOT_REGION 12       /* Sectors of the main and of the backup boot region */
+#define EXFAT_FAT_OFFSET 32        /* Sectors, both boot regions and a 4 KiB boundary */
+#define EXFAT_MIN_SECTORS 2048     /* 1 MiB, the smallest volume the spec allows */
+#define EXFAT_MAX_CLUSTERS 0xFFFFFFF5
+#define EXFAT_MAX_DIR (256 * 1024 * 1024)
+
+typedef struct exfat_layout {
+    uint64_t vol_len;      /* Sectors in the volume */
+    uint32_t fat_offset;
+    uint32_t fat_len;      /* Sectors of the one FAT */
+    uint32_t heap_offset;  /* First sector of cluster 2 */
+    uint32_t clusters;
+    uint8_t clus_shift;    /* Sectors per cluster as a power of two */
+} exfat_layout_t;
+
+/* exFAT volumes are built like build_fat32() builds FAT32 ones, in one
+   sequential pass from the image's tree, only that every file and
+   every directory but the root is marked NoFatChain: its clusters are
+   one run given by the first cluster and the length, the FAT stays
+   empty for them and only the allocation bitmap says they are used.
+   A file larger than 4 GiB is then just a longer run.
+
+   cluster_size is one of the BS_ sizes or BS_AUTO for the sizes
+   Windows picks, align what the partition start is aligned to, the
+   cluster heap starts on a multiple of it. format_exfat() writes an
+   empty volume the same way, for images that have to be copied. */
+
+int exfat_layout(uint64_t sectors, uint8_t cluster_size, uint32_t align, exfat_layout_t *l);
+int build_exfat(const uint32_t *part_fd, isofs_t *image, uint8_t cluster_size, char *label,
+                uint32_t align, size_t buf_size, verify_t *verify);
+int format_exfat(const uint32_t *part_fd, uint8_t cluster_size, uint32_t align, char *label);
+
+#endif // EXFAT_H
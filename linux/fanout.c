@@ -0,0 +1,463 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../log.h"
+#include "../progress.h"
+#include "../trace.h"
+#include "blockio.h"
+#include "crc32c.h"
+#include "decomp.h"
+#include "fanout.h"
+
+/* One image to many devices. The image is read (and decoded) once into
+   a ring of chunks shared by one writer thread per device. Every chunk
+   carries a count of the devices that still have to write it and only
+   goes back to the reader when that drops to zero, so the ring moves at
+   the pace of the slowest device and never runs ahead of it.
+
+   A device that fails drops out: its writer gives back every chunk it
+   still holds or has yet to write and is no longer counted for new
+   ones, the others carry on. */
+
+#define FANOUT_ALIGN BLOCKIO_ALIGN
+#define FANOUT_MAX_MEMORY (256 * 1024 * 1024)
+
+typedef struct fanout {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  unsigned char **buf;
+  size_t *len;
+  int *refs;          /* Writers that still need the chunk */
+  uint32_t *crc;
+  int nbufs;
+  uint64_t read_seq;
+  int eof;
+  int error;
+  int live;           /* Writers still going */
+
+  fanout_target_t *targets;
+  int ntargets;
+  size_t chunk_size;
+  int depth;
+  int need_crc;
+} fanout_t;
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static ssize_t read_full(int fd, unsigned char *buf, size_t len) {
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t n = read(fd, buf + done, len - done);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+
+    if (n == 0) break;
+
+    done += n;
+  }
+
+  return done;
+}
+
+static int write_full(int fd, const unsigned char *buf, size_t len,
+                      uint64_t off) {
+  while (len > 0) {
+    ssize_t n = pwrite(fd, buf, len, off);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+
+    buf += n;
+    len -= n;
+    off += n;
+  }
+
+  return 0;
+}
+
+static void fail(fanout_target_t *t, int error, uint64_t off) {
+  if (t->error) return;
+
+  t->error = error ? error : EIO;
+  t->error_off = off;
+}
+
+/* Called with the lock held */
+
+static void release(fanout_t *f, int slot) {
+  if (--f->refs[slot] == 0) pthread_cond_broadcast(&f->cond);
+}
+
+static void chunk_written(void *arg, int buf, size_t len, int error) {
+  fanout_target_t *t = arg;
+  fanout_t *f = t->f;
+
+  if (error) {
+    fail(t, error, t->offs[buf]);
+  } else if (t->verify) {
+    verify_add(t->verify, t->offs[buf], len, f->crc[buf], 0, NULL);
+  }
+
+  pthread_mutex_lock(&f->lock);
+  t->held[buf] = 0;
+  t->written += error ? 0 : len;
+  release(f, buf);
+  pthread_mutex_unlock(&f->lock);
+}
+
+static void *writer_thread(void *arg) {
+  fanout_target_t *t = arg;
+  fanout_t *f = t->f;
+  double start = now();
+  uint64_t off = 0;
+  blockio_t b;
+
+  trace_thread("write %s", t->name);
+
+  t->direct = blockio_direct(t->fd, 1) == 0;
+
+  if (blockio_open(&b, t->fd, f->depth, f->buf, f->nbufs, f->chunk_size) < 0) {
+    fail(t, errno, 0);
+    goto out;
+  }
+
+  if (t->verify) verify_written(t->verify, UINT64_MAX);
+
+  for (;;) {
+    pthread_mutex_lock(&f->lock);
+
+    while (t->seq == f->read_seq && !f->eof && !f->error) {
+      if (b.inflight > 0) {
+        pthread_mutex_unlock(&f->lock);
+        blockio_reap(&b, 1);
+        pthread_mutex_lock(&f->lock);
+        if (b.error) break;
+        continue;
+      }
+
+      pthread_cond_wait(&f->cond, &f->lock);
+    }
+
+    if (b.error || f->error || t->seq == f->read_seq) {
+      pthread_mutex_unlock(&f->lock);
+      break;
+    }
+
+    int slot = t->seq % f->nbufs;
+    size_t len = f->len[slot];
+
+    t->held[slot] = 1;
+    t->seq++;
+
+    pthread_mutex_unlock(&f->lock);
+
+    t->offs[slot] = off;
+
+    if (len == 0) {
+      chunk_written(t, slot, 0, 0);
+      break;
+    }
+
+    /* The tail of an image can be shorter than a sector, it goes
+       through the page cache once everything before it is done */
+
+    if (t->direct && len % 512 != 0) {
+      if (blockio_drain(&b) < 0) break;
+
+      if (blockio_direct(t->fd, 0) < 0 || write_full(t->fd, f->buf[slot], len, off) < 0) {
+        fail(t, errno, off);
+        chunk_written(t, slot, 0, EIO);
+        break;
+      }
+
+      chunk_written(t, slot, len, 0);
+    } else if (blockio_write(&b, slot, len, off, chunk_written, t) < 0) {
+      break;
+    }
+
+    off += len;
+  }
+
+  blockio_drain(&b);
+  blockio_close(&b);
+
+  if (b.error) fail(t, b.error, off);
+
+  if (!t->error && !f->error) {
+    TRACE_SPAN("fsync");
+    if (fsync(t->fd) < 0) fail(t, errno, off);
+  }
+
+out:
+  blockio_direct(t->fd, 0);
+
+  t->secs = now() - start;
+
+  /* Hand back whatever this device still holds, a ring failure leaves
+     requests that never complete */
+
+  pthread_mutex_lock(&f->lock);
+
+  for (int i = 0; i < f->nbufs; i++) {
+    if (t->held[i]) {
+      t->held[i] = 0;
+      release(f, i);
+    }
+  }
+
+  for (; t->seq < f->read_seq; t->seq++) release(f, t->seq % f->nbufs);
+
+  f->live--;
+  pthread_cond_broadcast(&f->cond);
+  pthread_mutex_unlock(&f->lock);
+
+  return NULL;
+}
+
+/* The calling thread is the reader, returns the number of devices that
+   got the whole image or -1 when the image itself could not be read */
+
+int fanout_write(const char *image_path, fanout_target_t *targets, int ntargets,
+                 size_t chunk_size, int depth, int threads) {
+  fanout_t f;
+  decomp_t d;
+  decomp_t *decomp = NULL;
+  uint64_t in_size = 0;
+  uint64_t read_pos = 0;
+  int fd = -1;
+  int ret = -1;
+  int running[FANOUT_MAX_TARGETS] = { 0 };
+
+  memset(&f, 0, sizeof(f));
+
+  if (ntargets < 1 || ntargets > FANOUT_MAX_TARGETS) {
+    r_printf("Error: %d devices, at most %d can be written at once\n", ntargets,
+             FANOUT_MAX_TARGETS);
+    return -1;
+  }
+
+  chunk_size = (chunk_size + FANOUT_ALIGN - 1) / FANOUT_ALIGN * FANOUT_ALIGN;
+
+  if (decomp_detect(image_path) != DECOMP_NONE) {
+    if (decomp_open(&d, image_path, threads) < 0) return -1;
+
+    decomp = &d;
+    in_size = d.in_size;
+  } else {
+    struct stat st;
+
+    if ((fd = open(image_path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+      r_printf("Error opening %s: %s\n", image_path, strerror(errno));
+      if (fd >= 0) close(fd);
+      return -1;
+    }
+
+    in_size = st.st_size;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+
+  if (depth < 1) depth = 1;
+
+  /* Twice the queue depth so a device that stalls for a moment doesn't
+     hold up the others right away */
+
+  f.nbufs = depth * 2 + 1;
+
+  if ((uint64_t)f.nbufs * chunk_size > FANOUT_MAX_MEMORY) {
+    f.nbufs = FANOUT_MAX_MEMORY / chunk_size < 2 ? 2 : FANOUT_MAX_MEMORY / chunk_size;
+  }
+
+  if (depth > f.nbufs - 1) depth = f.nbufs - 1;
+
+  f.chunk_size = chunk_size;
+  f.depth = depth;
+  f.targets = targets;
+  f.ntargets = ntargets;
+  f.buf = calloc(f.nbufs, sizeof(unsigned char *));
+  f.len = calloc(f.nbufs, sizeof(size_t));
+  f.refs = calloc(f.nbufs, sizeof(int));
+  f.crc = calloc(f.nbufs, sizeof(uint32_t));
+
+  if (f.buf == NULL || f.len == NULL || f.refs == NULL || f.crc == NULL) {
+    r_printf("Error: out of memory for chunks\n");
+    goto out_free;
+  }
+
+  for (int i = 0; i < f.nbufs; i++) {
+    if (posix_memalign((void **)&f.buf[i], FANOUT_ALIGN, chunk_size) != 0) {
+      r_printf("Error: out of memory for %zu byte chunks\n", chunk_size);
+      goto out_free;
+    }
+  }
+
+  for (int i = 0; i < ntargets; i++) {
+    fanout_target_t *t = &targets[i];
+
+    t->f = &f;
+    t->error = 0;
+    t->error_off = 0;
+    t->written = 0;
+    t->seq = 0;
+    t->held = calloc(f.nbufs, sizeof(int));
+    t->offs = calloc(f.nbufs, sizeof(uint64_t));
+
+    if (t->verify) f.need_crc = 1;
+
+    if (t->held == NULL || t->offs == NULL) {
+      r_printf("Error: out of memory for %s\n", t->name);
+      goto out_free;
+    }
+  }
+
+  pthread_mutex_init(&f.lock, NULL);
+  pthread_cond_init(&f.cond, NULL);
+
+  r_printf("Writing %s (%.1f MiB%s) to %d devices in %zu KiB chunks, %d buffers\n",
+           image_path, in_size / 1048576.0, decomp ? " compressed" : "", ntargets,
+           chunk_size / 1024, f.nbufs);
+
+  progress_begin(decomp ? 0 : in_size);
+
+  for (int i = 0; i < ntargets; i++) {
+    pthread_mutex_lock(&f.lock);
+    f.live++;
+    pthread_mutex_unlock(&f.lock);
+
+    if (pthread_create(&targets[i].thread, NULL, writer_thread, &targets[i]) != 0) {
+      r_printf("Error starting writer for %s\n", targets[i].name);
+      fail(&targets[i], EAGAIN, 0);
+
+      pthread_mutex_lock(&f.lock);
+      f.live--;
+      pthread_mutex_unlock(&f.lock);
+      continue;
+    }
+
+    running[i] = 1;
+  }
+
+  for (;;) {
+    int slot = f.read_seq % f.nbufs;
+
+    pthread_mutex_lock(&f.lock);
+
+    while (f.refs[slot] > 0 && f.live > 0) pthread_cond_wait(&f.cond, &f.lock);
+
+    int live = f.live;
+
+    pthread_mutex_unlock(&f.lock);
+
+    if (live == 0) break;
+
+    ssize_t n = decomp ? decomp_read(decomp, f.buf[slot], chunk_size)
+                       : read_full(fd, f.buf[slot], chunk_size);
+    int err = n < 0 ? (decomp ? EIO : errno) : 0;
+
+    if (!err && f.need_crc) f.crc[slot] = crc32c(0, f.buf[slot], n);
+
+    if (!err) read_pos += n;
+
+    pthread_mutex_lock(&f.lock);
+
+    if (err) {
+      f.error = err;
+    } else {
+      f.len[slot] = n;
+      f.refs[slot] = f.live;
+      f.read_seq++;
+      if ((size_t)n < chunk_size) f.eof = 1;
+    }
+
+    pthread_cond_broadcast(&f.cond);
+
+    int done = f.eof || f.error;
+
+    pthread_mutex_unlock(&f.lock);
+
+    if (err) r_printf("Error reading %s: %s\n", image_path, strerror(err));
+
+    /* The ring never gets more than a few chunks ahead of the slowest
+       device, so the read position is a fair measure of progress. A
+       compressed image's size is estimated from the input used so far */
+
+    if (decomp && decomp->in_pos) progress_total((uint64_t)((double)in_size / decomp->in_pos * read_pos));
+
+    progress_set(read_pos);
+
+    if (done) break;
+  }
+
+  for (int i = 0; i < ntargets; i++) {
+    if (running[i]) pthread_join(targets[i].thread, NULL);
+  }
+
+  pthread_mutex_destroy(&f.lock);
+  pthread_cond_destroy(&f.cond);
+
+  if (f.error) {
+    ret = -1;
+  } else {
+    ret = 0;
+
+    for (int i = 0; i < ntargets; i++) {
+      fanout_target_t *t = &targets[i];
+
+      if (t->error) {
+        r_printf("%s: FAILED at offset %llu: %s\n", t->name,
+                 (unsigned long long)t->error_off, strerror(t->error));
+        continue;
+      }
+
+      r_printf("%s: wrote %.1f MiB in %.1f s (%.1f MiB/s)\n", t->name,
+               t->written / 1048576.0, t->secs,
+               t->secs > 0 ? t->written / 1048576.0 / t->secs : 0.0);
+      ret++;
+    }
+
+    r_printf("%d of %d devices written\n", ret, ntargets);
+  }
+
+out_free:
+  for (int i = 0; i < ntargets; i++) {
+    free(targets[i].held);
+    free(targets[i].offs);
+    targets[i].held = NULL;
+    targets[i].offs = NULL;
+  }
+
+  for (int i = 0; f.buf != NULL && i < f.nbufs; i++) free(f.buf[i]);
+
+  free(f.buf);
+  free(f.len);
+  free(f.refs);
+  free(f.crc);
+
+  if (fd >= 0) close(fd);
+  if (decomp) decomp_close(decomp);
+
+  return ret;
+}
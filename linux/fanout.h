@@ -0,0 +1,38 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "verify.h"
+
+#define FANOUT_MAX_TARGETS 32
+
+/* One device written by fanout_write. The caller fills in name, fd and
+   verify, the results are there once it returns: error holds the errno
+   of the first failure, 0 when the device got the whole image. */
+
+typedef struct fanout_target {
+  const char *name;
+  uint32_t fd;
+  verify_t *verify;
+
+  int error;
+  uint64_t error_off;
+  uint64_t written;
+  double secs;
+
+  /* Writer thread state */
+  struct fanout *f;
+  pthread_t thread;
+  uint64_t seq;      /* Next chunk to write */
+  int *held;         /* Chunks submitted and not yet completed */
+  uint64_t *offs;
+  int direct;
+} fanout_target_t;
+
+int fanout_write(const char *image_path, fanout_target_t *targets, int ntargets,
+                 size_t chunk_size, int depth, int threads);
+
+#endif // FANOUT_H
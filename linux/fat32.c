@@ -29,20 +29,208 @@
 #include <linux/fs.h>
 #include <string.h>
 
+#include "blockio.h"
 #include "fat32.h"
+#include "wipe.h"
 #include "log.h"
+#include "logring.h"
 #include "definitions.h"
+#include "progress.h"
 
-int format_fat32(const uint32_t *part_fd, uint8_t cluster_size, char *label) {
+int fat32_sectors(int fd, uint64_t *sectors) {
+
+    struct stat st;
+    uint64_t bytes;
+
+    /* Block devices report their size through the ioctl, regular
+       files (images, benchmarks) through fstat() */
+
+    if (ioctl(fd, BLKGETSIZE64, &bytes) == 0) {
+        *sectors = bytes / 512;
+        return 0;
+    }
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        *sectors = st.st_size / 512;
+        return 0;
+    }
+
+    perror("ioctl");
+    return -1;
+}
+
+/* With align (bytes, the partition start is aligned to it) the reserved
+   sectors are padded so that cluster 2 starts on an erase block, as SD
+   card formatters do. Otherwise no cluster would line up with one and
+   every cluster write would be a read-modify-write in the stick. */
+
+static int layout(uint64_t DskSize, uint8_t cluster_size, uint32_t align, fat32_layout_t *l,
+                  int verbose) {
+
+    uint16_t BPB_ResvdSecCnt = FAT32_MIN_RSVD_SEC;
+    const uint8_t BPB_NumFATs = 2;
+
+    uint8_t BPB_SecPerClus;
+
+    if (DskSize > UINT32_MAX - 1) {
+        if (verbose) r_printf("Volume to big for FAT32!\n");
+        return -1;
+    }
+
+    switch (cluster_size) {
+      case BS_512B:
+        BPB_SecPerClus = 1;
+        break;
+      case BS_1024B:
+        BPB_SecPerClus = 2;
+        break;
+      case BS_2048B:
+        BPB_SecPerClus = 4;
+        break;
+      case BS_4096B:
+        BPB_SecPerClus = 8;
+        break;
+      case BS_8192B:
+        BPB_SecPerClus = 16;
+        break;
+      case BS_16384B:
+        BPB_SecPerClus = 32;
+        break;
+      case BS_32768B:
+        BPB_SecPerClus = 64;
+        break;
+      default:
+
+        if (verbose) r_printf("Autosetting cluster size.\n");
+
+        if (DskSize < 66600) {
+          if (verbose) r_printf("ERROR: Volume is too small!\n");
+          return -1;
+        } else if (DskSize < 532480) {
+          BPB_SecPerClus = 1;
+        } else if (DskSize < 16777216) {
+          BPB_SecPerClus = 8;
+        } else if (DskSize < 33554432) {
+          BPB_SecPerClus = 16;
+        } else if (DskSize < 67108864) {
+          BPB_SecPerClus = 32;
+        } else {
+          BPB_SecPerClus = 64;
+        }
+
+    }
+
+    uint32_t BPB_TotSec32 = (uint32_t) DskSize; /* Transition to 32-bit */
+    uint32_t BPB_FATSz32;
+
+    /* This snippet of code is from the FAT32 specification */
+
+    uint32_t TmpVal1 = BPB_TotSec32 - BPB_ResvdSecCnt;
+    uint32_t TmpVal2 = (256 * BPB_SecPerClus) + BPB_NumFATs;
+    TmpVal2 = TmpVal2 / 2;
+    BPB_FATSz32 = (TmpVal1 + (TmpVal2 - 1)) / TmpVal2;
+
+    /* The FATs only get a little larger than needed from the padding,
+       so the size from the minimum reserved area still covers them */
+
+    uint32_t AlignSec = align / 512;
+
+    if (AlignSec > 1) {
+        uint64_t Meta = FAT32_MIN_RSVD_SEC + (uint64_t) BPB_NumFATs * BPB_FATSz32;
+        uint64_t Padded = (Meta + AlignSec - 1) / AlignSec * AlignSec - (uint64_t) BPB_NumFATs * BPB_FATSz32;
+
+        if (Padded <= UINT16_MAX && Padded + (Meta - FAT32_MIN_RSVD_SEC) < BPB_TotSec32) {
+            BPB_ResvdSecCnt = (uint16_t) Padded;
+        } else if (verbose) {
+            r_printf("WARNING: Can't align the data region to %u KiB.\n", align / 1024);
+        }
+    }
+
+    l->tot_sec = BPB_TotSec32;
+    l->fat_sz = BPB_FATSz32;
+    l->rsvd_sec = BPB_ResvdSecCnt;
+    l->sec_per_clus = BPB_SecPerClus;
+    l->num_fats = BPB_NumFATs;
+    l->data_start = BPB_ResvdSecCnt + BPB_NumFATs * BPB_FATSz32;
+    l->clusters = (BPB_TotSec32 - l->data_start) / BPB_SecPerClus;
+
+    if (l->clusters < FAT32_MIN_CLUSTERS && verbose) {
+        r_printf("WARNING: Only %u clusters, too few for FAT32 on Windows.\n", l->clusters);
+    }
+
+    return 0;
+}
+
+int fat32_layout(uint64_t DskSize, uint8_t cluster_size, uint32_t align, fat32_layout_t *l) {
+    return layout(DskSize, cluster_size, align, l, 1);
+}
+
+/* Every cluster size the tree fits with is tried on the volume. The
+   cost of one is what gets written: both FATs in full, as the builder
+   writes them and a format zeroes them, and every cluster the tree
+   takes including the slack at the end of its last one. Sizes that
+   leave too few clusters for Windows are only used when nothing else
+   fits. With a fixed size it is only checked. Returns the BS_ index,
+   or -1 when the tree doesn't fit at all. */
+
+int fat32_pick_cluster(uint64_t sectors, uint32_t align, const fat32_usage_t *u, int cluster_size) {
+
+    int best = -1;
+    int best_valid = 0;
+    uint64_t best_cost = 0;
+
+    for (int i = 0; i < FAT32_CLUSTER_SIZES; i++) {
+        fat32_layout_t l;
+
+        if (cluster_size != BS_AUTO && i != cluster_size) continue;
+
+        if (layout(sectors, i, align, &l, 0) < 0 || l.clusters > FAT32_MAX_CLUSTERS) continue;
+
+        uint64_t bytes = (uint64_t) l.sec_per_clus * 512;
+        uint64_t fat_bytes = (uint64_t) l.num_fats * l.fat_sz * 512;
+        uint64_t cost = fat_bytes + u->clusters[i] * bytes;
+        int valid = l.clusters >= FAT32_MIN_CLUSTERS;
+
+        r_debug(LOG_MAIN, "Clusters of %llu bytes: %llu of %u, %.1f MiB slack, %.1f MiB of FATs\n",
+                (unsigned long long) bytes, (unsigned long long) u->clusters[i], l.clusters,
+                u->slack[i] / 1048576.0, fat_bytes / 1048576.0);
+
+        if (u->clusters[i] > l.clusters) continue;
+
+        if (best < 0 || valid > best_valid || (valid == best_valid && cost < best_cost)) {
+            best = i;
+            best_valid = valid;
+            best_cost = cost;
+        }
+    }
+
+    if (best < 0) {
+        r_printf("ERROR: %u files and %u directories, %.1f MiB, don't fit on the volume\n",
+                 u->files, u->dirs, u->bytes / 1048576.0);
+        return -1;
+    }
+
+    fat32_layout_t l;
+
+    layout(sectors, best, align, &l, 0);
+
+    r_printf("Using %u byte clusters: %llu of %u used (%.1f%%), %.1f MiB slack\n",
+             l.sec_per_clus * 512, (unsigned long long) u->clusters[best], l.clusters,
+             100.0 * u->clusters[best] / l.clusters, u->slack[best] / 1048576.0);
+
+    return best;
+}
+
+void fat32_boot_sectors(const fat32_layout_t *l, const char *label,
+                        unsigned char *bpb, unsigned char *fsi) {
 
     /* This portion declares the FAT32 BPB. Why I did it this way is because
      * constructing a BPB on-the-fly is redundant as most of the fields in the
      * BPB are constants for FAT32, and only a couple of bytes (around 20) need
      * actual modifying to construct a valid FAT32 file system that mounts fine
-     * on Windows and passes fsck.fat with one error, and that is that the FSInfo
-     * field is left uninitialized, but that is the way Windows 7 leaves it and
-     * when the fs gets mounted on Linux it gets initialized. After an initial
-     * mount on Linux, fsck.fat reports no errors on the fs. Also, all bootable
+     * on Windows and passes fsck.fat. The FSInfo sector carries the real free
+     * cluster count of the empty volume, so the first mount doesn't have to
+     * read the whole FAT to count them. Also, all bootable
      * and executable code is left blank, so if someone boots from this partition
      * by accident, they will not get a message. FAT32 partitions are not bootable
      * directly from the code in the BPB.
@@ -53,7 +241,7 @@ int format_fat32(const uint32_t *part_fd, uint8_t cluster_size, char *label) {
      *   3 OEM String: RUFUSL
      *  11 BPB_BytsPerSec = 512B constant for compat - uint16_t
      *  13 BPB_SecPerClus - Empty for populating - char
-     *  14 BPB_RsvdSecCnt = 32 constant for FAT32 - uint16_t
+     *  14 BPB_RsvdSecCnt - At least 32, padded for alignment - uint16_t
      *  16 BPB_NumFATs - Constant 2 per FAT32 spec - uint8_t
      *  17 BPB_RootEntCnt = 0 for FAT32 - uint16_t
      *  19 BPB_TotSec16 = 0 for FAT32 - uint16_t
@@ -186,8 +374,8 @@ int format_fat32(const uint32_t *part_fd, uint8_t cluster_size, char *label) {
              0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
              0x00, 0x00, 0x00, 0x00, /* Empty space */
    /* 484 */ 0x72, 0x72, 0x41, 0x61, /* FSI_StrucSig */
-   /* 488 */ 0xFF, 0xFF, 0xFF, 0xFF, /* FSI_Free_Count - Not known - Windows 7 default */
-   /* 492 */ 0xFF, 0xFF, 0xFF, 0xFF, /* FSI_Next_Free  - Not known - Windows 7 default */
+   /* 488 */ 0xFF, 0xFF, 0xFF, 0xFF, /* FSI_Free_Count - Empty for populating */
+   /* 492 */ 0xFF, 0xFF, 0xFF, 0xFF, /* FSI_Next_Free  - Empty for populating */
    /* 496 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
              0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* Reserved space */
    /* 508 */ 0x00, 0x00, 0x55, 0xAA /* MBR Signature */
@@ -195,98 +383,14 @@ int format_fat32(const uint32_t *part_fd, uint8_t cluster_size, char *label) {
 
     };
 
-    /* This is an empty FAT Table, with its 8 byte
-       magic number and an EOC to declare that it is
-       empty */
-
-    unsigned char fat32_fat[12] = {
-        0xF8,0xFF,0xFF,0x0F, /* Media Descriptor byte 0xF8 */
-        0xFF,0xFF,0xFF,0x0F, /* Root EOC */
-        0xFF,0xFF,0xFF,0x0F, /* Blank FAT EOC */
-    };
+    uint8_t BPB_SecPerClus = l->sec_per_clus;
+    uint16_t BPB_ResvdSecCnt = l->rsvd_sec;
+    uint32_t BPB_TotSec32 = l->tot_sec;
+    uint32_t BPB_FATSz32 = l->fat_sz;
+    uint32_t FSI_Free_Count = l->clusters - 1;  /* All but the root directory */
+    uint32_t FSI_Nxt_Free = 3;                  /* The first after it */
 
-    const uint16_t BPB_ResvdSecCnt = 32;
-
-    uint8_t BPB_SecPerClus;
-    uint64_t DskSize;
-
-    const uint8_t BPB_NumFATs = 2;
-
-    if (ioctl(*part_fd, BLKGETSIZE, &DskSize) < 0) {
-        perror("ioctl");
-        return -1;
-    }
-
-    if (DskSize > UINT32_MAX - 1) {
-        r_printf("Volume to big for FAT32!\n");
-        return -1;
-    }
-
-    switch (cluster_size) {
-      case BS_512B:
-        BPB_SecPerClus = 1;
-        break;
-      case BS_1024B:
-        BPB_SecPerClus = 2;
-        break;
-      case BS_2048B:
-        BPB_SecPerClus = 4;
-        break;
-      case BS_4096B:
-        BPB_SecPerClus = 8;
-        break;
-      case BS_8192B:
-        BPB_SecPerClus = 16;
-        break;
-      case BS_16384B:
-        BPB_SecPerClus = 32;
-        break;
-      case BS_32768B:
-        BPB_SecPerClus = 64;
-        break;
-      default:
-
-        r_printf("Autosetting cluster size.\n");
-
-        if (DskSize < 66600) {
-          r_printf("ERROR: Volume is too small!\n");
-          return -1;
-        } else if (DskSize < 532480) {
-          BPB_SecPerClus = 1;
-        } else if (DskSize < 16777216) {
-          BPB_SecPerClus = 8;
-        } else if (DskSize < 33554432) {
-          BPB_SecPerClus = 16;
-        } else if (DskSize < 67108864) {
-          BPB_SecPerClus = 32;
-        } else if (DskSize < 0xFFFFFFFF) {
-          BPB_SecPerClus = 64;
-        }
-
-    }
-
-    uint32_t BPB_TotSec32 = (uint32_t) DskSize; /* Transition to 32-bit */
-    uint32_t BPB_FATSz32;
-
-    /* This snippet of code is from the FAT32 specification */
-
-    uint32_t TmpVal1 = BPB_TotSec32 - BPB_ResvdSecCnt;
-    uint32_t TmpVal2 = (256 * BPB_SecPerClus) + BPB_NumFATs;
-    TmpVal2 = TmpVal2 / 2;
-    BPB_FATSz32 = (TmpVal1 + (TmpVal2 - 1)) / TmpVal2;
-
-    /* Some debug informatio */
-
-    r_printf("Device fd: %d\n", *part_fd);
-    r_printf("Label: %s\n",label);
-    r_printf("Sectors per cluter: %d\n", BPB_SecPerClus);
-    r_printf("Total sectors: %d\n", BPB_TotSec32);
-    r_printf("FAT32 FAT Size: %d\n", BPB_FATSz32);
-    r_printf("BPB Size: %ld\n", sizeof(fat32_bpb));
-    r_printf("FSI Size: %ld\n", sizeof(fat32_fsi));
-    r_printf("FAT Size: %ld\n", sizeof(fat32_fat));
-
-    /* STEP 1/4: Populate: PBP_SecPerClus */
+    /* STEP 1/7: Populate: PBP_SecPerClus */
 
     fat32_bpb[BPB_SEC_PER_CLUS_OFFSET] = BPB_SecPerClus;
 
@@ -294,21 +398,26 @@ int format_fat32(const uint32_t *part_fd, uint8_t cluster_size, char *label) {
        and writes them into the BPB array whilst flipping
        their endianess to little endian on the fly */
 
-    /* STEP 2/4: Populate: BPB_TotSec32 */
+    /* STEP 2/7: Populate: BPB_RsvdSecCnt */
+
+    fat32_bpb[BPB_RSVD_SEC_CNT_OFFSET + 1] = (BPB_ResvdSecCnt >> 8) & 0xFF;
+    fat32_bpb[BPB_RSVD_SEC_CNT_OFFSET    ] = BPB_ResvdSecCnt & 0xFF;
+
+    /* STEP 3/7: Populate: BPB_TotSec32 */
 
     fat32_bpb[BPB_TOT_SEC_32_OFFSET + 3] = (BPB_TotSec32 >> 24) & 0xFF;
     fat32_bpb[BPB_TOT_SEC_32_OFFSET + 2] = (BPB_TotSec32 >> 16) & 0xFF;
     fat32_bpb[BPB_TOT_SEC_32_OFFSET + 1] = (BPB_TotSec32 >> 8) & 0xFF;
     fat32_bpb[BPB_TOT_SEC_32_OFFSET    ] = BPB_TotSec32 & 0xFF;
 
-    /* STEP 3/4: Populate: BPB_FATSz32 */
+    /* STEP 4/7: Populate: BPB_FATSz32 */
 
     fat32_bpb[BPB_FAT_SZ_32_OFFSET + 3] = (BPB_FATSz32 >> 24) & 0xFF;
     fat32_bpb[BPB_FAT_SZ_32_OFFSET + 2] = (BPB_FATSz32 >> 16) & 0xFF;
     fat32_bpb[BPB_FAT_SZ_32_OFFSET + 1] = (BPB_FATSz32 >> 8) & 0xFF;
     fat32_bpb[BPB_FAT_SZ_32_OFFSET    ] = BPB_FATSz32 & 0xFF;
 
-    /* STEP 4/4: Populate: BS_VolLab */
+    /* STEP 5/7: Populate: BS_VolLab */
 
     if (strlen(label) > 11) {
         r_printf("WARNING: Label is larger than allowed 11 chars. Will truncate.");
@@ -323,8 +432,82 @@ int format_fat32(const uint32_t *part_fd, uint8_t cluster_size, char *label) {
         }
     }
 
+    /* STEP 6/7: Populate: FSI_Free_Count */
+
+    fat32_fsi[FSI_FREE_COUNT_OFFSET + 3] = (FSI_Free_Count >> 24) & 0xFF;
+    fat32_fsi[FSI_FREE_COUNT_OFFSET + 2] = (FSI_Free_Count >> 16) & 0xFF;
+    fat32_fsi[FSI_FREE_COUNT_OFFSET + 1] = (FSI_Free_Count >> 8) & 0xFF;
+    fat32_fsi[FSI_FREE_COUNT_OFFSET    ] = FSI_Free_Count & 0xFF;
+
+    /* STEP 7/7: Populate: FSI_Nxt_Free */
+
+    fat32_fsi[FSI_NXT_FREE_OFFSET + 3] = (FSI_Nxt_Free >> 24) & 0xFF;
+    fat32_fsi[FSI_NXT_FREE_OFFSET + 2] = (FSI_Nxt_Free >> 16) & 0xFF;
+    fat32_fsi[FSI_NXT_FREE_OFFSET + 1] = (FSI_Nxt_Free >> 8) & 0xFF;
+    fat32_fsi[FSI_NXT_FREE_OFFSET    ] = FSI_Nxt_Free & 0xFF;
+
+    memcpy(bpb, fat32_bpb, sizeof(fat32_bpb));
+    memcpy(fsi, fat32_fsi, sizeof(fat32_fsi));
+}
+
+int format_fat32(const uint32_t *part_fd, uint8_t cluster_size, uint32_t align, char *label,
+                 size_t chunk, int depth) {
+
+    /* This is an empty FAT Table, with its 8 byte
+       magic number and an EOC to declare that it is
+       empty */
+
+    unsigned char fat32_fat[12] = {
+        0xF8,0xFF,0xFF,0x0F, /* Media Descriptor byte 0xF8 */
+        0xFF,0xFF,0xFF,0x0F, /* Root EOC */
+        0xFF,0xFF,0xFF,0x0F, /* Blank FAT EOC */
+    };
+
+    unsigned char fat32_bpb[512];
+    unsigned char fat32_fsi[512];
+
+    uint64_t DskSize;
+    fat32_layout_t layout;
+
+    if (fat32_sectors(*part_fd, &DskSize) < 0) return -1;
+
+    if (fat32_layout(DskSize, cluster_size, align, &layout) < 0) return -1;
+
+    const uint16_t BPB_ResvdSecCnt = layout.rsvd_sec;
+    const uint32_t BPB_FATSz32 = layout.fat_sz;
+
+    /* Some debug informatio */
+
+    r_printf("Device fd: %d\n", *part_fd);
+    r_printf("Label: %s\n",label);
+    r_printf("Sectors per cluter: %d\n", layout.sec_per_clus);
+    r_printf("Total sectors: %d\n", layout.tot_sec);
+    r_printf("Reserved sectors: %d\n", BPB_ResvdSecCnt);
+    r_printf("FAT32 FAT Size: %d\n", BPB_FATSz32);
+    r_printf("BPB Size: %ld\n", sizeof(fat32_bpb));
+    r_printf("FSI Size: %ld\n", sizeof(fat32_fsi));
+    r_printf("FAT Size: %ld\n", sizeof(fat32_fat));
+
+    fat32_boot_sectors(&layout, label, fat32_bpb, fat32_fsi);
+
     r_printf("File descriptor: %d\n", *part_fd);
 
+    /* Whatever the device held before would read as allocated clusters and
+       directory entries, so both FATs and the root directory cluster are
+       zeroed in one go. The start is rounded down to a block, the boot
+       sectors that may overlap are written after. */
+
+    uint64_t zero_start = (uint64_t) BPB_ResvdSecCnt * 512 / BLOCKIO_ALIGN * BLOCKIO_ALIGN;
+    uint64_t zero_end = ((uint64_t) layout.data_start + layout.sec_per_clus) * 512;
+
+    zero_end = (zero_end + BLOCKIO_ALIGN - 1) / BLOCKIO_ALIGN * BLOCKIO_ALIGN;
+
+    if (zero_end > (uint64_t) layout.tot_sec * 512) zero_end = (uint64_t) layout.tot_sec * 512;
+
+    progress_begin(zero_end - zero_start);
+
+    if (zero_range(part_fd, zero_start, zero_end - zero_start, chunk, depth) < 0) return -1;
+
     /* See the macro on the beginning of the file */
 
     SEEKNWRITE(*part_fd, 0, fat32_bpb, 512);                                     /* Write first BPB */
@@ -1,7 +1,21 @@
+#ifndef FAT32_H
+#define FAT32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
 #define BPB_SEC_PER_CLUS_OFFSET 13
+#define BPB_RSVD_SEC_CNT_OFFSET 14
 #define BPB_TOT_SEC_32_OFFSET 32
 #define BPB_FAT_SZ_32_OFFSET 36
 #define BPB_LABEL_OFFSET 71
+#define FSI_FREE_COUNT_OFFSET 488
+#define FSI_NXT_FREE_OFFSET 492
+
+#define FAT32_MIN_CLUSTERS 65525
+#define FAT32_MAX_CLUSTERS 0x0FFFFFF5
+#define FAT32_MIN_RSVD_SEC 32
+#define FAT32_CLUSTER_SIZES 7      /* BS_512B to BS_32768B */
 
 #define SEEKNWRITE(fd, offset, array, max) \
     lseek(fd, offset, SEEK_SET); \
@@ -10,4 +24,33 @@
         return -1; \
     } \
 
-int format_fat32(const uint32_t *part_fd, uint8_t cluster_size, char *label);
+typedef struct fat32_layout {
+    uint32_t tot_sec;      /* Sectors in the volume */
+    uint32_t fat_sz;       /* Sectors per FAT */
+    uint16_t rsvd_sec;     /* Reserved sectors before the first FAT */
+    uint8_t sec_per_clus;
+    uint8_t num_fats;
+    uint32_t data_start;   /* First sector of cluster 2 */
+    uint32_t clusters;     /* Data clusters in the volume */
+} fat32_layout_t;
+
+/* What a tree of files needs from a volume at each cluster size,
+   directories included */
+
+typedef struct fat32_usage {
+    uint64_t clusters[FAT32_CLUSTER_SIZES];
+    uint64_t slack[FAT32_CLUSTER_SIZES];    /* Bytes after the end of files */
+    uint64_t bytes;
+    uint32_t files;
+    uint32_t dirs;
+} fat32_usage_t;
+
+int fat32_sectors(int fd, uint64_t *sectors);
+int fat32_layout(uint64_t sectors, uint8_t cluster_size, uint32_t align, fat32_layout_t *l);
+int fat32_pick_cluster(uint64_t sectors, uint32_t align, const fat32_usage_t *u, int cluster_size);
+void fat32_boot_sectors(const fat32_layout_t *l, const char *label,
+                        unsigned char *bpb, unsigned char *fsi);
+int format_fat32(const uint32_t *part_fd, uint8_t cluster_size, uint32_t align, char *label,
+                 size_t chunk, int depth);
+
+#endif // FAT32_H
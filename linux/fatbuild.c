@@ -0,0 +1,909 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <endian.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "../log.h"
+#include "../logring.h"
+#include "../progress.h"
+#include "../trace.h"
+#include "fat32.h"
+#include "crc32c.h"
+#include "fatbuild.h"
+#include "stream.h"
+
+/* Instead of formatting an empty volume, mounting it and letting the
+ * kernel allocate clusters one file at a time, the whole volume is
+ * planned in memory from the image's directory tree and then written
+ * front to back in one pass:
+ *
+ *   reserved sectors | FAT 1 | FAT 2 | directories | file data
+ *
+ * Every directory and every file gets one contiguous run of clusters,
+ * directories first (cluster 2 is the root), then files in image order,
+ * so both the FAT chains and the data are written strictly sequentially
+ * through large buffers. Nothing after the last used cluster is touched.
+ */
+
+#define DIR_ENTRY_SIZE 32
+#define MAX_DIR_SLOTS 65536
+#define FAT_EOC 0x0FFFFFFF
+#define FAT_MAX_FILE 0xFFFFFFFFULL
+
+#define ATTR_VOLUME_ID 0x08
+#define ATTR_DIRECTORY 0x10
+#define ATTR_ARCHIVE 0x20
+#define ATTR_LFN 0x0F
+
+#define LCASE_BASE 0x08
+#define LCASE_EXT 0x10
+
+typedef struct fb_node {
+    uint32_t first;     /* First cluster, 0 for empty files */
+    uint32_t clusters;
+    int32_t dir;        /* Index in dirs for directories, -1 otherwise */
+    uint8_t sfn[11];
+    uint8_t lcase;
+    uint8_t lfn_slots;
+} fb_node_t;
+
+typedef struct fb_dir {
+    int32_t entry;      /* Image entry, -1 for the root */
+    int32_t parent;     /* Index in dirs, -1 for the root */
+    uint32_t first;
+    uint32_t clusters;
+    uint32_t slots;
+    uint32_t *children;
+    uint32_t nchildren;
+    uint32_t cap;
+} fb_dir_t;
+
+typedef struct fb {
+    isofs_t *image;
+    fat32_layout_t l;
+    uint32_t cluster_bytes;
+    fb_node_t *nodes;
+    fb_dir_t *dirs;
+    uint32_t ndirs;
+    uint32_t cap;
+    uint32_t next;      /* First cluster not allocated yet */
+    uint16_t *upcase;   /* How lookups compare long names */
+    uint16_t time;
+    uint16_t date;
+    uint8_t label[11];
+} fb_t;
+
+typedef struct sfn_set {
+    const uint8_t **slots;
+    uint32_t mask;
+} sfn_set_t;
+
+static const char *basename_of(const char *path) {
+
+    const char *slash = strrchr(path, '/');
+
+    return slash ? slash + 1 : path;
+}
+
+/* Decodes UTF-8 into UTF-16 for long file names, replacing what FAT
+   does not allow in a name with underscores. Returns the number of
+   code units or -1 if the name is too long. */
+
+int lfn_units(const char *name, uint16_t *out) {
+
+    const unsigned char *p = (const unsigned char *) name;
+    int n = 0;
+
+    while (*p) {
+        uint32_t c = *p++;
+
+        if (c >= 0xF0 && (p[0] & 0xC0) == 0x80 && (p[1] & 0xC0) == 0x80 && (p[2] & 0xC0) == 0x80) {
+            c = ((c & 0x07) << 18) | ((p[0] & 0x3F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+            p += 3;
+        } else if (c >= 0xE0 && (p[0] & 0xC0) == 0x80 && (p[1] & 0xC0) == 0x80) {
+            c = ((c & 0x0F) << 12) | ((p[0] & 0x3F) << 6) | (p[1] & 0x3F);
+            p += 2;
+        } else if (c >= 0xC0 && (p[0] & 0xC0) == 0x80) {
+            c = ((c & 0x1F) << 6) | (p[0] & 0x3F);
+            p += 1;
+        } else if (c >= 0x80) {
+            c = '_';
+        }
+
+        if (c < 0x20 || (c < 0x80 && strchr("\"*/:<>?\\|", (int) c))) c = '_';
+
+        if (c >= 0x10000) {
+            if (n + 2 > MAX_LFN) return -1;
+            c -= 0x10000;
+            out[n++] = 0xD800 + (c >> 10);
+            out[n++] = 0xDC00 + (c & 0x3FF);
+        } else {
+            if (n + 1 > MAX_LFN) return -1;
+            out[n++] = c;
+        }
+    }
+
+    return n;
+}
+
+/* Each one of a run of case pairs, upper case first, maps to the one
+   before it */
+
+static void pairs(uint16_t *up, uint32_t first, uint32_t last) {
+    for (uint32_t c = first + 1; c <= last; c += 2) up[c] = c - 1;
+}
+
+/* The simple case mappings of the scripts file names on images are
+   written in, everything else maps to itself. exFAT only compares
+   names through the table on the volume, so it has to be complete for
+   the names it holds, not for all of Unicode. */
+
+void lfn_upcase(uint16_t *up) {
+
+    for (uint32_t c = 0; c < UPCASE_CHARS; c++) up[c] = c;
+
+    for (uint32_t c = 'a'; c <= 'z'; c++) up[c] = c - 0x20;
+
+    for (uint32_t c = 0xE0; c <= 0xFE; c++) if (c != 0xF7) up[c] = c - 0x20;
+
+    up[0xFF] = 0x178;
+
+    /* Latin Extended-A, without the dotted and dotless i */
+
+    pairs(up, 0x100, 0x12F);
+    pairs(up, 0x132, 0x137);
+    pairs(up, 0x139, 0x148);
+    pairs(up, 0x14A, 0x177);
+    pairs(up, 0x179, 0x17E);
+
+    /* Greek */
+
+    for (uint32_t c = 0x3B1; c <= 0x3CB; c++) up[c] = c - 0x20;
+
+    up[0x3C2] = 0x3A3;
+    up[0x3AC] = 0x386;
+    for (uint32_t c = 0x3AD; c <= 0x3AF; c++) up[c] = c - 0x25;
+    up[0x3CC] = 0x38C;
+    up[0x3CD] = 0x38E;
+    up[0x3CE] = 0x38F;
+
+    /* Cyrillic */
+
+    for (uint32_t c = 0x430; c <= 0x44F; c++) up[c] = c - 0x20;
+    for (uint32_t c = 0x450; c <= 0x45F; c++) up[c] = c - 0x50;
+
+    pairs(up, 0x460, 0x481);
+    pairs(up, 0x48A, 0x4BF);
+    pairs(up, 0x4C1, 0x4CE);
+    up[0x4CF] = 0x4C0;
+    pairs(up, 0x4D0, 0x52F);
+
+    /* Armenian and fullwidth Latin */
+
+    for (uint32_t c = 0x561; c <= 0x586; c++) up[c] = c - 0x30;
+    for (uint32_t c = 0xFF41; c <= 0xFF5A; c++) up[c] = c - 0x20;
+}
+
+/* A child's name the way a lookup compares it */
+
+static int lfn_folded(const isofs_t *image, uint32_t entry, const uint16_t *up, uint16_t *units) {
+
+    int len = lfn_units(basename_of(image->entries[entry].path), units);
+
+    for (int i = 0; i < len; i++) units[i] = up[units[i]];
+
+    return len;
+}
+
+int lfn_clash(const isofs_t *image, const uint32_t *children, uint32_t count, const uint16_t *up,
+              uint32_t *first, uint32_t *second) {
+
+    uint16_t units[MAX_LFN], other[MAX_LFN];
+    uint32_t *slots, *hashes;
+    uint32_t size = 16;
+    int ret = 0;
+
+    if (count < 2) return 0;
+
+    /* The slots hold a position in children plus one, 0 is free */
+
+    while (size < 2 * count) size *= 2;
+
+    slots = calloc(size, sizeof(uint32_t));
+    hashes = malloc(count * sizeof(uint32_t));
+
+    if (slots == NULL || hashes == NULL) {
+        free(slots);
+        free(hashes);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count && ret == 0; i++) {
+        int len = lfn_folded(image, children[i], up, units);
+        uint32_t h = 2166136261u;
+        uint32_t s;
+
+        /* Too long, which the caller reports */
+
+        hashes[i] = 0;
+
+        if (len < 0) continue;
+
+        for (int u = 0; u < len; u++) h = (h ^ units[u]) * 16777619u;
+
+        hashes[i] = h;
+
+        for (s = h & (size - 1); slots[s]; s = (s + 1) & (size - 1)) {
+            uint32_t j = slots[s] - 1;
+
+            if (hashes[j] == h && lfn_folded(image, children[j], up, other) == len &&
+                memcmp(units, other, len * sizeof(uint16_t)) == 0) {
+                *first = children[j];
+                *second = children[i];
+                ret = 1;
+                break;
+            }
+        }
+
+        slots[s] = i + 1;
+    }
+
+    free(slots);
+    free(hashes);
+
+    return ret;
+}
+
+static int sfn_char(int c) {
+    return isalnum(c) || (c && strchr("!#$%&'()-@^_`{}~", c));
+}
+
+/* A name that already is a valid 8.3 name, with each part in a single
+   case, needs no long name entries: the case goes into the NT flags */
+
+static int sfn_exact(const char *name, uint8_t *sfn, uint8_t *lcase) {
+
+    size_t len = strlen(name);
+    const char *dot = strchr(name, '.');
+
+    if (len == 0 || len > 12 || name[0] == '.') return 0;
+    if (dot != NULL && (dot != strrchr(name, '.') || dot[1] == 0x00)) return 0;
+
+    size_t base_len = dot ? (size_t) (dot - name) : len;
+    size_t ext_len = dot ? len - base_len - 1 : 0;
+
+    if (base_len > 8 || ext_len > 3) return 0;
+
+    int upper[2] = { 0, 0 };
+    int lower[2] = { 0, 0 };
+
+    memset(sfn, ' ', 11);
+
+    for (size_t i = 0; i < len; i++) {
+        int c = (unsigned char) name[i];
+        int part = (dot && name + i > dot) ? 1 : 0;
+
+        if (name + i == dot) continue;
+        if (c >= 0x80 || !sfn_char(c)) return 0;
+
+        if (isupper(c)) upper[part] = 1;
+        if (islower(c)) lower[part] = 1;
+
+        sfn[part ? 8 + (size_t) (name + i - dot - 1) : i] = toupper(c);
+    }
+
+    if ((upper[0] && lower[0]) || (upper[1] && lower[1])) return 0;
+
+    *lcase = (lower[0] ? LCASE_BASE : 0) | (lower[1] ? LCASE_EXT : 0);
+
+    return 1;
+}
+
+static void sfn_part(const char *from, const char *to, char *out, size_t max) {
+
+    size_t n = 0;
+
+    for (const unsigned char *p = (const unsigned char *) from; p < (const unsigned char *) to && n < max; p++) {
+        if (*p == ' ' || *p == '.' || (*p & 0xC0) == 0x80) continue;
+
+        out[n++] = (*p < 0x80 && sfn_char(*p)) ? toupper(*p) : '_';
+    }
+
+    out[n] = 0x00;
+}
+
+static uint32_t sfn_hash(const uint8_t *sfn) {
+
+    uint32_t h = 2166136261u;
+
+    for (int i = 0; i < 11; i++) h = (h ^ sfn[i]) * 16777619u;
+
+    return h;
+}
+
+static int sfn_has(sfn_set_t *set, const uint8_t *sfn) {
+
+    for (uint32_t i = sfn_hash(sfn) & set->mask; set->slots[i]; i = (i + 1) & set->mask) {
+        if (memcmp(set->slots[i], sfn, 11) == 0) return 1;
+    }
+
+    return 0;
+}
+
+static void sfn_add(sfn_set_t *set, const uint8_t *sfn) {
+
+    uint32_t i = sfn_hash(sfn) & set->mask;
+
+    while (set->slots[i]) i = (i + 1) & set->mask;
+
+    set->slots[i] = sfn;
+}
+
+/* Windows style basis name with a numeric tail, BASISN~1.EXT */
+
+static int sfn_generate(sfn_set_t *set, const char *name, uint8_t *sfn) {
+
+    const char *dot = strrchr(name, '.');
+    char base[9], ext[4];
+
+    if (dot == name) dot = NULL;
+
+    sfn_part(name, dot ? dot : name + strlen(name), base, 8);
+    sfn_part(dot ? dot + 1 : "", dot ? name + strlen(name) : "", ext, 3);
+
+    if (base[0] == 0x00) snprintf(base, sizeof(base), "_");
+
+    for (uint32_t n = 1; n < 1000000; n++) {
+        char tail[9];
+        int tail_len = snprintf(tail, sizeof(tail), "~%u", n);
+        size_t keep = strlen(base);
+
+        if (keep > (size_t) (8 - tail_len)) keep = 8 - tail_len;
+
+        memset(sfn, ' ', 11);
+        memcpy(sfn, base, keep);
+        memcpy(sfn + keep, tail, tail_len);
+        memcpy(sfn + 8, ext, strlen(ext));
+
+        if (!sfn_has(set, sfn)) return 0;
+    }
+
+    return -1;
+}
+
+static uint8_t sfn_checksum(const uint8_t *sfn) {
+
+    uint8_t sum = 0;
+
+    for (int i = 0; i < 11; i++) sum = ((sum & 1) << 7) + (sum >> 1) + sfn[i];
+
+    return sum;
+}
+
+static int add_dir(fb_t *b, int32_t entry, int32_t parent) {
+
+    if (b->ndirs == b->cap) {
+        uint32_t cap = b->cap ? b->cap * 2 : 256;
+        fb_dir_t *tmp = realloc(b->dirs, cap * sizeof(fb_dir_t));
+
+        if (tmp == NULL) return -1;
+
+        b->dirs = tmp;
+        b->cap = cap;
+    }
+
+    memset(&b->dirs[b->ndirs], 0, sizeof(fb_dir_t));
+    b->dirs[b->ndirs].entry = entry;
+    b->dirs[b->ndirs].parent = parent;
+
+    return b->ndirs++;
+}
+
+static int add_child(fb_dir_t *d, uint32_t entry) {
+
+    if (d->nchildren == d->cap) {
+        uint32_t cap = d->cap ? d->cap * 2 : 16;
+        uint32_t *tmp = realloc(d->children, cap * sizeof(uint32_t));
+
+        if (tmp == NULL) return -1;
+
+        d->children = tmp;
+        d->cap = cap;
+    }
+
+    d->children[d->nchildren++] = entry;
+
+    return 0;
+}
+
+static size_t dir_path_len(fb_t *b, uint32_t d) {
+    return b->dirs[d].entry < 0 ? 0 : strlen(b->image->entries[b->dirs[d].entry].path);
+}
+
+/* Image entries come parents first, so a stack of open directories
+   is enough to find the parent of each entry */
+
+static int plan_tree(fb_t *b) {
+
+    isofs_t *image = b->image;
+    uint32_t stack[256];
+    int depth = 0;
+
+    if (add_dir(b, -1, -1) < 0) return -1;
+
+    stack[0] = 0;
+
+    for (size_t i = 0; i < image->count; i++) {
+        const isofs_entry_t *e = &image->entries[i];
+        const char *slash = strrchr(e->path, '/');
+        size_t parent_len = slash ? (size_t) (slash - e->path) : 0;
+
+        b->nodes[i].dir = -1;
+
+        while (depth > 0 && (dir_path_len(b, stack[depth]) != parent_len ||
+                             strncmp(image->entries[b->dirs[stack[depth]].entry].path, e->path, parent_len) != 0)) {
+            depth--;
+        }
+
+        if (S_ISLNK(e->mode)) {
+            log_write(LOG_COPY, LOG_INFO, "Skipping symlink: %s -> %s\n", e->path, e->link);
+            continue;
+        }
+
+        if (S_ISREG(e->mode) && e->size > FAT_MAX_FILE) {
+            r_printf("ERROR: %s is larger than 4 GiB and can't be stored on FAT32.\n", e->path);
+            return -1;
+        }
+
+        if (add_child(&b->dirs[stack[depth]], i) < 0) return -1;
+
+        if (S_ISDIR(e->mode)) {
+            int d = add_dir(b, i, stack[depth]);
+
+            if (d < 0) return -1;
+
+            if (depth + 1 >= (int) (sizeof(stack) / sizeof(stack[0]))) {
+                r_printf("ERROR: Directories are nested more than %d levels deep, too deep for FAT32\n",
+                         (int) (sizeof(stack) / sizeof(stack[0])) - 1);
+                return -1;
+            }
+
+            b->nodes[i].dir = d;
+            stack[++depth] = d;
+        }
+    }
+
+    return 0;
+}
+
+static int plan_names(fb_t *b, uint32_t d) {
+
+    fb_dir_t *dir = &b->dirs[d];
+    uint16_t units[MAX_LFN];
+    sfn_set_t set;
+    uint32_t size = 16;
+
+    while (size < 2 * (dir->nchildren + 2)) size *= 2;
+
+    if ((set.slots = calloc(size, sizeof(uint8_t *))) == NULL) return -1;
+
+    set.mask = size - 1;
+
+    /* The root holds the volume label, the others "." and ".." */
+
+    dir->slots = dir->entry < 0 ? 1 : 2;
+
+    for (uint32_t i = 0; i < dir->nchildren; i++) {
+        const isofs_entry_t *e = &b->image->entries[dir->children[i]];
+        fb_node_t *n = &b->nodes[dir->children[i]];
+        const char *name = basename_of(e->path);
+        int len;
+
+        n->lfn_slots = 0;
+
+        if (!sfn_exact(name, n->sfn, &n->lcase) || sfn_has(&set, n->sfn)) {
+            if ((len = lfn_units(name, units)) < 0) {
+                r_printf("ERROR: File name too long for FAT32: %s\n", e->path);
+                free(set.slots);
+                return -1;
+            }
+
+            if (sfn_generate(&set, name, n->sfn) < 0) {
+                r_printf("ERROR: Too many similar names in %s\n", e->path);
+                free(set.slots);
+                return -1;
+            }
+
+            n->lcase = 0;
+            n->lfn_slots = (len + 12) / 13;
+        }
+
+        sfn_add(&set, n->sfn);
+        dir->slots += 1 + n->lfn_slots;
+    }
+
+    free(set.slots);
+
+    /* The short names are unique by now, but two long names that only
+       differ in case, or in what lfn_units() replaced, would still be
+       two entries no lookup tells apart */
+
+    uint32_t first, second;
+    int clash = lfn_clash(b->image, dir->children, dir->nchildren, b->upcase, &first, &second);
+
+    if (clash < 0) return -1;
+
+    if (clash > 0) {
+        r_printf("ERROR: %s and %s have the same name on FAT32\n", b->image->entries[first].path,
+                 b->image->entries[second].path);
+        return -1;
+    }
+
+    if (dir->slots > MAX_DIR_SLOTS) {
+        r_printf("ERROR: Too many entries in one directory for FAT32\n");
+        return -1;
+    }
+
+    dir->clusters = (dir->slots * DIR_ENTRY_SIZE + b->cluster_bytes - 1) / b->cluster_bytes;
+
+    return 0;
+}
+
+static int plan_clusters(fb_t *b) {
+
+    b->next = 2;
+
+    for (uint32_t d = 0; d < b->ndirs; d++) {
+        b->dirs[d].first = b->next;
+        b->next += b->dirs[d].clusters;
+
+        if (b->dirs[d].entry >= 0) {
+            b->nodes[b->dirs[d].entry].first = b->dirs[d].first;
+            b->nodes[b->dirs[d].entry].clusters = b->dirs[d].clusters;
+        }
+    }
+
+    for (size_t i = 0; i < b->image->count; i++) {
+        const isofs_entry_t *e = &b->image->entries[i];
+        fb_node_t *n = &b->nodes[i];
+
+        if (!S_ISREG(e->mode)) continue;
+
+        n->clusters = (e->size + b->cluster_bytes - 1) / b->cluster_bytes;
+        n->first = n->clusters ? b->next : 0;
+
+        if ((uint64_t) b->next + n->clusters - 2 > b->l.clusters) {
+            r_printf("ERROR: Image does not fit on the device (%.1f MiB needed).\n",
+                     b->image->total_bytes / 1048576.0);
+            return -1;
+        }
+
+        b->next += n->clusters;
+    }
+
+    if (b->next - 2 > b->l.clusters) {
+        r_printf("ERROR: Image does not fit on the device.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    put16(p, v & 0xFFFF);
+    put16(p + 2, v >> 16);
+}
+
+static void put_sfn(fb_t *b, uint8_t *slot, const uint8_t *name, uint8_t attr, uint8_t lcase,
+                    uint32_t cluster, uint32_t size) {
+
+    memcpy(slot, name, 11);
+    slot[11] = attr;
+    slot[12] = lcase;
+    put16(slot + 14, b->time);
+    put16(slot + 16, b->date);
+    put16(slot + 18, b->date);
+    put16(slot + 20, cluster >> 16);
+    put16(slot + 22, b->time);
+    put16(slot + 24, b->date);
+    put16(slot + 26, cluster & 0xFFFF);
+    put32(slot + 28, size);
+}
+
+static void put_lfn(uint8_t *slot, const uint16_t *units, int len, int seq, int last, uint8_t sum) {
+
+    static const int pos[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+
+    slot[0] = seq | (last ? 0x40 : 0x00);
+    slot[11] = ATTR_LFN;
+    slot[13] = sum;
+
+    for (int i = 0; i < 13; i++) {
+        int at = (seq - 1) * 13 + i;
+        uint16_t c = at < len ? units[at] : (at == len ? 0x0000 : 0xFFFF);
+
+        put16(slot + pos[i], c);
+    }
+}
+
+static int write_dir(fb_t *b, stream_t *s, uint32_t d) {
+
+    fb_dir_t *dir = &b->dirs[d];
+    size_t size = (size_t) dir->clusters * b->cluster_bytes;
+    uint8_t *buf = calloc(1, size);
+    uint8_t *slot = buf;
+    uint16_t units[MAX_LFN];
+
+    if (buf == NULL) return -1;
+
+    if (dir->entry < 0) {
+        put_sfn(b, slot, b->label, ATTR_VOLUME_ID, 0, 0, 0);
+        slot += DIR_ENTRY_SIZE;
+    } else {
+        uint32_t parent = dir->parent > 0 ? b->dirs[dir->parent].first : 0;
+
+        put_sfn(b, slot, (const uint8_t *) ".          ", ATTR_DIRECTORY, 0, dir->first, 0);
+        slot += DIR_ENTRY_SIZE;
+        put_sfn(b, slot, (const uint8_t *) "..         ", ATTR_DIRECTORY, 0, parent, 0);
+        slot += DIR_ENTRY_SIZE;
+    }
+
+    for (uint32_t i = 0; i < dir->nchildren; i++) {
+        const isofs_entry_t *e = &b->image->entries[dir->children[i]];
+        fb_node_t *n = &b->nodes[dir->children[i]];
+
+        if (n->lfn_slots) {
+            int len = lfn_units(basename_of(e->path), units);
+            uint8_t sum = sfn_checksum(n->sfn);
+
+            for (int seq = n->lfn_slots; seq >= 1; seq--) {
+                put_lfn(slot, units, len, seq, seq == n->lfn_slots, sum);
+                slot += DIR_ENTRY_SIZE;
+            }
+        }
+
+        if (S_ISDIR(e->mode)) {
+            put_sfn(b, slot, n->sfn, ATTR_DIRECTORY, n->lcase, n->first, 0);
+        } else {
+            put_sfn(b, slot, n->sfn, ATTR_ARCHIVE, n->lcase, n->first, (uint32_t) e->size);
+        }
+
+        slot += DIR_ENTRY_SIZE;
+    }
+
+    int ret = stream_write(s, buf, size);
+
+    free(buf);
+
+    return ret;
+}
+
+static void chain(uint32_t *fat, uint32_t first, uint32_t clusters) {
+
+    for (uint32_t c = first; c + 1 < first + clusters; c++) fat[c] = htole32(c + 1);
+
+    if (clusters) fat[first + clusters - 1] = htole32(FAT_EOC);
+}
+
+static int write_fats(fb_t *b, stream_t *s) {
+
+    uint32_t *fat = calloc(b->next, sizeof(uint32_t));
+
+    if (fat == NULL) return -1;
+
+    fat[0] = htole32(0x0FFFFFF8);
+    fat[1] = htole32(FAT_EOC);
+
+    for (uint32_t d = 0; d < b->ndirs; d++) chain(fat, b->dirs[d].first, b->dirs[d].clusters);
+
+    for (size_t i = 0; i < b->image->count; i++) {
+        if (S_ISREG(b->image->entries[i].mode)) chain(fat, b->nodes[i].first, b->nodes[i].clusters);
+    }
+
+    uint64_t used = (uint64_t) b->next * sizeof(uint32_t);
+    uint64_t fat_bytes = (uint64_t) b->l.fat_sz * 512;
+    int ret = 0;
+
+    for (int i = 0; i < b->l.num_fats && ret == 0; i++) {
+        if (stream_write(s, fat, used) < 0 || stream_zero(s, fat_bytes - used) < 0) ret = -1;
+    }
+
+    free(fat);
+
+    return ret;
+}
+
+static int write_reserved(fb_t *b, stream_t *s, const char *label) {
+
+    unsigned char bpb[512];
+    unsigned char fsi[512];
+    size_t size = (size_t) b->l.rsvd_sec * 512;
+    uint8_t *buf = calloc(1, size);
+
+    if (buf == NULL) return -1;
+
+    fat32_boot_sectors(&b->l, label, bpb, fsi);
+
+    /* The boot sectors describe an empty volume, this one is filled */
+
+    put32(fsi + FSI_FREE_COUNT_OFFSET, b->l.clusters - (b->next - 2));
+    put32(fsi + FSI_NXT_FREE_OFFSET, b->next);
+
+    memcpy(buf, bpb, 512);
+    memcpy(buf + 512, fsi, 512);
+    memcpy(buf + 3072, bpb, 512);
+    memcpy(buf + 3584, fsi, 512);
+
+    int ret = stream_write(s, buf, size);
+
+    free(buf);
+
+    return ret;
+}
+
+static int write_files(fb_t *b, stream_t *s, verify_t *verify) {
+
+    progress_begin(b->image->total_bytes);
+
+    for (size_t i = 0; i < b->image->count; i++) {
+        const isofs_entry_t *e = &b->image->entries[i];
+        uint64_t off = 0;
+        uint32_t crc = 0;
+
+        if (!S_ISREG(e->mode) || e->size == 0) continue;
+
+        TRACE_SPAN_ARG("file", e->path);
+
+        r_debug(LOG_COPY, "Extracting: %s\n", e->path);
+
+        while (off < e->size) {
+            size_t room;
+            unsigned char *dst = stream_reserve(s, &room);
+
+            if (dst == NULL) return -1;
+
+            if (room > e->size - off) room = e->size - off;
+
+            if (isofs_pread(b->image, e, dst, room, off) != (ssize_t) room) {
+                r_printf("Error reading %s from the image\n", e->path);
+                return -1;
+            }
+
+            if (verify != NULL) crc = crc32c(crc, dst, room);
+
+            if (stream_commit(s, room) < 0) return -1;
+
+            off += room;
+
+            progress_add(room);
+        }
+
+        if (verify != NULL) {
+            uint64_t at = (uint64_t) b->l.data_start * 512 + (uint64_t) (b->nodes[i].first - 2) * b->cluster_bytes;
+
+            if (verify_add(verify, at, e->size, crc, 0, e->path) < 0) return -1;
+        }
+
+        if (stream_zero(s, (uint64_t) b->nodes[i].clusters * b->cluster_bytes - e->size) < 0) return -1;
+    }
+
+    return 0;
+}
+
+static void set_label(fb_t *b, const char *label) {
+
+    memset(b->label, ' ', 11);
+
+    for (int i = 0; i < 11 && label[i]; i++) {
+        b->label[i] = toupper((unsigned char) label[i]);
+    }
+}
+
+static void set_time(fb_t *b) {
+
+    time_t now = time(NULL);
+    struct tm tm;
+
+    localtime_r(&now, &tm);
+
+    b->time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+    b->date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+}
+
+static void free_builder(fb_t *b) {
+
+    for (uint32_t d = 0; d < b->ndirs; d++) free(b->dirs[d].children);
+
+    free(b->dirs);
+    free(b->nodes);
+    free(b->upcase);
+}
+
+static void stream_written(void *arg, uint64_t end) {
+    verify_written(arg, end);
+}
+
+int build_fat32(const uint32_t *part_fd, isofs_t *image, uint8_t cluster_size, char *label,
+                uint32_t align, size_t buf_size, verify_t *verify) {
+
+    fb_t b;
+    uint64_t sectors;
+    stream_t s;
+
+    memset(&b, 0, sizeof(b));
+    b.image = image;
+
+    if (fat32_sectors(*part_fd, &sectors) < 0) return -1;
+
+    if (fat32_layout(sectors, cluster_size, align, &b.l) < 0) return -1;
+
+    b.cluster_bytes = b.l.sec_per_clus * 512;
+
+    set_label(&b, label);
+    set_time(&b);
+
+    b.nodes = calloc(image->count + 1, sizeof(fb_node_t));
+    b.upcase = malloc(UPCASE_CHARS * sizeof(uint16_t));
+
+    if (b.nodes == NULL || b.upcase == NULL) {
+        free_builder(&b);
+        return -1;
+    }
+
+    lfn_upcase(b.upcase);
+
+    int ret = plan_tree(&b);
+
+    for (uint32_t d = 0; d < b.ndirs && ret == 0; d++) ret = plan_names(&b, d);
+
+    if (ret == 0) ret = plan_clusters(&b);
+
+    if (ret < 0) {
+        free_builder(&b);
+        return -1;
+    }
+
+    r_printf("FAT32 layout: %u directories, %u of %u clusters of %u bytes used\n",
+             b.ndirs, b.next - 2, b.l.clusters, b.cluster_bytes);
+
+    if (buf_size == 0) buf_size = STREAM_BUF_SIZE;
+
+    if (stream_open(&s, *part_fd, 0, buf_size) < 0) {
+        free_builder(&b);
+        return -1;
+    }
+
+    /* Each file is checked as soon as the device has all of it */
+
+    if (verify != NULL) {
+        s.written = stream_written;
+        s.written_arg = verify;
+    }
+
+    ret = write_reserved(&b, &s, label);
+
+    if (ret == 0) ret = write_fats(&b, &s);
+
+    for (uint32_t d = 0; d < b.ndirs && ret == 0; d++) ret = write_dir(&b, &s, d);
+
+    if (ret == 0) ret = write_files(&b, &s, verify);
+
+    if (stream_close(&s) < 0) ret = -1;
+
+    free_builder(&b);
+
+    return ret;
+}
@@ -0,0 +1,29 @@
+#ifndef FATBUILD_H
+#define FATBUILD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../isofs.h"
+#include "verify.h"
+
+#define MAX_LFN 255 /* UTF-16 units of a long name, FAT32 and exFAT alike */
+#define UPCASE_CHARS 0x10000
+
+/* align is what the partition start is aligned to, see fat32_layout(),
+   buf_size the size of the writes, 0 for STREAM_BUF_SIZE */
+
+int build_fat32(const uint32_t *part_fd, isofs_t *image, uint8_t cluster_size, char *label,
+                uint32_t align, size_t buf_size, verify_t *verify);
+int lfn_units(const char *name, uint16_t *out);
+void lfn_upcase(uint16_t *up);
+
+/* Finds two children of one directory whose names are the same once
+   lfn_units() replaced what the file system doesn't allow and once
+   up-cased through up. Returns 1 with their image entries in first
+   and second, 0 when every name is unique and -1 when out of memory. */
+
+int lfn_clash(const isofs_t *image, const uint32_t *children, uint32_t count, const uint16_t *up,
+              uint32_t *first, uint32_t *second);
+
+#endif // FATBUILD_H
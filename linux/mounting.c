@@ -4,13 +4,13 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <ftw.h>
 #include <linux/loop.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -18,16 +18,13 @@
 #include "definitions.h"
 #include "mounting.h"
 
-#define BUF_SIZE 4096
-
-static char *source;
-static char *dest;
-static long file_count = 0;
-static long files_copied = 0;
-
-
 int make_temp_device(uint8_t major, uint8_t minor, uint32_t *device_fd) {
-  remove(TEMP_DEVICE);
+  return make_temp_node(TEMP_DEVICE, major, minor, device_fd);
+}
+
+int make_temp_node(const char *path, uint8_t major, uint8_t minor,
+                   uint32_t *device_fd) {
+  remove(path);
 
   r_printf("Creating temporary node for Rufusl: major: %d minor %d\n", major,
            minor);
@@ -36,14 +33,14 @@ int make_temp_device(uint8_t major, uint8_t minor, uint32_t *device_fd) {
 
   if (temp_dev < 0) return -1;
 
-  if (mknod(TEMP_DEVICE, S_IFBLK, temp_dev) < 0) {
+  if (mknod(path, S_IFBLK, temp_dev) < 0) {
     r_printf("Creating temporaray device node failed: %s\n", strerror(errno));
     return -1;
   }
 
   r_printf("Opening device for writing ... ");
 
-  *device_fd = open(TEMP_DEVICE, O_RDWR);
+  *device_fd = open(path, O_RDWR);
 
   if (*device_fd < 0) {
       r_printf("Error opening device: %s\n", strerror(errno));
@@ -51,6 +48,8 @@ int make_temp_device(uint8_t major, uint8_t minor, uint32_t *device_fd) {
   }
 
   r_printf(" OK! fd: %d\n", *device_fd);
+
+  return 0;
 }
 
 int make_temp_partition(uint8_t major, uint8_t minor, uint32_t *part_fd) {
@@ -76,6 +75,8 @@ int make_temp_partition(uint8_t major, uint8_t minor, uint32_t *part_fd) {
   }
 
   r_printf(" OK! fd: %d\n", *part_fd);
+
+  return 0;
 }
 
 int make_temp_dir(const char *path) {
@@ -122,121 +123,6 @@ int make_temp_dir(const char *path) {
   }
 }
 
-int callback(const char *fpath, const struct stat *sb, int typeflag,
-             struct FTW *ftwbuf) {
-  /* Allocate new array and copy fpath into it because
-     nftw() has an assertion if fpath has been changed. */
-
-  char buf[strlen(fpath) + 1];
-  memcpy(buf, fpath, strlen(fpath) + 1);
-
-  /* Get length of path where the loop device is mounted */
-
-  uint32_t a_len = strlen(source);
-
-  /* Trim soure path. Write each char from (buf + a_len + 1) to buf. */
-
-  uint32_t i = a_len + 1;
-  uint32_t j = 0;
-
-  for (; j < sizeof(buf) - a_len; i++) {
-    buf[j] = *(buf + i);
-    j++;
-  }
-
-  buf[j] = 0x00; /* Null-terminate the string. Now we have a relative path */
-
-  /* Allocate new buffer with size of destination path, and the relative path +
-   * a null terminator */
-
-  char dest_path[strlen(dest) + strlen(buf) + 1];
-
-  /* Concate destination and relative path */
-
-  snprintf(dest_path, strlen(dest) + strlen(buf) + 1, "%s%s", dest, buf);
-
-  /* Now we have an absolute source and destination path. :) */
-
-  files_copied++;
-
-  if (typeflag == FTW_D) {
-    mkdir(dest_path, 0700);
-    return 0;
-  }
-
-  int inputFd, outputFd, openFlags;
-  mode_t filePerms;
-  ssize_t numRead;
-
-  r_printf("Extracting: %s\n", dest_path);
-  set_progress_bar(
-      (int)((((float)file_count - ((float)file_count - (float)files_copied)) /
-             (float)file_count) *
-            100.0f));
-
-  // set_progress_bar(  (file_count - (file_count - files_copied) / file_count)
-  // * 100.0f  );
-
-  char buf1[BUF_SIZE];
-
-  inputFd = open(fpath, O_RDONLY);
-
-  if (inputFd == -1) {
-    r_printf("Error: %s\n", strerror(errno));
-    return -1;
-  }
-
-  openFlags = O_CREAT | O_WRONLY;
-  filePerms = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
-
-  outputFd = open(dest_path, openFlags, filePerms);
-
-  if (outputFd == -1) {
-    r_printf("Error: %s\n", strerror(errno));
-    return -1;
-  }
-
-  while ((numRead = read(inputFd, buf1, BUF_SIZE)) > 0) {
-    if (write(outputFd, buf1, numRead) != numRead) {
-      r_printf("Error: %s\n", strerror(errno));
-      break;
-    }
-  }
-
-  if (numRead == -1) {
-    r_printf("Error: %s\n", strerror(errno));
-    return -1;
-  }
-  if (close(outputFd) == -1) {
-    r_printf("Error: %s\n", strerror(errno));
-    return -1;
-  }
-  if (close(inputFd) == -1) {
-    r_printf("Error: %s\n", strerror(errno));
-    return -1;
-  }
-
-  return 0;
-}
-
-int count_files(const char *fpath, const struct stat *sb, int typeflag,
-                struct FTW *ftwbuf) {
-  file_count++;
-  return 0;
-}
-
-int recursive_copy(char *src, char *dest_) {
-  source = src;
-  dest = dest_;
-
-  files_copied = 0;
-  file_count = 0;
-
-  r_printf("Counting files...\n");
-  nftw(source, count_files, 4, 0);
-  nftw(source, callback, 4, 0);
-}
-
 void clean_up(const uint32_t *dev_fd, const uint32_t *part_fd,
               const uint32_t *loop_fd,
               const uint32_t *iso_fd) {
@@ -329,7 +215,19 @@ int mount_device_to_temp(const int32_t *file_system) {
       }
       r_printf("Mount OK\n");
       break;
+    case FS_EXFAT:
+      if (mount(TEMP_PART, TEMP_DIR, MOUNT_EXFAT, MS_MGC_VAL, NULL) < 0) {
+        r_printf("Device mount error: %s\n", strerror(errno));
+        return -1;
+      }
+      r_printf("Mount OK\n");
+      break;
+    default:
+      r_printf("Can't mount unknown file system %d\n", *file_system);
+      return -1;
   }
+
+  return 0;
 }
 
 int mount_iso_to_loop(const char *isopath, int isopath_len,
@@ -8,6 +8,7 @@
 #include <fcntl.h>
 
 #include "log.h"
+#include "progress.h"
 #include "partition.h"
 #include "definitions.h"
 
@@ -22,21 +23,43 @@
     return -1;        \
   }
 
+int partition_bounds(int64_t length, int64_t sector_size, uint32_t align,
+                     int64_t *start, int64_t *end) {
+  int64_t step;
+
+  if (align == 0) align = PART_ALIGN_DEFAULT;
+
+  step = align / sector_size > 0 ? align / sector_size : 1;
+  *start = step;
+  *end = (length - PART_GPT_BACKUP) / step * step - 1;
+
+  if (*end <= *start) {
+    r_printf("Device too small for %u KiB alignment\n", align / 1024);
+    return -1;
+  }
+
+  return 0;
+}
+
 /* WARNING: GNU chose the integer 0 to indicate an error, the code
    below is OK! Why they did that is beyond me. */
 
-int nuke_and_partition(const char *path_dev, const int table, const int fs) {
+int nuke_and_partition(const char *path_dev, const int table, const int fs, uint32_t align) {
   r_printf("Using device: %s\n", path_dev);
 
   PedDevice *device;
   PedDisk *disk;
   PedPartition *part;
   PedConstraint *constr;
+  int64_t start, end;
 
   PedFileSystemType *fstype;
   PedDiskType *type;
 
-  set_progress_bar(10);
+  /* Nothing here has a size worth counting, the bar sits at zero
+     until the table is on the device */
+
+  progress_begin(0);
 
   switch (fs) {
     case FS_NTFS:
@@ -47,6 +70,10 @@ int nuke_and_partition(const char *path_dev, const int table, const int fs) {
       fstype = ped_file_system_type_get(FAT32);
       r_printf("* Marking partition type as FAT32\n");
       break;
+    case FS_EXFAT:
+      fstype = ped_file_system_type_get(EXFAT);
+      r_printf("* Marking partition type as exFAT\n");
+      break;
     default:
       r_printf("Internal error: unknown fs type.\n");
       return -1;
@@ -55,16 +82,13 @@ int nuke_and_partition(const char *path_dev, const int table, const int fs) {
   ASSERT(fstype,
          "Your system does not appear to be supporting FAT32/NTFS. Please "
          "install ntfs-3g, mkfs.fat or related.\n");
-  set_progress_bar(20);
   device = ped_device_get(path_dev);
   ASSERT(device, "Opening device failed.\n");
-  set_progress_bar(30);
   constr = ped_device_get_constraint(device);
   ASSERT(constr,
          "Failed to get device info. This *could* happen if your USB disk is a "
          "4K sector model. Try a different flash drive.\n");
 
-  set_progress_bar(40);
   switch (table) {
     case TB_GPT:
       type = ped_disk_type_get(GPT);
@@ -82,13 +106,26 @@ int nuke_and_partition(const char *path_dev, const int table, const int fs) {
   ASSERT(type,
          "libparted internal error: MBR/GPT Partition table info not found.\n");
   disk = ped_disk_new_fresh(device, type);
-  set_progress_bar(50);
   ASSERT(disk, "Failed to nuke the USB. Full RAM?\n");
+
+  /* Start on an erase block boundary and end on one short of the
+     backup GPT, so the partition is a whole number of erase blocks */
+
+  if (partition_bounds(device->length, device->sector_size, align, &start, &end) < 0) return -1;
+
+  r_printf("* Partition from sector %lld to %lld, aligned to %u KiB\n",
+           (long long)start, (long long)end, (align ? align : PART_ALIGN_DEFAULT) / 1024);
+
   part =
-      ped_partition_new(disk, PED_PARTITION_NORMAL, fstype, 1, device->length);
+      ped_partition_new(disk, PED_PARTITION_NORMAL, fstype, start, end);
   ASSERT(part, "Failed to construct partition Full RAM?\n");
 
-  set_progress_bar(60);
+  /* Exactly there, parted would otherwise move it to its own idea
+     of alignment */
+
+  ped_constraint_destroy(constr);
+  constr = ped_constraint_exact(&part->geom);
+  ASSERT(constr, "Failed to construct partition constraint. Full RAM?\n");
 
   if (ped_partition_is_flag_available(part, PED_PARTITION_BOOT)) {
     r_printf("* Marking partition bootable\n");
@@ -97,64 +134,19 @@ int nuke_and_partition(const char *path_dev, const int table, const int fs) {
     r_printf("WARNING: Could not set bootable flag on partition!\n");
   }
 
-  set_progress_bar(70);
-
   ASSERT_(ped_disk_add_partition(disk, part, constr),
           "Failed to add partition to MBR\n");
   r_printf("Writing partition table to MBR on %s\n", path_dev);
-  set_progress_bar(80);
 
   ASSERT_(ped_disk_commit_to_dev(disk),
           "FATAL ERROR: FAILED TO WRITE MBR TO DEVICE!\n");
   r_printf("Refreshing kernel device partition info\n");
-  set_progress_bar(90);
   ASSERT_(ped_disk_commit_to_os(disk),
           "Error informing kernel of new partition!\n");
-  set_progress_bar(100);
+  progress_finish();
   ped_device_free_all();
 
   sync();
 
   return 0;
 }
-
-int full_wipe(const uint32_t *device_fd) {
-
-  set_progress_bar(0);
-
-  size_t file_size;
-
-  if (ioctl(*device_fd, BLKGETSIZE, &file_size) < 0) {
-    perror("ioctl");
-    return -1;
-  }
-
-  file_size += file_size * 512;
-  r_printf("Fully wiping %ld bytes on fd %d\n", file_size, *device_fd);
-
-  char buffer[4096];
-
-  for (uint64_t i = 0; i < sizeof(buffer); i++) {
-    buffer[i] = 0x00;
-  }
-
-  ssize_t temp;
-  size_t temp2 = 0;
-  double copied = 0;
-
-  while ((temp = write(*device_fd, buffer, 4096)) > 0) {
-
-    copied += temp;
-    temp2 += temp;
-
-    if (temp2 > 50000000) {
-      set_progress_bar((int)(((file_size - (file_size - copied)) / file_size) * 100.0f));
-      temp2 = 0;
-    }
-
-  }
-
-  sync();
-
-  return 0;
-}
@@ -1,8 +1,19 @@
+#include <stdint.h>
+
 #define MBR "msdos"
 #define GPT "gpt"
 
 #define FAT32 "fat32"
 #define NTFS "ntfs"
+#define EXFAT NTFS /* libparted has no exFAT, both are type 0x07 and basic data */
+
+#define PART_ALIGN_DEFAULT (4 * 1024 * 1024) /* A multiple of most erase blocks */
+#define PART_GPT_BACKUP 34                   /* Sectors the backup GPT needs at the end */
+
+/* The partition starts and ends on a multiple of align bytes,
+   PART_ALIGN_DEFAULT when it is 0. partition_bounds() says where it
+   goes on a device of length sectors, before anything is written. */
 
-int nuke_and_partition(const char *path_dev, const int table, const int fs);
-int full_wipe(const uint32_t *device_fd);
+int partition_bounds(int64_t length, int64_t sector_size, uint32_t align,
+                     int64_t *start, int64_t *end);
+int nuke_and_partition(const char *path_dev, const int table, const int fs, uint32_t align);
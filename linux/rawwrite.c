@@ -0,0 +1,558 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../log.h"
+#include "../progress.h"
+#include "../trace.h"
+#include "blockio.h"
+#include "crc32c.h"
+#include "decomp.h"
+#include "rawwrite.h"
+#include "verify.h"
+#include "zeroscan.h"
+
+/* DD mode: the image is copied to the whole device as is. A reader
+   thread fills a ring of aligned chunks while this thread hands them
+   to the block I/O layer, which keeps up to depth writes in flight, so
+   reading the image overlaps writing the stick. Both ends are opened
+   with O_DIRECT where the file system and driver allow it, which keeps
+   the page cache out of the way and makes every write a full, aligned
+   chunk.
+
+   Raw images are often mostly empty. Holes in a sparse image are found
+   with SEEK_DATA and never read, chunks that read back as zeros are
+   spotted by a vector scan, and neither is sent over USB: when the
+   device was just wiped they are skipped, otherwise runs of them become
+   one BLKZEROOUT each.
+
+   Compressed images are decoded by the reader thread straight into the
+   ring, so decoding, zero scanning and writing all run at once and the
+   ring bounds how far the decoder can get ahead of the device. */
+
+#define RAW_ALIGN BLOCKIO_ALIGN
+#define RAW_MAX_MEMORY (256 * 1024 * 1024)
+#define RAW_MAX_ZERO_RUN (1024ULL * 1024 * 1024)
+
+#define SLOT_FREE 0
+#define SLOT_FILLED 1
+#define SLOT_BUSY 2
+
+typedef struct raw_ring {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  unsigned char **buf;
+  size_t *len;
+  int *state;
+  int *zero;         /* Chunk is all zeros, not necessarily read */
+  uint32_t *crc;     /* Only computed when verifying */
+  uint64_t *offs;    /* Device offset of a chunk in flight */
+  verify_t *verify;
+  int nbufs;
+  uint64_t read_seq; /* Chunks read so far, chunk n lives in n % nbufs */
+  int eof;
+  int error;
+  int stop;
+
+  int fd;
+  decomp_t *decomp;  /* NULL for uncompressed images */
+  size_t chunk_size;
+  uint64_t read_pos;
+  uint64_t in_pos;   /* Compressed bytes behind read_pos, under lock */
+
+  uint64_t total;
+  uint64_t written;
+} raw_ring_t;
+
+static ssize_t read_full(int fd, unsigned char *buf, size_t len, uint64_t off) {
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t n = pread(fd, buf + done, len - done, off + done);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+
+    if (n == 0) break;
+
+    done += n;
+  }
+
+  return done;
+}
+
+static int write_full(int fd, const unsigned char *buf, size_t len,
+                      uint64_t off) {
+  while (len > 0) {
+    ssize_t n = pwrite(fd, buf, len, off);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+
+    buf += n;
+    len -= n;
+    off += n;
+  }
+
+  return 0;
+}
+
+static void *reader_thread(void *arg) {
+  raw_ring_t *r = arg;
+
+  trace_thread("reader");
+
+  for (;;) {
+    pthread_mutex_lock(&r->lock);
+
+    int slot = r->read_seq % r->nbufs;
+
+    while (r->state[slot] != SLOT_FREE && !r->stop)
+      pthread_cond_wait(&r->cond, &r->lock);
+
+    if (r->stop) {
+      pthread_mutex_unlock(&r->lock);
+      break;
+    }
+
+    pthread_mutex_unlock(&r->lock);
+
+    /* A chunk entirely inside a hole is known to be zeros */
+
+    int hole = 0;
+    ssize_t n;
+    TRACE_SPAN("read");
+
+    if (r->decomp == NULL) {
+      off_t data = lseek(r->fd, r->read_pos, SEEK_DATA);
+
+      hole = (data < 0 && errno == ENXIO) ||
+             (data >= 0 && (uint64_t)data >= r->read_pos + r->chunk_size);
+    }
+
+    if (r->decomp != NULL) {
+      n = decomp_read(r->decomp, r->buf[slot], r->chunk_size);
+      if (n < 0) errno = EIO;
+    } else if (hole) {
+      n = r->total - r->read_pos < r->chunk_size ? r->total - r->read_pos : r->chunk_size;
+    } else {
+      n = read_full(r->fd, r->buf[slot], r->chunk_size, r->read_pos);
+    }
+
+    int err = n < 0 ? errno : 0;
+    int zero = !err && (hole || is_zero(r->buf[slot], n));
+
+    if (!err && !zero && r->verify) r->crc[slot] = crc32c(0, r->buf[slot], n);
+
+    pthread_mutex_lock(&r->lock);
+
+    if (err) {
+      r->error = err;
+    } else {
+      r->read_pos += n;
+      if (r->decomp != NULL) r->in_pos = r->decomp->in_pos;
+      r->len[slot] = n;
+      r->zero[slot] = zero;
+      r->state[slot] = SLOT_FILLED;
+      r->read_seq++;
+      if ((size_t)n < r->chunk_size) r->eof = 1;
+    }
+
+    pthread_cond_broadcast(&r->cond);
+
+    int done = r->eof || r->error;
+
+    pthread_mutex_unlock(&r->lock);
+
+    if (done) break;
+  }
+
+  return NULL;
+}
+
+static void chunk_done(raw_ring_t *r, int buf, size_t len) {
+  pthread_mutex_lock(&r->lock);
+  r->state[buf] = SLOT_FREE;
+  r->written += len;
+  uint64_t decoded = r->read_pos;
+  uint64_t in_pos = r->in_pos;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+
+  /* The size of a compressed image is only known once it is decoded,
+     it is estimated from how much of the input went into what was
+     decoded so far. In double, the product overflows for images of a
+     few GB */
+
+  if (r->decomp != NULL && in_pos) {
+    progress_total((uint64_t)((double)r->decomp->in_size / in_pos * decoded));
+  }
+
+  progress_add(len);
+}
+
+static void write_done(void *arg, int buf, size_t len, int error) {
+  raw_ring_t *r = arg;
+
+  /* Queued before the buffer is handed back to the reader */
+
+  if (r->verify && !error) {
+    verify_add(r->verify, r->offs[buf], len, r->crc[buf], r->zero[buf], NULL);
+  }
+
+  chunk_done(r, buf, len);
+}
+
+static int zero_out(int fd, uint64_t off, uint64_t len) {
+  uint64_t range[2] = { off, len };
+
+  return ioctl(fd, BLKZEROOUT, range);
+}
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int raw_check(const char *image_path, const uint32_t *device_fd) {
+  struct stat st;
+  uint64_t dev_size = 0;
+  int fd;
+
+  if ((fd = open(image_path, O_RDONLY)) < 0) {
+    r_printf("Error opening %s: %s\n", image_path, strerror(errno));
+    return -1;
+  }
+
+  if (fstat(fd, &st) < 0) {
+    r_printf("Error: %s: %s\n", image_path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  close(fd);
+
+  /* Regular files have no BLKGETSIZE64, they simply grow. A compressed
+     image that turns out too large fails on the first write past the
+     end instead */
+
+  if (decomp_detect(image_path) == DECOMP_NONE &&
+      ioctl(*device_fd, BLKGETSIZE64, &dev_size) == 0 &&
+      (uint64_t)st.st_size > dev_size) {
+    r_printf("ERROR: Image is %.1f MiB, the device only %.1f MiB\n",
+             st.st_size / 1048576.0, dev_size / 1048576.0);
+    return -1;
+  }
+
+  return 0;
+}
+
+int raw_write(const char *image_path, const uint32_t *device_fd,
+              size_t chunk_size, int depth, int target_zeroed,
+              verify_t *verify, int threads) {
+  raw_ring_t r;
+  decomp_t d;
+  struct stat st;
+  int direct = 1;
+  int ret = 0;
+
+  memset(&r, 0, sizeof(r));
+
+  chunk_size = (chunk_size + RAW_ALIGN - 1) / RAW_ALIGN * RAW_ALIGN;
+
+  if (decomp_detect(image_path) != DECOMP_NONE) {
+    if (decomp_open(&d, image_path, threads) < 0) return -1;
+
+    r.decomp = &d;
+  }
+
+  if ((r.fd = open(image_path, O_RDONLY | O_DIRECT)) < 0 &&
+      (r.fd = open(image_path, O_RDONLY)) < 0) {
+    r_printf("Error opening %s: %s\n", image_path, strerror(errno));
+    if (r.decomp) decomp_close(r.decomp);
+    return -1;
+  }
+
+  if (fstat(r.fd, &st) < 0) {
+    r_printf("Error: %s: %s\n", image_path, strerror(errno));
+    ret = -1;
+    goto out_free;
+  }
+
+  if (raw_check(image_path, device_fd) < 0) {
+    ret = -1;
+    goto out_free;
+  }
+
+  if (blockio_direct(*device_fd, 1) < 0) {
+    r_printf("O_DIRECT not supported on the device, using buffered writes\n");
+    direct = 0;
+  }
+
+  /* One chunk more than can be in flight so the reader always has
+     somewhere to go, within a sane memory budget */
+
+  if (depth < 1) depth = 1;
+
+  r.nbufs = depth + 1 < RAW_BUFFERS ? RAW_BUFFERS : depth + 1;
+
+  if ((uint64_t)r.nbufs * chunk_size > RAW_MAX_MEMORY) {
+    r.nbufs = RAW_MAX_MEMORY / chunk_size < 2 ? 2 : RAW_MAX_MEMORY / chunk_size;
+    depth = r.nbufs - 1;
+  }
+
+  r.chunk_size = chunk_size;
+  r.total = st.st_size;
+  r.buf = calloc(r.nbufs, sizeof(unsigned char *));
+  r.len = calloc(r.nbufs, sizeof(size_t));
+  r.state = calloc(r.nbufs, sizeof(int));
+  r.zero = calloc(r.nbufs, sizeof(int));
+  r.crc = calloc(r.nbufs, sizeof(uint32_t));
+  r.offs = calloc(r.nbufs, sizeof(uint64_t));
+  r.verify = verify;
+
+  if (r.buf == NULL || r.len == NULL || r.state == NULL || r.zero == NULL ||
+      r.crc == NULL || r.offs == NULL) {
+    r_printf("Error: out of memory for chunks\n");
+    ret = -1;
+    goto out_free;
+  }
+
+  for (int i = 0; i < r.nbufs; i++) {
+    if (posix_memalign((void **)&r.buf[i], RAW_ALIGN, chunk_size) != 0) {
+      r_printf("Error: out of memory for %zu byte chunks\n", chunk_size);
+      ret = -1;
+      goto out_free;
+    }
+  }
+
+  pthread_mutex_init(&r.lock, NULL);
+  pthread_cond_init(&r.cond, NULL);
+
+  r_printf("Writing %s (%.1f MiB%s) in %zu KiB chunks, %d buffers%s\n",
+           image_path, st.st_size / 1048576.0, r.decomp ? " compressed" : "",
+           chunk_size / 1024, r.nbufs, direct ? ", O_DIRECT" : "");
+
+  blockio_t b;
+
+  if (blockio_open(&b, *device_fd, depth, r.buf, r.nbufs, chunk_size) < 0) {
+    ret = -1;
+    goto out;
+  }
+
+  pthread_t reader;
+
+  if (pthread_create(&reader, NULL, reader_thread, &r) != 0) {
+    r_printf("Error starting reader thread\n");
+    blockio_close(&b);
+    ret = -1;
+    goto out;
+  }
+
+  /* Chunks are queued for verification as their writes complete */
+
+  if (verify) verify_written(verify, UINT64_MAX);
+
+  progress_begin(r.decomp != NULL ? 0 : r.total);
+
+  double start = now();
+  uint64_t seq = 0;
+  uint64_t off = 0;
+  uint64_t zeros = 0;
+  uint64_t run_off = 0;   /* Zero chunks waiting for one BLKZEROOUT */
+  uint64_t run_len = 0;
+  int zeroout = target_zeroed ? 0 : -1; /* -1 until the first try */
+
+  for (;;) {
+    pthread_mutex_lock(&r.lock);
+
+    /* While waiting for the reader, finished writes have to be reaped
+       or it may be waiting for exactly one of those buffers */
+
+    while (seq == r.read_seq && !r.eof && !r.error) {
+      if (b.inflight > 0) {
+        pthread_mutex_unlock(&r.lock);
+        blockio_reap(&b, 1);
+        pthread_mutex_lock(&r.lock);
+        if (b.error) break;
+        continue;
+      }
+
+      pthread_cond_wait(&r.cond, &r.lock);
+    }
+
+    if (b.error || seq == r.read_seq) {
+      if (r.error) {
+        r_printf("Error reading %s: %s\n", image_path, strerror(r.error));
+      }
+      if (r.error || b.error) ret = -1;
+      pthread_mutex_unlock(&r.lock);
+      break;
+    }
+
+    int slot = seq % r.nbufs;
+    size_t len = r.len[slot];
+
+    int zero = r.zero[slot];
+
+    r.state[slot] = SLOT_BUSY;
+
+    pthread_mutex_unlock(&r.lock);
+
+    int skip = 0;
+
+    if (zero && len % 512 == 0 && len > 0) {
+      if (target_zeroed) {
+        skip = 1;
+      } else if (zeroout == -1) {
+
+        /* The first zero chunk finds out whether the device can zero
+           ranges by itself, a regular file can't */
+
+        zeroout = zero_out(*device_fd, off, len) == 0;
+        skip = zeroout;
+      } else if (zeroout == 1) {
+        if (run_len > 0 && (run_off + run_len != off || run_len >= RAW_MAX_ZERO_RUN)) {
+          if (zero_out(*device_fd, run_off, run_len) < 0) {
+            r_printf("BLKZEROOUT failed at offset %llu: %s\n",
+                     (unsigned long long)run_off, strerror(errno));
+            ret = -1;
+            break;
+          }
+          if (verify) verify_add(verify, run_off, run_len, 0, 1, NULL);
+          run_len = 0;
+        }
+
+        if (run_len == 0) run_off = off;
+
+        run_len += len;
+        skip = 2; /* Verified once the run is zeroed */
+      }
+    }
+
+    if (skip) {
+      if (verify && skip == 1) verify_add(verify, off, len, 0, 1, NULL);
+      zeros += len;
+      chunk_done(&r, slot, len);
+      off += len;
+      seq++;
+      continue;
+    }
+
+    /* Holes were never read into the buffer */
+
+    if (zero) memset(r.buf[slot], 0, len);
+
+    r.offs[slot] = off;
+
+    /* Only the tail of an image can be shorter than a sector, O_DIRECT
+       can't write that so the last chunk goes through the page cache
+       once everything before it is done */
+
+    if (direct && len % 512 != 0) {
+      if (blockio_drain(&b) < 0 || blockio_direct(*device_fd, 0) < 0 ||
+          write_full(*device_fd, r.buf[slot], len, off) < 0) {
+        if (!b.error) {
+          r_printf("Error writing at offset %llu: %s\n",
+                   (unsigned long long)off, strerror(errno));
+        }
+        ret = -1;
+        break;
+      }
+
+      write_done(&r, slot, len, 0);
+    } else if (len > 0 && blockio_write(&b, slot, len, off, write_done, &r) < 0) {
+      ret = -1;
+      break;
+    }
+
+    if (len == 0) {
+      r.state[slot] = SLOT_FREE;
+      break;
+    }
+
+    off += len;
+    seq++;
+  }
+
+  if (ret == 0 && run_len > 0) {
+    if (zero_out(*device_fd, run_off, run_len) < 0) {
+      r_printf("BLKZEROOUT failed at offset %llu: %s\n",
+               (unsigned long long)run_off, strerror(errno));
+      ret = -1;
+    } else if (verify) {
+      verify_add(verify, run_off, run_len, 0, 1, NULL);
+    }
+  }
+
+  if (blockio_drain(&b) < 0) ret = -1;
+
+  pthread_mutex_lock(&r.lock);
+  r.stop = 1;
+  pthread_cond_broadcast(&r.cond);
+  pthread_mutex_unlock(&r.lock);
+
+  pthread_join(reader, NULL);
+
+  blockio_close(&b);
+
+  if (ret == 0) {
+    TRACE_SPAN("fsync");
+
+    if (fsync(*device_fd) < 0) {
+      r_printf("Error syncing: %s\n", strerror(errno));
+      ret = -1;
+    }
+  }
+
+  if (ret == 0) {
+    double secs = now() - start;
+
+    progress_finish();
+    r_printf("Wrote %.1f MiB in %.1f s (%.1f MiB/s)\n", off / 1048576.0, secs,
+             secs > 0 ? off / 1048576.0 / secs : 0.0);
+    r_printf("%.1f MiB of zeros %s, zero scan: %s\n", zeros / 1048576.0,
+             target_zeroed ? "skipped" : "zeroed out on the device", zeroscan_name());
+  }
+
+out:
+  pthread_mutex_destroy(&r.lock);
+  pthread_cond_destroy(&r.cond);
+
+out_free:
+  blockio_direct(*device_fd, 0);
+
+  for (int i = 0; r.buf != NULL && i < r.nbufs; i++) free(r.buf[i]);
+
+  free(r.buf);
+  free(r.len);
+  free(r.state);
+  free(r.zero);
+  free(r.crc);
+  free(r.offs);
+
+  if (r.fd >= 0) close(r.fd);
+  if (r.decomp) decomp_close(r.decomp);
+
+  return ret;
+}
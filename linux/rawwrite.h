@@ -0,0 +1,23 @@
+#ifndef RAWWRITE_H
+#define RAWWRITE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "verify.h"
+
+#define RAW_BUFFERS 3
+
+#define RAW_MIN_CHUNK_MB 1
+#define RAW_MAX_CHUNK_MB 64
+#define RAW_DEFAULT_CHUNK_MB 4
+
+/* raw_check() does the checks raw_write() starts with, the image can
+   be read and fits on the device, for callers that want them done
+   before anything is written to it */
+
+int raw_check(const char *image_path, const uint32_t *device_fd);
+int raw_write(const char *image_path, const uint32_t *device_fd, size_t chunk_size,
+              int depth, int target_zeroed, verify_t *verify, int threads);
+
+#endif // RAWWRITE_H
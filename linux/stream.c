@@ -0,0 +1,211 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../log.h"
+#include "../trace.h"
+#include "stream.h"
+
+static void *stream_thread(void *arg) {
+  stream_t *s = arg;
+
+  trace_thread("stream");
+  pthread_mutex_lock(&s->lock);
+
+  for (;;) {
+    while (s->pending < 0 && !s->quit) pthread_cond_wait(&s->cond, &s->lock);
+
+    if (s->pending < 0) break;
+
+    unsigned char *buf = s->buf[s->pending];
+    size_t len = s->pending_len;
+    uint64_t off = s->pending_off;
+
+    pthread_mutex_unlock(&s->lock);
+
+    int err = 0;
+    TRACE_SPAN("pwrite");
+
+    while (len > 0) {
+      ssize_t n = pwrite(s->fd, buf, len, off);
+
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        err = errno;
+        break;
+      }
+
+      buf += n;
+      len -= n;
+      off += n;
+    }
+
+    pthread_mutex_lock(&s->lock);
+
+    if (err && !s->error) s->error = err;
+
+    if (!err && s->written) s->written(s->written_arg, off);
+
+    s->pending = -1;
+    pthread_cond_broadcast(&s->cond);
+  }
+
+  pthread_mutex_unlock(&s->lock);
+
+  return NULL;
+}
+
+/* Hand the current buffer over to the thread and switch to the other */
+
+static int stream_flush(stream_t *s) {
+  pthread_mutex_lock(&s->lock);
+
+  while (s->pending >= 0) pthread_cond_wait(&s->cond, &s->lock);
+
+  if (s->error) {
+    pthread_mutex_unlock(&s->lock);
+    r_printf("Error writing at offset %llu: %s\n",
+             (unsigned long long)s->pos, strerror(s->error));
+    return -1;
+  }
+
+  if (s->fill > 0) {
+    s->pending = s->cur;
+    s->pending_len = s->fill;
+    s->pending_off = s->pos;
+    pthread_cond_broadcast(&s->cond);
+
+    s->pos += s->fill;
+    s->cur ^= 1;
+    s->fill = 0;
+  }
+
+  pthread_mutex_unlock(&s->lock);
+
+  return 0;
+}
+
+int stream_open(stream_t *s, int fd, uint64_t offset, size_t size) {
+  memset(s, 0, sizeof(stream_t));
+
+  s->fd = fd;
+  s->pos = offset;
+  s->size = size;
+  s->pending = -1;
+
+  if (posix_memalign((void **)&s->buf[0], 4096, size) != 0 ||
+      posix_memalign((void **)&s->buf[1], 4096, size) != 0) {
+    free(s->buf[0]);
+    r_printf("Error: out of memory for write buffers\n");
+    return -1;
+  }
+
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->cond, NULL);
+
+  if (pthread_create(&s->thread, NULL, stream_thread, s) != 0) {
+    r_printf("Error starting writer thread\n");
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    free(s->buf[0]);
+    free(s->buf[1]);
+    return -1;
+  }
+
+  return 0;
+}
+
+unsigned char *stream_reserve(stream_t *s, size_t *len) {
+  if (s->fill == s->size && stream_flush(s) < 0) return NULL;
+
+  *len = s->size - s->fill;
+
+  return s->buf[s->cur] + s->fill;
+}
+
+int stream_commit(stream_t *s, size_t len) {
+  s->fill += len;
+
+  if (s->fill == s->size) return stream_flush(s);
+
+  return 0;
+}
+
+int stream_write(stream_t *s, const void *data, size_t len) {
+  const unsigned char *p = data;
+
+  while (len > 0) {
+    size_t room;
+    unsigned char *dst = stream_reserve(s, &room);
+
+    if (dst == NULL) return -1;
+
+    if (room > len) room = len;
+
+    memcpy(dst, p, room);
+    p += room;
+    len -= room;
+
+    if (stream_commit(s, room) < 0) return -1;
+  }
+
+  return 0;
+}
+
+int stream_zero(stream_t *s, uint64_t len) {
+  while (len > 0) {
+    size_t room;
+    unsigned char *dst = stream_reserve(s, &room);
+
+    if (dst == NULL) return -1;
+
+    if (room > len) room = len;
+
+    memset(dst, 0, room);
+    len -= room;
+
+    if (stream_commit(s, room) < 0) return -1;
+  }
+
+  return 0;
+}
+
+int stream_close(stream_t *s) {
+  int ret = stream_flush(s);
+
+  pthread_mutex_lock(&s->lock);
+
+  while (s->pending >= 0) pthread_cond_wait(&s->cond, &s->lock);
+
+  if (s->error && ret == 0) {
+    r_printf("Error writing: %s\n", strerror(s->error));
+    ret = -1;
+  }
+
+  s->quit = 1;
+  pthread_cond_broadcast(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+
+  pthread_join(s->thread, NULL);
+
+  pthread_mutex_destroy(&s->lock);
+  pthread_cond_destroy(&s->cond);
+  free(s->buf[0]);
+  free(s->buf[1]);
+
+  if (ret == 0) {
+    TRACE_SPAN("fsync");
+
+    if (fsync(s->fd) < 0) {
+      r_printf("Error syncing: %s\n", strerror(errno));
+      ret = -1;
+    }
+  }
+
+  return ret;
+}
@@ -0,0 +1,44 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define STREAM_BUF_SIZE (4 * 1024 * 1024)
+
+/* Sequential writer with two buffers: while one buffer is being filled
+   by the caller, a thread writes the other one out. Every write except
+   the last one is a full buffer at a multiple of the buffer size from
+   the start offset, so with an aligned start the device only ever sees
+   large, erase-block-aligned sequential writes. */
+
+typedef struct stream {
+  int fd;
+  uint64_t pos;         /* Device offset of the buffer being filled */
+  size_t size;
+  unsigned char *buf[2];
+  size_t fill;
+  int cur;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int pending;          /* Buffer waiting for the thread, -1 if none */
+  size_t pending_len;
+  uint64_t pending_off;
+  int error;
+  int quit;
+
+  void (*written)(void *arg, uint64_t end); /* Called by the thread */
+  void *written_arg;
+} stream_t;
+
+int stream_open(stream_t *s, int fd, uint64_t offset, size_t size);
+int stream_write(stream_t *s, const void *data, size_t len);
+int stream_zero(stream_t *s, uint64_t len);
+unsigned char *stream_reserve(stream_t *s, size_t *len);
+int stream_commit(stream_t *s, size_t len);
+int stream_close(stream_t *s);
+
+#endif // STREAM_H
@@ -0,0 +1,276 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "../log.h"
+#include "../progress.h"
+#include "transfer.h"
+
+/* Files are moved with the cheapest mechanism that works between the
+   source and the destination file system. copy_file_range() keeps the
+   data in the kernel without even a pipe, but loop mounted iso9660/udf
+   and vfat/ntfs are different file systems, and most kernels refuse it
+   with EXDEV. splice() through a pipe is the next best thing, and a
+   plain read()/write() loop with a large buffer is the last resort.
+   Once a mechanism is found not to work, it is skipped for every later
+   file of the same job. */
+
+#define CHUNK_SIZE (64 * 1024 * 1024)
+
+static int copy_range_ok = 1;
+static int splice_ok = 1;
+
+static int unsupported(int err) {
+  return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP;
+}
+
+static ssize_t copy_range(int in_fd, off_t *in_off, int out_fd, size_t len) {
+#ifdef __NR_copy_file_range
+  return syscall(__NR_copy_file_range, in_fd, in_off, out_fd, NULL, len, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+
+    buf += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+static int alloc_buf(transfer_t *t) {
+  if (t->buf == NULL) t->buf = malloc(TRANSFER_BUF_SIZE);
+  return t->buf == NULL ? -1 : 0;
+}
+
+/* A source that ends before the length it was given is a truncated
+   image or a file that shrank, never a short copy to report as done */
+
+static int short_read(void) {
+  errno = EIO;
+  return -1;
+}
+
+/* Returns 0 when done, 1 when the caller should fall back to
+   another method for the remaining bytes and -1 on error */
+
+static int try_copy_range(int in_fd, off_t *in_off, int out_fd, off_t *left) {
+  while (*left > 0) {
+    size_t len = *left > CHUNK_SIZE ? CHUNK_SIZE : (size_t)*left;
+    ssize_t n = copy_range(in_fd, in_off, out_fd, len);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return unsupported(errno) ? 1 : -1;
+    }
+
+    if (n == 0) return short_read();
+
+    *left -= n;
+    progress_add(n);
+  }
+
+  return 0;
+}
+
+static int drain_pipe(transfer_t *t, int out_fd, size_t pending) {
+  if (alloc_buf(t) < 0) return -1;
+
+  while (pending > 0) {
+    size_t len = pending > TRANSFER_BUF_SIZE ? TRANSFER_BUF_SIZE : pending;
+    ssize_t n = read(t->pipe_fd[0], t->buf, len);
+
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) continue;
+      return -1;
+    }
+
+    if (write_all(out_fd, t->buf, n) < 0) return -1;
+
+    pending -= n;
+    progress_add(n);
+  }
+
+  return 0;
+}
+
+static int try_splice(transfer_t *t, int in_fd, off_t *in_off, int out_fd,
+                      off_t *left) {
+  if (t->pipe_fd[0] < 0) {
+    if (pipe(t->pipe_fd) < 0) return 1;
+
+    /* A bigger pipe means fewer round trips, but the default
+       limit for unprivileged users may refuse it */
+
+    fcntl(t->pipe_fd[1], F_SETPIPE_SZ, TRANSFER_PIPE_SIZE);
+  }
+
+  while (*left > 0) {
+    size_t len = *left > TRANSFER_PIPE_SIZE ? TRANSFER_PIPE_SIZE : (size_t)*left;
+    ssize_t n = splice(in_fd, in_off, t->pipe_fd[1], NULL, len,
+                       SPLICE_F_MOVE | SPLICE_F_MORE);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return unsupported(errno) ? 1 : -1;
+    }
+
+    if (n == 0) return short_read();
+
+    size_t pending = n;
+
+    while (pending > 0) {
+      ssize_t w = splice(t->pipe_fd[0], NULL, out_fd, NULL, pending,
+                         SPLICE_F_MOVE | SPLICE_F_MORE);
+
+      if (w < 0) {
+        if (errno == EINTR) continue;
+        if (!unsupported(errno)) return -1;
+
+        /* The data is already in the pipe, so push it out by hand
+           before the caller falls back for the rest of the file */
+
+        if (drain_pipe(t, out_fd, pending) < 0) return -1;
+
+        *left -= n;
+        return 1;
+      }
+
+      pending -= w;
+      progress_add(w);
+    }
+
+    *left -= n;
+  }
+
+  return 0;
+}
+
+static int read_write(transfer_t *t, int in_fd, off_t *in_off, int out_fd,
+                      off_t left) {
+  ssize_t n;
+
+  if (alloc_buf(t) < 0) return -1;
+
+  /* Without an offset the file is read up to its end, with one
+     (a range inside an image) exactly the requested length. Either way
+     it must hold at least that length */
+
+  for (;;) {
+    if (in_off == NULL) {
+      n = read(in_fd, t->buf, TRANSFER_BUF_SIZE);
+    } else {
+      if (left <= 0) break;
+      n = pread(in_fd, t->buf,
+                left > TRANSFER_BUF_SIZE ? TRANSFER_BUF_SIZE : (size_t)left,
+                *in_off);
+    }
+
+    if (n == 0) {
+      if (left > 0) return short_read();
+      break;
+    }
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+
+    if (write_all(out_fd, t->buf, n) < 0) return -1;
+
+    progress_add(n);
+
+    if (in_off != NULL) *in_off += n;
+    left -= n;
+  }
+
+  return 0;
+}
+
+void transfer_init(transfer_t *t) {
+  t->pipe_fd[0] = -1;
+  t->pipe_fd[1] = -1;
+  t->buf = NULL;
+}
+
+void transfer_free(transfer_t *t) {
+  if (t->pipe_fd[0] >= 0) close(t->pipe_fd[0]);
+  if (t->pipe_fd[1] >= 0) close(t->pipe_fd[1]);
+  free(t->buf);
+  transfer_init(t);
+}
+
+void transfer_reset(void) {
+  __atomic_store_n(&copy_range_ok, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&splice_ok, 1, __ATOMIC_RELAXED);
+}
+
+static int transfer(transfer_t *t, int in_fd, off_t *in_off, int out_fd,
+                    off_t size, int *method) {
+  off_t left = size;
+  int ret;
+
+  if (__atomic_load_n(&copy_range_ok, __ATOMIC_RELAXED)) {
+    *method = TRANSFER_COPY_FILE_RANGE;
+
+    if ((ret = try_copy_range(in_fd, in_off, out_fd, &left)) <= 0) return ret;
+
+    if (__atomic_exchange_n(&copy_range_ok, 0, __ATOMIC_RELAXED)) {
+      r_printf("copy_file_range() not supported here (%s), trying splice()\n",
+               strerror(errno));
+    }
+  }
+
+  if (__atomic_load_n(&splice_ok, __ATOMIC_RELAXED)) {
+    *method = TRANSFER_SPLICE;
+
+    if ((ret = try_splice(t, in_fd, in_off, out_fd, &left)) <= 0) return ret;
+
+    if (__atomic_exchange_n(&splice_ok, 0, __ATOMIC_RELAXED)) {
+      r_printf("splice() not supported here (%s), using read()/write()\n",
+               strerror(errno));
+    }
+  }
+
+  *method = TRANSFER_READ_WRITE;
+
+  return read_write(t, in_fd, in_off, out_fd, left);
+}
+
+int transfer_file(transfer_t *t, int in_fd, int out_fd, off_t size, int *method) {
+  return transfer(t, in_fd, NULL, out_fd, size, method);
+}
+
+int transfer_range(transfer_t *t, int in_fd, off_t in_off, int out_fd, off_t size,
+                   int *method) {
+  return transfer(t, in_fd, &in_off, out_fd, size, method);
+}
+
+const char *transfer_name(int method) {
+  switch (method) {
+    case TRANSFER_COPY_FILE_RANGE:
+      return "copy_file_range";
+    case TRANSFER_SPLICE:
+      return "splice";
+    default:
+      return "read/write";
+  }
+}
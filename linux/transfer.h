@@ -0,0 +1,29 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <sys/types.h>
+
+#define TRANSFER_COPY_FILE_RANGE 0
+#define TRANSFER_SPLICE 1
+#define TRANSFER_READ_WRITE 2
+
+#define TRANSFER_BUF_SIZE (1024 * 1024)
+#define TRANSFER_PIPE_SIZE (1024 * 1024)
+
+/* Per-thread transfer state. The pipe and the buffer are only
+   allocated once the splice or the read/write path is first needed. */
+
+typedef struct transfer {
+  int pipe_fd[2];
+  char *buf;
+} transfer_t;
+
+void transfer_init(transfer_t *t);
+void transfer_free(transfer_t *t);
+void transfer_reset(void);
+int transfer_file(transfer_t *t, int in_fd, int out_fd, off_t size, int *method);
+int transfer_range(transfer_t *t, int in_fd, off_t in_off, int out_fd, off_t size,
+                   int *method);
+const char *transfer_name(int method);
+
+#endif // TRANSFER_H
@@ -0,0 +1,230 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../log.h"
+#include "../logring.h"
+#include "../trace.h"
+#include "crc32c.h"
+#include "verify.h"
+#include "zeroscan.h"
+
+static int check_region(verify_t *v, const verify_region_t *r,
+                        unsigned char *buf) {
+  uint32_t crc = 0;
+  int zero = 1;
+
+  for (uint64_t done = 0; done < r->len;) {
+    size_t want = r->len - done < VERIFY_BUF_SIZE ? r->len - done : VERIFY_BUF_SIZE;
+
+    /* O_DIRECT wants whole sectors, the extra bytes are not checked */
+
+    size_t len = (want + 511) / 512 * 512;
+    ssize_t n = pread(v->fd, buf, len, r->off + done);
+
+    if (n < 0 && errno == EINTR) continue;
+
+    if (n < (ssize_t)want) {
+      r_printf("Verify: error reading back offset %llu: %s\n",
+               (unsigned long long)(r->off + done),
+               n < 0 ? strerror(errno) : "short read");
+      return -1;
+    }
+
+    if (r->zero) {
+      zero = zero && is_zero(buf, want);
+    } else {
+      crc = crc32c(crc, buf, want);
+    }
+
+    done += want;
+  }
+
+  if (r->zero ? !zero : crc != r->crc) {
+    if (r->name) {
+      r_printf("Verify: %s does not match what was written!\n", r->name);
+    } else {
+      r_printf("Verify: %llu bytes at offset %llu do not match what was written!\n",
+               (unsigned long long)r->len, (unsigned long long)r->off);
+    }
+    return -1;
+  }
+
+  r_debug(LOG_VERIFY, "Verify: %llu bytes at offset %llu match\n",
+          (unsigned long long)r->len, (unsigned long long)r->off);
+
+  return 0;
+}
+
+static void *verify_thread(void *arg) {
+  verify_t *v = arg;
+  unsigned char *buf;
+
+  trace_thread("verify");
+
+  if (posix_memalign((void **)&buf, 4096, VERIFY_BUF_SIZE) != 0) {
+    pthread_mutex_lock(&v->lock);
+    v->bad++;
+    pthread_mutex_unlock(&v->lock);
+    r_printf("Verify: out of memory\n");
+    return NULL;
+  }
+
+  pthread_mutex_lock(&v->lock);
+
+  for (;;) {
+    while (!(v->next < v->count &&
+             v->regions[v->next].off + v->regions[v->next].len <= v->written) &&
+           !(v->closing && v->next == v->count)) {
+      pthread_cond_wait(&v->cond, &v->lock);
+    }
+
+    if (v->next == v->count) break;
+
+    verify_region_t r = v->regions[v->next++];
+
+    pthread_mutex_unlock(&v->lock);
+
+    int ret;
+
+    {
+      TRACE_SPAN_ARG("verify", r.name);
+      ret = check_region(v, &r, buf);
+    }
+
+    pthread_mutex_lock(&v->lock);
+
+    v->checked++;
+    v->bytes += r.len;
+    if (ret < 0) v->bad++;
+  }
+
+  pthread_mutex_unlock(&v->lock);
+
+  free(buf);
+
+  return NULL;
+}
+
+int verify_start(verify_t *v, const char *path, int threads) {
+  memset(v, 0, sizeof(verify_t));
+
+  if ((v->fd = open(path, O_RDONLY | O_DIRECT)) < 0) {
+    if ((v->fd = open(path, O_RDONLY)) < 0) {
+      r_printf("Verify: error opening %s: %s\n", path, strerror(errno));
+      return -1;
+    }
+    r_printf("Verify: O_DIRECT not supported, reading through the page cache\n");
+  }
+
+  if (threads < 1) threads = 1;
+  if (threads > VERIFY_MAX_THREADS) threads = VERIFY_MAX_THREADS;
+
+  pthread_mutex_init(&v->lock, NULL);
+  pthread_cond_init(&v->cond, NULL);
+
+  for (v->nthreads = 0; v->nthreads < threads; v->nthreads++) {
+    if (pthread_create(&v->threads[v->nthreads], NULL, verify_thread, v) != 0) {
+      r_printf("Verify: failed to start thread %d\n", v->nthreads);
+      break;
+    }
+  }
+
+  if (v->nthreads == 0) {
+    pthread_mutex_destroy(&v->lock);
+    pthread_cond_destroy(&v->cond);
+    close(v->fd);
+    return -1;
+  }
+
+  r_printf("Verifying with %d threads, CRC32C (%s)\n", v->nthreads, crc32c_name());
+
+  return 0;
+}
+
+int verify_add(verify_t *v, uint64_t off, uint64_t len, uint32_t crc, int zero,
+               const char *name) {
+  if (len == 0) return 0;
+
+  pthread_mutex_lock(&v->lock);
+
+  if (v->count == v->cap) {
+    size_t cap = v->cap ? v->cap * 2 : 1024;
+    verify_region_t *tmp = realloc(v->regions, cap * sizeof(verify_region_t));
+
+    if (tmp == NULL) {
+      pthread_mutex_unlock(&v->lock);
+      r_printf("Verify: out of memory\n");
+      return -1;
+    }
+
+    v->regions = tmp;
+    v->cap = cap;
+  }
+
+  verify_region_t *r = &v->regions[v->count];
+
+  r->off = off;
+  r->len = len;
+  r->crc = crc;
+  r->zero = zero;
+  r->name = name ? strdup(name) : NULL;
+
+  v->count++;
+
+  pthread_cond_broadcast(&v->cond);
+  pthread_mutex_unlock(&v->lock);
+
+  return 0;
+}
+
+/* Everything before end is on the device and may be read back */
+
+void verify_written(verify_t *v, uint64_t end) {
+  pthread_mutex_lock(&v->lock);
+
+  if (end > v->written) {
+    v->written = end;
+    pthread_cond_broadcast(&v->cond);
+  }
+
+  pthread_mutex_unlock(&v->lock);
+}
+
+int verify_finish(verify_t *v) {
+  struct timespec start, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  pthread_mutex_lock(&v->lock);
+  v->written = UINT64_MAX;
+  v->closing = 1;
+  pthread_cond_broadcast(&v->cond);
+  pthread_mutex_unlock(&v->lock);
+
+  for (int i = 0; i < v->nthreads; i++) pthread_join(v->threads[i], NULL);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  r_printf("Verified %zu regions, %.1f MiB, %.1f s after the write (%d bad)\n",
+           v->checked, v->bytes / 1048576.0,
+           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+           v->bad);
+
+  for (size_t i = 0; i < v->count; i++) free(v->regions[i].name);
+
+  free(v->regions);
+  pthread_mutex_destroy(&v->lock);
+  pthread_cond_destroy(&v->cond);
+  close(v->fd);
+
+  return v->bad ? -1 : 0;
+}
@@ -0,0 +1,50 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define VERIFY_MAX_THREADS 32
+#define VERIFY_BUF_SIZE (4 * 1024 * 1024)
+
+typedef struct verify_region {
+  uint64_t off;
+  uint64_t len;
+  uint32_t crc;
+  int zero;   /* Expected to read back as zeros, crc unused */
+  char *name; /* File name for the log, NULL for raw ranges */
+} verify_region_t;
+
+/* Read-back verification running alongside the write. Regions are
+   queued with the checksum of what was written and are picked up in
+   order by a pool of threads once the writer reports that everything
+   up to their end has reached the device. The device is opened a
+   second time with O_DIRECT so the page cache can't answer for it. */
+
+typedef struct verify {
+  int fd;
+  int nthreads;
+  pthread_t threads[VERIFY_MAX_THREADS];
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  verify_region_t *regions;
+  size_t count;
+  size_t cap;
+  size_t next;
+  uint64_t written;
+  int closing;
+
+  size_t checked;
+  uint64_t bytes;
+  int bad;
+} verify_t;
+
+int verify_start(verify_t *v, const char *path, int threads);
+int verify_add(verify_t *v, uint64_t off, uint64_t len, uint32_t crc, int zero,
+               const char *name);
+void verify_written(verify_t *v, uint64_t end);
+int verify_finish(verify_t *v);
+
+#endif // VERIFY_H
@@ -0,0 +1,175 @@
+#include <errno.h>
+#include <linux/fs.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../log.h"
+#include "../progress.h"
+#include "../trace.h"
+#include "blockio.h"
+#include "definitions.h"
+#include "wipe.h"
+
+/* A full format has the device do as much of the work as it can.
+   TRIM only tries a secure discard and then a plain discard, which on
+   flash just drops the mapping and takes seconds. A zero fill asks the
+   kernel for BLKZEROOUT, which becomes WRITE ZEROES or UNMAP when the
+   device has them. Only when the ioctls are refused do the zeros go
+   over the wire from here, as large aligned writes. The ranges are
+   issued in pieces so the progress bar moves. */
+
+typedef struct wipe_state {
+  int free[BLOCKIO_MAX_DEPTH]; /* Buffers not in flight */
+  int nfree;
+} wipe_state_t;
+
+static void wipe_done(void *arg, int buf, size_t len, int error) {
+  wipe_state_t *w = arg;
+
+  w->free[w->nfree++] = buf;
+
+  progress_add(len);
+}
+
+/* Last resort, zeros written by us. The buffers are zeroed once and
+   only ever written from, so every request can reuse them as soon as
+   it comes back. */
+
+static int zero_fill(int fd, uint64_t start, uint64_t size, size_t chunk, int depth) {
+  wipe_state_t w;
+
+  memset(&w, 0, sizeof(w));
+
+  unsigned char *bufs[BLOCKIO_MAX_DEPTH];
+  int nbufs = depth < 1 ? 1 : (depth > BLOCKIO_MAX_DEPTH ? BLOCKIO_MAX_DEPTH : depth);
+
+  for (int i = 0; i < nbufs; i++) {
+    if (posix_memalign((void **)&bufs[i], BLOCKIO_ALIGN, chunk) != 0) {
+      r_printf("Error: out of memory for wipe buffers\n");
+      while (i-- > 0) free(bufs[i]);
+      return -1;
+    }
+    memset(bufs[i], 0, chunk);
+    w.free[w.nfree++] = i;
+  }
+
+  int direct = blockio_direct(fd, 1) == 0;
+  blockio_t b;
+  int ret = blockio_open(&b, fd, nbufs, bufs, nbufs, chunk);
+
+  for (uint64_t off = 0; ret == 0 && off < size; off += chunk) {
+    size_t len = size - off < chunk ? size - off : chunk;
+
+    while (w.nfree == 0 && ret == 0) ret = blockio_reap(&b, 1);
+
+    if (ret == 0) ret = blockio_write(&b, w.free[--w.nfree], len, start + off, wipe_done, &w);
+  }
+
+  if (blockio_drain(&b) < 0) ret = -1;
+
+  blockio_close(&b);
+
+  if (direct) blockio_direct(fd, 0);
+
+  for (int i = 0; i < nbufs; i++) free(bufs[i]);
+
+  return ret;
+}
+
+/* Returns 1 when the device refuses the request outright, so the next
+   method can be tried, and -1 when it fails part way */
+
+static int range_ioctl(int fd, unsigned long req, const char *name,
+                       uint64_t start, uint64_t size) {
+  for (uint64_t off = 0; off < size; off += WIPE_IOCTL_CHUNK) {
+    uint64_t range[2] = { start + off, size - off < WIPE_IOCTL_CHUNK ? size - off : WIPE_IOCTL_CHUNK };
+
+    TRACE_SPAN(name);
+
+    if (ioctl(fd, req, range) < 0) {
+      if (off == 0 && (errno == EOPNOTSUPP || errno == ENOTTY ||
+                       errno == EINVAL || errno == EPERM)) {
+        r_printf("%s not supported: %s\n", name, strerror(errno));
+        return 1;
+      }
+
+      r_printf("%s failed at offset %llu: %s\n", name,
+               (unsigned long long)(start + off), strerror(errno));
+      return -1;
+    }
+
+    progress_set(off + range[1]);
+  }
+
+  r_printf("Wiped using %s\n", name);
+
+  return 0;
+}
+
+/* The zero fill of a full wipe, for any range */
+
+int zero_range(const uint32_t *fd, uint64_t start, uint64_t size, size_t chunk, int depth) {
+  int ret = range_ioctl(*fd, BLKZEROOUT, "BLKZEROOUT", start, size);
+
+  if (ret == 1) {
+    if (chunk == 0) chunk = WIPE_CHUNK;
+
+    chunk = (chunk + BLOCKIO_ALIGN - 1) / BLOCKIO_ALIGN * BLOCKIO_ALIGN;
+
+    r_printf("Writing zeros in %zu KiB blocks\n", chunk / 1024);
+    ret = zero_fill(*fd, start, size, chunk, depth);
+  }
+
+  return ret;
+}
+
+int full_wipe(const uint32_t *device_fd, int mode, size_t chunk, int depth) {
+  uint64_t size;
+  int ret = 1;
+
+  /* Regular files stand in for devices in the benchmarks */
+
+  if (ioctl(*device_fd, BLKGETSIZE64, &size) < 0) {
+    struct stat st;
+
+    if (fstat(*device_fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+      r_printf("Error getting device size: %s\n", strerror(errno));
+      return -1;
+    }
+
+    size = st.st_size;
+  }
+
+  r_printf("Wiping %llu bytes on fd %d (%s)\n", (unsigned long long)size,
+           *device_fd, mode == WIPE_TRIM ? WIPE_TRIM_LABEL : WIPE_ZERO_LABEL);
+
+  if (size == 0) return 0;
+
+  progress_begin(size);
+
+  if (mode == WIPE_TRIM) {
+    ret = range_ioctl(*device_fd, BLKSECDISCARD, "BLKSECDISCARD", 0, size);
+
+    if (ret == 1) ret = range_ioctl(*device_fd, BLKDISCARD, "BLKDISCARD", 0, size);
+
+    if (ret == 1) r_printf("Device can't discard, zero filling instead\n");
+  }
+
+  if (ret == 1) ret = zero_range(device_fd, 0, size, chunk, depth);
+
+  if (ret == 0) {
+    TRACE_SPAN("fsync");
+
+    if (fsync(*device_fd) < 0) {
+      r_printf("Error syncing: %s\n", strerror(errno));
+      ret = -1;
+    }
+  }
+
+  return ret;
+}
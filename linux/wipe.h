@@ -0,0 +1,15 @@
+#ifndef WIPE_H
+#define WIPE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WIPE_CHUNK (4 * 1024 * 1024)
+#define WIPE_IOCTL_CHUNK (256ULL * 1024 * 1024)
+
+/* chunk is the size of a zero fill write, 0 for WIPE_CHUNK */
+
+int full_wipe(const uint32_t *device_fd, int mode, size_t chunk, int depth);
+int zero_range(const uint32_t *fd, uint64_t start, uint64_t size, size_t chunk, int depth);
+
+#endif // WIPE_H
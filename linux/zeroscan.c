@@ -0,0 +1,86 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "zeroscan.h"
+
+/* Checks whether a buffer is all zeros, 128 or 64 bytes per step with
+   AVX2 or SSE2 where the CPU has them. Blocks are ORed together and
+   tested once per step, so a data block exits on its first step and a
+   zero block costs little more than reading it. */
+
+static int zero_generic(const unsigned char *p, size_t len) {
+  size_t i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    uint64_t w[4];
+
+    memcpy(w, p + i, sizeof(w));
+
+    if (w[0] | w[1] | w[2] | w[3]) return 0;
+  }
+
+  for (; i < len; i++) {
+    if (p[i]) return 0;
+  }
+
+  return 1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static int zero_avx2(const unsigned char *p, size_t len) {
+  size_t i = 0;
+
+  for (; i + 128 <= len; i += 128) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(p + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(p + i + 32));
+    __m256i c = _mm256_loadu_si256((const __m256i *)(p + i + 64));
+    __m256i d = _mm256_loadu_si256((const __m256i *)(p + i + 96));
+    __m256i acc = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+
+    if (!_mm256_testz_si256(acc, acc)) return 0;
+  }
+
+  return zero_generic(p + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static int zero_sse2(const unsigned char *p, size_t len) {
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+
+  for (; i + 64 <= len; i += 64) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(p + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(p + i + 16));
+    __m128i c = _mm_loadu_si128((const __m128i *)(p + i + 32));
+    __m128i d = _mm_loadu_si128((const __m128i *)(p + i + 48));
+    __m128i acc = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF) return 0;
+  }
+
+  return zero_generic(p + i, len - i);
+}
+
+#endif
+
+int is_zero(const void *buf, size_t len) {
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("avx2")) return zero_avx2(buf, len);
+  if (__builtin_cpu_supports("sse2")) return zero_sse2(buf, len);
+#endif
+
+  return zero_generic(buf, len);
+}
+
+const char *zeroscan_name(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("avx2")) return "AVX2";
+  if (__builtin_cpu_supports("sse2")) return "SSE2";
+#endif
+
+  return "generic";
+}
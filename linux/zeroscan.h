@@ -0,0 +1,9 @@
+#ifndef ZEROSCAN_H
+#define ZEROSCAN_H
+
+#include <stddef.h>
+
+int is_zero(const void *buf, size_t len);
+const char *zeroscan_name(void);
+
+#endif // ZEROSCAN_H
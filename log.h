@@ -2,6 +2,7 @@
 #define LOG_H
 
 #include <stdarg.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 
@@ -10,6 +11,7 @@
 #include <QScrollBar>
 #include <QProgressBar>
 #include <QLineEdit>
+#include <QTimer>
 
 namespace Ui {
 class Log;
@@ -30,16 +32,20 @@ public:
     Ui::Log *ui;
     QString *text;
     QScrollBar *bar;
-    int progressed;
+    QTimer *timer;
+    QProgressBar *progress;
+    QLineEdit *status;
+    QString ticker;
+    quint64 dropped;
 
 private slots:
     void on_buttonClose_clicked();
     void on_buttonClear_clicked();
-    void write(char *msg);
+    void on_fileCheck_toggled(bool checked);
+    void drain();
+    void show_ticker(QString text);
 
 signals:
-    void call_write(char *msg);
-    void progress_set(int va);
     void ticker_set(QString text);
 };
 
@@ -57,12 +63,7 @@ typedef struct Log Log;
 
 extern Log *logptr;
 
-EXPORT_C void write_c(Log *ptr, char *msg);
 EXPORT_C void r_printf(const char *format, ...);
-EXPORT_C void set_progress_bar_(Log *ptr, int va);
-EXPORT_C void set_progress_bar(int va);
-EXPORT_C void add_progress_bar_(Log *ptr, int va);
-EXPORT_C void add_progress_bar(int va);
 EXPORT_C void set_ticker_(Log *ptr, const char *text);
 EXPORT_C void set_ticker(const char *text);
 
@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "log.h"
+#include "logring.h"
+
+/* Bounded multi-producer ring after Vyukov: every record carries a
+   sequence number telling whether it is free for the producer whose
+   turn it is (seq == pos) or holds a message for the consumer
+   (seq == pos + 1). Producers claim a position with one CAS on the
+   tail and publish the record by storing its sequence, so a producer
+   preempted halfway only holds up the consumer at that record, never
+   the other producers. There is a single consumer. */
+
+#define LOG_FULL_WAIT 100       /* ms a message waits for room */
+
+typedef struct log_record {
+    uint64_t seq;
+    uint8_t subsys;
+    int8_t level;
+    uint16_t len;
+    char text[LOG_TEXT_SIZE];
+} __attribute__((aligned(64))) log_record_t;
+
+int log_levels[LOG_SUBSYSTEMS] = { LOG_INFO, LOG_INFO, LOG_INFO };
+
+static log_record_t ring[LOG_RING_SIZE];
+static uint64_t tail __attribute__((aligned(64)));
+static uint64_t head __attribute__((aligned(64)));
+static uint64_t dropped;
+
+/* Sequence numbers are stored less the record's index, so the zeroed
+   ring is already numbered for the first round */
+
+#define SLOT(pos) ((pos) & (LOG_RING_SIZE - 1))
+
+static uint64_t load_seq(uint64_t pos) {
+    return __atomic_load_n(&ring[SLOT(pos)].seq, __ATOMIC_ACQUIRE) + SLOT(pos);
+}
+
+static void store_seq(uint64_t pos, uint64_t seq) {
+    __atomic_store_n(&ring[SLOT(pos)].seq, seq - SLOT(pos), __ATOMIC_RELEASE);
+}
+
+/* Returns the claimed position, or -1 when there is no room */
+
+static int64_t claim(int level) {
+    struct timespec start = { 0, 0 };
+    uint64_t pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+
+    for (;;) {
+        int64_t dif = (int64_t)(load_seq(pos) - pos);
+
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                return pos;
+            }
+        } else if (dif < 0) {
+
+            /* Full, the consumer hasn't caught up */
+
+            if (level >= LOG_DEBUG) break;
+
+            struct timespec ts;
+
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+
+            if (start.tv_sec == 0 && start.tv_nsec == 0) {
+                start = ts;
+            } else if ((ts.tv_sec - start.tv_sec) * 1000 +
+                       (ts.tv_nsec - start.tv_nsec) / 1000000 > LOG_FULL_WAIT) {
+                break;
+            }
+
+            sched_yield();
+            pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        } else {
+            pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+
+    return -1;
+}
+
+static void vwrite(int subsys, int level, const char *format, va_list ap) {
+    int64_t pos = claim(level);
+
+    if (pos < 0) return;
+
+    log_record_t *r = &ring[SLOT(pos)];
+    int n = vsnprintf(r->text, sizeof(r->text), format, ap);
+
+    if (n < 0) n = 0;
+    if (n >= (int) sizeof(r->text)) n = sizeof(r->text) - 1;
+
+    r->subsys = subsys;
+    r->level = level;
+    r->len = n;
+
+    store_seq(pos, pos + 1);
+}
+
+void log_set_level(int subsys, int level) {
+    if (subsys < 0 || subsys >= LOG_SUBSYSTEMS) return;
+
+    __atomic_store_n(&log_levels[subsys], level, __ATOMIC_RELAXED);
+}
+
+void log_write(int subsys, int level, const char *format, ...) {
+    if (!log_enabled(subsys, level)) return;
+
+    va_list ap;
+
+    va_start(ap, format);
+    vwrite(subsys, level, format, ap);
+    va_end(ap);
+}
+
+void r_printf(const char *format, ...) {
+    if (!log_enabled(LOG_MAIN, LOG_INFO)) return;
+
+    va_list ap;
+
+    va_start(ap, format);
+    vwrite(LOG_MAIN, LOG_INFO, format, ap);
+    va_end(ap);
+}
+
+/* Hands up to max messages to sink, in order, from one thread only.
+   Returns how many there were. */
+
+int log_drain(log_sink_t sink, void *arg, int max) {
+    int count = 0;
+
+    while (count < max) {
+        log_record_t *r = &ring[SLOT(head)];
+
+        if (load_seq(head) != head + 1) break;
+
+        sink(arg, r->subsys, r->level, r->text, r->len);
+
+        store_seq(head, head + LOG_RING_SIZE);
+        head++;
+        count++;
+    }
+
+    return count;
+}
+
+uint64_t log_dropped(void) {
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
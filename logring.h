@@ -0,0 +1,56 @@
+#ifndef LOGRING_H
+#define LOGRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LOG_RING_SIZE 2048      /* Records, a power of two */
+#define LOG_TEXT_SIZE 500       /* Longer messages are cut */
+
+#define LOG_NONE -1
+#define LOG_ERROR 0
+#define LOG_INFO 1
+#define LOG_DEBUG 2
+
+/* Subsystems with their own verbosity, r_printf logs to LOG_MAIN */
+
+#define LOG_MAIN 0
+#define LOG_COPY 1              /* Per file messages while copying or building */
+#define LOG_VERIFY 2            /* Per region read-back results */
+#define LOG_SUBSYSTEMS 3
+
+/* Messages are formatted straight into a fixed ring shared by all
+   threads and picked up in batches by whoever shows them, no locks and
+   no allocations on the way. When the ring is full debug messages are
+   dropped and counted rather than holding up the thread logging them,
+   anything else waits a little for room first. */
+
+extern int log_levels[LOG_SUBSYSTEMS];
+
+#define log_enabled(subsys, level) \
+    (__atomic_load_n(&log_levels[subsys], __ATOMIC_RELAXED) >= (level))
+
+/* The arguments aren't even evaluated when the level is off */
+
+#define r_debug(subsys, ...) \
+    do { \
+        if (log_enabled(subsys, LOG_DEBUG)) log_write(subsys, LOG_DEBUG, __VA_ARGS__); \
+    } while (0)
+
+typedef void (*log_sink_t)(void *arg, int subsys, int level, const char *text, size_t len);
+
+void log_set_level(int subsys, int level);
+void log_write(int subsys, int level, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+int log_drain(log_sink_t sink, void *arg, int max);
+uint64_t log_dropped(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LOGRING_H
@@ -0,0 +1,101 @@
+#include <stdint.h>
+#include <time.h>
+
+#include "progress.h"
+
+static uint64_t done;
+static uint64_t total;
+static uint32_t phase;
+static int finished;
+static int estimated;
+
+/* Only touched by the thread sampling */
+
+static uint32_t seen = (uint32_t) -1;
+static double last_time;
+static uint64_t last_done;
+static double rate;
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void progress_begin(uint64_t bytes) {
+    __atomic_store_n(&done, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&total, bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&finished, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&estimated, 0, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&phase, 1, __ATOMIC_RELEASE);
+}
+
+/* For stages that only get to know their size on the way, like a
+   compressed image. Such a stage is not at 100% before it says so. */
+
+void progress_total(uint64_t bytes) {
+    __atomic_store_n(&total, bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&estimated, 1, __ATOMIC_RELAXED);
+}
+
+void progress_add(uint64_t bytes) {
+    __atomic_fetch_add(&done, bytes, __ATOMIC_RELAXED);
+}
+
+void progress_set(uint64_t bytes) {
+    __atomic_store_n(&done, bytes, __ATOMIC_RELAXED);
+}
+
+/* What was counted is the size now, an estimate may have been off.
+   Stages without a size, which otherwise sit at zero, show as full. */
+
+void progress_finish(void) {
+    uint64_t d = __atomic_load_n(&done, __ATOMIC_RELAXED);
+
+    if (d == 0) d = __atomic_load_n(&total, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&total, d, __ATOMIC_RELAXED);
+    __atomic_store_n(&done, d, __ATOMIC_RELAXED);
+    __atomic_store_n(&finished, 1, __ATOMIC_RELAXED);
+}
+
+void progress_sample(progress_t *p) {
+    double t = now();
+
+    p->phase = __atomic_load_n(&phase, __ATOMIC_ACQUIRE);
+    p->done = __atomic_load_n(&done, __ATOMIC_RELAXED);
+    p->total = __atomic_load_n(&total, __ATOMIC_RELAXED);
+
+    if (p->phase != seen) {
+        seen = p->phase;
+        last_time = t;
+        last_done = 0;
+        rate = 0;
+    }
+
+    /* A rate sample per window, a stalled device brings it down to
+       zero within a few of them rather than keeping the last speed */
+
+    if (t - last_time >= PROGRESS_WINDOW / 1000.0) {
+        double inst = p->done > last_done ? (p->done - last_done) / (t - last_time) : 0;
+
+        rate = rate > 0 ? PROGRESS_SMOOTHING * inst + (1 - PROGRESS_SMOOTHING) * rate : inst;
+        last_done = p->done;
+        last_time = t;
+    }
+
+    p->percent = p->total ? (int) (p->done * 100 / p->total) : 0;
+
+    if (__atomic_load_n(&finished, __ATOMIC_RELAXED)) {
+        p->percent = 100;
+    } else if (p->percent > 99 && __atomic_load_n(&estimated, __ATOMIC_RELAXED)) {
+        p->percent = 99;
+    } else if (p->percent > 100) {
+        p->percent = 100;
+    }
+
+    p->rate = rate;
+    p->eta = rate > 1 && p->total >= p->done ? (p->total - p->done) / rate : -1;
+}
@@ -0,0 +1,41 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PROGRESS_SMOOTHING 0.3  /* Weight of the newest rate sample */
+#define PROGRESS_WINDOW 250     /* ms over which a rate sample is taken */
+
+/* One progress model for every stage. A stage announces up front how
+   many bytes it is going to move with progress_begin(), then any of
+   its threads adds what it has done with progress_add() or, when it
+   keeps its own count, progress_set(). Those are a single atomic
+   operation each and can be called per chunk. Whoever shows progress
+   calls progress_sample() on its own timer, from one thread only,
+   which keeps the updates to the screen at the rate it chooses. */
+
+typedef struct progress {
+    uint64_t done;
+    uint64_t total;         /* 0 when the stage has no size */
+    int percent;
+    double rate;            /* Smoothed bytes per second */
+    double eta;             /* Seconds left, -1 when unknown */
+    uint32_t phase;         /* Changes with every progress_begin() */
+} progress_t;
+
+void progress_begin(uint64_t total);
+void progress_total(uint64_t total);
+void progress_add(uint64_t bytes);
+void progress_set(uint64_t done);
+void progress_finish(void);
+void progress_sample(progress_t *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PROGRESS_H
@@ -9,6 +9,8 @@
 #define TRUE true
 
 #define NB_OLD_C32          2
+#define OLD_C32_NAMES       { "menu.c32", "vesamenu.c32" }
+#define OLD_C32_THRESHOLD   { 53500, 148000 }
 
 
 #endif // RUFUSL
@@ -0,0 +1,74 @@
+# C core shared by the window (Rufusl.pro) and the command line tool
+# (cli/rufusl-cli.pro). Progress and messages go through log.h, each
+# front end links its own implementation of it.
+
+INCLUDEPATH += $$PWD
+
+QMAKE_CFLAGS_WARN_ON = -Wno-sign-compare
+
+LIBS += -L/lib -lparted -lpthread -lz -llzma -lbz2
+
+CONFIG += link_pkgconfig
+
+packagesExist(libzstd) {
+    DEFINES += HAVE_ZSTD
+    PKGCONFIG += libzstd
+}
+
+SOURCES += $$PWD/linux/user.c \
+    $$PWD/linux/devices.c \
+    $$PWD/linux/devmon.c \
+    $$PWD/linux/devprobe.c \
+    $$PWD/linux/mounting.c \
+    $$PWD/linux/partition.c \
+    $$PWD/linux/fat32.c \
+    $$PWD/linux/copy.c \
+    $$PWD/linux/transfer.c \
+    $$PWD/linux/stream.c \
+    $$PWD/linux/fatbuild.c \
+    $$PWD/linux/exfat.c \
+    $$PWD/linux/rawwrite.c \
+    $$PWD/linux/blockio.c \
+    $$PWD/linux/wipe.c \
+    $$PWD/linux/zeroscan.c \
+    $$PWD/linux/crc32c.c \
+    $$PWD/linux/verify.c \
+    $$PWD/linux/decomp.c \
+    $$PWD/linux/fanout.c \
+    $$PWD/job.c \
+    $$PWD/iso.c \
+    $$PWD/isofs.c \
+    $$PWD/scancache.c \
+    $$PWD/logring.c \
+    $$PWD/progress.c \
+    $$PWD/trace.c
+
+HEADERS += $$PWD/linux/user.h \
+    $$PWD/linux/devices.h \
+    $$PWD/linux/devmon.h \
+    $$PWD/linux/devprobe.h \
+    $$PWD/linux/mounting.h \
+    $$PWD/linux/partition.h \
+    $$PWD/linux/fat32.h \
+    $$PWD/linux/copy.h \
+    $$PWD/linux/transfer.h \
+    $$PWD/linux/stream.h \
+    $$PWD/linux/fatbuild.h \
+    $$PWD/linux/exfat.h \
+    $$PWD/linux/rawwrite.h \
+    $$PWD/linux/blockio.h \
+    $$PWD/linux/wipe.h \
+    $$PWD/linux/zeroscan.h \
+    $$PWD/linux/crc32c.h \
+    $$PWD/linux/verify.h \
+    $$PWD/linux/decomp.h \
+    $$PWD/linux/fanout.h \
+    $$PWD/definitions.h \
+    $$PWD/job.h \
+    $$PWD/iso.h \
+    $$PWD/isofs.h \
+    $$PWD/scancache.h \
+    $$PWD/logring.h \
+    $$PWD/progress.h \
+    $$PWD/trace.h \
+    $$PWD/rufusl.h
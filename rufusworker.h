@@ -11,20 +11,34 @@ class RufusWorker : public QThread
     Q_OBJECT
 
 private:
+    int targets;
     int cluster_size;
     int file_system;
     int partition_scheme;
     int full_format;
+    int wipe_mode;
+    int threads;
+    int source;
+    int chunk_size;
+    int queue_depth;
+    int verify;
     const QString *isopath;
     uint8_t job_type;
 
 public:
 
     RufusWorker(Device *chosen,
+                int targets,
                 int partition_scheme,
                 int file_system,
                 int cluster_size,
                 int full_format,
+                int wipe_mode,
+                int threads,
+                int source,
+                int chunk_size,
+                int queue_depth,
+                int verify,
                 const QString *isopath,
                 uint8_t job_type);
 
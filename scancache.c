@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "scancache.h"
+#include "linux/crc32c.h"
+
+/* An entry is one file: the header, the image path, the report as it
+   is in memory, the list of files and then their NUL terminated paths.
+   It is read with a single read() and the paths are used in place. A
+   different build of the report struct just reads as a miss. */
+
+#define SCANCACHE_MAGIC "RUFUSLSC"
+
+typedef struct entry_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t report_size;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t pvd_crc;
+    uint32_t path_len;
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t pool_size;
+} entry_header_t;
+
+typedef struct entry_file {
+    uint64_t size;
+    uint32_t mode;
+    uint32_t path;          /* Offset in the pool */
+} entry_file_t;
+
+int scancache_dir(char *out, size_t len, int create) {
+    const char *base = getenv("XDG_CACHE_HOME");
+    int n;
+
+    /* A path cut short would be some other file, never use it */
+
+    if (base && *base) {
+        n = snprintf(out, len, "%s/" SCANCACHE_DIR, base);
+    } else if ((base = getenv("HOME")) && *base) {
+        n = snprintf(out, len, "%s/.cache", base);
+        if (create && n >= 0 && (size_t) n < len) mkdir(out, 0700);
+        n = snprintf(out, len, "%s/.cache/" SCANCACHE_DIR, base);
+    } else {
+        return -1;
+    }
+
+    if (n < 0 || (size_t) n >= len) return -1;
+
+    if (create && mkdir(out, 0700) < 0 && errno != EEXIST) return -1;
+
+    return 0;
+}
+
+static int entry_path(const scancache_key_t *key, char *out, size_t len, int create) {
+    char dir[PATH_MAX];
+    uint64_t h = 14695981039346656037ull;
+
+    if (scancache_dir(dir, sizeof(dir), create) < 0) return -1;
+
+    for (const char *p = key->path; *p; p++) h = (h ^ (unsigned char) *p) * 1099511628211ull;
+
+    int n = snprintf(out, len, "%s/%016llx.scan", dir, (unsigned long long) h);
+
+    return n < 0 || (size_t) n >= len ? -1 : 0;
+}
+
+int scancache_key(const char *image_path, scancache_key_t *key) {
+    unsigned char pvd[2048];
+    struct stat st;
+
+    memset(key, 0, sizeof(scancache_key_t));
+
+    if (realpath(image_path, key->path) == NULL) return -1;
+
+    int fd = open(key->path, O_RDONLY);
+
+    if (fd < 0) return -1;
+
+    ssize_t n = fstat(fd, &st) < 0 ? -1 : pread(fd, pvd, sizeof(pvd), 16 * 2048);
+
+    close(fd);
+
+    if (n < 0) return -1;
+
+    key->size = st.st_size;
+    key->mtime_sec = st.st_mtim.tv_sec;
+    key->mtime_nsec = st.st_mtim.tv_nsec;
+    key->pvd_crc = crc32c(0, pvd, n);
+
+    return 0;
+}
+
+int scancache_load(const scancache_key_t *key, RUFUS_IMG_REPORT *report, iso_manifest_t *manifest) {
+    char path[PATH_MAX];
+    struct stat st;
+    entry_header_t h;
+
+    if (entry_path(key, path, sizeof(path), 0) < 0) return -1;
+
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) return -1;
+
+    char *buf = NULL;
+    int ret = -1;
+
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(h)) goto out;
+
+    if ((buf = malloc(st.st_size)) == NULL || read(fd, buf, st.st_size) != st.st_size) goto out;
+
+    memcpy(&h, buf, sizeof(h));
+
+    size_t path_len = strlen(key->path);
+    size_t files_off = sizeof(h) + h.path_len + sizeof(RUFUS_IMG_REPORT);
+    size_t pool_off = files_off + h.count * sizeof(entry_file_t);
+
+    if (memcmp(h.magic, SCANCACHE_MAGIC, 8) != 0 || h.version != SCANCACHE_VERSION ||
+        h.report_size != sizeof(RUFUS_IMG_REPORT) || h.size != key->size ||
+        h.mtime_sec != key->mtime_sec || h.mtime_nsec != key->mtime_nsec ||
+        h.pvd_crc != key->pvd_crc || h.path_len != path_len ||
+        h.count > (uint64_t) st.st_size / sizeof(entry_file_t) ||
+        pool_off + h.pool_size != (uint64_t) st.st_size ||
+        memcmp(buf + sizeof(h), key->path, path_len) != 0) goto out;
+
+    /* The pool has to end in a NUL so no path can run past it */
+
+    if (h.pool_size > 0 && buf[st.st_size - 1] != 0) goto out;
+
+    iso_file_t *files = malloc((h.count ? h.count : 1) * sizeof(iso_file_t));
+
+    if (files == NULL) goto out;
+
+    for (uint64_t i = 0; i < h.count; i++) {
+        entry_file_t f;
+
+        memcpy(&f, buf + files_off + i * sizeof(f), sizeof(f));
+
+        if (f.path >= h.pool_size) {
+            free(files);
+            goto out;
+        }
+
+        files[i].path = buf + pool_off + f.path;
+        files[i].size = f.size;
+        files[i].mode = f.mode;
+    }
+
+    iso_manifest_free(manifest);
+    memcpy(report, buf + sizeof(h) + h.path_len, sizeof(RUFUS_IMG_REPORT));
+
+    manifest->files = files;
+    manifest->count = manifest->cap = h.count;
+    manifest->bytes = h.bytes;
+    manifest->pool = buf;
+    buf = NULL;
+
+    ret = 0;
+
+out:
+    free(buf);
+    close(fd);
+
+    return ret;
+}
+
+/* Written next to the entry and renamed over it, a reader never sees
+   half of one */
+
+int scancache_store(const scancache_key_t *key, const RUFUS_IMG_REPORT *report,
+                    const iso_manifest_t *manifest) {
+    char path[PATH_MAX];
+    char tmp[PATH_MAX + 32];
+    entry_header_t h;
+
+    if (entry_path(key, path, sizeof(path), 1) < 0) return -1;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SCANCACHE_MAGIC, 8);
+    h.version = SCANCACHE_VERSION;
+    h.report_size = sizeof(RUFUS_IMG_REPORT);
+    h.size = key->size;
+    h.mtime_sec = key->mtime_sec;
+    h.mtime_nsec = key->mtime_nsec;
+    h.pvd_crc = key->pvd_crc;
+    h.path_len = strlen(key->path);
+    h.count = manifest->count;
+    h.bytes = manifest->bytes;
+
+    for (size_t i = 0; i < manifest->count; i++) h.pool_size += strlen(manifest->files[i].path) + 1;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid());
+
+    FILE *f = fopen(tmp, "wb");
+
+    if (f == NULL) return -1;
+
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(key->path, 1, h.path_len, f);
+    fwrite(report, sizeof(RUFUS_IMG_REPORT), 1, f);
+
+    uint32_t off = 0;
+
+    for (size_t i = 0; i < manifest->count; i++) {
+        entry_file_t e = { manifest->files[i].size, manifest->files[i].mode, off };
+
+        fwrite(&e, sizeof(e), 1, f);
+        off += strlen(manifest->files[i].path) + 1;
+    }
+
+    for (size_t i = 0; i < manifest->count; i++) {
+        fwrite(manifest->files[i].path, 1, strlen(manifest->files[i].path) + 1, f);
+    }
+
+    if (ferror(f) | fclose(f) || rename(tmp, path) < 0) {
+        r_printf("Could not save the scan of %s: %s\n", key->path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,32 @@
+#ifndef SCANCACHE_H
+#define SCANCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "iso.h"
+
+#define SCANCACHE_DIR "rufusl"      /* Under $XDG_CACHE_HOME or ~/.cache */
+#define SCANCACHE_VERSION 1
+
+/* Scan results kept on disk per image, so picking the same ISO again
+   needs neither a mount nor a walk. An entry is only used while the
+   image still has the same path, size and mtime and its primary volume
+   descriptor still hashes the same, anything else is a miss and the
+   next scan overwrites it. */
+
+typedef struct scancache_key {
+    char path[4096];        /* Absolute */
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t pvd_crc;
+} scancache_key_t;
+
+int scancache_dir(char *out, size_t len, int create);   /* Also holds the device profiles */
+int scancache_key(const char *image_path, scancache_key_t *key);
+int scancache_load(const scancache_key_t *key, RUFUS_IMG_REPORT *report, iso_manifest_t *manifest);
+int scancache_store(const scancache_key_t *key, const RUFUS_IMG_REPORT *report,
+                    const iso_manifest_t *manifest);
+
+#endif // SCANCACHE_H
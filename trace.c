@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "trace.h"
+
+/* Every thread records into a buffer of its own, so a span costs two
+   clock reads and a copy, no lock. A thread finds its buffer through a
+   thread local pointer, tagged with the trace it was made for, so
+   buffers from an earlier trace are never touched again. The buffers
+   are only read by trace_stop(), once every thread that traced has
+   been joined. */
+
+typedef struct trace_event {
+    const char *name;
+    uint64_t start;
+    uint64_t dur;
+    char arg[TRACE_ARG_SIZE];
+} trace_event_t;
+
+typedef struct trace_buf {
+    struct trace_buf *next;
+    int tid;
+    char thread[32];
+    int count;
+    trace_event_t events[TRACE_BUF_EVENTS];
+} trace_buf_t;
+
+static int tracing;
+static uint32_t generation;
+static uint64_t origin;
+static char *out_path;
+
+static trace_buf_t *bufs;
+static int nbufs;
+static uint64_t dropped;
+
+static __thread trace_buf_t *mine;
+static __thread uint32_t mine_gen;
+static __thread char mine_name[32];
+
+static uint64_t now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* A fresh buffer for this thread, or NULL when the trace is too big */
+
+static trace_buf_t *grow(void) {
+    if (__atomic_add_fetch(&nbufs, 1, __ATOMIC_RELAXED) > TRACE_MAX_BUFS) return NULL;
+
+    trace_buf_t *b = malloc(sizeof(trace_buf_t));
+
+    if (b == NULL) return NULL;
+
+    b->tid = syscall(SYS_gettid);
+    b->count = 0;
+
+    if (mine_name[0]) {
+        memcpy(b->thread, mine_name, sizeof(b->thread));
+    } else {
+        snprintf(b->thread, sizeof(b->thread), "thread %d", b->tid);
+    }
+
+    b->next = __atomic_load_n(&bufs, __ATOMIC_RELAXED);
+
+    while (!__atomic_compare_exchange_n(&bufs, &b->next, b, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    mine = b;
+    mine_gen = generation;
+
+    return b;
+}
+
+int trace_start(const char *path) {
+    if (path == NULL || *path == 0) return 0;
+
+    free(out_path);
+
+    if ((out_path = strdup(path)) == NULL) return -1;
+
+    bufs = NULL;
+    nbufs = 0;
+    dropped = 0;
+    origin = now();
+    generation++;
+
+    __atomic_store_n(&tracing, 1, __ATOMIC_RELEASE);
+
+    r_printf("Tracing to %s\n", path);
+
+    return 0;
+}
+
+void trace_thread(const char *format, ...) {
+    va_list ap;
+
+    va_start(ap, format);
+    vsnprintf(mine_name, sizeof(mine_name), format, ap);
+    va_end(ap);
+
+    if (mine != NULL && mine_gen == generation) {
+        memcpy(mine->thread, mine_name, sizeof(mine->thread));
+    }
+}
+
+trace_span_t trace_begin(const char *name, const char *arg) {
+    trace_span_t s = { name, arg, 0 };
+
+    if (__atomic_load_n(&tracing, __ATOMIC_ACQUIRE)) s.start = now();
+
+    return s;
+}
+
+void trace_end(trace_span_t *s) {
+    if (s->start == 0 || !__atomic_load_n(&tracing, __ATOMIC_ACQUIRE)) return;
+
+    uint64_t end = now();
+    trace_buf_t *b = mine_gen == generation ? mine : NULL;
+
+    if (b == NULL || b->count == TRACE_BUF_EVENTS) b = grow();
+
+    if (b == NULL) {
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    trace_event_t *e = &b->events[b->count++];
+
+    e->name = s->name;
+    e->start = s->start - origin;
+    e->dur = end - s->start;
+
+    if (s->arg != NULL) {
+        snprintf(e->arg, sizeof(e->arg), "%s", s->arg);
+    } else {
+        e->arg[0] = 0;
+    }
+}
+
+static void json_string(FILE *f, const char *s) {
+    fputc('"', f);
+
+    for (; *s; s++) {
+        unsigned char c = *s;
+
+        if (c == '"' || c == '\\') {
+            fprintf(f, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+
+    fputc('"', f);
+}
+
+/* Writes the trace out and frees it, from the thread that started it */
+
+int trace_stop(void) {
+    if (!__atomic_exchange_n(&tracing, 0, __ATOMIC_ACQ_REL)) return 0;
+
+    FILE *f = fopen(out_path, "w");
+    int pid = getpid();
+    int ret = 0;
+    uint64_t count = 0;
+
+    if (f == NULL) {
+        r_printf("Error writing trace %s: %s\n", out_path, strerror(errno));
+        ret = -1;
+    } else {
+        fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        fprintf(f, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"args\":{\"name\":\"rufusl\"}}", pid);
+
+        for (trace_buf_t *b = bufs; b != NULL; b = b->next) {
+            fprintf(f, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+                    pid, b->tid);
+            json_string(f, b->thread);
+            fprintf(f, "}}");
+
+            for (int i = 0; i < b->count; i++) {
+                trace_event_t *e = &b->events[i];
+
+                fprintf(f, ",\n{\"ph\":\"X\",\"cat\":\"rufusl\",\"name\":");
+                json_string(f, e->name);
+                fprintf(f, ",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                        pid, b->tid, e->start / 1000.0, e->dur / 1000.0);
+
+                if (e->arg[0]) {
+                    fprintf(f, ",\"args\":{\"arg\":");
+                    json_string(f, e->arg);
+                    fputc('}', f);
+                }
+
+                fputc('}', f);
+            }
+
+            count += b->count;
+        }
+
+        fprintf(f, "\n]}\n");
+
+        if (fclose(f) != 0) {
+            r_printf("Error writing trace %s: %s\n", out_path, strerror(errno));
+            ret = -1;
+        } else {
+            r_printf("Wrote %llu spans to %s, %llu dropped\n", (unsigned long long) count,
+                     out_path, (unsigned long long) dropped);
+        }
+    }
+
+    while (bufs != NULL) {
+        trace_buf_t *next = bufs->next;
+
+        free(bufs);
+        bufs = next;
+    }
+
+    return ret;
+}
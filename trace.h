@@ -0,0 +1,49 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TRACE_BUF_EVENTS 4096   /* Spans per buffer, a thread chains more */
+#define TRACE_MAX_BUFS 256      /* About 100 MiB, later spans are dropped */
+#define TRACE_ARG_SIZE 80       /* Longer arguments are cut */
+
+/* Spans timed into a buffer per thread and written out at the end as
+   a Chrome trace event file, which opens in ui.perfetto.dev or
+   chrome://tracing. A span covers the block it is declared in:
+
+       TRACE_SPAN("full_wipe");
+       TRACE_SPAN_ARG("copy", path);
+
+   arg has to stay valid until the span ends, it is copied then. When
+   no trace is being taken a span is a load and a branch. */
+
+typedef struct trace_span {
+    const char *name;
+    const char *arg;
+    uint64_t start;         /* ns, 0 when not tracing */
+} trace_span_t;
+
+#define TRACE_CAT_(a, b) a##b
+#define TRACE_CAT(a, b) TRACE_CAT_(a, b)
+
+#define TRACE_SPAN_ARG(name, arg) \
+    trace_span_t TRACE_CAT(trace_span_, __LINE__) \
+        __attribute__((cleanup(trace_end))) = trace_begin(name, arg)
+
+#define TRACE_SPAN(name) TRACE_SPAN_ARG(name, NULL)
+
+int trace_start(const char *path);
+int trace_stop(void);
+void trace_thread(const char *format, ...) __attribute__((format(printf, 1, 2)));
+trace_span_t trace_begin(const char *name, const char *arg);
+void trace_end(trace_span_t *span);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TRACE_H
@@ -5,7 +5,8 @@ DeviceComboBox::DeviceComboBox(QWidget *& w, RufusWindow *window) : QComboBox(w)
     this->main = window;
 }
 
+/* The list is kept current by the device monitor, nothing to scan */
+
 void DeviceComboBox::showPopup() {
-    this->main->scan();
     QComboBox::showPopup();
 }
@@ -1,9 +1,13 @@
 #include "log.h"
+#include "logring.h"
+#include "progress.h"
 #include "ui_log.h"
 
 #include <QDebug>
 #include <QMutex>
 
+#define LOG_DRAIN_INTERVAL 50   /* ms between batches */
+#define LOG_DRAIN_MAX 4096      /* Messages shown per batch at most */
 
 bool Log::logOpen = false;
 
@@ -12,6 +16,8 @@ Log::Log(QWidget *parent) : QDialog(parent), ui(new Ui::Log)
     ui->setupUi(this);
     text = new QString;
     this->bar = this->ui->logText->verticalScrollBar();
+    this->timer = new QTimer(this);
+    this->dropped = 0;
 
 }
 
@@ -21,10 +27,11 @@ Log::~Log()
 }
 
 void Log::set_up(QProgressBar *bar, QLineEdit *edit) {
-    this->progressed = 0;
-    connect(this, SIGNAL(call_write(char*)), this, SLOT(write(char*)), Qt::QueuedConnection);
-    connect(this, SIGNAL(progress_set(int)), bar, SLOT(setValue(int)));
-    connect(this, SIGNAL(ticker_set(QString)), edit, SLOT(setText(QString)));
+    this->progress = bar;
+    this->status = edit;
+    connect(this, SIGNAL(ticker_set(QString)), this, SLOT(show_ticker(QString)));
+    connect(this->timer, SIGNAL(timeout()), this, SLOT(drain()));
+    this->timer->start(LOG_DRAIN_INTERVAL);
 }
 
 void Log::on_buttonClose_clicked()
@@ -39,65 +46,83 @@ void Log::on_buttonClear_clicked()
     this->ui->logText->clear();
 }
 
+void Log::on_fileCheck_toggled(bool checked)
+{
+    log_set_level(LOG_COPY, checked ? LOG_DEBUG : LOG_INFO);
+}
 
-/*
-   This is, by far, THE most complicated piece of code I have
-   ever written. This is how it works:
 
-   r_printf(char *format, ...) can be called from either C or C++,
-   it takes the format and va_list arguments, and formats them. Then,
-   it calls write_c, which sends a signal the Logger, which is connected
-   to itself, so the Qt scheduler schedules an update to the window by calling write(),
-   so that Qt does not freak out. Crazy, right?
+/*
+   This used to be, by far, THE most complicated piece of code I have
+   ever written. This is how it works now:
+
+   r_printf(char *format, ...) can be called from either C or C++ on
+   any thread, it formats the message straight into the ring in
+   logring.c and returns, no signal, no malloc. Every LOG_DRAIN_INTERVAL
+   the timer calls drain() on the GUI thread, which takes whatever piled
+   up and puts it in the window in one go, so a copy logging thousands
+   of files does not queue thousands of repaints. The same tick samples
+   progress.c for the bar and the speed, so however fast the workers
+   count bytes the window is redrawn at most every LOG_DRAIN_INTERVAL.
 
 */
 
-
-void Log::write(char *msg)
-{
-    this->ui->logText->insertPlainText(msg);
-    this->bar->setValue(bar->maximum());
-    free(msg);
+static void append(void *arg, int, int, const char *text, size_t len) {
+    ((QString*) arg)->append(QString::fromUtf8(text, len));
 }
 
-void Log::reject()
+void Log::drain()
 {
+    QString batch;
 
-    Log::logOpen = false;
-    QDialog::reject();
+    log_drain(append, &batch, LOG_DRAIN_MAX);
 
-}
+    quint64 lost = log_dropped();
 
-void write_c(Log *ptr, char *msg) {
-    emit ptr->call_write(msg);
-}
+    if (lost != this->dropped) {
+        batch.append(QString("[%1 messages dropped]\n").arg(lost - this->dropped));
+        this->dropped = lost;
+    }
 
-void r_printf(const char *format, ...) {
+    if (!batch.isEmpty()) {
+        this->ui->logText->moveCursor(QTextCursor::End);
+        this->ui->logText->insertPlainText(batch);
+        this->bar->setValue(bar->maximum());
+    }
 
-    char *buf = (char*) malloc(4096);
-    va_list argList;
-    va_start(argList, format);
-    vsnprintf(buf, 4096,format, argList);
-    va_end(argList);
-    write_c(logptr, buf);
+    progress_t p;
 
-}
+    progress_sample(&p);
 
-EXPORT_C void add_progress_bar_(Log *ptr, int va) {
-    ptr->progressed += va;
-    emit ptr->progress_set(ptr->progressed);
-}
+    if (this->progress->value() != p.percent) this->progress->setValue(p.percent);
+
+    QString text = this->ticker;
+
+    if (p.total > 0 && p.done < p.total && p.rate > 0) {
+        text += QString(" %1 MB/s").arg(p.rate / 1e6, 0, 'f', 1);
 
-EXPORT_C void add_progress_bar(int va) {
-    add_progress_bar_(logptr, va);
+        if (p.eta >= 0) {
+            int secs = (int) p.eta;
+
+            text += QString(", %1:%2 left").arg(secs / 60).arg(secs % 60, 2, 10, QChar('0'));
+        }
+    }
+
+    if (this->status->text() != text) this->status->setText(text);
 }
 
-EXPORT_C void set_progress_bar_(Log *ptr, int va) {
-    emit ptr->progress_set(va);
+void Log::show_ticker(QString text)
+{
+    this->ticker = text;
+    this->status->setText(text);
 }
 
-EXPORT_C void set_progress_bar(int va) {
-    set_progress_bar_(logptr, va);
+void Log::reject()
+{
+
+    Log::logOpen = false;
+    QDialog::reject();
+
 }
 
 EXPORT_C void set_ticker_(Log *ptr,const char *text) {
@@ -9,6 +9,9 @@
 
 extern "C" {
     #include "linux/user.h"
+    #include "linux/copy.h"
+    #include "linux/rawwrite.h"
+    #include "linux/blockio.h"
 }
 
 #define SKIP_ROOT_CHECK
@@ -18,11 +21,21 @@ extern "C" {
 
 Log *logptr; /* Forward declaration */
 
+/* Runs on the monitor thread, the list is rebuilt on the GUI thread */
+
+static void device_event(void *arg, int event, const Device *dev) {
+  (void) event;
+  (void) dev;
+
+  QMetaObject::invokeMethod(static_cast<RufusWindow *>(arg), "scan", Qt::QueuedConnection);
+}
+
 RufusWindow::RufusWindow(QWidget *parent) : QMainWindow(parent), ui(new Ui::RufusWindow) {
 
   ui->setupUi(this);
 
   this->setupUi();
+  devmon_start(device_event, this);
   this->scan();
   this->show();
 
@@ -84,12 +97,31 @@ void RufusWindow::on_buttonStart_clicked() {
         return;
     }
 
+    /* Fan-out takes every listed device, they are contiguous in the array */
+
     int index = this->box->currentIndex();
-    this->worker = new RufusWorker(&devices[index],
+    int all = ui->allCheck->isChecked() && ui->sourceCombo->currentIndex() == SRC_DD;
+
+    /* A copy, the list changes under it whenever a stick comes or goes */
+
+    if (all) {
+        memcpy(this->chosen, this->devices, this->discovered * sizeof(Device));
+    } else {
+        this->chosen[0] = this->devices[index];
+    }
+
+    this->worker = new RufusWorker(this->chosen,
+                                   all ? this->discovered : 1,
                                    ui->partitionCombo->currentIndex(),
-                                   ui->fsCombo->currentIndex(),
+                                   ui->fsCombo->currentData().toInt(),
                                    ui->clusterCombo->currentIndex(),
                                    ui->formatCheck->isChecked(),
+                                   ui->wipeCombo->currentIndex(),
+                                   ui->threadsSpin->value(),
+                                   ui->sourceCombo->currentIndex(),
+                                   ui->chunkSpin->value(),
+                                   ui->depthSpin->value(),
+                                   ui->verifyCheck->isChecked(),
                                    this->iso_path,
                                    JOB_COPY);
     this->worker->start();
@@ -131,14 +163,40 @@ void RufusWindow::setupUi()
     this->ui->clusterCombo->addItem(BS_8192B_LABEL);
     this->ui->clusterCombo->addItem(BS_16384B_LABEL);
     this->ui->clusterCombo->addItem(BS_32768B_LABEL);
+    this->ui->clusterCombo->addItem(BS_AUTO_LABEL);
+
+    /* Picked for the files in the image once it is being written */
+
+    this->ui->clusterCombo->setCurrentIndex(BS_AUTO);
+
+    /* Add items to full format wipe modes, only used without quick format */
+
+    this->ui->wipeCombo->addItem(WIPE_ZERO_LABEL);
+    this->ui->wipeCombo->addItem(WIPE_TRIM_LABEL);
+    this->ui->wipeCombo->setEnabled(!this->ui->formatCheck->isChecked());
 
-    this->ui->clusterCombo->setCurrentIndex(BS_4096B);
+    /* Set up 'Copy threads' field */
 
-    /* Add items to 'File system' */
+    this->ui->threadsSpin->setRange(1, COPY_MAX_THREADS);
+    this->ui->threadsSpin->setValue(COPY_DEFAULT_THREADS);
 
-    this->ui->fsCombo->addItem(FS_FAT32_LABEL);
-    this->ui->fsCombo->addItem(FS_NTFS_LABEL);
-    this->ui->fsCombo->setEnabled(false);
+    /* Set up 'DD chunk size' field, the lowest value leaves it to the device's profile */
+
+    this->ui->chunkSpin->setRange(0, RAW_MAX_CHUNK_MB);
+    this->ui->chunkSpin->setSpecialValueText("Auto");
+    this->ui->chunkSpin->setValue(0);
+
+    /* Set up 'I/O queue depth' field, same as above */
+
+    this->ui->depthSpin->setRange(0, BLOCKIO_MAX_DEPTH);
+    this->ui->depthSpin->setSpecialValueText("Auto");
+    this->ui->depthSpin->setValue(0);
+
+    /* Add items to 'File system', there is no NTFS formatter. exFAT
+     * is for images with files of 4 GB or more. */
+
+    this->ui->fsCombo->addItem(FS_FAT32_LABEL, FS_FAT32);
+    this->ui->fsCombo->addItem(FS_EXFAT_LABEL, FS_EXFAT);
 
     /* Add items to partition table items */
 
@@ -153,33 +211,22 @@ void RufusWindow::setupUi()
 }
 
 
-/* Scan SCSI Devices and update UI */
+/* Fill the device list from the monitor's table, which is kept up to
+   date in the background, so this never waits on sysfs */
 
 void RufusWindow::scan() {
 
+  int index = this->box->currentIndex();
+  QString current = index >= 0 && index < this->discovered
+                    ? QString(this->devices[index].device) : QString();
+
   /* Clear combo box and reset number of discovered devices */
 
   this->box->clear();
-  this->discovered = 0;
-
-  /* Clear array */
-
-  for (int i = 0; i < MAX_DEVICES; i++) {
-    this->devices[i].capacity = 0;
-    if (memset(this->devices[i].device, 0, sizeof(this->devices[i].device)) ==
-        NULL)
-      return;
-    if (memset(this->devices[i].model, 0, sizeof(this->devices[i].model)) ==
-        NULL)
-      return;
-    if (memset(this->devices[i].vendor, 0, sizeof(this->devices[i].vendor)) ==
-        NULL)
-      return;
-  }
 
-  /* Scan for devices */
+  memset(this->devices, 0, sizeof(this->devices));
 
-  scan_devices(this->devices, MAX_DEVICES, &this->discovered);
+  this->discovered = devmon_devices(this->devices, MAX_DEVICES);
 
   /* Format device names and add to combo box */
 
@@ -194,24 +241,37 @@ void RufusWindow::scan() {
 
     this->box->addItem(buf);
 
-    if (memset(buf, 0, sizeof(buf)) == NULL) return;
+    /* The stick that was picked stays picked */
 
+    if (current == devices[i].device) this->box->setCurrentIndex(i);
   }
 }
 
 RufusWindow::~RufusWindow() {
+  devmon_stop();
   delete box;
   delete log;
   delete ui;
 }
 
+void RufusWindow::on_formatCheck_toggled(bool checked)
+{
+    this->ui->wipeCombo->setEnabled(!checked);
+}
+
+void RufusWindow::on_sourceCombo_currentIndexChanged(int index)
+{
+    this->ui->allCheck->setEnabled(index == SRC_DD);
+}
+
 void RufusWindow::on_usingSearch_clicked()
 {
     file_dialog = new QFileDialog;
     this->iso_path = new QString(file_dialog->getOpenFileName());
     file_dialog->close();
     if (this->iso_path->size() == 0) return;
-    this->worker = new RufusWorker(NULL, 0xFF, 0xFF, 0xFF, 0xFF, this->iso_path, JOB_SCAN);
+    if (ui->sourceCombo->currentIndex() == SRC_DD) return; /* Nothing to analyze in a raw image */
+    this->worker = new RufusWorker(NULL, 0, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, SRC_ISO, 0xFF, 0xFF, 0, this->iso_path, JOB_SCAN);
     this->worker->start();
 
     // RufusWorker scan_iso() ...
@@ -8,6 +8,7 @@ extern "C" {
 
 #include <stdint.h>
 #include "linux/devices.h"
+#include "linux/devmon.h"
 
 }
 
@@ -33,7 +34,7 @@ public:
 
     explicit RufusWindow(QWidget *parent = 0);
     QString *iso_path;
-    void scan();
+    Q_INVOKABLE void scan();
     ~RufusWindow();
 
 
@@ -46,6 +47,8 @@ private slots:
     void setProgress(int);
 
     void on_usingSearch_clicked();
+    void on_formatCheck_toggled(bool checked);
+    void on_sourceCombo_currentIndexChanged(int index);
 
 private:
 
@@ -53,6 +56,7 @@ private:
     Log *log;
     About *about;
     Device devices[MAX_DEVICES];
+    Device chosen[MAX_DEVICES]; /* What the running job writes to */
     uint8_t discovered = 0;
     DeviceComboBox *box;
     RufusWorker *worker;